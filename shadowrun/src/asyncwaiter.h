@@ -0,0 +1,93 @@
+#pragma once
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Asynchronous operation waiter
+//
+//  Waits for one or more IVssAsync operations by polling QueryStatus at a
+//  fixed interval, instead of blocking in IVssAsync::Wait. While waiting it
+//  logs which operations are still pending, and it cancels an operation
+//  still pending when its deadline has passed, so that a hung writer or
+//  provider cannot block the program, and the shadow copies it has already
+//  created, forever. An operation that does not react to Cancel within a
+//  grace period is given up.
+//
+
+// Default milliseconds between each time the operations are polled
+const DWORD ASYNC_DEFAULT_POLL_INTERVAL = 100;
+
+// Default milliseconds between the messages about pending operations
+const DWORD ASYNC_DEFAULT_PROGRESS_INTERVAL = 10000;
+
+// Milliseconds to wait for a cancelled operation to stop, before giving up
+const DWORD ASYNC_CANCEL_GRACE_PERIOD = 30000;
+
+
+// Settings for waiting on asynchronous operations
+struct AsyncWaitSettings
+{
+    // Milliseconds between each time the operations are polled
+    DWORD   pollInterval = ASYNC_DEFAULT_POLL_INTERVAL;
+
+    // Milliseconds between the messages about pending operations, 0 for none
+    DWORD   progressInterval = ASYNC_DEFAULT_PROGRESS_INTERVAL;
+
+    // Seconds until an operation without its own timeout is cancelled, 0 for no deadline
+    DWORD   defaultTimeout = 0;
+
+    // Seconds until the DoSnapshotSet operation is cancelled, 0 to use the default timeout
+    DWORD   snapshotTimeout = 0;
+
+    // Parse a comma separated list of name:value pairs, as given to the -timeout option:
+    // poll:milliseconds, progress:seconds, default:seconds or DoSnapshotSet:seconds.
+    // Throws E_INVALIDARG on unknown names or invalid values.
+    void Parse(const wstring& settings);
+
+    // Milliseconds until the given operation is cancelled, INFINITE for no deadline
+    DWORD GetTimeout(LPCWSTR operationName) const;
+};
+
+
+class AsyncWaiter
+{
+public:
+
+    AsyncWaiter(const AsyncWaitSettings& settings);
+
+    // Add an operation to wait for, its deadline counts from now
+    // Returns the index of the operation, as given to GetResult
+    size_t Add(IVssAsync* pAsync, LPCWSTR operationName);
+
+    // Wait until all the operations have finished, failed, been cancelled or been given up
+    // Throws HRESULT only if an operation cannot be polled
+    void WaitAll();
+
+    // Result of an operation, as returned by QueryStatus, or HRESULT_FROM_WIN32(ERROR_TIMEOUT)
+    // if it was cancelled because of its deadline
+    HRESULT GetResult(size_t index) const { return m_operations[index].hrResult; }
+
+private:
+
+    struct Operation
+    {
+        IVssAsyncPtr    pAsync;
+        wstring         name;
+        DWORD           dwTimeout = INFINITE;
+        ULONGLONG       ullStartTime = 0;
+        ULONGLONG       ullCancelTime = 0;
+        bool            bCancelled = false;
+        bool            bDone = false;
+        HRESULT         hrResult = VSS_S_ASYNC_PENDING;
+    };
+
+    // Poll an operation, returns true when it is done
+    bool Poll(Operation& operation, ULONGLONG ullNow);
+
+    //
+    //  Data members
+    //
+
+    AsyncWaitSettings   m_settings;
+
+    vector<Operation>   m_operations;
+};
@@ -0,0 +1,561 @@
+// Main header
+#include "stdafx.h"
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Backend using the VSS infrastructure
+//
+
+
+// Create the internal backup components object and prepare it for backup
+void ComVssBackend::Initialize(LONG lContext)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    // Create the internal backup components object
+    CHECK_COM(CreateVssBackupComponents(&m_pVssObject));
+
+    // Initialize for backup
+    CHECK_COM(m_pVssObject->InitializeForBackup())
+
+    // Set the context, different than the default context
+    CHECK_COM(m_pVssObject->SetContext(lContext));
+
+    // Set various properties per backup components instance
+    CHECK_COM(m_pVssObject->SetBackupState(true, true, VSS_BT_FULL, false));
+}
+
+
+HRESULT ComVssBackend::StartSnapshotSet(VSS_ID* pSnapshotSetId)
+{
+    return m_pVssObject->StartSnapshotSet(pSnapshotSetId);
+}
+
+
+HRESULT ComVssBackend::AddToSnapshotSet(VSS_PWSZ pwszVolumeName, VSS_ID ProviderId, VSS_ID* pidSnapshot)
+{
+    return m_pVssObject->AddToSnapshotSet(pwszVolumeName, ProviderId, pidSnapshot);
+}
+
+
+HRESULT ComVssBackend::DoSnapshotSet(IVssAsync** ppAsync)
+{
+    return m_pVssObject->DoSnapshotSet(ppAsync);
+}
+
+
+HRESULT ComVssBackend::GetSnapshotProperties(VSS_ID SnapshotId, VSS_SNAPSHOT_PROP* pProp)
+{
+    return m_pVssObject->GetSnapshotProperties(SnapshotId, pProp);
+}
+
+
+// Query through a backup components object in VSS_CTX_ALL, to see the shadow copies of all contexts
+HRESULT ComVssBackend::Query(VSS_ID QueriedObjectId, VSS_OBJECT_TYPE eQueriedObjectType, VSS_OBJECT_TYPE eReturnedObjectsType, IVssEnumObject** ppEnum)
+{
+    if (m_pQueryObject == NULL)
+    {
+        IVssBackupComponentsPtr pQueryObject;
+        HRESULT hr = CreateVssBackupComponents(&pQueryObject);
+        if (SUCCEEDED(hr))
+            hr = pQueryObject->InitializeForBackup();
+        if (SUCCEEDED(hr))
+            hr = pQueryObject->SetContext(VSS_CTX_ALL);
+        if (FAILED(hr))
+            return hr;
+        m_pQueryObject = pQueryObject;
+    }
+
+    return m_pQueryObject->Query(QueriedObjectId, eQueriedObjectType, eReturnedObjectsType, ppEnum);
+}
+
+
+HRESULT ComVssBackend::DeleteSnapshots(VSS_ID SourceObjectId, VSS_OBJECT_TYPE eSourceObjectType, BOOL bForceDelete, LONG* plDeletedSnapshots, VSS_ID* pNondeletedSnapshotID)
+{
+    return m_pVssObject->DeleteSnapshots(SourceObjectId, eSourceObjectType, bForceDelete, plDeletedSnapshots, pNondeletedSnapshotID);
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Simulated asynchronous operation
+//
+//  Completes a given number of milliseconds after creation, with the given
+//  result. Behaves like the IVssAsync objects returned by VSS: QueryStatus
+//  reports VSS_S_ASYNC_PENDING until then, and Cancel turns a pending
+//  operation into VSS_S_ASYNC_CANCELLED, after the given cancel latency.
+//
+
+class SimulatedAsync : public IVssAsync
+{
+public:
+
+    SimulatedAsync(DWORD dwLatency, DWORD dwCancelLatency, HRESULT hrResult):
+        m_lRefCount(1), m_lCancelled(FALSE), m_hrResult(hrResult), m_dwCancelLatency(dwCancelLatency), m_ullCancelTime(0)
+    {
+        m_ullCompletionTime = GetTickCount64() + dwLatency;
+    }
+
+    // IUnknown
+
+    STDMETHOD(QueryInterface)(REFIID riid, void** ppvObject)
+    {
+        if (ppvObject == NULL)
+            return E_POINTER;
+        if (riid != __uuidof(IUnknown) && riid != __uuidof(IVssAsync))
+        {
+            *ppvObject = NULL;
+            return E_NOINTERFACE;
+        }
+        *ppvObject = static_cast<IVssAsync*>(this);
+        AddRef();
+        return S_OK;
+    }
+
+    STDMETHOD_(ULONG, AddRef)()
+    {
+        return InterlockedIncrement(&m_lRefCount);
+    }
+
+    STDMETHOD_(ULONG, Release)()
+    {
+        LONG lRefCount = InterlockedDecrement(&m_lRefCount);
+        if (lRefCount == 0)
+            delete this;
+        return lRefCount;
+    }
+
+    // IVssAsync
+
+    STDMETHOD(Cancel)()
+    {
+        if (IsCompleted())
+            return VSS_S_ASYNC_FINISHED;
+        if (InterlockedExchange(&m_lCancelled, TRUE))
+            return VSS_S_ASYNC_CANCELLED;
+        m_ullCancelTime = GetTickCount64();
+        return S_OK;
+    }
+
+    STDMETHOD(Wait)(DWORD dwMilliseconds)
+    {
+        ULONGLONG ullNow = GetTickCount64();
+        if (!m_lCancelled && ullNow < m_ullCompletionTime)
+        {
+            ULONGLONG ullRemaining = m_ullCompletionTime - ullNow;
+            Sleep((dwMilliseconds == INFINITE || ullRemaining < dwMilliseconds) ? (DWORD)ullRemaining : dwMilliseconds);
+        }
+        return S_OK;
+    }
+
+    STDMETHOD(QueryStatus)(HRESULT* pHrResult, INT* pReserved)
+    {
+        UNREFERENCED_PARAMETER(pReserved);
+        if (pHrResult == NULL)
+            return E_POINTER;
+        if (m_lCancelled && GetTickCount64() - m_ullCancelTime >= m_dwCancelLatency)
+            *pHrResult = VSS_S_ASYNC_CANCELLED;
+        else if (!IsCompleted())
+            *pHrResult = VSS_S_ASYNC_PENDING;
+        else if (FAILED(m_hrResult))
+            *pHrResult = m_hrResult;
+        else
+            *pHrResult = VSS_S_ASYNC_FINISHED;
+        return S_OK;
+    }
+
+private:
+
+    bool IsCompleted()
+    {
+        return GetTickCount64() >= m_ullCompletionTime;
+    }
+
+    volatile LONG   m_lRefCount;
+    volatile LONG   m_lCancelled;
+    HRESULT         m_hrResult;
+    ULONGLONG       m_ullCompletionTime;
+
+    // Time after Cancel until the operation reports being cancelled
+    DWORD           m_dwCancelLatency;
+    ULONGLONG       m_ullCancelTime;
+};
+
+
+// Allocate a copy of the string with CoTaskMemAlloc, as expected by VssFreeSnapshotProperties
+static VSS_PWSZ CoTaskMemStrDup(const wstring& str)
+{
+    size_t cb = (str.length() + 1) * sizeof(WCHAR);
+    VSS_PWSZ pwsz = (VSS_PWSZ)CoTaskMemAlloc(cb);
+    if (pwsz == NULL)
+        throw(E_OUTOFMEMORY);
+    memcpy(pwsz, str.c_str(), cb);
+    return pwsz;
+}
+
+
+// Copy the properties, with new allocations for the strings
+static void CopySnapshotProperties(const VSS_SNAPSHOT_PROP& source, VSS_SNAPSHOT_PROP& target)
+{
+    target = source;
+    target.m_pwszSnapshotDeviceObject = CoTaskMemStrDup(source.m_pwszSnapshotDeviceObject);
+    target.m_pwszOriginalVolumeName = CoTaskMemStrDup(source.m_pwszOriginalVolumeName);
+    target.m_pwszOriginatingMachine = CoTaskMemStrDup(source.m_pwszOriginatingMachine);
+    target.m_pwszServiceMachine = CoTaskMemStrDup(source.m_pwszServiceMachine);
+    target.m_pwszExposedName = NULL;
+    target.m_pwszExposedPath = NULL;
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Simulated enumeration of shadow copies
+//
+//  Returns copies of the properties captured when the enumeration was
+//  created, in the same way as the IVssEnumObject returned by Query.
+//
+
+class SimulatedEnumObject : public IVssEnumObject
+{
+public:
+
+    // Takes ownership of the given properties
+    SimulatedEnumObject(vector<VSS_SNAPSHOT_PROP>& snapshots):
+        m_lRefCount(1), m_position(0)
+    {
+        m_snapshots.swap(snapshots);
+    }
+
+    ~SimulatedEnumObject()
+    {
+        for (size_t i = 0; i < m_snapshots.size(); ++i)
+            ::VssFreeSnapshotProperties(&m_snapshots[i]);
+    }
+
+    // IUnknown
+
+    STDMETHOD(QueryInterface)(REFIID riid, void** ppvObject)
+    {
+        if (ppvObject == NULL)
+            return E_POINTER;
+        if (riid != __uuidof(IUnknown) && riid != __uuidof(IVssEnumObject))
+        {
+            *ppvObject = NULL;
+            return E_NOINTERFACE;
+        }
+        *ppvObject = static_cast<IVssEnumObject*>(this);
+        AddRef();
+        return S_OK;
+    }
+
+    STDMETHOD_(ULONG, AddRef)()
+    {
+        return InterlockedIncrement(&m_lRefCount);
+    }
+
+    STDMETHOD_(ULONG, Release)()
+    {
+        LONG lRefCount = InterlockedDecrement(&m_lRefCount);
+        if (lRefCount == 0)
+            delete this;
+        return lRefCount;
+    }
+
+    // IVssEnumObject
+
+    STDMETHOD(Next)(ULONG celt, VSS_OBJECT_PROP* rgelt, ULONG* pceltFetched)
+    {
+        if (rgelt == NULL || pceltFetched == NULL)
+            return E_POINTER;
+
+        ULONG ulFetched = 0;
+        for (; ulFetched < celt && m_position < m_snapshots.size(); ++ulFetched, ++m_position)
+        {
+            rgelt[ulFetched].Type = VSS_OBJECT_SNAPSHOT;
+            CopySnapshotProperties(m_snapshots[m_position], rgelt[ulFetched].Obj.Snap);
+        }
+
+        *pceltFetched = ulFetched;
+        return (ulFetched == celt) ? S_OK : S_FALSE;
+    }
+
+    STDMETHOD(Skip)(ULONG celt)
+    {
+        m_position = min(m_position + celt, m_snapshots.size());
+        return (m_position < m_snapshots.size()) ? S_OK : S_FALSE;
+    }
+
+    STDMETHOD(Reset)()
+    {
+        m_position = 0;
+        return S_OK;
+    }
+
+    STDMETHOD(Clone)(IVssEnumObject** ppenum)
+    {
+        if (ppenum == NULL)
+            return E_POINTER;
+        vector<VSS_SNAPSHOT_PROP> snapshots(m_snapshots.size());
+        for (size_t i = 0; i < m_snapshots.size(); ++i)
+            CopySnapshotProperties(m_snapshots[i], snapshots[i]);
+        SimulatedEnumObject* pClone = new SimulatedEnumObject(snapshots);
+        pClone->m_position = m_position;
+        *ppenum = pClone;
+        return S_OK;
+    }
+
+private:
+
+    volatile LONG               m_lRefCount;
+    vector<VSS_SNAPSHOT_PROP>   m_snapshots;
+    size_t                      m_position;
+};
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Simulated backend
+//
+
+
+// Parse the settings of the -simulate option
+void SimulationSettings::Parse(const wstring& settings)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    vector<wstring> pairs = SplitWString(settings, L',');
+    for (size_t i = 0; i < pairs.size(); ++i)
+    {
+        size_t separatorPos = pairs[i].find(L':');
+        wstring name = pairs[i].substr(0, separatorPos);
+        wstring value = (separatorPos == wstring::npos) ? wstring() : pairs[i].substr(separatorPos + 1);
+        LPWSTR pwszEnd = NULL;
+        DWORD dwValue = wcstoul(value.c_str(), &pwszEnd, 0);
+        if (value.empty() || *pwszEnd != L'\0')
+        {
+            ft.WriteErrorLine(L"ERROR: Invalid simulation setting '%s', expected name:number!", pairs[i].c_str());
+            throw(E_INVALIDARG);
+        }
+
+        if (IsEqual(name, L"seed"))
+            seed = dwValue;
+        else if (IsEqual(name, L"snapshot-latency"))
+            snapshotLatency = dwValue;
+        else if (IsEqual(name, L"call-latency"))
+            callLatency = dwValue;
+        else if (IsEqual(name, L"cancel-latency"))
+            cancelLatency = dwValue;
+        else if (IsEqual(name, L"snapshot-failure"))
+            snapshotFailure = (HRESULT)dwValue;
+        else
+        {
+            ft.WriteErrorLine(L"ERROR: Unknown simulation setting '%s'!", name.c_str());
+            throw(E_INVALIDARG);
+        }
+    }
+}
+
+
+SimulatedVssBackend::SimulatedVssBackend(const SimulationSettings& settings):
+    m_settings(settings), m_deviceCounter(0), m_lContext(VSS_CTX_BACKUP), m_snapshotSetId(GUID_NULL)
+{
+    // Never start the xorshift generator from zero
+    m_randomState = 0x9E3779B97F4A7C15ull ^ settings.seed;
+
+    // Start the clock at 2022-01-01 00:00:00 UTC
+    m_clock = 132854688000000000ll;
+}
+
+
+// Initialize the simulated backup components object
+void SimulatedVssBackend::Initialize(LONG lContext)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    ft.WriteDebugLine(L"Using simulated VSS provider (seed %lu)", m_settings.seed);
+
+    m_lContext = lContext;
+}
+
+
+// Spend the configured time of a synchronous call
+void SimulatedVssBackend::SimulateCallLatency()
+{
+    if (m_settings.callLatency > 0)
+        Sleep(m_settings.callLatency);
+}
+
+
+// Generate the next identifier from the seeded xorshift64* sequence
+VSS_ID SimulatedVssBackend::NewId()
+{
+    ULONGLONG ullValues[2];
+    for (int i = 0; i < 2; ++i)
+    {
+        m_randomState ^= m_randomState >> 12;
+        m_randomState ^= m_randomState << 25;
+        m_randomState ^= m_randomState >> 27;
+        ullValues[i] = m_randomState * 0x2545F4914F6CDD1Dull;
+    }
+
+    VSS_ID id;
+    memcpy(&id, ullValues, sizeof(id));
+
+    // Mark as a version 4 (random) GUID
+    id.Data3 = (id.Data3 & 0x0FFF) | 0x4000;
+    id.Data4[0] = (id.Data4[0] & 0x3F) | 0x80;
+    return id;
+}
+
+
+HRESULT SimulatedVssBackend::StartSnapshotSet(VSS_ID* pSnapshotSetId)
+{
+    SimulateCallLatency();
+
+    if (m_snapshotSetId != GUID_NULL)
+        return VSS_E_SNAPSHOT_SET_IN_PROGRESS;
+
+    m_snapshotSetId = NewId();
+    *pSnapshotSetId = m_snapshotSetId;
+    return S_OK;
+}
+
+
+HRESULT SimulatedVssBackend::AddToSnapshotSet(VSS_PWSZ pwszVolumeName, VSS_ID ProviderId, VSS_ID* pidSnapshot)
+{
+    UNREFERENCED_PARAMETER(ProviderId);
+
+    SimulateCallLatency();
+
+    if (m_snapshotSetId == GUID_NULL)
+        return VSS_E_BAD_STATE;
+
+    for (size_t i = 0; i < m_pendingSnapshots.size(); ++i)
+        if (IsEqual(m_pendingSnapshots[i].originalVolumeName, pwszVolumeName))
+            return VSS_E_OBJECT_ALREADY_EXISTS;
+
+    SimulatedSnapshot snapshot;
+    snapshot.id = NewId();
+    snapshot.setId = m_snapshotSetId;
+    snapshot.originalVolumeName = pwszVolumeName;
+    snapshot.creationTimestamp = 0;
+    m_pendingSnapshots.push_back(snapshot);
+
+    *pidSnapshot = snapshot.id;
+    return S_OK;
+}
+
+
+HRESULT SimulatedVssBackend::DoSnapshotSet(IVssAsync** ppAsync)
+{
+    SimulateCallLatency();
+
+    if (m_snapshotSetId == GUID_NULL || m_pendingSnapshots.empty())
+        return VSS_E_BAD_STATE;
+
+    // The shadow copies are created right away, but the asynchronous
+    // operation does not report completion before the configured latency.
+    if (SUCCEEDED(m_settings.snapshotFailure))
+    {
+        m_clock += 10000000ll; // One second later than the previous set
+        for (size_t i = 0; i < m_pendingSnapshots.size(); ++i)
+        {
+            WCHAR wszDevice[64];
+            CHECK_COM(StringCchPrintfW(wszDevice, ARRAYSIZE(wszDevice), L"\\\\?\\GLOBALROOT\\Device\\SimulatedShadowCopy%lu", ++m_deviceCounter));
+            m_pendingSnapshots[i].deviceName = wszDevice;
+            m_pendingSnapshots[i].creationTimestamp = m_clock;
+            m_snapshots.push_back(m_pendingSnapshots[i]);
+        }
+    }
+    m_pendingSnapshots.clear();
+    m_snapshotSetId = GUID_NULL;
+
+    *ppAsync = new SimulatedAsync(m_settings.snapshotLatency, m_settings.cancelLatency, m_settings.snapshotFailure);
+    return S_OK;
+}
+
+
+// Fill the given properties structure from the simulated shadow copy, in a set of the given number of shadow copies
+void SimulatedVssBackend::GetSnapshotProperties(const SimulatedSnapshot& snapshot, LONG lSnapshotsCount, VSS_SNAPSHOT_PROP* pProp)
+{
+    ZeroMemory(pProp, sizeof(*pProp));
+    pProp->m_SnapshotId = snapshot.id;
+    pProp->m_SnapshotSetId = snapshot.setId;
+    pProp->m_pwszSnapshotDeviceObject = CoTaskMemStrDup(snapshot.deviceName);
+    pProp->m_pwszOriginalVolumeName = CoTaskMemStrDup(snapshot.originalVolumeName);
+    pProp->m_pwszOriginatingMachine = CoTaskMemStrDup(L"SIMULATED");
+    pProp->m_pwszServiceMachine = CoTaskMemStrDup(L"SIMULATED");
+    pProp->m_lSnapshotAttributes = m_lContext;
+    pProp->m_tsCreationTimestamp = snapshot.creationTimestamp;
+    pProp->m_eStatus = VSS_SS_CREATED;
+    pProp->m_lSnapshotsCount = lSnapshotsCount;
+}
+
+
+HRESULT SimulatedVssBackend::GetSnapshotProperties(VSS_ID SnapshotId, VSS_SNAPSHOT_PROP* pProp)
+{
+    SimulateCallLatency();
+
+    for (size_t i = 0; i < m_snapshots.size(); ++i)
+    {
+        if (m_snapshots[i].id != SnapshotId)
+            continue;
+
+        LONG lSnapshotsCount = 0;
+        for (size_t j = 0; j < m_snapshots.size(); ++j)
+            if (m_snapshots[j].setId == m_snapshots[i].setId)
+                ++lSnapshotsCount;
+        GetSnapshotProperties(m_snapshots[i], lSnapshotsCount, pProp);
+        return S_OK;
+    }
+
+    return VSS_E_OBJECT_NOT_FOUND;
+}
+
+
+HRESULT SimulatedVssBackend::Query(VSS_ID QueriedObjectId, VSS_OBJECT_TYPE eQueriedObjectType, VSS_OBJECT_TYPE eReturnedObjectsType, IVssEnumObject** ppEnum)
+{
+    SimulateCallLatency();
+
+    if (QueriedObjectId != GUID_NULL || eQueriedObjectType != VSS_OBJECT_NONE || eReturnedObjectsType != VSS_OBJECT_SNAPSHOT)
+        return E_INVALIDARG;
+
+    // The shadow copies of each set are counted once, not for each shadow copy
+    map<VSS_ID, LONG, ltguid> snapshotsPerSet;
+    for (size_t i = 0; i < m_snapshots.size(); ++i)
+        ++snapshotsPerSet[m_snapshots[i].setId];
+
+    // Capture the current properties, the enumeration object hands out copies of them
+    vector<VSS_SNAPSHOT_PROP> snapshots(m_snapshots.size());
+    for (size_t i = 0; i < m_snapshots.size(); ++i)
+        GetSnapshotProperties(m_snapshots[i], snapshotsPerSet[m_snapshots[i].setId], &snapshots[i]);
+
+    HRESULT hr = snapshots.empty() ? S_FALSE : S_OK;
+    *ppEnum = new SimulatedEnumObject(snapshots);
+    return hr;
+}
+
+
+HRESULT SimulatedVssBackend::DeleteSnapshots(VSS_ID SourceObjectId, VSS_OBJECT_TYPE eSourceObjectType, BOOL bForceDelete, LONG* plDeletedSnapshots, VSS_ID* pNondeletedSnapshotID)
+{
+    UNREFERENCED_PARAMETER(bForceDelete);
+
+    SimulateCallLatency();
+
+    if (eSourceObjectType != VSS_OBJECT_SNAPSHOT && eSourceObjectType != VSS_OBJECT_SNAPSHOT_SET)
+        return E_INVALIDARG;
+
+    *plDeletedSnapshots = 0;
+    *pNondeletedSnapshotID = GUID_NULL;
+    for (size_t i = m_snapshots.size(); i-- > 0; )
+    {
+        const VSS_ID& id = (eSourceObjectType == VSS_OBJECT_SNAPSHOT) ? m_snapshots[i].id : m_snapshots[i].setId;
+        if (id != SourceObjectId)
+            continue;
+        m_snapshots.erase(m_snapshots.begin() + i);
+        ++*plDeletedSnapshots;
+    }
+
+    return (*plDeletedSnapshots > 0) ? S_OK : VSS_E_OBJECT_NOT_FOUND;
+}
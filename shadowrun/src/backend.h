@@ -0,0 +1,185 @@
+#pragma once
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Snapshot backends
+//
+//  The VssClient class does not talk to the VSS COM API directly, but through
+//  a backend implementing the VssBackend interface. The methods mirror the
+//  IVssBackupComponents methods used by ShadowRun, and report errors by
+//  returning HRESULT values in the same way, so they can be called through
+//  the regular CHECK_COM macro.
+//
+//  There are two implementations:
+//  - ComVssBackend: Forwards to IVssBackupComponents.
+//  - SimulatedVssBackend: In-memory provider with configurable latencies and
+//    failures, for running the snapshot workflow without administrator
+//    privileges and for reproducible timing measurements.
+//
+
+class VssBackend
+{
+public:
+
+    virtual ~VssBackend() {}
+
+    // Create the backup components object, initialize it for backup and set the context
+    virtual void Initialize(LONG lContext) = 0;
+
+    // Short name for logging
+    virtual LPCWSTR GetName() = 0;
+
+    //
+    //  Mirrors of the IVssBackupComponents methods
+    //
+
+    virtual HRESULT StartSnapshotSet(VSS_ID* pSnapshotSetId) = 0;
+
+    virtual HRESULT AddToSnapshotSet(VSS_PWSZ pwszVolumeName, VSS_ID ProviderId, VSS_ID* pidSnapshot) = 0;
+
+    virtual HRESULT DoSnapshotSet(IVssAsync** ppAsync) = 0;
+
+    virtual HRESULT GetSnapshotProperties(VSS_ID SnapshotId, VSS_SNAPSHOT_PROP* pProp) = 0;
+
+    // Only the query of all shadow copies is supported. It returns the shadow copies of all
+    // contexts, not only the one given to Initialize.
+    virtual HRESULT Query(VSS_ID QueriedObjectId, VSS_OBJECT_TYPE eQueriedObjectType, VSS_OBJECT_TYPE eReturnedObjectsType, IVssEnumObject** ppEnum) = 0;
+
+    virtual HRESULT DeleteSnapshots(VSS_ID SourceObjectId, VSS_OBJECT_TYPE eSourceObjectType, BOOL bForceDelete, LONG* plDeletedSnapshots, VSS_ID* pNondeletedSnapshotID) = 0;
+};
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Backend using the VSS infrastructure
+//
+
+class ComVssBackend : public VssBackend
+{
+public:
+
+    virtual void Initialize(LONG lContext);
+
+    virtual LPCWSTR GetName() { return L"VSS"; }
+
+    virtual HRESULT StartSnapshotSet(VSS_ID* pSnapshotSetId);
+
+    virtual HRESULT AddToSnapshotSet(VSS_PWSZ pwszVolumeName, VSS_ID ProviderId, VSS_ID* pidSnapshot);
+
+    virtual HRESULT DoSnapshotSet(IVssAsync** ppAsync);
+
+    virtual HRESULT GetSnapshotProperties(VSS_ID SnapshotId, VSS_SNAPSHOT_PROP* pProp);
+
+    virtual HRESULT Query(VSS_ID QueriedObjectId, VSS_OBJECT_TYPE eQueriedObjectType, VSS_OBJECT_TYPE eReturnedObjectsType, IVssEnumObject** ppEnum);
+
+    virtual HRESULT DeleteSnapshots(VSS_ID SourceObjectId, VSS_OBJECT_TYPE eSourceObjectType, BOOL bForceDelete, LONG* plDeletedSnapshots, VSS_ID* pNondeletedSnapshotID);
+
+private:
+
+    // The IVssBackupComponents interface is automatically released when this object is destructed.
+    // Needed to issue VSS calls
+    IVssBackupComponentsPtr         m_pVssObject;
+
+    // Shadow copies of other contexts are only visible in VSS_CTX_ALL, where none can be
+    // created, so the queries use their own backup components object, created on first use
+    IVssBackupComponentsPtr         m_pQueryObject;
+};
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Simulated backend
+//
+
+// Settings for the simulated backend
+struct SimulationSettings
+{
+    // Seed for generated identifiers: The same seed gives the same identifiers
+    DWORD   seed = 1;
+
+    // Time (milliseconds) until the asynchronous DoSnapshotSet operation completes
+    DWORD   snapshotLatency = 0;
+
+    // Time (milliseconds) spent in each synchronous call
+    DWORD   callLatency = 0;
+
+    // Time (milliseconds) after a cancellation until the DoSnapshotSet operation reports being cancelled
+    DWORD   cancelLatency = 0;
+
+    // Error returned by the DoSnapshotSet operation, S_OK for success
+    HRESULT snapshotFailure = S_OK;
+
+    // Parse a comma separated list of name:value pairs, as given to the -simulate option.
+    // Throws E_INVALIDARG on unknown names or invalid values.
+    void Parse(const wstring& settings);
+};
+
+
+// Shadow copy kept by the simulated backend
+struct SimulatedSnapshot
+{
+    VSS_ID          id;
+    VSS_ID          setId;
+    wstring         originalVolumeName;
+    wstring         deviceName;
+    VSS_TIMESTAMP   creationTimestamp;
+};
+
+
+class SimulatedVssBackend : public VssBackend
+{
+public:
+
+    SimulatedVssBackend(const SimulationSettings& settings);
+
+    virtual void Initialize(LONG lContext);
+
+    virtual LPCWSTR GetName() { return L"simulated"; }
+
+    virtual HRESULT StartSnapshotSet(VSS_ID* pSnapshotSetId);
+
+    virtual HRESULT AddToSnapshotSet(VSS_PWSZ pwszVolumeName, VSS_ID ProviderId, VSS_ID* pidSnapshot);
+
+    virtual HRESULT DoSnapshotSet(IVssAsync** ppAsync);
+
+    virtual HRESULT GetSnapshotProperties(VSS_ID SnapshotId, VSS_SNAPSHOT_PROP* pProp);
+
+    virtual HRESULT Query(VSS_ID QueriedObjectId, VSS_OBJECT_TYPE eQueriedObjectType, VSS_OBJECT_TYPE eReturnedObjectsType, IVssEnumObject** ppEnum);
+
+    virtual HRESULT DeleteSnapshots(VSS_ID SourceObjectId, VSS_OBJECT_TYPE eSourceObjectType, BOOL bForceDelete, LONG* plDeletedSnapshots, VSS_ID* pNondeletedSnapshotID);
+
+private:
+
+    // Spend the configured time of a synchronous call
+    void SimulateCallLatency();
+
+    // Fill the given properties structure from the simulated shadow copy, in a set of the given number of shadow copies
+    void GetSnapshotProperties(const SimulatedSnapshot& snapshot, LONG lSnapshotsCount, VSS_SNAPSHOT_PROP* pProp);
+
+    // Generate the next identifier from the seeded sequence
+    VSS_ID NewId();
+
+    //
+    //  Data members
+    //
+
+    SimulationSettings              m_settings;
+
+    // State of the identifier generator
+    ULONGLONG                       m_randomState;
+
+    // Simulated clock used for the creation timestamps
+    VSS_TIMESTAMP                   m_clock;
+
+    // Counter used for the shadow copy device names
+    DWORD                           m_deviceCounter;
+
+    LONG                            m_lContext;
+
+    // Shadow copy set being built, GUID_NULL if none
+    VSS_ID                          m_snapshotSetId;
+
+    // Shadow copies added to the set being built
+    vector<SimulatedSnapshot>       m_pendingSnapshots;
+
+    // All shadow copies created by the simulated provider
+    vector<SimulatedSnapshot>       m_snapshots;
+};
@@ -0,0 +1,188 @@
+// Main header
+#include "stdafx.h"
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <intrin.h>
+#include <immintrin.h>
+#define BLOCKCOMPARE_X86
+#endif
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Processor support
+//
+
+#ifdef BLOCKCOMPARE_X86
+
+// Returns true if the processor and the operating system support AVX2
+static bool DetectAvx2()
+{
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+
+    // AVX must be supported, and its registers saved by the operating system
+    __cpuid(info, 1);
+    bool bOsxsave = (info[2] & (1 << 27)) != 0;
+    bool bAvx = (info[2] & (1 << 28)) != 0;
+    if (!bOsxsave || !bAvx || (_xgetbv(0) & 0x6) != 0x6)
+        return false;
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+}
+
+static const bool s_bAvx2 = DetectAvx2();
+
+
+// Compare 32 bytes at a time, the tail is left to the caller
+static size_t CompareAvx2(const BYTE* pFirst, const BYTE* pSecond, size_t cbData)
+{
+    size_t i = 0;
+    for (; i + 128 <= cbData; i += 128)
+    {
+        // Four comparisons are combined before testing, to keep the loads in flight
+        __m256i x0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(pFirst + i)), _mm256_loadu_si256((const __m256i*)(pSecond + i)));
+        __m256i x1 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(pFirst + i + 32)), _mm256_loadu_si256((const __m256i*)(pSecond + i + 32)));
+        __m256i x2 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(pFirst + i + 64)), _mm256_loadu_si256((const __m256i*)(pSecond + i + 64)));
+        __m256i x3 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(pFirst + i + 96)), _mm256_loadu_si256((const __m256i*)(pSecond + i + 96)));
+        __m256i x = _mm256_or_si256(_mm256_or_si256(x0, x1), _mm256_or_si256(x2, x3));
+        if (!_mm256_testz_si256(x, x))
+            return (size_t)-1;
+    }
+    for (; i + 32 <= cbData; i += 32)
+    {
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(pFirst + i)), _mm256_loadu_si256((const __m256i*)(pSecond + i)));
+        if (!_mm256_testz_si256(x, x))
+            return (size_t)-1;
+    }
+    _mm256_zeroupper();
+    return i;
+}
+
+
+// Compare 16 bytes at a time, the tail is left to the caller
+static size_t CompareSse2(const BYTE* pFirst, const BYTE* pSecond, size_t cbData)
+{
+    size_t i = 0;
+    for (; i + 64 <= cbData; i += 64)
+    {
+        __m128i e0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(pFirst + i)), _mm_loadu_si128((const __m128i*)(pSecond + i)));
+        __m128i e1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(pFirst + i + 16)), _mm_loadu_si128((const __m128i*)(pSecond + i + 16)));
+        __m128i e2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(pFirst + i + 32)), _mm_loadu_si128((const __m128i*)(pSecond + i + 32)));
+        __m128i e3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(pFirst + i + 48)), _mm_loadu_si128((const __m128i*)(pSecond + i + 48)));
+        __m128i e = _mm_and_si128(_mm_and_si128(e0, e1), _mm_and_si128(e2, e3));
+        if (_mm_movemask_epi8(e) != 0xFFFF)
+            return (size_t)-1;
+    }
+    for (; i + 16 <= cbData; i += 16)
+    {
+        __m128i e = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(pFirst + i)), _mm_loadu_si128((const __m128i*)(pSecond + i)));
+        if (_mm_movemask_epi8(e) != 0xFFFF)
+            return (size_t)-1;
+    }
+    return i;
+}
+
+
+// Test 32 bytes at a time for zeros, the tail is left to the caller
+static size_t TestZeroAvx2(const BYTE* pData, size_t cbData)
+{
+    size_t i = 0;
+    for (; i + 128 <= cbData; i += 128)
+    {
+        __m256i x = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(pData + i)), _mm256_loadu_si256((const __m256i*)(pData + i + 32))),
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i*)(pData + i + 64)), _mm256_loadu_si256((const __m256i*)(pData + i + 96))));
+        if (!_mm256_testz_si256(x, x))
+            return (size_t)-1;
+    }
+    _mm256_zeroupper();
+    return i;
+}
+
+
+// Test 16 bytes at a time for zeros, the tail is left to the caller
+static size_t TestZeroSse2(const BYTE* pData, size_t cbData)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 64 <= cbData; i += 64)
+    {
+        __m128i x = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i*)(pData + i)), _mm_loadu_si128((const __m128i*)(pData + i + 16))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i*)(pData + i + 32)), _mm_loadu_si128((const __m128i*)(pData + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, zero)) != 0xFFFF)
+            return (size_t)-1;
+    }
+    return i;
+}
+
+#endif
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Block compare
+//
+
+
+// Returns true if the blocks are equal
+bool IsEqualBlock(const BYTE* pFirst, const BYTE* pSecond, size_t cbData)
+{
+    size_t i = 0;
+#ifdef BLOCKCOMPARE_X86
+    i = s_bAvx2 ? CompareAvx2(pFirst, pSecond, cbData) : CompareSse2(pFirst, pSecond, cbData);
+    if (i == (size_t)-1)
+        return false;
+#endif
+    for (; i + sizeof(ULONGLONG) <= cbData; i += sizeof(ULONGLONG))
+    {
+        if (*(const ULONGLONG UNALIGNED*)(pFirst + i) != *(const ULONGLONG UNALIGNED*)(pSecond + i))
+            return false;
+    }
+    for (; i < cbData; ++i)
+    {
+        if (pFirst[i] != pSecond[i])
+            return false;
+    }
+    return true;
+}
+
+
+// Returns true if the block is all zeros
+bool IsZeroBlock(const BYTE* pData, size_t cbData)
+{
+    size_t i = 0;
+#ifdef BLOCKCOMPARE_X86
+    i = s_bAvx2 ? TestZeroAvx2(pData, cbData) : TestZeroSse2(pData, cbData);
+    if (i == (size_t)-1)
+        return false;
+#endif
+    for (; i + sizeof(ULONGLONG) <= cbData; i += sizeof(ULONGLONG))
+    {
+        if (*(const ULONGLONG UNALIGNED*)(pData + i) != 0)
+            return false;
+    }
+    for (; i < cbData; ++i)
+    {
+        if (pData[i] != 0)
+            return false;
+    }
+    return true;
+}
+
+
+// Name of the implementation used
+LPCWSTR GetBlockCompareImplementation()
+{
+#ifdef BLOCKCOMPARE_X86
+    return s_bAvx2 ? L"AVX2" : L"SSE2";
+#else
+    return L"portable";
+#endif
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Block compare
+//
+//  Comparison of large blocks of data, used when exporting and diffing
+//  shadow copy devices, where every byte read is compared. On x86 and x64
+//  the comparison is done 32 bytes at a time with AVX2 when the processor
+//  supports it, checked once at runtime, and else 16 bytes at a time with
+//  SSE2, which all x64 processors support. Other processors use a plain
+//  loop of 8 byte words.
+//
+
+// Returns true if the blocks are equal
+bool IsEqualBlock(const BYTE* pFirst, const BYTE* pSecond, size_t cbData);
+
+// Returns true if the block is all zeros
+bool IsZeroBlock(const BYTE* pData, size_t cbData);
+
+// Name of the implementation used, e.g. for the log
+LPCWSTR GetBlockCompareImplementation();
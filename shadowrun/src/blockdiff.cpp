@@ -0,0 +1,516 @@
+// Main header
+#include "stdafx.h"
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Previous shadow copies
+//
+
+
+// Find the previous shadow copy of each shadow copy in the set
+void FindPreviousSnapshots(VssBackend* pBackend, const SnapshotSetInfo& snapshotSet, const vector<VSS_ID>& candidates, vector<SnapshotInfo>& previous)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    ft.WriteInfoLine(L"Looking for previous shadow copies of the volumes...");
+
+    struct FoundSnapshot
+    {
+        VSS_ID          id;
+        VSS_ID          setId;
+        wstring         volumeName;
+        wstring         deviceName;
+        VSS_TIMESTAMP   created;
+    };
+    vector<FoundSnapshot> found;
+
+    IVssEnumObjectPtr pEnum;
+    CHECK_COM(pBackend->Query(GUID_NULL, VSS_OBJECT_NONE, VSS_OBJECT_SNAPSHOT, &pEnum));
+    while (true)
+    {
+        VSS_OBJECT_PROP prop;
+        ULONG ulFetched = 0;
+        HRESULT hr = pEnum->Next(1, &prop, &ulFetched);
+        CHECK_COM_ERROR(hr, L"IVssEnumObject::Next");
+        if (hr == S_FALSE || ulFetched == 0)
+            break;
+
+        // Automatically call VssFreeSnapshotProperties on this structure at the end of scope
+        VSS_SNAPSHOT_PROP& snap = prop.Obj.Snap;
+        CAutoSnapPointer snapAutoCleanup(&snap);
+
+        // Shadow copies being created or deleted may not have these yet
+        if (snap.m_pwszOriginalVolumeName == NULL || snap.m_pwszSnapshotDeviceObject == NULL)
+            continue;
+
+        FoundSnapshot snapshot;
+        snapshot.id = snap.m_SnapshotId;
+        snapshot.setId = snap.m_SnapshotSetId;
+        snapshot.volumeName = snap.m_pwszOriginalVolumeName;
+        snapshot.deviceName = snap.m_pwszSnapshotDeviceObject;
+        snapshot.created = snap.m_tsCreationTimestamp;
+        found.push_back(snapshot);
+    }
+
+    previous.clear();
+    previous.resize(snapshotSet.snapshots.size());
+    for (size_t i = 0; i < snapshotSet.snapshots.size(); ++i)
+    {
+        const SnapshotInfo& current = snapshotSet.snapshots[i];
+        const FoundSnapshot* pCurrent = NULL;
+        for (size_t j = 0; j < found.size() && pCurrent == NULL; ++j)
+        {
+            if (found[j].id == current.id)
+                pCurrent = &found[j];
+        }
+        if (pCurrent == NULL)
+        {
+            ft.WriteInfoLine(L"Shadow copy %s was not found among the shadow copies on the system", current.idString.c_str());
+            continue;
+        }
+
+        // The latest one of the same volume created before it, and not in the same set
+        const FoundSnapshot* pPrevious = NULL;
+        for (size_t j = 0; j < found.size(); ++j)
+        {
+            if (found[j].setId == snapshotSet.id || found[j].created >= pCurrent->created || !IsEqual(found[j].volumeName, pCurrent->volumeName))
+                continue;
+            if (!candidates.empty() && find(candidates.begin(), candidates.end(), found[j].id) == candidates.end())
+                continue;
+            if (pPrevious == NULL || found[j].created > pPrevious->created)
+                pPrevious = &found[j];
+        }
+        if (pPrevious == NULL)
+        {
+            ft.WriteInfoLine(L"No previous shadow copy of %s was found", pCurrent->volumeName.c_str());
+            continue;
+        }
+
+        previous[i].id = pPrevious->id;
+        previous[i].idString = Guid2WString(pPrevious->id);
+        previous[i].deviceName = pPrevious->deviceName;
+        ft.WriteInfoLine(L"Previous shadow copy of %s is %s (%s)", pCurrent->volumeName.c_str(), previous[i].idString.c_str(), previous[i].deviceName.c_str());
+    }
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Block queue
+//
+
+
+BlockQueue::BlockQueue(DWORD cBuffers, DWORD cbBuffer) :
+    m_bClosed(false),
+    m_hrResult(S_OK)
+{
+    InitializeCriticalSection(&m_lock);
+    m_hFreeSemaphore = CreateSemaphore(NULL, cBuffers, cBuffers, NULL);
+    m_hReadySemaphore = CreateSemaphore(NULL, 0, cBuffers + 1, NULL);
+    m_hAbortEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (m_hFreeSemaphore == NULL || m_hReadySemaphore == NULL || m_hAbortEvent == NULL)
+    {
+        Free();
+        throw(HRESULT_FROM_WIN32(ERROR_NOT_ENOUGH_MEMORY));
+    }
+    for (DWORD i = 0; i < cBuffers; ++i)
+    {
+        BYTE* pBuffer = (BYTE*)VirtualAlloc(NULL, cbBuffer, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (pBuffer == NULL)
+        {
+            Free();
+            throw(E_OUTOFMEMORY);
+        }
+        m_buffers.push_back(pBuffer);
+        m_free.push_back(i);
+    }
+}
+
+
+BlockQueue::~BlockQueue()
+{
+    Free();
+}
+
+
+// Free the buffers and handles
+void BlockQueue::Free()
+{
+    for (size_t i = 0; i < m_buffers.size(); ++i)
+        VirtualFree(m_buffers[i], 0, MEM_RELEASE);
+    m_buffers.clear();
+    if (m_hFreeSemaphore != NULL)
+        CloseHandle(m_hFreeSemaphore);
+    if (m_hReadySemaphore != NULL)
+        CloseHandle(m_hReadySemaphore);
+    if (m_hAbortEvent != NULL)
+        CloseHandle(m_hAbortEvent);
+    m_hFreeSemaphore = m_hReadySemaphore = m_hAbortEvent = NULL;
+    DeleteCriticalSection(&m_lock);
+}
+
+
+// Copy a block into a free buffer and queue it, waiting for a free buffer
+bool BlockQueue::Put(ULONGLONG ullOffset, const BYTE* pData, DWORD cbData)
+{
+    HANDLE handles[] = { m_hAbortEvent, m_hFreeSemaphore };
+    if (WaitForMultipleObjects(ARRAYSIZE(handles), handles, FALSE, INFINITE) != WAIT_OBJECT_0 + 1)
+        return false;
+
+    EnterCriticalSection(&m_lock);
+    QueuedBlock block;
+    block.index = m_free.back();
+    m_free.pop_back();
+    LeaveCriticalSection(&m_lock);
+
+    // Only this thread has the buffer until it is queued
+    memcpy(m_buffers[block.index], pData, cbData);
+    block.ullOffset = ullOffset;
+    block.pData = m_buffers[block.index];
+    block.cbData = cbData;
+
+    EnterCriticalSection(&m_lock);
+    m_ready.push_back(block);
+    LeaveCriticalSection(&m_lock);
+    ReleaseSemaphore(m_hReadySemaphore, 1, NULL);
+    return true;
+}
+
+
+// No more blocks will be put
+void BlockQueue::Close(HRESULT hr)
+{
+    EnterCriticalSection(&m_lock);
+    m_bClosed = true;
+    m_hrResult = hr;
+    LeaveCriticalSection(&m_lock);
+    ReleaseSemaphore(m_hReadySemaphore, 1, NULL);
+}
+
+
+// Take the next block, waiting for it
+bool BlockQueue::Take(QueuedBlock& block)
+{
+    WaitForSingleObject(m_hReadySemaphore, INFINITE);
+
+    EnterCriticalSection(&m_lock);
+    bool bTaken = !m_ready.empty();
+    if (bTaken)
+    {
+        block = m_ready.front();
+        m_ready.erase(m_ready.begin());
+    }
+    else
+    {
+        // Closed, and the count given by Close is kept for any later Take
+        _ASSERTE(m_bClosed);
+        ReleaseSemaphore(m_hReadySemaphore, 1, NULL);
+    }
+    LeaveCriticalSection(&m_lock);
+    return bTaken;
+}
+
+
+// Return the buffer of a block taken
+void BlockQueue::Release(const QueuedBlock& block)
+{
+    EnterCriticalSection(&m_lock);
+    m_free.push_back(block.index);
+    LeaveCriticalSection(&m_lock);
+    ReleaseSemaphore(m_hFreeSemaphore, 1, NULL);
+}
+
+
+// Stop the producer
+void BlockQueue::Abort()
+{
+    SetEvent(m_hAbortEvent);
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Sinks
+//
+
+
+// Puts the blocks of the previous device into the queue
+class QueueSink : public ExportSink
+{
+public:
+
+    QueueSink(BlockQueue& queue) : m_queue(queue) {}
+
+    virtual void Begin(ULONGLONG) {}
+
+    virtual void Write(ULONGLONG ullOffset, const BYTE* pData, DWORD cbData)
+    {
+        if (!m_queue.Put(ullOffset, pData, cbData))
+            throw(E_ABORT);
+    }
+
+    virtual void End() {}
+
+private:
+
+    BlockQueue&     m_queue;
+};
+
+
+DeltaSink::DeltaSink(const wstring& fileBase, BlockQueue& previousBlocks, const ExportSettings& settings) :
+    m_fileBase(fileBase),
+    m_previousBlocks(previousBlocks),
+    m_hDeltaFile(INVALID_HANDLE_VALUE),
+    m_ullDeltaSize(0),
+    m_ullRangeOffset(0),
+    m_ullRangeLength(0),
+    m_ullBytesCompared(0),
+    m_ullBytesChanged(0)
+{
+    if (settings.compression != 0)
+        m_pCompressedDelta.reset(new CompressedFileSink(fileBase + L".delta.cmp", settings));
+}
+
+
+DeltaSink::~DeltaSink()
+{
+    if (m_hDeltaFile != INVALID_HANDLE_VALUE)
+        CloseHandle(m_hDeltaFile);
+}
+
+
+void DeltaSink::Begin(ULONGLONG ullDeviceSize)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    // The size of the delta is only known at the end
+    if (m_pCompressedDelta)
+    {
+        m_pCompressedDelta->Begin(0);
+    }
+    else
+    {
+        wstring deltaFileName = m_fileBase + L".delta";
+        m_hDeltaFile = CreateFile(deltaFileName.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (m_hDeltaFile == INVALID_HANDLE_VALUE)
+        {
+            DWORD dwLastError = GetLastError();
+            ft.WriteErrorLine(L"ERROR: Could not create the delta file '%s'!", deltaFileName.c_str());
+            CHECK_WIN32_ERROR(dwLastError, L"CreateFile");
+        }
+    }
+
+    wstring changeFileName = m_fileBase + L".changes";
+    m_changeFile.open(changeFileName.c_str(), ios::out | ios::trunc);
+    if (!m_changeFile)
+    {
+        ft.WriteErrorLine(L"ERROR: Could not create the change file '%s'!", changeFileName.c_str());
+        throw(HRESULT_FROM_WIN32(ERROR_CANNOT_MAKE));
+    }
+    m_changeFile << m_header;
+    m_changeFile << "size " << ullDeviceSize << "\n";
+    m_changeFile << "unit " << DIFF_UNIT_SIZE << "\n";
+    m_changeFile << "\n";
+}
+
+
+void DeltaSink::Write(ULONGLONG ullOffset, const BYTE* pData, DWORD cbData)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    // Both devices are read in the same blocks, in the same order
+    QueuedBlock previous;
+    if (!m_previousBlocks.Take(previous))
+        throw(FAILED(m_previousBlocks.GetResult()) ? m_previousBlocks.GetResult() : E_UNEXPECTED);
+    if (previous.ullOffset != ullOffset || previous.cbData != cbData)
+    {
+        m_previousBlocks.Release(previous);
+        ft.WriteErrorLine(L"ERROR: The blocks of the devices are out of step at offset %llu", ullOffset);
+        throw(E_UNEXPECTED);
+    }
+
+    try
+    {
+        for (DWORD i = 0; i < cbData; i += DIFF_UNIT_SIZE)
+        {
+            DWORD cbUnit = min(DIFF_UNIT_SIZE, cbData - i);
+            if (!IsEqualBlock(pData + i, previous.pData + i, cbUnit))
+                AddChange(ullOffset + i, pData + i, cbUnit);
+        }
+    }
+    catch (HRESULT)
+    {
+        m_previousBlocks.Release(previous);
+        throw;
+    }
+    m_previousBlocks.Release(previous);
+    m_ullBytesCompared += cbData;
+}
+
+
+void DeltaSink::End()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    FlushRange();
+    m_changeFile.close();
+    if (m_changeFile.fail())
+    {
+        ft.WriteErrorLine(L"ERROR: Could not write the change file '%s.changes'!", m_fileBase.c_str());
+        throw(HRESULT_FROM_WIN32(ERROR_WRITE_FAULT));
+    }
+    if (m_pCompressedDelta)
+    {
+        m_pCompressedDelta->End();
+        return;
+    }
+    CloseHandle(m_hDeltaFile);
+    m_hDeltaFile = INVALID_HANDLE_VALUE;
+}
+
+
+// Write a changed unit
+void DeltaSink::AddChange(ULONGLONG ullOffset, const BYTE* pData, DWORD cbData)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    // The offsets in the compressed file are those of the delta file it replaces
+    if (m_pCompressedDelta)
+    {
+        m_pCompressedDelta->Write(m_ullDeltaSize, pData, cbData);
+    }
+    else
+    {
+        DWORD cbWritten = 0;
+        CHECK_WIN32(WriteFile(m_hDeltaFile, pData, cbData, &cbWritten, NULL));
+    }
+    m_ullDeltaSize += cbData;
+    m_ullBytesChanged += cbData;
+
+    if (m_ullRangeLength > 0 && m_ullRangeOffset + m_ullRangeLength == ullOffset)
+    {
+        m_ullRangeLength += cbData;
+        return;
+    }
+    FlushRange();
+    m_ullRangeOffset = ullOffset;
+    m_ullRangeLength = cbData;
+}
+
+
+// Write the line of the current range of changes
+void DeltaSink::FlushRange()
+{
+    if (m_ullRangeLength > 0)
+        m_changeFile << m_ullRangeOffset << " " << m_ullRangeLength << "\n";
+    m_ullRangeLength = 0;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Block differ
+//
+
+
+BlockDiffer::BlockDiffer(const ExportSettings& settings) :
+    m_settings(settings)
+{
+}
+
+
+// Read the previous device into the queue
+DWORD WINAPI BlockDiffer::PreviousReaderThread(LPVOID pParameter)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    PreviousReader* pContext = (PreviousReader*)pParameter;
+    HRESULT hr = S_OK;
+    try
+    {
+        QueueSink sink(*pContext->pQueue);
+        pContext->pReader->Read(*pContext->pExtents, sink);
+    }
+    catch (HRESULT hrError)
+    {
+        hr = hrError;
+    }
+    catch (bad_alloc)
+    {
+        hr = E_OUTOFMEMORY;
+    }
+    pContext->pQueue->Close(hr);
+    return 0;
+}
+
+
+// Write the changes of the current device since the previous one
+bool BlockDiffer::Diff(const SnapshotInfo& current, const SnapshotInfo& previous, const wstring& fileBase)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    ft.WriteInfoLine(L"Comparing %s with previous shadow copy %s...", current.deviceName.c_str(), previous.deviceName.c_str());
+    ULONGLONG ullStartTime = GetTickCount64();
+
+    DeviceReader currentReader(m_settings);
+    currentReader.Open(current.deviceName);
+    DeviceReader previousReader(m_settings);
+    previousReader.Open(previous.deviceName);
+    if (currentReader.GetSize() != previousReader.GetSize())
+    {
+        ft.WriteInfoLine(L"The size of the volume has changed since the previous shadow copy, %llu and %llu bytes",
+            currentReader.GetSize(), previousReader.GetSize());
+        return false;
+    }
+
+    // Clusters free now do not matter, whatever they held before
+    vector<Extent> extents;
+    VolumeBitmap bitmap;
+    if (!m_settings.usedOnly || !bitmap.GetUsedExtents(currentReader.GetHandle(), currentReader.GetSize(), extents))
+    {
+        Extent extent;
+        extent.length = currentReader.GetSize();
+        extents.assign(1, extent);
+    }
+
+    BlockQueue previousBlocks(m_settings.queueDepth, m_settings.blockSize);
+    PreviousReader context;
+    context.pReader = &previousReader;
+    context.pExtents = &extents;
+    context.pQueue = &previousBlocks;
+    HANDLE hThread = CreateThread(NULL, 0, PreviousReaderThread, &context, 0, NULL);
+    CHECK_WIN32(hThread != NULL);
+    CAutoHandle autoCloseThread(hThread);
+
+    DeltaSink sink(fileBase, previousBlocks, m_settings);
+    ostringstream header;
+    header << "current " << WString2String(current.idString) << "\n";
+    header << "previous " << WString2String(previous.idString) << "\n";
+    sink.SetHeader(header.str());
+    try
+    {
+        currentReader.Read(extents, sink);
+    }
+    catch (...)
+    {
+        // The previous reader may be waiting for a free buffer
+        previousBlocks.Abort();
+        WaitForSingleObject(hThread, INFINITE);
+        throw;
+    }
+    WaitForSingleObject(hThread, INFINITE);
+    if (FAILED(previousBlocks.GetResult()))
+        throw(previousBlocks.GetResult());
+
+    double seconds = (GetTickCount64() - ullStartTime) / 1000.0;
+    double megabytes = sink.GetBytesCompared() / (1024.0 * 1024.0);
+    ft.WriteInfoLine(L"Compared %.1f MB in %.1f seconds (%.1f MB/s, %s), %.1f MB changed",
+        megabytes, seconds, (seconds > 0) ? megabytes / seconds : 0.0, GetBlockCompareImplementation(),
+        sink.GetBytesChanged() / (1024.0 * 1024.0));
+    return true;
+}
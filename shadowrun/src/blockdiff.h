@@ -0,0 +1,172 @@
+#pragma once
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Block diff
+//
+//  With the -diff option the export only writes the blocks that changed
+//  since a previous shadow copy of the same volume, which must still exist
+//  on the system, e.g. a persistent shadow copy created by vshadow or the
+//  shadow copy of a concurrent ShadowRun. By default the latest shadow copy
+//  of the volume created before the current one is used, found by querying
+//  all shadow copies on the system; specific ones can also be given.
+//
+//  Both devices are read at the same time, each by its own thread with its
+//  own queue of outstanding reads, and the blocks of the previous device
+//  are handed over to the thread comparing them through a bounded queue of
+//  pooled buffers. The blocks are compared in units of 64 KB with the
+//  vectorized block compare, and each changed unit is appended to the delta
+//  file, while the list of changed ranges is written to the change file:
+//
+//      {shadow id}.changes     Text file, a header of name value lines,
+//                              then an "offset length" line for each
+//                              changed range, in bytes
+//      {shadow id}.delta       The data of the changed ranges, in the same
+//                              order, without any gaps
+//
+//  Applying the delta to an image of the previous shadow copy, writing the
+//  data of each range at its offset, gives an image of the current one.
+//
+
+// Size of the units compared, a changed unit is written entirely
+const DWORD DIFF_UNIT_SIZE = 64 * 1024;
+
+
+// Find the previous shadow copy of each shadow copy in the set, of the same volume and created before it,
+// among the shadow copies returned by the backend.
+// If shadow copy IDs are given, only those are considered, and else all shadow copies on the system.
+// The previous shadow copies are returned in the same order as the set, with empty device names where none was found.
+void FindPreviousSnapshots(VssBackend* pBackend, const SnapshotSetInfo& snapshotSet, const vector<VSS_ID>& candidates, vector<SnapshotInfo>& previous);
+
+
+// A block in a BlockQueue
+struct QueuedBlock
+{
+    size_t              index = 0;
+    ULONGLONG           ullOffset = 0;
+    const BYTE*         pData = NULL;
+    DWORD               cbData = 0;
+};
+
+
+// Blocks handed over from one thread to another, through a fixed number of pooled buffers
+class BlockQueue
+{
+public:
+
+    BlockQueue(DWORD cBuffers, DWORD cbBuffer);
+
+    ~BlockQueue();
+
+    // Copy a block into a free buffer and queue it, waiting for a free buffer
+    // Returns false if the queue has been aborted by the consumer
+    bool Put(ULONGLONG ullOffset, const BYTE* pData, DWORD cbData);
+
+    // No more blocks will be put, with the result of the producer
+    void Close(HRESULT hr);
+
+    // Take the next block, waiting for it, to be released when done with it
+    // Returns false if the queue is closed and empty, then see GetResult
+    bool Take(QueuedBlock& block);
+
+    // Return the buffer of a block taken
+    void Release(const QueuedBlock& block);
+
+    // Stop the producer, making any waiting and later Put return false
+    void Abort();
+
+    // Result given to Close
+    HRESULT GetResult() { return m_hrResult; }
+
+private:
+
+    // Free the buffers and handles
+    void Free();
+
+    vector<BYTE*>               m_buffers;
+    vector<size_t>              m_free;
+    vector<QueuedBlock>         m_ready;
+    bool                        m_bClosed;
+    HRESULT                     m_hrResult;
+
+    // Protects the lists
+    CRITICAL_SECTION            m_lock;
+
+    // Count the free buffers and the queued blocks (plus one when closed), and signalled when aborted
+    HANDLE                      m_hFreeSemaphore;
+    HANDLE                      m_hReadySemaphore;
+    HANDLE                      m_hAbortEvent;
+};
+
+
+// Writes the changes between the blocks of the current device and those of the previous device from a queue
+class DeltaSink : public ExportSink
+{
+public:
+
+    DeltaSink(const wstring& fileBase, BlockQueue& previousBlocks, const ExportSettings& settings);
+
+    ~DeltaSink();
+
+    // Text of the header of the change file, name value lines
+    void SetHeader(const string& header) { m_header = header; }
+
+    virtual void Begin(ULONGLONG ullDeviceSize);
+    virtual void Write(ULONGLONG ullOffset, const BYTE* pData, DWORD cbData);
+    virtual void End();
+
+    // Bytes compared and bytes changed
+    ULONGLONG GetBytesCompared() { return m_ullBytesCompared; }
+    ULONGLONG GetBytesChanged() { return m_ullBytesChanged; }
+
+private:
+
+    // Write a changed unit
+    void AddChange(ULONGLONG ullOffset, const BYTE* pData, DWORD cbData);
+
+    // Write the line of the current range of changes
+    void FlushRange();
+
+    wstring             m_fileBase;
+    BlockQueue&         m_previousBlocks;
+    string              m_header;
+
+    // The delta file, or its compressed file if compression is enabled
+    HANDLE              m_hDeltaFile;
+    unique_ptr<CompressedFileSink> m_pCompressedDelta;
+    ULONGLONG           m_ullDeltaSize;
+    ofstream            m_changeFile;
+
+    // Current range of contiguous changes, not yet written to the change file
+    ULONGLONG           m_ullRangeOffset;
+    ULONGLONG           m_ullRangeLength;
+
+    ULONGLONG           m_ullBytesCompared;
+    ULONGLONG           m_ullBytesChanged;
+};
+
+
+// Diff two devices of the same size, writing the delta files
+class BlockDiffer
+{
+public:
+
+    BlockDiffer(const ExportSettings& settings);
+
+    // Write the changes of the current device since the previous one to {fileBase}.changes and {fileBase}.delta
+    // Returns false if the devices have different sizes and cannot be compared
+    bool Diff(const SnapshotInfo& current, const SnapshotInfo& previous, const wstring& fileBase);
+
+private:
+
+    // Read the previous device into the queue
+    struct PreviousReader
+    {
+        DeviceReader*           pReader = NULL;
+        const vector<Extent>*   pExtents = NULL;
+        BlockQueue*             pQueue = NULL;
+    };
+    static DWORD WINAPI PreviousReaderThread(LPVOID pParameter);
+
+    ExportSettings          m_settings;
+};
@@ -0,0 +1,328 @@
+// Main header
+#include "stdafx.h"
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Settings
+//
+
+
+// Parse the settings of the -capture-rotate option
+void OutputCaptureSettings::Parse(const wstring& settings)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    vector<wstring> pairs = SplitWString(settings, L',');
+    for (size_t i = 0; i < pairs.size(); ++i)
+    {
+        size_t separatorPos = pairs[i].find(L':');
+        wstring name = pairs[i].substr(0, separatorPos);
+        wstring value = (separatorPos == wstring::npos) ? wstring() : pairs[i].substr(separatorPos + 1);
+        LPWSTR pwszEnd = NULL;
+        DWORD dwValue = wcstoul(value.c_str(), &pwszEnd, 10);
+        if (value.empty() || *pwszEnd != L'\0')
+        {
+            ft.WriteErrorLine(L"ERROR: Invalid capture setting '%s', expected name:number!", pairs[i].c_str());
+            throw(E_INVALIDARG);
+        }
+
+        if (IsEqual(name, L"size"))
+            rotateSize = dwValue;
+        else if (IsEqual(name, L"count"))
+            rotateCount = dwValue;
+        else
+        {
+            ft.WriteErrorLine(L"ERROR: Unknown capture setting '%s'!", pairs[i].c_str());
+            throw(E_INVALIDARG);
+        }
+    }
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Output capture
+//
+
+
+OutputCapture::OutputCapture(const OutputCaptureSettings& settings) :
+    m_settings(settings),
+    m_hLogFile(NULL),
+    m_ullLogSize(0)
+{
+    InitializeCriticalSection(&m_lock);
+}
+
+
+OutputCapture::~OutputCapture()
+{
+    Flush();
+    if (m_hLogFile != NULL)
+        CloseHandle(m_hLogFile);
+    DeleteCriticalSection(&m_lock);
+}
+
+
+// Open the log file, if any, appending to an existing file
+void OutputCapture::Open()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    if (m_settings.logFile.empty())
+        return;
+
+    ft.WriteDebugLine(L"Opening capture log file '%s'...", m_settings.logFile.c_str());
+    HANDLE hFile = CreateFile(m_settings.logFile.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        DWORD dwLastError = GetLastError();
+        ft.WriteErrorLine(L"ERROR: Could not open the capture log file '%s'!", m_settings.logFile.c_str());
+        CHECK_WIN32_ERROR(dwLastError, L"CreateFile");
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(hFile, &size) || !SetFilePointerEx(hFile, size, NULL, FILE_BEGIN))
+    {
+        DWORD dwLastError = GetLastError();
+        CloseHandle(hFile);
+        CHECK_WIN32_ERROR(dwLastError, L"SetFilePointerEx");
+    }
+    m_hLogFile = hFile;
+    m_ullLogSize = size.QuadPart;
+}
+
+
+// Start a command with its output captured
+HANDLE OutputCapture::StartCommand(const wstring& jobName, const wstring& command, const vector<wstring>& arguments, bool quoteArguments, bool expandArguments)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    CloseReaders(false);
+
+    // The command gets the write ends of the pipes, when it exits the readers get end of file
+    HANDLE hOutput = StartReader(jobName, false);
+    HANDLE hError = NULL;
+    HANDLE hProcess = NULL;
+    try
+    {
+        hError = StartReader(jobName, true);
+        hProcess = ::StartCommand(command, arguments, quoteArguments, expandArguments, hOutput, hError);
+    }
+    catch (HRESULT)
+    {
+        CloseHandle(hOutput);
+        if (hError != NULL)
+            CloseHandle(hError);
+        throw;
+    }
+    CloseHandle(hOutput);
+    CloseHandle(hError);
+    return hProcess;
+}
+
+
+// Wait until all the output of the commands started so far has been written
+void OutputCapture::Flush()
+{
+    CloseReaders(true);
+}
+
+
+// Create a pipe and a thread reading it, returns the inheritable write end
+HANDLE OutputCapture::StartReader(const wstring& jobName, bool bError)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    SECURITY_ATTRIBUTES sa = { sizeof(sa), NULL, TRUE };
+    HANDLE hRead = NULL;
+    HANDLE hWrite = NULL;
+    CHECK_WIN32(CreatePipe(&hRead, &hWrite, &sa, OUTPUT_CAPTURE_READ_BUFFER_SIZE));
+    SetHandleInformation(hRead, HANDLE_FLAG_INHERIT, 0);
+
+    Reader* pReader = new Reader;
+    pReader->pCapture = this;
+    pReader->hPipe = hRead;
+    pReader->jobName = jobName;
+    pReader->bError = bError;
+
+    HANDLE hThread = CreateThread(NULL, 0, ReaderThread, pReader, 0, NULL);
+    if (hThread == NULL)
+    {
+        DWORD dwLastError = GetLastError();
+        delete pReader;
+        CloseHandle(hRead);
+        CloseHandle(hWrite);
+        CHECK_WIN32_ERROR(dwLastError, L"CreateThread");
+    }
+
+    EnterCriticalSection(&m_lock);
+    m_readers.push_back(hThread);
+    LeaveCriticalSection(&m_lock);
+
+    return hWrite;
+}
+
+
+// Reader thread
+DWORD WINAPI OutputCapture::ReaderThread(LPVOID pParameter)
+{
+    Reader* pReader = (Reader*)pParameter;
+    pReader->pCapture->Read(*pReader);
+    CloseHandle(pReader->hPipe);
+    delete pReader;
+    return 0;
+}
+
+
+// Read the pipe until the command closes it
+void OutputCapture::Read(const Reader& reader)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    char buffer[OUTPUT_CAPTURE_READ_BUFFER_SIZE];
+    char line[OUTPUT_CAPTURE_MAX_LINE_LENGTH];
+    DWORD lineLength = 0;
+
+    DWORD cbRead = 0;
+    while (ReadFile(reader.hPipe, buffer, sizeof(buffer), &cbRead, NULL) && cbRead > 0)
+    {
+        for (DWORD i = 0; i < cbRead; ++i)
+        {
+            if (buffer[i] == '\n')
+            {
+                if (lineLength > 0 && line[lineLength - 1] == '\r')
+                    --lineLength;
+                WriteLine(reader, line, lineLength);
+                lineLength = 0;
+                continue;
+            }
+            if (lineLength == sizeof(line))
+            {
+                WriteLine(reader, line, lineLength);
+                lineLength = 0;
+            }
+            line[lineLength++] = buffer[i];
+        }
+    }
+
+    // Output not ending with a newline
+    if (lineLength > 0)
+        WriteLine(reader, line, lineLength);
+}
+
+
+// Write a line of output with its prefix to the console and the log file
+void OutputCapture::WriteLine(const Reader& reader, const char* line, DWORD length)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    SYSTEMTIME time;
+    GetLocalTime(&time);
+    WCHAR prefix[128];
+    StringCchPrintfW(prefix, ARRAYSIZE(prefix), L"%04u-%02u-%02u %02u:%02u:%02u.%03u [%s %s] ",
+        time.wYear, time.wMonth, time.wDay, time.wHour, time.wMinute, time.wSecond, time.wMilliseconds,
+        reader.jobName.c_str(), reader.bError ? L"err" : L"out");
+
+    EnterCriticalSection(&m_lock);
+
+    m_wideLine = prefix;
+    if (length > 0)
+    {
+        int cchText = MultiByteToWideChar(CP_OEMCP, 0, line, length, NULL, 0);
+        size_t cchPrefix = m_wideLine.length();
+        m_wideLine.resize(cchPrefix + cchText);
+        MultiByteToWideChar(CP_OEMCP, 0, line, length, &m_wideLine[cchPrefix], cchText);
+    }
+    fwprintf(reader.bError ? stderr : stdout, L"%s\n", m_wideLine.c_str());
+
+    if (m_hLogFile != NULL)
+    {
+        int cbText = WideCharToMultiByte(CP_UTF8, 0, m_wideLine.c_str(), (int)m_wideLine.length(), NULL, 0, NULL, NULL);
+        m_logLine.resize(cbText);
+        WideCharToMultiByte(CP_UTF8, 0, m_wideLine.c_str(), (int)m_wideLine.length(), &m_logLine[0], cbText, NULL, NULL);
+        m_logLine += "\r\n";
+        WriteLog(m_logLine);
+    }
+
+    LeaveCriticalSection(&m_lock);
+}
+
+
+// Write to the log file, rotating it first if needed, called with the lock held
+void OutputCapture::WriteLog(const string& text)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    if (m_settings.rotateSize > 0 && m_ullLogSize > 0 && m_ullLogSize + text.length() > m_settings.rotateSize * 1024ULL * 1024ULL)
+        RotateLog();
+
+    DWORD cbWritten = 0;
+    if (m_hLogFile == NULL || !WriteFile(m_hLogFile, text.c_str(), (DWORD)text.length(), &cbWritten, NULL))
+    {
+        // The output still goes to the console, so do not fail the command because of the log
+        if (m_hLogFile != NULL)
+        {
+            ft.WriteErrorLine(L"WARNING: Could not write to the capture log file (0x%08lx), no longer writing to it", HRESULT_FROM_WIN32(GetLastError()));
+            CloseHandle(m_hLogFile);
+            m_hLogFile = NULL;
+        }
+        return;
+    }
+    m_ullLogSize += cbWritten;
+}
+
+
+// Rename the log file and the old files, and start a new one, called with the lock held
+void OutputCapture::RotateLog()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    CloseHandle(m_hLogFile);
+    m_hLogFile = NULL;
+
+    // The oldest file is replaced by the one before it
+    for (DWORD i = m_settings.rotateCount; i > 1; --i)
+        MoveFileEx((m_settings.logFile + L"." + to_wstring(i - 1)).c_str(), (m_settings.logFile + L"." + to_wstring(i)).c_str(), MOVEFILE_REPLACE_EXISTING);
+    if (m_settings.rotateCount > 0)
+        MoveFileEx(m_settings.logFile.c_str(), (m_settings.logFile + L".1").c_str(), MOVEFILE_REPLACE_EXISTING);
+
+    // Without old files to keep the file is just started over
+    HANDLE hFile = CreateFile(m_settings.logFile.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        ft.WriteErrorLine(L"WARNING: Could not start a new capture log file (0x%08lx), no longer writing to it", HRESULT_FROM_WIN32(GetLastError()));
+        return;
+    }
+    m_hLogFile = hFile;
+    m_ullLogSize = 0;
+}
+
+
+// Close the handles of the reader threads that are done, or wait for all of them
+void OutputCapture::CloseReaders(bool bWait)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    // The readers need the lock to write, so do not hold it while waiting
+    vector<HANDLE> readers;
+    EnterCriticalSection(&m_lock);
+    for (size_t i = 0; i < m_readers.size(); )
+    {
+        if (bWait || WaitForSingleObject(m_readers[i], 0) == WAIT_OBJECT_0)
+        {
+            readers.push_back(m_readers[i]);
+            m_readers.erase(m_readers.begin() + i);
+        }
+        else
+            ++i;
+    }
+    LeaveCriticalSection(&m_lock);
+
+    for (size_t i = 0; i < readers.size(); ++i)
+    {
+        WaitForSingleObject(readers[i], INFINITE);
+        CloseHandle(readers[i]);
+    }
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Output capture
+//
+//  With the -capture option the standard output and error of the commands
+//  are read through pipes instead of being inherited from ShadowRun, and
+//  each line is prefixed with a timestamp, the job it came from and the
+//  stream, before it is written to the console and optionally to a log
+//  file, given with -capture-file. The log file is rotated when it reaches
+//  a given size, keeping a given number of old files.
+//
+//  Each pipe is read by its own thread, with a fixed size read buffer and
+//  a fixed size line buffer; a line longer than the line buffer is split.
+//  Lines are written directly from the reader thread, one at a time, so
+//  nothing is queued: A command producing output faster than it can be
+//  written is simply held back by the pipe, and the memory used does not
+//  depend on the amount of output.
+//
+//  The output of the commands is assumed to be in the OEM code page, as
+//  for console programs. It is written to the console as text, and to the
+//  log file encoded as UTF-8.
+//
+
+// Size of the buffer of each pipe, and of each read from it
+const DWORD OUTPUT_CAPTURE_READ_BUFFER_SIZE = 4096;
+
+// Maximum length of a line, in bytes, longer lines are split
+const DWORD OUTPUT_CAPTURE_MAX_LINE_LENGTH = 4096;
+
+// Default size of the log file before it is rotated, in megabytes, and old files to keep
+const DWORD OUTPUT_CAPTURE_DEFAULT_ROTATE_SIZE = 100;
+const DWORD OUTPUT_CAPTURE_DEFAULT_ROTATE_COUNT = 5;
+
+
+// Settings for the output capture, given by the -capture options on the command line
+struct OutputCaptureSettings
+{
+    // Capture the output of the commands
+    bool                enabled = false;
+
+    // Log file to also write the output to, none if empty
+    wstring             logFile;
+
+    // Megabytes written to the log file before it is rotated (0 for never), and number of old files to keep
+    DWORD               rotateSize = OUTPUT_CAPTURE_DEFAULT_ROTATE_SIZE;
+    DWORD               rotateCount = OUTPUT_CAPTURE_DEFAULT_ROTATE_COUNT;
+
+    // Parse a comma separated list of name:value pairs, as given to the -capture-rotate option:
+    // size:megabytes and count:number.
+    // Throws E_INVALIDARG on unknown names or invalid values.
+    void Parse(const wstring& settings);
+};
+
+
+class OutputCapture
+{
+public:
+
+    OutputCapture(const OutputCaptureSettings& settings);
+
+    // Waits for all the output to be written
+    ~OutputCapture();
+
+    // Open the log file, if any, appending to an existing file
+    void Open();
+
+    // Start a command with its output captured, see StartCommand, the job name is included in the prefix of each line.
+    // Returns the process handle to wait for with WaitForCommand, the output may be written a little after the process exits.
+    HANDLE StartCommand(const wstring& jobName, const wstring& command, const vector<wstring>& arguments, bool quoteArguments, bool expandArguments);
+
+    // Wait until all the output of the commands started so far has been written
+    void Flush();
+
+private:
+
+    // A pipe read by a reader thread
+    struct Reader
+    {
+        OutputCapture*      pCapture = NULL;
+        HANDLE              hPipe = NULL;
+        wstring             jobName;
+        bool                bError = false;
+    };
+
+    // Create a pipe and a thread reading it, returns the inheritable write end
+    HANDLE StartReader(const wstring& jobName, bool bError);
+
+    // Read the pipe until the command closes it
+    static DWORD WINAPI ReaderThread(LPVOID pParameter);
+    void Read(const Reader& reader);
+
+    // Write a line of output with its prefix to the console and the log file
+    void WriteLine(const Reader& reader, const char* line, DWORD length);
+
+    // Write to the log file, rotating it first if needed
+    void WriteLog(const string& text);
+
+    // Rename the log file and the old files, and start a new one
+    void RotateLog();
+
+    // Close the handles of the reader threads that are done, or wait for all of them
+    void CloseReaders(bool bWait);
+
+    //
+    //  Data members
+    //
+
+    OutputCaptureSettings       m_settings;
+
+    // Protects everything below, serializing the lines written
+    CRITICAL_SECTION            m_lock;
+
+    // Reader threads, until closed by CloseReaders
+    vector<HANDLE>              m_readers;
+
+    // Log file, and bytes written to it since it was started
+    HANDLE                      m_hLogFile;
+    ULONGLONG                   m_ullLogSize;
+
+    // Buffers used for each line, kept to avoid allocations
+    wstring                     m_wideLine;
+    string                      m_logLine;
+};
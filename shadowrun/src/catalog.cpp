@@ -0,0 +1,690 @@
+// Main header
+#include "stdafx.h"
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Snapshot catalog
+//
+
+
+static const char CATALOG_LOG_MAGIC[8] = { 'S', 'R', 'C', 'A', 'T', 'L', 'O', 'G' };
+static const char CATALOG_INDEX_MAGIC[8] = { 'S', 'R', 'C', 'A', 'T', 'I', 'D', 'X' };
+static const DWORD CATALOG_VERSION = 1;
+
+// Size of a new log file, doubled when full
+static const ULONGLONG CATALOG_INITIAL_LOG_SIZE = 64 * 1024;
+
+// Number of runs and IDs of a new index, doubled when full
+static const ULONGLONG CATALOG_INITIAL_CAPACITY = 256;
+
+
+// Size of a record in the log, with its text, aligned to 8 bytes
+static ULONGLONG GetRecordSize(const CatalogRecord& record)
+{
+    return sizeof(CatalogRecord) + ((record.cbText + 7) & ~7);
+}
+
+
+static ULONGLONG GetCurrentFileTime()
+{
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    return ((ULONGLONG)now.dwHighDateTime << 32) | now.dwLowDateTime;
+}
+
+
+SnapshotCatalog::SnapshotCatalog(const wstring& fileName) :
+    m_fileName(fileName),
+    m_run(0),
+    m_ullStartTick(0),
+    m_ullLastOffset(0),
+    m_hLogFile(INVALID_HANDLE_VALUE),
+    m_hLogMapping(NULL),
+    m_pLog(NULL),
+    m_ullLogMapped(0),
+    m_hIndexFile(INVALID_HANDLE_VALUE),
+    m_hIndexMapping(NULL),
+    m_pIndex(NULL),
+    m_pRuns(NULL),
+    m_pIds(NULL)
+{
+}
+
+
+SnapshotCatalog::~SnapshotCatalog()
+{
+    Close();
+}
+
+
+// Open and map the log and the index, waiting for other processes using them
+void SnapshotCatalog::Open()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    ULONGLONG ullStartTick = GetTickCount64();
+    while (true)
+    {
+        m_hLogFile = CreateFile(m_fileName.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL);
+        if (m_hLogFile != INVALID_HANDLE_VALUE)
+            break;
+        DWORD dwLastError = GetLastError();
+        if (dwLastError == ERROR_SHARING_VIOLATION && GetTickCount64() - ullStartTick < CATALOG_LOCK_TIMEOUT)
+        {
+            Sleep(100);
+            continue;
+        }
+        ft.WriteErrorLine(L"ERROR: Could not open the catalog file '%s'!", m_fileName.c_str());
+        CHECK_WIN32_ERROR(dwLastError, L"CreateFile");
+    }
+
+    try
+    {
+        LARGE_INTEGER fileSize;
+        CHECK_WIN32(GetFileSizeEx(m_hLogFile, &fileSize));
+        MapLog(sizeof(LogHeader));
+        LogHeader* pHeader = (LogHeader*)m_pLog;
+        if (fileSize.QuadPart == 0)
+        {
+            memcpy(pHeader->magic, CATALOG_LOG_MAGIC, sizeof(pHeader->magic));
+            pHeader->version = CATALOG_VERSION;
+            pHeader->used = sizeof(LogHeader);
+            CHECK_WIN32(FlushViewOfFile(pHeader, sizeof(LogHeader)));
+            CHECK_WIN32(FlushFileBuffers(m_hLogFile));
+        }
+        else if (memcmp(pHeader->magic, CATALOG_LOG_MAGIC, sizeof(pHeader->magic)) != 0 || pHeader->version != CATALOG_VERSION
+            || pHeader->used < sizeof(LogHeader) || pHeader->used > m_ullLogMapped)
+        {
+            ft.WriteErrorLine(L"ERROR: The catalog file '%s' is not valid!", m_fileName.c_str());
+            throw(HRESULT_FROM_WIN32(ERROR_FILE_CORRUPT));
+        }
+        MapIndex();
+    }
+    catch (...)
+    {
+        Close();
+        throw;
+    }
+}
+
+
+void SnapshotCatalog::Close()
+{
+    UnmapIndex();
+    UnmapLog();
+    if (m_hLogFile != INVALID_HANDLE_VALUE)
+        CloseHandle(m_hLogFile);
+    m_hLogFile = INVALID_HANDLE_VALUE;
+}
+
+
+// Map the log file, at least of the given size
+void SnapshotCatalog::MapLog(ULONGLONG ullMinSize)
+{
+    LARGE_INTEGER fileSize;
+    CHECK_WIN32(GetFileSizeEx(m_hLogFile, &fileSize));
+    ULONGLONG ullSize = max((ULONGLONG)fileSize.QuadPart, CATALOG_INITIAL_LOG_SIZE);
+    while (ullSize < ullMinSize)
+        ullSize *= 2;
+
+    // Mapping extends the file to the size of the mapping, the log only uses the size in its header
+    m_hLogMapping = CreateFileMapping(m_hLogFile, NULL, PAGE_READWRITE, (DWORD)(ullSize >> 32), (DWORD)ullSize, NULL);
+    CHECK_WIN32(m_hLogMapping != NULL);
+    m_pLog = (BYTE*)MapViewOfFile(m_hLogMapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, 0);
+    CHECK_WIN32(m_pLog != NULL);
+    m_ullLogMapped = ullSize;
+}
+
+
+void SnapshotCatalog::UnmapLog()
+{
+    if (m_pLog != NULL)
+        UnmapViewOfFile(m_pLog);
+    if (m_hLogMapping != NULL)
+        CloseHandle(m_hLogMapping);
+    m_pLog = NULL;
+    m_hLogMapping = NULL;
+    m_ullLogMapped = 0;
+}
+
+
+// Map the index file, building it from the log if it does not cover the whole log
+void SnapshotCatalog::MapIndex()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    wstring indexFileName = m_fileName + L".index";
+    m_hIndexFile = CreateFile(indexFileName.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL);
+    if (m_hIndexFile == INVALID_HANDLE_VALUE)
+    {
+        DWORD dwLastError = GetLastError();
+        ft.WriteErrorLine(L"ERROR: Could not open the index file '%s' of the catalog!", indexFileName.c_str());
+        CHECK_WIN32_ERROR(dwLastError, L"CreateFile");
+    }
+    LARGE_INTEGER fileSize;
+    CHECK_WIN32(GetFileSizeEx(m_hIndexFile, &fileSize));
+    if ((ULONGLONG)fileSize.QuadPart < sizeof(IndexHeader))
+    {
+        RebuildIndex(CATALOG_INITIAL_CAPACITY, CATALOG_INITIAL_CAPACITY);
+        return;
+    }
+
+    m_hIndexMapping = CreateFileMapping(m_hIndexFile, NULL, PAGE_READWRITE, 0, 0, NULL);
+    CHECK_WIN32(m_hIndexMapping != NULL);
+    m_pIndex = (IndexHeader*)MapViewOfFile(m_hIndexMapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, 0);
+    CHECK_WIN32(m_pIndex != NULL);
+    m_pRuns = (RunEntry*)(m_pIndex + 1);
+    m_pIds = (IdEntry*)(m_pRuns + m_pIndex->runCapacity);
+
+    // The index of another version, or of a log it does not cover completely, is built again
+    ULONGLONG ullRunCapacity = m_pIndex->runCapacity;
+    ULONGLONG ullIdCapacity = m_pIndex->idCapacity;
+    if (memcmp(m_pIndex->magic, CATALOG_INDEX_MAGIC, sizeof(m_pIndex->magic)) != 0 || m_pIndex->version != CATALOG_VERSION
+        || ullRunCapacity > (ULONGLONG)fileSize.QuadPart / sizeof(RunEntry) || ullIdCapacity > (ULONGLONG)fileSize.QuadPart / sizeof(IdEntry)
+        || sizeof(IndexHeader) + ullRunCapacity * sizeof(RunEntry) + ullIdCapacity * sizeof(IdEntry) != (ULONGLONG)fileSize.QuadPart
+        || m_pIndex->runCount > ullRunCapacity || m_pIndex->idCount > ullIdCapacity
+        || m_pIndex->logSize != ((LogHeader*)m_pLog)->used)
+    {
+        ft.WriteDebugLine(L"Index of catalog %s is not up to date, building it from the catalog", m_fileName.c_str());
+        RebuildIndex(CATALOG_INITIAL_CAPACITY, CATALOG_INITIAL_CAPACITY);
+    }
+}
+
+
+void SnapshotCatalog::UnmapIndex()
+{
+    if (m_pIndex != NULL)
+        UnmapViewOfFile(m_pIndex);
+    if (m_hIndexMapping != NULL)
+        CloseHandle(m_hIndexMapping);
+    if (m_hIndexFile != INVALID_HANDLE_VALUE)
+        CloseHandle(m_hIndexFile);
+    m_pIndex = NULL;
+    m_pRuns = NULL;
+    m_pIds = NULL;
+    m_hIndexMapping = NULL;
+    m_hIndexFile = INVALID_HANDLE_VALUE;
+}
+
+
+// Build the index from the log, with room for at least the given number of runs and IDs
+void SnapshotCatalog::RebuildIndex(ULONGLONG ullMinRuns, ULONGLONG ullMinIds)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    vector<RunEntry> runs;
+    vector<IdEntry> ids;
+    LogHeader* pHeader = (LogHeader*)m_pLog;
+    ULONGLONG ullUsed = pHeader->used;
+    for (ULONGLONG ullOffset = sizeof(LogHeader); ullOffset < ullUsed; )
+    {
+        // The log is cut off before a damaged record, so that the records before it can still be used
+        const CatalogRecord* pRecord = FindRecord(ullOffset);
+        if (pRecord == NULL || (pRecord->kind == CATALOG_RUN_STARTED ? pRecord->run != runs.size() + 1 : (pRecord->run == 0 || pRecord->run > runs.size())))
+        {
+            ft.WriteErrorLine(L"WARNING: The catalog file '%s' has a damaged record at offset %llu, dropping the %llu bytes from there",
+                m_fileName.c_str(), ullOffset, ullUsed - ullOffset);
+            pHeader->used = ullUsed = ullOffset;
+            pHeader->runCount = runs.size();
+            CHECK_WIN32(FlushViewOfFile(pHeader, sizeof(LogHeader)));
+            CHECK_WIN32(FlushFileBuffers(m_hLogFile));
+            break;
+        }
+        if (pRecord->kind == CATALOG_RUN_STARTED)
+        {
+            RunEntry run = { pRecord->time, ullOffset, ullOffset, 0 };
+            runs.push_back(run);
+        }
+        else
+            runs[(size_t)pRecord->run - 1].lastOffset = ullOffset;
+        if (pRecord->setId != GUID_NULL)
+        {
+            IdEntry id = { pRecord->setId, pRecord->run, 0 };
+            ids.push_back(id);
+        }
+        if (pRecord->snapshotId != GUID_NULL)
+        {
+            IdEntry id = { pRecord->snapshotId, pRecord->run, 0 };
+            ids.push_back(id);
+        }
+        ullOffset += GetRecordSize(*pRecord);
+    }
+
+    // The IDs are sorted, each with the first run it is recorded for
+    stable_sort(ids.begin(), ids.end(), [](const IdEntry& id1, const IdEntry& id2) { return memcmp(&id1.id, &id2.id, sizeof(VSS_ID)) < 0; });
+    ids.erase(unique(ids.begin(), ids.end(), [](const IdEntry& id1, const IdEntry& id2) { return id1.id == id2.id; }), ids.end());
+
+    ULONGLONG ullRunCapacity = CATALOG_INITIAL_CAPACITY;
+    while (ullRunCapacity < ullMinRuns || ullRunCapacity < runs.size() * 2)
+        ullRunCapacity *= 2;
+    ULONGLONG ullIdCapacity = CATALOG_INITIAL_CAPACITY;
+    while (ullIdCapacity < ullMinIds || ullIdCapacity < ids.size() * 2)
+        ullIdCapacity *= 2;
+
+    IndexHeader header = {};
+    memcpy(header.magic, CATALOG_INDEX_MAGIC, sizeof(header.magic));
+    header.version = CATALOG_VERSION;
+    header.logSize = ullUsed;
+    header.runCount = runs.size();
+    header.runCapacity = ullRunCapacity;
+    header.idCount = ids.size();
+    header.idCapacity = ullIdCapacity;
+    runs.resize((size_t)ullRunCapacity);
+    ids.resize((size_t)ullIdCapacity);
+
+    // Written to a new file which then replaces the index, the log is locked so nothing else uses it
+    UnmapIndex();
+    wstring indexFileName = m_fileName + L".index";
+    wstring newFileName = indexFileName + L".new";
+    {
+        HANDLE hFile = CreateFile(newFileName.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile == INVALID_HANDLE_VALUE)
+        {
+            DWORD dwLastError = GetLastError();
+            ft.WriteErrorLine(L"ERROR: Could not create the index file '%s' of the catalog!", newFileName.c_str());
+            CHECK_WIN32_ERROR(dwLastError, L"CreateFile");
+        }
+        CAutoHandle autoCloseFile(hFile);
+        DWORD cbWritten = 0;
+        CHECK_WIN32(WriteFile(hFile, &header, sizeof(header), &cbWritten, NULL));
+        CHECK_WIN32(WriteFile(hFile, runs.data(), (DWORD)(runs.size() * sizeof(RunEntry)), &cbWritten, NULL));
+        CHECK_WIN32(WriteFile(hFile, ids.data(), (DWORD)(ids.size() * sizeof(IdEntry)), &cbWritten, NULL));
+        CHECK_WIN32(FlushFileBuffers(hFile));
+    }
+    CHECK_WIN32(MoveFileEx(newFileName.c_str(), indexFileName.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH));
+
+    m_hIndexFile = CreateFile(indexFileName.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL);
+    CHECK_WIN32(m_hIndexFile != INVALID_HANDLE_VALUE);
+    m_hIndexMapping = CreateFileMapping(m_hIndexFile, NULL, PAGE_READWRITE, 0, 0, NULL);
+    CHECK_WIN32(m_hIndexMapping != NULL);
+    m_pIndex = (IndexHeader*)MapViewOfFile(m_hIndexMapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, 0);
+    CHECK_WIN32(m_pIndex != NULL);
+    m_pRuns = (RunEntry*)(m_pIndex + 1);
+    m_pIds = (IdEntry*)(m_pRuns + m_pIndex->runCapacity);
+}
+
+
+// The record at the offset of the log, NULL if it is not complete or its checksum does not match
+const CatalogRecord* SnapshotCatalog::FindRecord(ULONGLONG ullOffset)
+{
+    ULONGLONG ullUsed = ((LogHeader*)m_pLog)->used;
+    const CatalogRecord* pRecord = (const CatalogRecord*)(m_pLog + ullOffset);
+    if (ullOffset % 8 != 0 || ullOffset < sizeof(LogHeader) || ullOffset + sizeof(CatalogRecord) > ullUsed
+        || GetRecordSize(*pRecord) > ullUsed - ullOffset)
+        return NULL;
+    CatalogRecord record = *pRecord;
+    record.crc32c = 0;
+    DWORD crc32c = Crc32c(0, (const BYTE*)&record, sizeof(record));
+    crc32c = Crc32c(crc32c, (const BYTE*)(pRecord + 1), pRecord->cbText);
+    return (crc32c == pRecord->crc32c) ? pRecord : NULL;
+}
+
+
+// The record at the offset of the log, checked
+const CatalogRecord* SnapshotCatalog::GetRecord(ULONGLONG ullOffset)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    const CatalogRecord* pRecord = FindRecord(ullOffset);
+    if (pRecord == NULL)
+    {
+        // The index no longer covers the log, so the next time it is built again and the log cut off there
+        if (m_pIndex != NULL)
+        {
+            m_pIndex->logSize = 0;
+            FlushViewOfFile(m_pIndex, sizeof(IndexHeader));
+        }
+        ft.WriteErrorLine(L"ERROR: The catalog file '%s' is damaged at offset %llu, it is repaired the next time it is used!", m_fileName.c_str(), ullOffset);
+        throw(HRESULT_FROM_WIN32(ERROR_FILE_CORRUPT));
+    }
+    return pRecord;
+}
+
+
+// Append a record of this run to the log and the index
+void SnapshotCatalog::Append(CatalogRecord& record, const wstring& text)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    LogHeader* pHeader = (LogHeader*)m_pLog;
+    ULONGLONG ullOffset = pHeader->used;
+    record.cbText = (DWORD)(text.length() * sizeof(WCHAR));
+    ULONGLONG cbRecord = GetRecordSize(record);
+    if (ullOffset + cbRecord > m_ullLogMapped)
+    {
+        UnmapLog();
+        MapLog(ullOffset + cbRecord);
+        pHeader = (LogHeader*)m_pLog;
+    }
+
+    // The runs are numbered and their start times kept in the order they are started
+    record.time = GetCurrentFileTime();
+    if (record.kind == CATALOG_RUN_STARTED)
+    {
+        record.run = pHeader->runCount + 1;
+        record.previous = 0;
+        if (m_pIndex->runCount > 0)
+            record.time = max(record.time, m_pRuns[m_pIndex->runCount - 1].startTime);
+    }
+    else
+    {
+        _ASSERTE(m_run != 0);
+        record.run = m_run;
+        record.previous = m_ullLastOffset;
+    }
+    record.crc32c = 0;
+    DWORD crc32c = Crc32c(0, (const BYTE*)&record, sizeof(record));
+    record.crc32c = Crc32c(crc32c, (const BYTE*)text.c_str(), record.cbText);
+
+    // The record is on disk before the header says it is there, anything after it is left from an interrupted append
+    BYTE* pRecord = m_pLog + ullOffset;
+    memset(pRecord, 0, (size_t)cbRecord);
+    memcpy(pRecord, &record, sizeof(record));
+    memcpy(pRecord + sizeof(record), text.c_str(), record.cbText);
+    CHECK_WIN32(FlushViewOfFile(pRecord, (SIZE_T)cbRecord));
+    CHECK_WIN32(FlushFileBuffers(m_hLogFile));
+    pHeader->used = ullOffset + cbRecord;
+    if (record.kind == CATALOG_RUN_STARTED)
+        pHeader->runCount = record.run;
+    CHECK_WIN32(FlushViewOfFile(pHeader, sizeof(LogHeader)));
+    CHECK_WIN32(FlushFileBuffers(m_hLogFile));
+    m_run = record.run;
+    m_ullLastOffset = ullOffset;
+
+    // An index that is full is built again with twice the room, including this record
+    if (m_pIndex->runCount >= m_pIndex->runCapacity || m_pIndex->idCount + 2 > m_pIndex->idCapacity)
+    {
+        RebuildIndex(m_pIndex->runCapacity * 2, m_pIndex->idCapacity * 2);
+        return;
+    }
+    if (record.kind == CATALOG_RUN_STARTED)
+    {
+        RunEntry run = { record.time, ullOffset, ullOffset, 0 };
+        m_pRuns[m_pIndex->runCount++] = run;
+    }
+    else
+        m_pRuns[record.run - 1].lastOffset = ullOffset;
+    AddId(record.setId, record.run);
+    AddId(record.snapshotId, record.run);
+
+    // The index covers the record only when all of it is on disk
+    CHECK_WIN32(FlushViewOfFile(m_pIndex, 0));
+    CHECK_WIN32(FlushFileBuffers(m_hIndexFile));
+    m_pIndex->logSize = pHeader->used;
+    CHECK_WIN32(FlushViewOfFile(m_pIndex, sizeof(IndexHeader)));
+}
+
+
+// Add the run of an ID to the index, unless it is already there
+void SnapshotCatalog::AddId(const VSS_ID& id, ULONGLONG run)
+{
+    if (id == GUID_NULL)
+        return;
+    IdEntry* pEnd = m_pIds + m_pIndex->idCount;
+    IdEntry* pPosition = lower_bound(m_pIds, pEnd, id, [](const IdEntry& entry, const VSS_ID& id) { return memcmp(&entry.id, &id, sizeof(VSS_ID)) < 0; });
+    if (pPosition != pEnd && pPosition->id == id)
+        return;
+    memmove(pPosition + 1, pPosition, (pEnd - pPosition) * sizeof(IdEntry));
+    pPosition->id = id;
+    pPosition->run = run;
+    pPosition->reserved = 0;
+    m_pIndex->idCount++;
+}
+
+
+// Start a new run
+void SnapshotCatalog::BeginRun(const wstring& commandLine)
+{
+    Lock lock(*this);
+
+    m_ullStartTick = GetTickCount64();
+    CatalogRecord record = {};
+    record.kind = CATALOG_RUN_STARTED;
+    Append(record, commandLine);
+}
+
+
+// Record the shadow copies of the set
+void SnapshotCatalog::AddSnapshotSet(const SnapshotSetInfo& snapshotSet, const vector<wstring>& volumeList)
+{
+    Lock lock(*this);
+
+    for (size_t i = 0; i < snapshotSet.snapshots.size(); ++i)
+    {
+        const SnapshotInfo& snapshot = snapshotSet.snapshots[i];
+        CatalogRecord record = {};
+        record.kind = CATALOG_SNAPSHOT_CREATED;
+        record.setId = snapshotSet.id;
+        record.snapshotId = snapshot.id;
+        wstring volume = (volumeList.size() == snapshotSet.snapshots.size()) ? volumeList[i] : wstring();
+        Append(record, volume + L"\n" + snapshot.deviceName);
+    }
+}
+
+
+// Record where the shadow copies of the set are mounted
+void SnapshotCatalog::AddMounts(const SnapshotSetInfo& snapshotSet)
+{
+    Lock lock(*this);
+
+    for (size_t i = 0; i < snapshotSet.snapshots.size(); ++i)
+    {
+        const SnapshotInfo& snapshot = snapshotSet.snapshots[i];
+        if (snapshot.mount.empty())
+            continue;
+        CatalogRecord record = {};
+        record.kind = CATALOG_SNAPSHOT_MOUNTED;
+        record.setId = snapshotSet.id;
+        record.snapshotId = snapshot.id;
+        Append(record, snapshot.mount);
+    }
+}
+
+
+void SnapshotCatalog::AddCommandResult(int exitCode, ULONGLONG ullDuration)
+{
+    Lock lock(*this);
+
+    CatalogRecord record = {};
+    record.kind = CATALOG_COMMAND_FINISHED;
+    record.value = exitCode;
+    record.duration = ullDuration;
+    Append(record, wstring());
+}
+
+
+void SnapshotCatalog::EndRun(int exitCode)
+{
+    Lock lock(*this);
+
+    CatalogRecord record = {};
+    record.kind = CATALOG_RUN_FINISHED;
+    record.value = exitCode;
+    record.duration = GetTickCount64() - m_ullStartTick;
+    Append(record, wstring());
+}
+
+
+ULONGLONG SnapshotCatalog::GetRunCount()
+{
+    Lock lock(*this);
+
+    return m_pIndex->runCount;
+}
+
+
+// Find the run that created the shadow copy or the shadow copy set
+bool SnapshotCatalog::FindRun(const VSS_ID& id, ULONGLONG& run)
+{
+    Lock lock(*this);
+
+    IdEntry* pEnd = m_pIds + m_pIndex->idCount;
+    IdEntry* pPosition = lower_bound(m_pIds, pEnd, id, [](const IdEntry& entry, const VSS_ID& id) { return memcmp(&entry.id, &id, sizeof(VSS_ID)) < 0; });
+    if (pPosition == pEnd || pPosition->id != id)
+        return false;
+    run = pPosition->run;
+    return true;
+}
+
+
+// Find the first run started at or after the time
+ULONGLONG SnapshotCatalog::FindFirstRunSince(ULONGLONG ullTime)
+{
+    Lock lock(*this);
+
+    RunEntry* pEnd = m_pRuns + m_pIndex->runCount;
+    RunEntry* pPosition = lower_bound(m_pRuns, pEnd, ullTime, [](const RunEntry& entry, ULONGLONG ullTime) { return entry.startTime < ullTime; });
+    return (pPosition - m_pRuns) + 1;
+}
+
+
+// Read the records of the run, in order
+void SnapshotCatalog::ReadRun(ULONGLONG run, vector<CatalogEntry>& entries)
+{
+    FunctionTracer ft(DBG_INFO);
+    Lock lock(*this);
+
+    entries.clear();
+    if (run == 0 || run > m_pIndex->runCount)
+    {
+        ft.WriteErrorLine(L"ERROR: There is no run %llu in the catalog '%s'!", run, m_fileName.c_str());
+        throw(E_INVALIDARG);
+    }
+
+    // Backwards from the last record of the run, each refers to the one before
+    ULONGLONG ullOffset = m_pRuns[run - 1].lastOffset;
+    while (true)
+    {
+        const CatalogRecord* pRecord = GetRecord(ullOffset);
+        if (pRecord->run != run || pRecord->previous >= ullOffset)
+        {
+            ft.WriteErrorLine(L"ERROR: The catalog file '%s' is not valid, record at offset %llu is not of run %llu!", m_fileName.c_str(), ullOffset, run);
+            throw(HRESULT_FROM_WIN32(ERROR_FILE_CORRUPT));
+        }
+        CatalogEntry entry;
+        entry.record = *pRecord;
+        entry.text.assign((const WCHAR*)(pRecord + 1), pRecord->cbText / sizeof(WCHAR));
+        entries.push_back(entry);
+        if (pRecord->kind == CATALOG_RUN_STARTED || pRecord->previous == 0)
+            break;
+        ullOffset = pRecord->previous;
+    }
+    reverse(entries.begin(), entries.end());
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Printing the catalog
+//
+
+
+// Local time of a FILETIME in UTC, as text
+static wstring FormatCatalogTime(ULONGLONG ullTime)
+{
+    FILETIME fileTime;
+    fileTime.dwLowDateTime = (DWORD)ullTime;
+    fileTime.dwHighDateTime = (DWORD)(ullTime >> 32);
+    SYSTEMTIME utcTime, localTime;
+    if (!FileTimeToSystemTime(&fileTime, &utcTime) || !SystemTimeToTzSpecificLocalTime(NULL, &utcTime, &localTime))
+        return L"?";
+    WCHAR text[32];
+    StringCchPrintf(text, ARRAYSIZE(text), L"%04u-%02u-%02u %02u:%02u:%02u",
+        localTime.wYear, localTime.wMonth, localTime.wDay, localTime.wHour, localTime.wMinute, localTime.wSecond);
+    return text;
+}
+
+
+// Print the runs recorded in the catalog
+void PrintCatalog(const wstring& fileName, const wstring& filter)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    // Opening the catalog creates it, which is not wanted here
+    if (GetFileAttributes(fileName.c_str()) == INVALID_FILE_ATTRIBUTES)
+    {
+        ft.WriteErrorLine(L"ERROR: Cannot read catalog file '%s'!", fileName.c_str());
+        throw(E_INVALIDARG);
+    }
+    SnapshotCatalog catalog(fileName);
+
+    // All runs, those of the last days, or the one of a shadow copy or set
+    ULONGLONG first = 1;
+    ULONGLONG last = catalog.GetRunCount();
+    if (!filter.empty() && filter[0] == L'{')
+    {
+        VSS_ID id = WString2Guid(filter);
+        ULONGLONG run = 0;
+        if (!catalog.FindRun(id, run))
+        {
+            ft.WriteInfoLine(L"No shadow copy or shadow copy set %s in the catalog", filter.c_str());
+            return;
+        }
+        first = last = run;
+    }
+    else if (!filter.empty())
+    {
+        LPWSTR pwszEnd = NULL;
+        DWORD days = wcstoul(filter.c_str(), &pwszEnd, 10);
+        if (*pwszEnd != L'\0' || days == 0)
+        {
+            ft.WriteErrorLine(L"ERROR: Invalid catalog filter '%s', expected a number of days or a shadow copy or set ID!", filter.c_str());
+            throw(E_INVALIDARG);
+        }
+        ULONGLONG ullNow = GetCurrentFileTime();
+        ULONGLONG ullSpan = days * 24ULL * 60 * 60 * 10000000;
+        first = catalog.FindFirstRunSince((ullNow > ullSpan) ? ullNow - ullSpan : 0);
+    }
+
+    ft.WriteInfoLine(L"Catalog %s with %llu runs", fileName.c_str(), catalog.GetRunCount());
+    for (ULONGLONG run = first; run <= last; ++run)
+    {
+        vector<CatalogEntry> entries;
+        catalog.ReadRun(run, entries);
+        bool bFinished = false;
+        VSS_ID setId = GUID_NULL;
+        for (size_t i = 0; i < entries.size(); ++i)
+        {
+            const CatalogRecord& record = entries[i].record;
+            const wstring& text = entries[i].text;
+            switch (record.kind)
+            {
+            case CATALOG_RUN_STARTED:
+                ft.WriteInfoLine(L"");
+                ft.WriteInfoLine(L"Run %llu started %s: %s", record.run, FormatCatalogTime(record.time).c_str(), text.c_str());
+                break;
+            case CATALOG_SNAPSHOT_CREATED:
+            {
+                if (record.setId != setId)
+                {
+                    setId = record.setId;
+                    ft.WriteInfoLine(L"- Shadow copy set %s created %s", Guid2WString(setId).c_str(), FormatCatalogTime(record.time).c_str());
+                }
+                size_t separatorPos = text.find(L'\n');
+                wstring volume = text.substr(0, separatorPos);
+                wstring device = (separatorPos == wstring::npos) ? wstring() : text.substr(separatorPos + 1);
+                ft.WriteInfoLine(L"  - Shadow copy %s of %s, device %s", Guid2WString(record.snapshotId).c_str(), volume.c_str(), device.c_str());
+                break;
+            }
+            case CATALOG_SNAPSHOT_MOUNTED:
+                ft.WriteInfoLine(L"  - Shadow copy %s mounted at %s", Guid2WString(record.snapshotId).c_str(), text.c_str());
+                break;
+            case CATALOG_COMMAND_FINISHED:
+                ft.WriteInfoLine(L"- Command exited with code %d after %.1f seconds", record.value, record.duration / 1000.0);
+                break;
+            case CATALOG_RUN_FINISHED:
+                ft.WriteInfoLine(L"- Run completed %s with exit code %d after %.1f seconds", FormatCatalogTime(record.time).c_str(), record.value, record.duration / 1000.0);
+                bFinished = true;
+                break;
+            default:
+                ft.WriteInfoLine(L"- Record of unknown kind %lu", record.kind);
+                break;
+            }
+        }
+        if (!bFinished)
+            ft.WriteInfoLine(L"- Run did not complete, it was interrupted or is still running");
+    }
+}
@@ -0,0 +1,219 @@
+#pragma once
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Snapshot catalog
+//
+//  With the -catalog option each run is recorded in a catalog file that
+//  is kept across runs: when it started, the shadow copies created, with
+//  their volumes and devices, where they were mounted, the exit code and
+//  time of the command, and the exit code and time of the run. A run that
+//  was interrupted, e.g. by a crash, has no record of its end. The history
+//  is printed with -history, and can be used to find out what a run left
+//  behind, or which runs are older than the ones to keep, without querying
+//  all the shadow copies on the system.
+//
+//  The catalog is a log of records that are only ever appended, memory-
+//  mapped, each with a CRC32C. A record is written and flushed before the
+//  size of the log in its header is updated and flushed, so a record is
+//  either completely in the log or not at all, also after a crash. A log
+//  damaged anyway is cut off before its first damaged record when the
+//  index is built again, with a warning. Each
+//  record refers to the previous record of its run, so that the records of
+//  runs at the same time can be interleaved.
+//
+//  Next to the log is an index, in the file {catalog}.index, memory-mapped
+//  too: the start time and the first and last record of each run, in the
+//  order of the runs, which is also the order of their start times, and
+//  the IDs of all shadow copies and sets with their run, sorted by ID. A
+//  run is found by its start time or by an ID with a binary search. The
+//  index is derived from the log, and built again from it when it does not
+//  cover the whole log, e.g. after a crash while it was updated.
+//
+//  The catalog is opened only while a record is appended or read, not
+//  shared with other processes, which wait for it.
+//
+
+// Kinds of records
+const DWORD CATALOG_RUN_STARTED = 1;        // Text: the command line
+const DWORD CATALOG_SNAPSHOT_CREATED = 2;   // Text: the volume and the device, on separate lines
+const DWORD CATALOG_SNAPSHOT_MOUNTED = 3;   // Text: the mount path
+const DWORD CATALOG_COMMAND_FINISHED = 4;   // Value: the exit code
+const DWORD CATALOG_RUN_FINISHED = 5;       // Value: the exit code
+
+// Longest time to wait for another process using the catalog, in milliseconds
+const DWORD CATALOG_LOCK_TIMEOUT = 30 * 1000;
+
+
+// Header of a record in the catalog, followed by its text
+struct CatalogRecord
+{
+    DWORD               kind;
+    DWORD               cbText;         // UTF-16 text, without a terminating zero
+    DWORD               crc32c;         // Of the header with this being zero, and the text
+    LONG                value;
+    ULONGLONG           run;            // Numbered from 1
+    ULONGLONG           time;           // FILETIME, UTC
+    ULONGLONG           duration;       // In milliseconds, of the command or the run
+    ULONGLONG           previous;       // Offset of the previous record of the run, zero for the first
+    VSS_ID              setId;
+    VSS_ID              snapshotId;
+};
+
+
+// A record read from the catalog, with its text
+struct CatalogEntry
+{
+    CatalogRecord       record;
+    wstring             text;
+};
+
+
+// Catalog of the runs, the shadow copies they created and their results
+class SnapshotCatalog
+{
+public:
+
+    SnapshotCatalog(const wstring& fileName);
+
+    ~SnapshotCatalog();
+
+    //
+    //  Recording of this run
+    //
+
+    // Start a new run, all records of this object are of that run
+    void BeginRun(const wstring& commandLine);
+
+    // Record the shadow copies of the set, with their volumes in the same order if known
+    void AddSnapshotSet(const SnapshotSetInfo& snapshotSet, const vector<wstring>& volumeList);
+
+    // Record where the shadow copies of the set are mounted
+    void AddMounts(const SnapshotSetInfo& snapshotSet);
+
+    void AddCommandResult(int exitCode, ULONGLONG ullDuration);
+
+    void EndRun(int exitCode);
+
+    //
+    //  Queries
+    //
+
+    ULONGLONG GetRunCount();
+
+    // Find the run that created the shadow copy or the shadow copy set, returns false if none did
+    bool FindRun(const VSS_ID& id, ULONGLONG& run);
+
+    // Find the first run started at or after the time (FILETIME, UTC), the run count plus one if none
+    ULONGLONG FindFirstRunSince(ULONGLONG ullTime);
+
+    // Read the records of the run, in order
+    void ReadRun(ULONGLONG run, vector<CatalogEntry>& entries);
+
+private:
+
+    // Header of the log file, followed by the records
+    struct LogHeader
+    {
+        char            magic[8];
+        DWORD           version;
+        DWORD           reserved1;
+        ULONGLONG       used;           // Size of the records written completely, with the header
+        ULONGLONG       runCount;
+        BYTE            reserved2[32];
+    };
+
+    // Header of the index file, followed by the runs and the IDs
+    struct IndexHeader
+    {
+        char            magic[8];
+        DWORD           version;
+        DWORD           reserved1;
+        ULONGLONG       logSize;        // Size of the log covered by the index
+        ULONGLONG       runCount;
+        ULONGLONG       runCapacity;
+        ULONGLONG       idCount;
+        ULONGLONG       idCapacity;
+        BYTE            reserved2[16];
+    };
+
+    struct RunEntry
+    {
+        ULONGLONG       startTime;
+        ULONGLONG       firstOffset;
+        ULONGLONG       lastOffset;
+        ULONGLONG       reserved;
+    };
+
+    struct IdEntry
+    {
+        VSS_ID          id;
+        ULONGLONG       run;
+        ULONGLONG       reserved;
+    };
+
+    // Open and map the log and the index for the lifetime of the object, waiting for other processes using them
+    class Lock
+    {
+    public:
+        Lock(SnapshotCatalog& catalog) : m_catalog(catalog) { m_catalog.Open(); }
+        ~Lock() { m_catalog.Close(); }
+    private:
+        SnapshotCatalog& m_catalog;
+    };
+
+    void Open();
+
+    void Close();
+
+    // Map the log file, at least of the given size
+    void MapLog(ULONGLONG ullMinSize);
+
+    void UnmapLog();
+
+    // Map the index file, building it from the log if it does not cover the whole log
+    void MapIndex();
+
+    void UnmapIndex();
+
+    // Build the index from the log, with room for at least the given number of runs and IDs
+    void RebuildIndex(ULONGLONG ullMinRuns, ULONGLONG ullMinIds);
+
+    // The record at the offset of the log, NULL if it is not complete or its checksum does not match
+    const CatalogRecord* FindRecord(ULONGLONG ullOffset);
+
+    // The record at the offset of the log, checked
+    const CatalogRecord* GetRecord(ULONGLONG ullOffset);
+
+    // Append a record of this run to the log and the index
+    void Append(CatalogRecord& record, const wstring& text);
+
+    // Add the run of an ID to the index, unless it is already there
+    void AddId(const VSS_ID& id, ULONGLONG run);
+
+    //
+    //  Data members
+    //
+
+    wstring                         m_fileName;
+
+    // The run recorded, its start and its last record
+    ULONGLONG                       m_run;
+    ULONGLONG                       m_ullStartTick;
+    ULONGLONG                       m_ullLastOffset;
+
+    // The log and the index, while open
+    HANDLE                          m_hLogFile;
+    HANDLE                          m_hLogMapping;
+    BYTE*                           m_pLog;
+    ULONGLONG                       m_ullLogMapped;
+    HANDLE                          m_hIndexFile;
+    HANDLE                          m_hIndexMapping;
+    IndexHeader*                    m_pIndex;
+    RunEntry*                       m_pRuns;
+    IdEntry*                        m_pIds;
+};
+
+
+// Print the runs recorded in the catalog: all of them, those of the last number of days, or the one of a shadow copy or set ID
+void PrintCatalog(const wstring& fileName, const wstring& filter);
@@ -0,0 +1,247 @@
+// Main header
+#include "stdafx.h"
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <intrin.h>
+#include <nmmintrin.h>
+#define CHECKSUM_X86
+#endif
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  CRC32C
+//
+
+
+// Tables of the bitwise reflected polynomial, for 8 bytes at a time
+static DWORD s_crc32cTables[8][256];
+
+static bool InitializeCrc32cTables()
+{
+    for (DWORD i = 0; i < 256; ++i)
+    {
+        DWORD crc = i;
+        for (int bit = 0; bit < 8; ++bit)
+            crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+        s_crc32cTables[0][i] = crc;
+    }
+    for (DWORD i = 0; i < 256; ++i)
+    {
+        for (int table = 1; table < 8; ++table)
+            s_crc32cTables[table][i] = (s_crc32cTables[table - 1][i] >> 8) ^ s_crc32cTables[0][s_crc32cTables[table - 1][i] & 0xFF];
+    }
+    return true;
+}
+
+static const bool s_bCrc32cTables = InitializeCrc32cTables();
+
+
+// Update the inverted CRC with tables
+static DWORD Crc32cTables(DWORD crc, const BYTE* pData, size_t cbData)
+{
+    size_t i = 0;
+    for (; i + 8 <= cbData; i += 8)
+    {
+        DWORD low = *(const DWORD UNALIGNED*)(pData + i) ^ crc;
+        DWORD high = *(const DWORD UNALIGNED*)(pData + i + 4);
+        crc = s_crc32cTables[7][low & 0xFF] ^ s_crc32cTables[6][(low >> 8) & 0xFF]
+            ^ s_crc32cTables[5][(low >> 16) & 0xFF] ^ s_crc32cTables[4][low >> 24]
+            ^ s_crc32cTables[3][high & 0xFF] ^ s_crc32cTables[2][(high >> 8) & 0xFF]
+            ^ s_crc32cTables[1][(high >> 16) & 0xFF] ^ s_crc32cTables[0][high >> 24];
+    }
+    for (; i < cbData; ++i)
+        crc = (crc >> 8) ^ s_crc32cTables[0][(crc ^ pData[i]) & 0xFF];
+    return crc;
+}
+
+
+#ifdef CHECKSUM_X86
+
+// Returns true if the processor supports SSE 4.2, with the crc32 instruction
+static bool DetectSse42()
+{
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+}
+
+static const bool s_bSse42 = DetectSse42();
+
+
+// Update the inverted CRC with the crc32 instruction
+static DWORD Crc32cSse42(DWORD crc, const BYTE* pData, size_t cbData)
+{
+    size_t i = 0;
+#ifdef _M_X64
+    ULONGLONG crc64 = crc;
+    for (; i + 8 <= cbData; i += 8)
+        crc64 = _mm_crc32_u64(crc64, *(const ULONGLONG UNALIGNED*)(pData + i));
+    crc = (DWORD)crc64;
+#else
+    for (; i + 4 <= cbData; i += 4)
+        crc = _mm_crc32_u32(crc, *(const DWORD UNALIGNED*)(pData + i));
+#endif
+    for (; i < cbData; ++i)
+        crc = _mm_crc32_u8(crc, pData[i]);
+    return crc;
+}
+
+#endif
+
+
+// Update a CRC32C with more data
+DWORD Crc32c(DWORD crc, const BYTE* pData, size_t cbData)
+{
+#ifdef CHECKSUM_X86
+    if (s_bSse42)
+        return ~Crc32cSse42(~crc, pData, cbData);
+#endif
+    return ~Crc32cTables(~crc, pData, cbData);
+}
+
+
+// Name of the CRC32C implementation used
+LPCWSTR GetCrc32cImplementation()
+{
+#ifdef CHECKSUM_X86
+    if (s_bSse42)
+        return L"SSE4.2";
+#endif
+    return L"tables";
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  XXH64
+//
+
+
+static const ULONGLONG XXH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const ULONGLONG XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const ULONGLONG XXH_PRIME64_3 = 0x165667B19E3779F9ULL;
+static const ULONGLONG XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const ULONGLONG XXH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+
+static inline ULONGLONG XxhRotate(ULONGLONG value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+
+static inline ULONGLONG XxhRound(ULONGLONG acc, ULONGLONG input)
+{
+    acc += input * XXH_PRIME64_2;
+    acc = XxhRotate(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+
+static inline ULONGLONG XxhMergeRound(ULONGLONG acc, ULONGLONG lane)
+{
+    acc ^= XxhRound(0, lane);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+
+XxHash64::XxHash64(ULONGLONG ullSeed)
+{
+    Reset(ullSeed);
+}
+
+
+// Start again with the seed
+void XxHash64::Reset(ULONGLONG ullSeed)
+{
+    m_ullSeed = ullSeed;
+    m_lanes[0] = ullSeed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    m_lanes[1] = ullSeed + XXH_PRIME64_2;
+    m_lanes[2] = ullSeed;
+    m_lanes[3] = ullSeed - XXH_PRIME64_1;
+    m_ullTotal = 0;
+    m_cbBuffered = 0;
+}
+
+
+void XxHash64::Update(const BYTE* pData, size_t cbData)
+{
+    m_ullTotal += cbData;
+
+    // Complete the stripe of 32 bytes started by an earlier update
+    if (m_cbBuffered > 0)
+    {
+        size_t cbCopy = min(cbData, sizeof(m_buffer) - m_cbBuffered);
+        memcpy(m_buffer + m_cbBuffered, pData, cbCopy);
+        m_cbBuffered += (DWORD)cbCopy;
+        pData += cbCopy;
+        cbData -= cbCopy;
+        if (m_cbBuffered < sizeof(m_buffer))
+            return;
+        for (int lane = 0; lane < 4; ++lane)
+            m_lanes[lane] = XxhRound(m_lanes[lane], *(const ULONGLONG UNALIGNED*)(m_buffer + lane * 8));
+        m_cbBuffered = 0;
+    }
+
+    // The lanes are independent, so their rounds overlap in the processor
+    ULONGLONG v1 = m_lanes[0], v2 = m_lanes[1], v3 = m_lanes[2], v4 = m_lanes[3];
+    for (; cbData >= 32; pData += 32, cbData -= 32)
+    {
+        v1 = XxhRound(v1, *(const ULONGLONG UNALIGNED*)(pData));
+        v2 = XxhRound(v2, *(const ULONGLONG UNALIGNED*)(pData + 8));
+        v3 = XxhRound(v3, *(const ULONGLONG UNALIGNED*)(pData + 16));
+        v4 = XxhRound(v4, *(const ULONGLONG UNALIGNED*)(pData + 24));
+    }
+    m_lanes[0] = v1; m_lanes[1] = v2; m_lanes[2] = v3; m_lanes[3] = v4;
+
+    memcpy(m_buffer, pData, cbData);
+    m_cbBuffered = (DWORD)cbData;
+}
+
+
+// The hash of all data given since the start
+ULONGLONG XxHash64::GetHash() const
+{
+    ULONGLONG hash;
+    if (m_ullTotal >= 32)
+    {
+        hash = XxhRotate(m_lanes[0], 1) + XxhRotate(m_lanes[1], 7) + XxhRotate(m_lanes[2], 12) + XxhRotate(m_lanes[3], 18);
+        for (int lane = 0; lane < 4; ++lane)
+            hash = XxhMergeRound(hash, m_lanes[lane]);
+    }
+    else
+    {
+        hash = m_ullSeed + XXH_PRIME64_5;
+    }
+    hash += m_ullTotal;
+
+    const BYTE* pData = m_buffer;
+    DWORD cbData = m_cbBuffered;
+    for (; cbData >= 8; pData += 8, cbData -= 8)
+    {
+        hash ^= XxhRound(0, *(const ULONGLONG UNALIGNED*)pData);
+        hash = XxhRotate(hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (cbData >= 4)
+    {
+        hash ^= (ULONGLONG)(*(const DWORD UNALIGNED*)pData) * XXH_PRIME64_1;
+        hash = XxhRotate(hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        pData += 4;
+        cbData -= 4;
+    }
+    for (; cbData > 0; ++pData, --cbData)
+    {
+        hash ^= (*pData) * XXH_PRIME64_5;
+        hash = XxhRotate(hash, 11) * XXH_PRIME64_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
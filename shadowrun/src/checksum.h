@@ -0,0 +1,47 @@
+#pragma once
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Checksums
+//
+//  Checksums computed on the data of an export while it is in memory
+//  anyway, for the manifest. CRC32C (the Castagnoli polynomial, as used by
+//  iSCSI and ext4) is computed 8 bytes at a time with the crc32 instruction
+//  of SSE 4.2 when the processor supports it, checked once at runtime, and
+//  else with lookup tables 8 bytes at a time (slicing-by-8). XXH64, the 64
+//  bit xxHash, is a stronger and still very fast checksum, computed in
+//  four independent lanes that the processor runs in parallel.
+//
+
+// Update a CRC32C with more data, starting from zero, e.g. Crc32c(Crc32c(0, a), b) equals the CRC32C of a and b
+DWORD Crc32c(DWORD crc, const BYTE* pData, size_t cbData);
+
+// Name of the CRC32C implementation used, e.g. for the log
+LPCWSTR GetCrc32cImplementation();
+
+
+// 64 bit xxHash of data given in any number of pieces
+class XxHash64
+{
+public:
+
+    XxHash64(ULONGLONG ullSeed = 0);
+
+    // Start again with the seed
+    void Reset(ULONGLONG ullSeed = 0);
+
+    void Update(const BYTE* pData, size_t cbData);
+
+    // The hash of all data given since the start, which can still be updated with more
+    ULONGLONG GetHash() const;
+
+private:
+
+    ULONGLONG           m_lanes[4];
+    ULONGLONG           m_ullSeed;
+    ULONGLONG           m_ullTotal;
+
+    // Data not yet processed by the lanes, less than 32 bytes
+    BYTE                m_buffer[32];
+    DWORD               m_cbBuffered;
+};
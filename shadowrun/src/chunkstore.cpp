@@ -0,0 +1,574 @@
+// Main header
+#include "stdafx.h"
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Chunking
+//
+
+
+// Fingerprint bits that must be zero for a boundary, more of them before the average size is reached
+// and fewer after it, which keeps the sizes of the chunks close to the average (normalized chunking)
+static const ULONGLONG CHUNK_MASK_SMALL = ~0ULL << (64 - 18);
+static const ULONGLONG CHUNK_MASK_LARGE = ~0ULL << (64 - 14);
+
+
+// Random values for each byte value, the same in every run, so that the same data always gives the same chunks
+static ULONGLONG s_gear[256];
+
+static bool InitializeGear()
+{
+    // SplitMix64 with a fixed seed
+    ULONGLONG state = 0x5368616477526e31ULL;
+    for (int i = 0; i < 256; ++i)
+    {
+        ULONGLONG z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        s_gear[i] = z ^ (z >> 31);
+    }
+    return true;
+}
+
+static const bool s_bGear = InitializeGear();
+
+
+// Find the end of the next chunk of the data
+DWORD FindChunkBoundary(const BYTE* pData, DWORD cbData)
+{
+    if (cbData <= CHUNK_MIN_SIZE)
+        return cbData;
+    DWORD cbEnd = min(cbData, CHUNK_MAX_SIZE);
+    DWORD cbNormal = min(cbEnd, CHUNK_AVG_SIZE);
+
+    // The first bytes of a chunk are skipped, no boundary can be there anyway,
+    // and each byte shifts the earlier ones out of the top bits after 64 bytes
+    ULONGLONG fingerprint = 0;
+    DWORD i = CHUNK_MIN_SIZE;
+    for (; i < cbNormal; ++i)
+    {
+        fingerprint = (fingerprint << 1) + s_gear[pData[i]];
+        if ((fingerprint & CHUNK_MASK_SMALL) == 0)
+            return i + 1;
+    }
+    for (; i < cbEnd; ++i)
+    {
+        fingerprint = (fingerprint << 1) + s_gear[pData[i]];
+        if ((fingerprint & CHUNK_MASK_LARGE) == 0)
+            return i + 1;
+    }
+    return cbEnd;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Hashing
+//
+
+
+// Hexadecimal string of the hash
+string ChunkHash::ToString() const
+{
+    static const char digits[] = "0123456789abcdef";
+    string text(sizeof(bytes) * 2, '0');
+    for (size_t i = 0; i < sizeof(bytes); ++i)
+    {
+        text[i * 2] = digits[bytes[i] >> 4];
+        text[i * 2 + 1] = digits[bytes[i] & 0xF];
+    }
+    return text;
+}
+
+
+ChunkHasher::ChunkHasher() :
+    m_hAlgorithm(NULL),
+    m_hHash(NULL)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    NTSTATUS status = BCryptOpenAlgorithmProvider(&m_hAlgorithm, BCRYPT_SHA256_ALGORITHM, NULL, 0);
+    if (BCRYPT_SUCCESS(status))
+        status = BCryptCreateHash(m_hAlgorithm, &m_hHash, NULL, 0, NULL, 0, BCRYPT_HASH_REUSABLE_FLAG);
+    if (!BCRYPT_SUCCESS(status))
+    {
+        if (m_hAlgorithm != NULL)
+            BCryptCloseAlgorithmProvider(m_hAlgorithm, 0);
+        ft.WriteErrorLine(L"ERROR: Could not create a SHA-256 hash object (0x%08lx)!", status);
+        throw(HRESULT_FROM_NT(status));
+    }
+}
+
+
+ChunkHasher::~ChunkHasher()
+{
+    BCryptDestroyHash(m_hHash);
+    BCryptCloseAlgorithmProvider(m_hAlgorithm, 0);
+}
+
+
+void ChunkHasher::Hash(const BYTE* pData, DWORD cbData, ChunkHash& hash)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    // Finishing the hash makes the reusable hash object ready for the next one
+    NTSTATUS status = BCryptHashData(m_hHash, (PUCHAR)pData, cbData, 0);
+    if (BCRYPT_SUCCESS(status))
+        status = BCryptFinishHash(m_hHash, hash.bytes, sizeof(hash.bytes), 0);
+    if (!BCRYPT_SUCCESS(status))
+    {
+        ft.WriteErrorLine(L"ERROR: Could not compute a SHA-256 hash (0x%08lx)!", status);
+        throw(HRESULT_FROM_NT(status));
+    }
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Chunk index
+//
+
+
+static const char CHUNK_INDEX_MAGIC[8] = { 'S', 'R', 'C', 'H', 'U', 'N', 'K', 'S' };
+static const DWORD CHUNK_INDEX_VERSION = 1;
+
+
+ChunkIndex::ChunkIndex() :
+    m_hFile(INVALID_HANDLE_VALUE),
+    m_hMapping(NULL),
+    m_pHeader(NULL),
+    m_pEntries(NULL)
+{
+}
+
+
+ChunkIndex::~ChunkIndex()
+{
+    Unmap();
+}
+
+
+// Open the index file, creating it if it does not exist
+void ChunkIndex::Open(const wstring& fileName)
+{
+    // A replacement left by an interrupted rebuild is incomplete, the file it was to replace is still there
+    m_fileName = fileName;
+    DeleteFile((fileName + L".new").c_str());
+    Map(fileName, STORE_INDEX_INITIAL_CAPACITY);
+}
+
+
+// Map the file, creating it with the given capacity if it does not exist
+void ChunkIndex::Map(const wstring& fileName, ULONGLONG ullCapacity)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    m_hFile = CreateFile(fileName.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL);
+    if (m_hFile == INVALID_HANDLE_VALUE)
+    {
+        DWORD dwLastError = GetLastError();
+        ft.WriteErrorLine(L"ERROR: Could not open the index file '%s' of the store!", fileName.c_str());
+        CHECK_WIN32_ERROR(dwLastError, L"CreateFile");
+    }
+    LARGE_INTEGER fileSize;
+    CHECK_WIN32(GetFileSizeEx(m_hFile, &fileSize));
+    bool bCreate = (fileSize.QuadPart == 0);
+    ULONGLONG ullSize = bCreate ? sizeof(Header) + ullCapacity * sizeof(ChunkLocation) : fileSize.QuadPart;
+    if (ullSize < sizeof(Header))
+    {
+        ft.WriteErrorLine(L"ERROR: The index file '%s' of the store is not valid!", fileName.c_str());
+        throw(HRESULT_FROM_WIN32(ERROR_FILE_CORRUPT));
+    }
+
+    // Mapping a new file extends it to the size of the mapping, with zeros, which are unused entries
+    m_hMapping = CreateFileMapping(m_hFile, NULL, PAGE_READWRITE, (DWORD)(ullSize >> 32), (DWORD)ullSize, NULL);
+    CHECK_WIN32(m_hMapping != NULL);
+    m_pHeader = (Header*)MapViewOfFile(m_hMapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, 0);
+    CHECK_WIN32(m_pHeader != NULL);
+    m_pEntries = (ChunkLocation*)(m_pHeader + 1);
+
+    if (bCreate)
+    {
+        memcpy(m_pHeader->magic, CHUNK_INDEX_MAGIC, sizeof(m_pHeader->magic));
+        m_pHeader->version = CHUNK_INDEX_VERSION;
+        m_pHeader->capacity = ullCapacity;
+        return;
+    }
+    ULONGLONG ullFileCapacity = m_pHeader->capacity;
+    if (memcmp(m_pHeader->magic, CHUNK_INDEX_MAGIC, sizeof(m_pHeader->magic)) != 0 || m_pHeader->version != CHUNK_INDEX_VERSION
+        || ullFileCapacity == 0 || (ullFileCapacity & (ullFileCapacity - 1)) != 0 || sizeof(Header) + ullFileCapacity * sizeof(ChunkLocation) != ullSize
+        || m_pHeader->count >= ullFileCapacity)
+    {
+        ft.WriteErrorLine(L"ERROR: The index file '%s' of the store is not valid!", fileName.c_str());
+        throw(HRESULT_FROM_WIN32(ERROR_FILE_CORRUPT));
+    }
+}
+
+
+// Unmap and close the file
+void ChunkIndex::Unmap()
+{
+    if (m_pHeader != NULL)
+        UnmapViewOfFile(m_pHeader);
+    if (m_hMapping != NULL)
+        CloseHandle(m_hMapping);
+    if (m_hFile != INVALID_HANDLE_VALUE)
+        CloseHandle(m_hFile);
+    m_pHeader = NULL;
+    m_pEntries = NULL;
+    m_hMapping = NULL;
+    m_hFile = INVALID_HANDLE_VALUE;
+}
+
+
+// Copy the entries into a new file with the given capacity, and replace the file with it
+void ChunkIndex::Rebuild(ULONGLONG ullCapacity, DWORD pack, ULONGLONG ullPackSize)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    ft.WriteDebugLine(L"Rebuilding the index of %llu chunks with %llu entries", m_pHeader->count, ullCapacity);
+    wstring newFileName = m_fileName + L".new";
+    DeleteFile(newFileName.c_str());
+    {
+        ChunkIndex newIndex;
+        newIndex.m_fileName = newFileName;
+        newIndex.Map(newFileName, ullCapacity);
+        newIndex.m_pHeader->packCount = m_pHeader->packCount;
+        for (ULONGLONG i = 0; i < m_pHeader->capacity; ++i)
+        {
+            const ChunkLocation& entry = m_pEntries[i];
+            if (entry.length == 0)
+                continue;
+            if (pack != 0 && entry.pack == pack && entry.offset + entry.length > ullPackSize)
+                continue;
+            *newIndex.FindEntry(entry.hash) = entry;
+            newIndex.m_pHeader->count++;
+        }
+        newIndex.Flush();
+    }
+    // The old file is kept in use if it cannot be replaced
+    Unmap();
+    if (!MoveFileEx(newFileName.c_str(), m_fileName.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+    {
+        DWORD dwLastError = GetLastError();
+        Map(m_fileName, ullCapacity);
+        ft.WriteErrorLine(L"ERROR: Could not replace the index file '%s' of the store!", m_fileName.c_str());
+        CHECK_WIN32_ERROR(dwLastError, L"MoveFileEx");
+    }
+    Map(m_fileName, ullCapacity);
+}
+
+
+// The entry of the chunk, or the unused entry where it would be inserted
+ChunkLocation* ChunkIndex::FindEntry(const ChunkHash& hash)
+{
+    // The hash is already uniformly distributed, its first bytes are used as they are
+    ULONGLONG ullMask = m_pHeader->capacity - 1;
+    ULONGLONG i = *(const ULONGLONG UNALIGNED*)hash.bytes & ullMask;
+    while (m_pEntries[i].length != 0 && !(m_pEntries[i].hash == hash))
+        i = (i + 1) & ullMask;
+    return &m_pEntries[i];
+}
+
+
+// Find the location of a chunk
+bool ChunkIndex::Find(const ChunkHash& hash, ChunkLocation& location)
+{
+    const ChunkLocation* pEntry = FindEntry(hash);
+    if (pEntry->length == 0)
+        return false;
+    location = *pEntry;
+    return true;
+}
+
+
+// Add the location of a chunk not in the index
+void ChunkIndex::Insert(const ChunkLocation& location)
+{
+    // Kept at most three quarters full, so that the probe sequences stay short
+    if ((m_pHeader->count + 1) * 4 > m_pHeader->capacity * 3)
+        Rebuild(m_pHeader->capacity * 2);
+
+    ChunkLocation* pEntry = FindEntry(location.hash);
+    _ASSERTE(pEntry->length == 0);
+    *pEntry = location;
+    m_pHeader->count++;
+}
+
+
+// Remove the entries of chunks in the pack that end after the given size
+ULONGLONG ChunkIndex::Truncate(DWORD pack, ULONGLONG ullPackSize)
+{
+    ULONGLONG cRemoved = 0;
+    for (ULONGLONG i = 0; i < m_pHeader->capacity; ++i)
+    {
+        const ChunkLocation& entry = m_pEntries[i];
+        if (entry.length != 0 && entry.pack == pack && entry.offset + entry.length > ullPackSize)
+            ++cRemoved;
+    }
+    if (cRemoved > 0)
+        Rebuild(m_pHeader->capacity, pack, ullPackSize);
+    return cRemoved;
+}
+
+
+// Write the changes to disk
+void ChunkIndex::Flush()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    CHECK_WIN32(FlushViewOfFile(m_pHeader, 0));
+    CHECK_WIN32(FlushFileBuffers(m_hFile));
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Chunk store
+//
+
+
+ChunkStore::ChunkStore() :
+    m_hPackFile(INVALID_HANDLE_VALUE),
+    m_pack(0),
+    m_ullPackSize(0),
+    m_ullChunksAdded(0),
+    m_ullBytesAdded(0),
+    m_ullChunksFound(0),
+    m_ullBytesFound(0)
+{
+}
+
+
+ChunkStore::~ChunkStore()
+{
+    if (m_hPackFile != INVALID_HANDLE_VALUE)
+        CloseHandle(m_hPackFile);
+}
+
+
+// Open the store in the directory, creating it if it does not exist
+void ChunkStore::Open(const wstring& directory)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    m_directory = directory;
+    if (!CreateDirectory(directory.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+    {
+        DWORD dwLastError = GetLastError();
+        ft.WriteErrorLine(L"ERROR: Could not create the store directory '%s'!", directory.c_str());
+        CHECK_WIN32_ERROR(dwLastError, L"CreateDirectory");
+    }
+
+    m_index.Open(AppendBackslash(directory) + L"index");
+    OpenPack(max(m_index.GetPackCount(), (DWORD)1));
+
+    // Each pack is flushed before the next one is started, so only the chunks of the last one can be
+    // missing after an interruption, while their entries in the memory-mapped index were written
+    ULONGLONG cRemoved = m_index.Truncate(m_pack, m_ullPackSize);
+    if (cRemoved > 0)
+        ft.WriteInfoLine(L"Removed %llu chunks missing from %s from the index of the store", cRemoved, GetPackFileName(m_pack).c_str());
+
+    ft.WriteInfoLine(L"Opened store %s with %llu chunks in %lu pack files", directory.c_str(), m_index.GetCount(), m_pack);
+}
+
+
+wstring ChunkStore::GetPackFileName(DWORD pack)
+{
+    WCHAR fileName[32];
+    StringCchPrintf(fileName, ARRAYSIZE(fileName), L"pack-%08lu.dat", pack);
+    return AppendBackslash(m_directory) + fileName;
+}
+
+
+// Open the pack file for appending, creating it if it does not exist
+void ChunkStore::OpenPack(DWORD pack)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    if (m_hPackFile != INVALID_HANDLE_VALUE)
+        CloseHandle(m_hPackFile);
+    wstring fileName = GetPackFileName(pack);
+    m_hPackFile = CreateFile(fileName.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (m_hPackFile == INVALID_HANDLE_VALUE)
+    {
+        DWORD dwLastError = GetLastError();
+        ft.WriteErrorLine(L"ERROR: Could not open the pack file '%s' of the store!", fileName.c_str());
+        CHECK_WIN32_ERROR(dwLastError, L"CreateFile");
+    }
+    LARGE_INTEGER fileSize;
+    CHECK_WIN32(GetFileSizeEx(m_hPackFile, &fileSize));
+    CHECK_WIN32(SetFilePointerEx(m_hPackFile, fileSize, NULL, FILE_BEGIN));
+    m_pack = pack;
+    m_ullPackSize = fileSize.QuadPart;
+    m_index.SetPackCount(pack);
+}
+
+
+// Add a chunk unless it is already in the store
+bool ChunkStore::Add(const BYTE* pData, DWORD cbData, ChunkHash& hash)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    m_hasher.Hash(pData, cbData, hash);
+    ChunkLocation location;
+    if (m_index.Find(hash, location))
+    {
+        m_ullChunksFound++;
+        m_ullBytesFound += cbData;
+        return false;
+    }
+
+    if (m_ullPackSize > 0 && m_ullPackSize + sizeof(PackedChunkHeader) + cbData > STORE_PACK_SIZE)
+    {
+        CHECK_WIN32(FlushFileBuffers(m_hPackFile));
+        OpenPack(m_pack + 1);
+    }
+
+    PackedChunkHeader header = {};
+    header.hash = hash;
+    header.length = cbData;
+    DWORD cbWritten = 0;
+    CHECK_WIN32(WriteFile(m_hPackFile, &header, sizeof(header), &cbWritten, NULL));
+    CHECK_WIN32(WriteFile(m_hPackFile, pData, cbData, &cbWritten, NULL));
+
+    location.hash = hash;
+    location.pack = m_pack;
+    location.length = cbData;
+    location.offset = m_ullPackSize + sizeof(header);
+    m_ullPackSize += sizeof(header) + cbData;
+    m_index.Insert(location);
+
+    m_ullChunksAdded++;
+    m_ullBytesAdded += cbData;
+    return true;
+}
+
+
+// Write everything added to disk
+void ChunkStore::Flush()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    // The chunks before the index, which must not refer to chunks not on disk
+    CHECK_WIN32(FlushFileBuffers(m_hPackFile));
+    m_index.Flush();
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Chunk store sink
+//
+
+
+ChunkStoreSink::ChunkStoreSink(ChunkStore& store, const wstring& recipeFileName) :
+    m_store(store),
+    m_recipeFileName(recipeFileName),
+    m_tempFileName(recipeFileName + L".tmp"),
+    m_cbBuffered(0),
+    m_ullBufferOffset(0),
+    m_ullChunkCount(0),
+    m_ullBytesSkipped(0)
+{
+}
+
+
+ChunkStoreSink::~ChunkStoreSink()
+{
+    // Not completed, the recipe would be incomplete
+    if (m_recipeFile.is_open())
+    {
+        m_recipeFile.close();
+        DeleteFile(m_tempFileName.c_str());
+    }
+}
+
+
+void ChunkStoreSink::Begin(ULONGLONG ullDeviceSize)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    m_recipeFile.open(m_tempFileName.c_str(), ios::out | ios::trunc);
+    if (!m_recipeFile)
+    {
+        ft.WriteErrorLine(L"ERROR: Could not create the recipe file '%s'!", m_tempFileName.c_str());
+        throw(HRESULT_FROM_WIN32(ERROR_CANNOT_MAKE));
+    }
+    m_recipeFile << m_header;
+    m_recipeFile << "size " << ullDeviceSize << "\n";
+    m_recipeFile << "hash sha256\n";
+    m_recipeFile << "\n";
+}
+
+
+void ChunkStoreSink::Write(ULONGLONG ullOffset, const BYTE* pData, DWORD cbData)
+{
+    // A gap between extents of clusters in use ends the chunk, the chunks are contiguous data
+    if (m_cbBuffered > 0 && ullOffset != m_ullBufferOffset + m_cbBuffered)
+        AddChunks(true);
+    if (m_cbBuffered == 0)
+        m_ullBufferOffset = ullOffset;
+
+    if (m_buffer.size() < (size_t)m_cbBuffered + cbData)
+        m_buffer.resize((size_t)m_cbBuffered + cbData);
+    memcpy(m_buffer.data() + m_cbBuffered, pData, cbData);
+    m_cbBuffered += cbData;
+    AddChunks(false);
+}
+
+
+void ChunkStoreSink::End()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    AddChunks(true);
+    m_store.Flush();
+
+    m_recipeFile.close();
+    if (m_recipeFile.fail())
+    {
+        DeleteFile(m_tempFileName.c_str());
+        ft.WriteErrorLine(L"ERROR: Could not write the recipe file '%s'!", m_tempFileName.c_str());
+        throw(HRESULT_FROM_WIN32(ERROR_WRITE_FAULT));
+    }
+    CHECK_WIN32(MoveFileEx(m_tempFileName.c_str(), m_recipeFileName.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH));
+}
+
+
+// Cut and add the chunks of the buffered data
+void ChunkStoreSink::AddChunks(bool bFinal)
+{
+    // Until the end, a chunk is only cut when there is enough data for the largest one, so that the
+    // boundaries do not depend on the block size of the reads
+    DWORD cbDone = 0;
+    while (m_cbBuffered > cbDone && (bFinal || m_cbBuffered - cbDone >= CHUNK_MAX_SIZE))
+    {
+        const BYTE* pChunk = m_buffer.data() + cbDone;
+        DWORD cbChunk = FindChunkBoundary(pChunk, m_cbBuffered - cbDone);
+        if (IsZeroBlock(pChunk, cbChunk))
+        {
+            m_ullBytesSkipped += cbChunk;
+        }
+        else
+        {
+            ChunkHash hash;
+            m_store.Add(pChunk, cbChunk, hash);
+            m_recipeFile << (m_ullBufferOffset + cbDone) << " " << cbChunk << " " << hash.ToString() << "\n";
+        }
+        m_ullChunkCount++;
+        cbDone += cbChunk;
+    }
+    if (cbDone > 0)
+    {
+        memmove(m_buffer.data(), m_buffer.data() + cbDone, m_cbBuffered - cbDone);
+        m_cbBuffered -= cbDone;
+        m_ullBufferOffset += cbDone;
+    }
+}
@@ -0,0 +1,257 @@
+#pragma once
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Chunk store
+//
+//  With the -store option the shadow copy devices are exported into a
+//  deduplicating store, instead of image files, so that repeated exports
+//  of the same volume only add the data that is new since the earlier ones.
+//  The data read from the device is cut into chunks of variable size where
+//  the content says so (content-defined chunking, with the FastCDC method),
+//  so that data inserted or removed only changes the chunks around it. Each
+//  chunk is identified by its SHA-256 hash, computed by the Windows
+//  cryptography API which uses the SHA extensions of the processor when
+//  available, and only chunks not already in the store are added.
+//
+//  The store is a directory with the following files:
+//
+//      index                   Hash table of all chunks in the store, with
+//                              the pack file, offset and length of each,
+//                              memory-mapped and grown as needed
+//      pack-{number}.dat       The chunks, each after a small header with
+//                              its hash and length, appended until the
+//                              file reaches STORE_PACK_SIZE
+//      {shadow id}.recipe      Text file, a header of name value lines,
+//                              then an "offset length hash" line for each
+//                              chunk of the device, in order
+//
+//  Chunks of only zeros are not stored, and left out of the recipe: The
+//  device is rebuilt by writing each chunk of the recipe at its offset into
+//  a file of the given size, the gaps are zeros. The recipe is written
+//  last, after the store has been flushed, so a recipe is only there when
+//  all its chunks are.
+//
+
+// Smallest, average and largest size of chunks, the last chunk of the device or of an extent can be smaller
+const DWORD CHUNK_MIN_SIZE = 16 * 1024;
+const DWORD CHUNK_AVG_SIZE = 64 * 1024;
+const DWORD CHUNK_MAX_SIZE = 256 * 1024;
+
+// Size at which a new pack file is started
+const ULONGLONG STORE_PACK_SIZE = 1024 * 1024 * 1024;
+
+// Number of entries of a new index, grown to twice as many when it is getting full
+const ULONGLONG STORE_INDEX_INITIAL_CAPACITY = 64 * 1024;
+
+
+// Find the end of the next chunk of the data, at least CHUNK_MIN_SIZE and at most CHUNK_MAX_SIZE bytes,
+// unless the data is shorter. The boundary only depends on the data after the previous one.
+DWORD FindChunkBoundary(const BYTE* pData, DWORD cbData);
+
+
+// SHA-256 hash of a chunk
+struct ChunkHash
+{
+    BYTE                bytes[32];
+
+    bool operator==(const ChunkHash& other) const { return memcmp(bytes, other.bytes, sizeof(bytes)) == 0; }
+
+    // Hexadecimal string of the hash
+    string ToString() const;
+};
+
+
+// Computes SHA-256 hashes, reusing the same hash object
+class ChunkHasher
+{
+public:
+
+    ChunkHasher();
+
+    ~ChunkHasher();
+
+    void Hash(const BYTE* pData, DWORD cbData, ChunkHash& hash);
+
+private:
+
+    BCRYPT_ALG_HANDLE       m_hAlgorithm;
+    BCRYPT_HASH_HANDLE      m_hHash;
+};
+
+
+// Where a chunk is in the store, as an entry of the index
+struct ChunkLocation
+{
+    ChunkHash           hash;
+    DWORD               pack;
+    DWORD               length;     // Zero for an unused entry
+    ULONGLONG           offset;     // Of the data of the chunk in the pack file, after its header
+};
+
+
+// Hash table of the chunks in the store, in a memory-mapped file, with linear probing
+class ChunkIndex
+{
+public:
+
+    ChunkIndex();
+
+    ~ChunkIndex();
+
+    // Open the index file, creating it if it does not exist
+    void Open(const wstring& fileName);
+
+    // Find the location of a chunk, returns false if it is not in the index
+    bool Find(const ChunkHash& hash, ChunkLocation& location);
+
+    // Add the location of a chunk not in the index
+    void Insert(const ChunkLocation& location);
+
+    // Remove the entries of chunks in the pack that end after the given size, e.g. data lost when the
+    // pack file was not flushed, and returns the number removed
+    ULONGLONG Truncate(DWORD pack, ULONGLONG ullPackSize);
+
+    // Write the changes to disk
+    void Flush();
+
+    // Number of chunks in the index
+    ULONGLONG GetCount() { return m_pHeader->count; }
+
+    // Number of the last pack file, zero if none, kept in the index
+    DWORD GetPackCount() { return m_pHeader->packCount; }
+    void SetPackCount(DWORD packCount) { m_pHeader->packCount = packCount; }
+
+private:
+
+    // Header of the index file, followed by the entries
+    struct Header
+    {
+        char            magic[8];
+        DWORD           version;
+        DWORD           packCount;
+        ULONGLONG       capacity;
+        ULONGLONG       count;
+        BYTE            reserved[32];
+    };
+
+    // Map the file, creating it with the given capacity if it does not exist
+    void Map(const wstring& fileName, ULONGLONG ullCapacity);
+
+    // Unmap and close the file
+    void Unmap();
+
+    // Copy the entries into a new file with the given capacity, except those of the pack after the given size, and replace the file with it
+    void Rebuild(ULONGLONG ullCapacity, DWORD pack = 0, ULONGLONG ullPackSize = 0);
+
+    // The entry of the chunk, or the unused entry where it would be inserted
+    ChunkLocation* FindEntry(const ChunkHash& hash);
+
+    wstring             m_fileName;
+    HANDLE              m_hFile;
+    HANDLE              m_hMapping;
+    Header*             m_pHeader;
+    ChunkLocation*      m_pEntries;
+};
+
+
+// The store of chunks, in a directory
+class ChunkStore
+{
+public:
+
+    ChunkStore();
+
+    ~ChunkStore();
+
+    // Open the store in the directory, creating it if it does not exist
+    void Open(const wstring& directory);
+
+    // Add a chunk unless it is already in the store, and get its hash
+    // Returns true if the chunk was added
+    bool Add(const BYTE* pData, DWORD cbData, ChunkHash& hash);
+
+    // Write everything added to disk
+    void Flush();
+
+    const wstring& GetDirectory() { return m_directory; }
+
+    // Chunks and bytes added, and found already in the store
+    ULONGLONG GetChunksAdded() { return m_ullChunksAdded; }
+    ULONGLONG GetBytesAdded() { return m_ullBytesAdded; }
+    ULONGLONG GetChunksFound() { return m_ullChunksFound; }
+    ULONGLONG GetBytesFound() { return m_ullBytesFound; }
+
+    // Number of chunks in the store
+    ULONGLONG GetChunkCount() { return m_index.GetCount(); }
+
+private:
+
+    // Header of each chunk in a pack file
+    struct PackedChunkHeader
+    {
+        ChunkHash       hash;
+        DWORD           length;
+        DWORD           reserved;
+    };
+
+    // Open the pack file for appending, creating it if it does not exist
+    void OpenPack(DWORD pack);
+
+    wstring GetPackFileName(DWORD pack);
+
+    wstring             m_directory;
+    ChunkIndex          m_index;
+    ChunkHasher         m_hasher;
+
+    HANDLE              m_hPackFile;
+    DWORD               m_pack;
+    ULONGLONG           m_ullPackSize;
+
+    ULONGLONG           m_ullChunksAdded;
+    ULONGLONG           m_ullBytesAdded;
+    ULONGLONG           m_ullChunksFound;
+    ULONGLONG           m_ullBytesFound;
+};
+
+
+// Cuts the blocks read from a device into chunks, adds them to the store, and writes the recipe
+class ChunkStoreSink : public ExportSink
+{
+public:
+
+    ChunkStoreSink(ChunkStore& store, const wstring& recipeFileName);
+
+    ~ChunkStoreSink();
+
+    // Text of the header of the recipe, name value lines
+    void SetHeader(const string& header) { m_header = header; }
+
+    virtual void Begin(ULONGLONG ullDeviceSize);
+    virtual void Write(ULONGLONG ullOffset, const BYTE* pData, DWORD cbData);
+    virtual void End();
+
+    // Number of chunks of the device, and bytes in chunks of only zeros that were left out
+    ULONGLONG GetChunkCount() { return m_ullChunkCount; }
+    ULONGLONG GetBytesSkipped() { return m_ullBytesSkipped; }
+
+private:
+
+    // Cut and add the chunks of the buffered data, all of it at the end of an extent, and else
+    // leaving at most the data of one chunk of the largest size in the buffer
+    void AddChunks(bool bFinal);
+
+    ChunkStore&         m_store;
+    wstring             m_recipeFileName;
+    wstring             m_tempFileName;
+    string              m_header;
+    ofstream            m_recipeFile;
+
+    // Data not yet cut into chunks, starting at the given offset of the device
+    vector<BYTE>        m_buffer;
+    DWORD               m_cbBuffered;
+    ULONGLONG           m_ullBufferOffset;
+
+    ULONGLONG           m_ullChunkCount;
+    ULONGLONG           m_ullBytesSkipped;
+};
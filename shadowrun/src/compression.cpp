@@ -0,0 +1,312 @@
+// Main header
+#include "stdafx.h"
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Compression
+//
+
+
+static const char COMPRESSED_FILE_MAGIC[8] = { 'S', 'R', 'C', 'O', 'M', 'P', 'R', '1' };
+
+
+// Name of a compression algorithm
+LPCWSTR GetCompressionName(DWORD algorithm)
+{
+    switch (algorithm)
+    {
+    case 0: return L"none";
+    case COMPRESS_ALGORITHM_XPRESS: return L"xpress";
+    case COMPRESS_ALGORITHM_XPRESS_HUFF: return L"huff";
+    case COMPRESS_ALGORITHM_MSZIP: return L"mszip";
+    case COMPRESS_ALGORITHM_LZMS: return L"lzms";
+    default: return L"unknown";
+    }
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Compressed file sink
+//
+
+
+CompressedFileSink::CompressedFileSink(const wstring& fileName, const ExportSettings& settings) :
+    m_fileName(fileName),
+    m_settings(settings),
+    m_hFile(INVALID_HANDLE_VALUE),
+    m_ullSize(0),
+    m_current(0),
+    m_hWorkSemaphore(NULL),
+    m_bStopping(false),
+    m_ullBytesIn(0),
+    m_ullBytesWritten(0),
+    m_ullBytesSkipped(0)
+{
+    InitializeCriticalSection(&m_lock);
+}
+
+
+CompressedFileSink::~CompressedFileSink()
+{
+    Stop();
+    DeleteCriticalSection(&m_lock);
+}
+
+
+void CompressedFileSink::Begin(ULONGLONG ullSize)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    m_hFile = CreateFile(m_fileName.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (m_hFile == INVALID_HANDLE_VALUE)
+    {
+        DWORD dwLastError = GetLastError();
+        ft.WriteErrorLine(L"ERROR: Could not create the compressed file '%s'!", m_fileName.c_str());
+        CHECK_WIN32_ERROR(dwLastError, L"CreateFile");
+    }
+
+    // The size is written again at the end, when the size of the data is known
+    m_ullSize = ullSize;
+    CompressedFileHeader header = {};
+    memcpy(header.magic, COMPRESSED_FILE_MAGIC, sizeof(header.magic));
+    header.algorithm = m_settings.compression;
+    header.blockSize = m_settings.blockSize;
+    header.size = m_ullSize;
+    DWORD cbWritten = 0;
+    CHECK_WIN32(WriteFile(m_hFile, &header, sizeof(header), &cbWritten, NULL));
+    m_ullBytesWritten = sizeof(header);
+
+    DWORD cThreads = m_settings.compressThreads;
+    if (cThreads == 0)
+        cThreads = min(GetActiveProcessorCount(ALL_PROCESSOR_GROUPS), COMPRESSION_MAX_THREADS);
+
+    m_hWorkSemaphore = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+    CHECK_WIN32(m_hWorkSemaphore != NULL);
+
+    // Twice as many buffers as threads, so that the threads have the next blocks while the oldest one is written
+    m_slots.resize(cThreads * 2);
+    for (size_t i = 0; i < m_slots.size(); ++i)
+    {
+        Slot& slot = m_slots[i];
+        slot.pInput = (BYTE*)VirtualAlloc(NULL, m_settings.blockSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        slot.pOutput = (BYTE*)VirtualAlloc(NULL, m_settings.blockSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (slot.pInput == NULL || slot.pOutput == NULL)
+            throw(E_OUTOFMEMORY);
+        slot.hDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+        CHECK_WIN32(slot.hDone != NULL);
+    }
+
+    // The workers are not moved once their threads run
+    m_workers.resize(cThreads);
+    for (size_t i = 0; i < m_workers.size(); ++i)
+    {
+        Worker& worker = m_workers[i];
+        worker.pSink = this;
+        if (!CreateCompressor(m_settings.compression, NULL, &worker.hCompressor))
+        {
+            DWORD dwLastError = GetLastError();
+            ft.WriteErrorLine(L"ERROR: Could not create a compressor for %s, requires Windows 8 or later!", GetCompressionName(m_settings.compression));
+            CHECK_WIN32_ERROR(dwLastError, L"CreateCompressor");
+        }
+        worker.hThread = CreateThread(NULL, 0, WorkerThread, &worker, 0, NULL);
+        CHECK_WIN32(worker.hThread != NULL);
+    }
+    ft.WriteDebugLine(L"Compressing with %s on %lu threads", GetCompressionName(m_settings.compression), cThreads);
+}
+
+
+void CompressedFileSink::Write(ULONGLONG ullOffset, const BYTE* pData, DWORD cbData)
+{
+    // Blocks left out at the end still count in the size
+    m_ullBytesIn += cbData;
+    m_ullSize = max(m_ullSize, ullOffset + cbData);
+    if (m_settings.sparse && IsZeroBlock(pData, cbData))
+    {
+        m_ullBytesSkipped += cbData;
+        return;
+    }
+
+    // Contiguous data is gathered into blocks, a gap starts a new one
+    while (cbData > 0)
+    {
+        Slot& slot = m_slots[m_current];
+        if (slot.cbInput > 0 && ullOffset != slot.ullOffset + slot.cbInput)
+        {
+            Submit();
+            continue;
+        }
+        if (slot.cbInput == 0)
+            slot.ullOffset = ullOffset;
+        DWORD cbCopy = min(cbData, m_settings.blockSize - slot.cbInput);
+        memcpy(slot.pInput + slot.cbInput, pData, cbCopy);
+        slot.cbInput += cbCopy;
+        ullOffset += cbCopy;
+        pData += cbCopy;
+        cbData -= cbCopy;
+        if (slot.cbInput == m_settings.blockSize)
+            Submit();
+    }
+}
+
+
+void CompressedFileSink::End()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    // The rest of the blocks in order, from the oldest one after the slot being filled
+    Submit();
+    for (size_t i = 0; i < m_slots.size(); ++i)
+    {
+        Slot& slot = m_slots[(m_current + i) % m_slots.size()];
+        if (slot.bPending)
+            Complete(slot);
+    }
+
+    CompressedFileHeader header = {};
+    memcpy(header.magic, COMPRESSED_FILE_MAGIC, sizeof(header.magic));
+    header.algorithm = m_settings.compression;
+    header.blockSize = m_settings.blockSize;
+    header.size = m_ullSize;
+    LARGE_INTEGER start = {};
+    CHECK_WIN32(SetFilePointerEx(m_hFile, start, NULL, FILE_BEGIN));
+    DWORD cbWritten = 0;
+    CHECK_WIN32(WriteFile(m_hFile, &header, sizeof(header), &cbWritten, NULL));
+    CloseHandle(m_hFile);
+    m_hFile = INVALID_HANDLE_VALUE;
+    Stop();
+}
+
+
+// Hand the block being filled over to the threads, and get the next slot ready for filling
+void CompressedFileSink::Submit()
+{
+    Slot& slot = m_slots[m_current];
+    if (slot.cbInput == 0)
+        return;
+    slot.bPending = true;
+    slot.hr = S_OK;
+    ResetEvent(slot.hDone);
+    EnterCriticalSection(&m_lock);
+    m_work.push_back(m_current);
+    LeaveCriticalSection(&m_lock);
+    ReleaseSemaphore(m_hWorkSemaphore, 1, NULL);
+
+    // The slots are used in turn, so the oldest block is always the next one to be written
+    m_current = (m_current + 1) % m_slots.size();
+    Slot& next = m_slots[m_current];
+    if (next.bPending)
+        Complete(next);
+}
+
+
+// Wait for the block of the slot to be compressed, and write it
+void CompressedFileSink::Complete(Slot& slot)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    WaitForSingleObject(slot.hDone, INFINITE);
+    slot.bPending = false;
+    if (FAILED(slot.hr))
+    {
+        ft.WriteErrorLine(L"ERROR: Could not compress the block at offset %llu (0x%08lx)!", slot.ullOffset, slot.hr);
+        throw(slot.hr);
+    }
+
+    CompressedFrameHeader frame = {};
+    frame.offset = slot.ullOffset;
+    frame.length = slot.cbInput;
+    frame.storedLength = (slot.cbOutput > 0) ? slot.cbOutput : slot.cbInput;
+    DWORD cbWritten = 0;
+    CHECK_WIN32(WriteFile(m_hFile, &frame, sizeof(frame), &cbWritten, NULL));
+    CHECK_WIN32(WriteFile(m_hFile, (slot.cbOutput > 0) ? slot.pOutput : slot.pInput, frame.storedLength, &cbWritten, NULL));
+    m_ullBytesWritten += sizeof(frame) + frame.storedLength;
+    slot.cbInput = 0;
+}
+
+
+// Compress the block of a slot
+void CompressedFileSink::Compress(Worker& worker, Slot& slot)
+{
+    // The output buffer is no larger than the block, data that does not get smaller is stored as it is
+    SIZE_T cbCompressed = 0;
+    slot.cbOutput = 0;
+    if (::Compress(worker.hCompressor, slot.pInput, slot.cbInput, slot.pOutput, slot.cbInput, &cbCompressed))
+    {
+        if (cbCompressed < slot.cbInput)
+            slot.cbOutput = (DWORD)cbCompressed;
+    }
+    else if (GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+    {
+        slot.hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+}
+
+
+DWORD WINAPI CompressedFileSink::WorkerThread(LPVOID pParameter)
+{
+    Worker* pWorker = (Worker*)pParameter;
+    CompressedFileSink* pSink = pWorker->pSink;
+    while (true)
+    {
+        WaitForSingleObject(pSink->m_hWorkSemaphore, INFINITE);
+
+        // Any blocks not compressed yet when stopping are not needed anymore
+        EnterCriticalSection(&pSink->m_lock);
+        if (pSink->m_bStopping)
+        {
+            LeaveCriticalSection(&pSink->m_lock);
+            return 0;
+        }
+        size_t index = pSink->m_work.front();
+        pSink->m_work.erase(pSink->m_work.begin());
+        LeaveCriticalSection(&pSink->m_lock);
+
+        Slot& slot = pSink->m_slots[index];
+        pSink->Compress(*pWorker, slot);
+        SetEvent(slot.hDone);
+    }
+}
+
+
+// Stop and wait for the threads, and free the buffers
+void CompressedFileSink::Stop()
+{
+    EnterCriticalSection(&m_lock);
+    m_bStopping = true;
+    LeaveCriticalSection(&m_lock);
+    if (m_hWorkSemaphore != NULL)
+        ReleaseSemaphore(m_hWorkSemaphore, (LONG)m_workers.size(), NULL);
+    for (size_t i = 0; i < m_workers.size(); ++i)
+    {
+        if (m_workers[i].hThread != NULL)
+        {
+            WaitForSingleObject(m_workers[i].hThread, INFINITE);
+            CloseHandle(m_workers[i].hThread);
+        }
+        if (m_workers[i].hCompressor != NULL)
+            CloseCompressor(m_workers[i].hCompressor);
+    }
+    m_workers.clear();
+
+    for (size_t i = 0; i < m_slots.size(); ++i)
+    {
+        if (m_slots[i].pInput != NULL)
+            VirtualFree(m_slots[i].pInput, 0, MEM_RELEASE);
+        if (m_slots[i].pOutput != NULL)
+            VirtualFree(m_slots[i].pOutput, 0, MEM_RELEASE);
+        if (m_slots[i].hDone != NULL)
+            CloseHandle(m_slots[i].hDone);
+    }
+    m_slots.clear();
+
+    if (m_hWorkSemaphore != NULL)
+        CloseHandle(m_hWorkSemaphore);
+    m_hWorkSemaphore = NULL;
+    if (m_hFile != INVALID_HANDLE_VALUE)
+        CloseHandle(m_hFile);
+    m_hFile = INVALID_HANDLE_VALUE;
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Compression
+//
+//  With the compress setting of -export-io the image files, and the delta
+//  files of -diff, are compressed while they are exported, instead of by a
+//  separate tool afterwards reading and writing everything once more. The
+//  data is compressed in blocks of the export block size by a pool of
+//  threads, each with its own compressor of the Windows compression API,
+//  and the compressed blocks are written to the file in their original
+//  order. The blocks go through a fixed ring of buffers, twice as many as
+//  there are threads, and when the oldest block is not compressed yet the
+//  reader simply waits for it, which holds back the reads when compressing
+//  is slower than reading.
+//
+//  The compressed file has a header, followed by a frame for each block:
+//  The offset of the block in the uncompressed file, its length, and the
+//  length of the compressed data following the frame, which equals the
+//  length if the block did not compress and is stored as it is. Blocks of
+//  only zeros are left out when the image is sparse, and are zeros when
+//  the file is decompressed.
+//
+
+// Largest number of compression threads allowed
+const DWORD COMPRESSION_MAX_THREADS = 64;
+
+
+// Name of a compression algorithm, e.g. for the log
+LPCWSTR GetCompressionName(DWORD algorithm);
+
+
+// Header of a compressed file
+struct CompressedFileHeader
+{
+    char                magic[8];
+    DWORD               algorithm;      // COMPRESS_ALGORITHM_*
+    DWORD               blockSize;
+    ULONGLONG           size;           // Of the uncompressed file
+};
+
+
+// Header of each block in a compressed file
+struct CompressedFrameHeader
+{
+    ULONGLONG           offset;
+    DWORD               length;
+    DWORD               storedLength;
+};
+
+
+// Compresses the blocks with a pool of threads and writes them in order to a compressed file
+class CompressedFileSink : public ExportSink
+{
+public:
+
+    CompressedFileSink(const wstring& fileName, const ExportSettings& settings);
+
+    // Stops the threads
+    ~CompressedFileSink();
+
+    virtual void Begin(ULONGLONG ullSize);
+    virtual void Write(ULONGLONG ullOffset, const BYTE* pData, DWORD cbData);
+    virtual void End();
+
+    // Bytes given to the sink, bytes written to the file, and bytes of zeros left out
+    ULONGLONG GetBytesIn() { return m_ullBytesIn; }
+    ULONGLONG GetBytesWritten() { return m_ullBytesWritten; }
+    ULONGLONG GetBytesSkipped() { return m_ullBytesSkipped; }
+
+private:
+
+    // A buffer with a block being filled, compressed or waiting to be written
+    struct Slot
+    {
+        BYTE*               pInput = NULL;
+        BYTE*               pOutput = NULL;
+        ULONGLONG           ullOffset = 0;
+        DWORD               cbInput = 0;
+        DWORD               cbOutput = 0;   // Zero if stored as it is
+        bool                bPending = false;
+        HRESULT             hr = S_OK;
+        HANDLE              hDone = NULL;
+    };
+
+    // A compression thread, with its own compressor
+    struct Worker
+    {
+        CompressedFileSink* pSink = NULL;
+        COMPRESSOR_HANDLE   hCompressor = NULL;
+        HANDLE              hThread = NULL;
+    };
+
+    static DWORD WINAPI WorkerThread(LPVOID pParameter);
+
+    // Compress the block of a slot, on a worker thread
+    void Compress(Worker& worker, Slot& slot);
+
+    // Hand the block being filled over to the threads, and get the next slot ready for filling
+    void Submit();
+
+    // Wait for the block of the slot to be compressed, and write it
+    void Complete(Slot& slot);
+
+    // Stop and wait for the threads, and free the buffers
+    void Stop();
+
+    wstring                 m_fileName;
+    ExportSettings          m_settings;
+    HANDLE                  m_hFile;
+    ULONGLONG               m_ullSize;
+
+    vector<Slot>            m_slots;
+    size_t                  m_current;      // Slot being filled
+
+    vector<Worker>          m_workers;
+    CRITICAL_SECTION        m_lock;
+    vector<size_t>          m_work;         // Slots to compress, protected by the lock
+    HANDLE                  m_hWorkSemaphore;
+    bool                    m_bStopping;
+
+    ULONGLONG               m_ullBytesIn;
+    ULONGLONG               m_ullBytesWritten;
+    ULONGLONG               m_ullBytesSkipped;
+};
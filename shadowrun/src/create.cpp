@@ -1,7 +1,6 @@
 // Main header
 #include "stdafx.h"
 
-_COM_SMARTPTR_TYPEDEF(IVssAsync, __uuidof(IVssAsync)); // typedef _com_ptr_t<...> IVssAsyncPtr;
 
 
 void VssClient::CreateSnapshotSet(vector<wstring> volumeList)
@@ -9,7 +8,7 @@ void VssClient::CreateSnapshotSet(vector<wstring> volumeList)
     FunctionTracer ft(DBG_INFO);
 
     // Start the shadow set
-    CHECK_COM(m_pVssObject->StartSnapshotSet(&m_latestSnapshotSet.id))
+    CHECK_COM(m_pBackend->StartSnapshotSet(&m_latestSnapshotSet.id))
     m_latestSnapshotSet.idString = Guid2WString(m_latestSnapshotSet.id);
     ft.WriteInfoLine(L"Creating shadow set %s...", m_latestSnapshotSet.idString.c_str());
 
@@ -39,7 +38,7 @@ void VssClient::AddToSnapshotSet(vector<wstring> volumeList)
             volume.c_str());
 
         VSS_ID snapshotId;
-        CHECK_COM(m_pVssObject->AddToSnapshotSet((LPWSTR)volume.c_str(), GUID_NULL, &snapshotId));
+        CHECK_COM(m_pBackend->AddToSnapshotSet((LPWSTR)volume.c_str(), GUID_NULL, &snapshotId));
 
         wstring snapshotIdString = Guid2WString(snapshotId);
 
@@ -56,11 +55,15 @@ void VssClient::DoSnapshotSet()
     ft.WriteInfoLine(L"Creating the shadow...");
     ft.WriteDebugLine(L"COM call DoSnapshotSet");
 
+    // Recorded before it is created, so that it is deleted if this process dies before releasing it
+    if (m_pJournal)
+        m_pJournal->RecordSnapshotSet(m_latestSnapshotSet.id);
+
     IVssAsyncPtr pAsync;
-    CHECK_COM(m_pVssObject->DoSnapshotSet(&pAsync));
+    CHECK_COM(m_pBackend->DoSnapshotSet(&pAsync));
 
     // Waits for the async operation to finish and checks the result
-    WaitAndCheckForAsyncOperation(pAsync);
+    WaitAndCheckForAsyncOperation(pAsync, L"DoSnapshotSet");
 }
 
 void VssClient::SnapshotSetCreated()
@@ -70,13 +73,20 @@ void VssClient::SnapshotSetCreated()
     {
         // Get shadow copy device (if the snapshot is there)
         VSS_SNAPSHOT_PROP Snap;
-        CHECK_COM(m_pVssObject->GetSnapshotProperties(m_latestSnapshotSet.snapshots[i].id, &Snap));
+        CHECK_COM(m_pBackend->GetSnapshotProperties(m_latestSnapshotSet.snapshots[i].id, &Snap));
         // Automatically call VssFreeSnapshotProperties on this structure at the end of scope
         CAutoSnapPointer snapAutoCleanup(&Snap);
         m_latestSnapshotSet.snapshots[i].deviceName = Snap.m_pwszSnapshotDeviceObject;
     }
 }
 
+// Use a shadow copy set created elsewhere
+void VssClient::UseSnapshotSet(const SnapshotSetInfo& snapshotSet)
+{
+    _ASSERTE(m_latestSnapshotSet.snapshots.size() == 0);
+    m_latestSnapshotSet = snapshotSet;
+}
+
 wstring VssClient::MountSnapshots(wstring driveLetters)
 {
     FunctionTracer ft(DBG_INFO);
@@ -98,8 +108,13 @@ wstring VssClient::MountSnapshots(wstring driveLetters)
         drive += driveLetter;
         drive += L":"; // DefineDosDevice does not work with trailing backslash
         ft.WriteInfoLine(L"Mounting shadow copy %s (%s)...", drive.c_str(), m_latestSnapshotSet.snapshots[i].deviceName.c_str());
+        if (m_pJournal)
+            m_pJournal->RecordMount(drive, m_latestSnapshotSet.snapshots[i].deviceName);
         CHECK_WIN32(DefineDosDevice(NULL, drive.c_str(), m_latestSnapshotSet.snapshots[i].deviceName.c_str()));
 
+        // Remember the mount drive to be able to unmount when done, also if it does not work
+        m_latestSnapshotSet.snapshots[i].mount = drive;
+
         // Verify that the DOS device works (DefineDosDevice seems to return success regardless of target being invalid)
         auto hDrive = CreateFile(drive.c_str(), GENERIC_READ,
             FILE_SHARE_READ | FILE_SHARE_WRITE,
@@ -109,9 +124,6 @@ wstring VssClient::MountSnapshots(wstring driveLetters)
             ft.WriteErrorLine(L"ERROR: Mount %s (%s) is not accessible!", drive.c_str(), m_latestSnapshotSet.snapshots[i].deviceName.c_str());
             throw(E_UNEXPECTED);
         }
-
-        // Remember the mount drive to be able to unmount when done
-        m_latestSnapshotSet.snapshots[i].mount = drive;
     }
 
     return driveLetters;
@@ -127,6 +139,8 @@ void VssClient::UnmountSnapshots()
             ft.WriteInfoLine(L"Unmounting shadow copy %s (%s)...", m_latestSnapshotSet.snapshots[i].mount.c_str(), m_latestSnapshotSet.snapshots[i].deviceName.c_str());
             if (DefineDosDevice(DDD_REMOVE_DEFINITION | DDD_EXACT_MATCH_ON_REMOVE, m_latestSnapshotSet.snapshots[i].mount.c_str(), m_latestSnapshotSet.snapshots[i].deviceName.c_str()))
             {
+                if (m_pJournal)
+                    m_pJournal->RecordUnmount(m_latestSnapshotSet.snapshots[i].mount, m_latestSnapshotSet.snapshots[i].deviceName);
                 m_latestSnapshotSet.snapshots[i].mount.clear(); // Set empty so we know it no longer exists
             }
             else
@@ -150,6 +164,8 @@ void VssClient::UnmountSnapshotsSilent()
                 {
                     if (DefineDosDevice(DDD_REMOVE_DEFINITION | DDD_EXACT_MATCH_ON_REMOVE, m_latestSnapshotSet.snapshots[i].mount.c_str(), m_latestSnapshotSet.snapshots[i].deviceName.c_str()))
                     {
+                        if (m_pJournal)
+                            m_pJournal->RecordUnmount(m_latestSnapshotSet.snapshots[i].mount, m_latestSnapshotSet.snapshots[i].deviceName);
                         m_latestSnapshotSet.snapshots[i].mount.clear(); // Set empty so we know it no longer exists
                     }
                 }
@@ -193,28 +209,50 @@ void VssClient::SetProcessEnvironment()
 {
     FunctionTracer ft(DBG_INFO);
     ft.WriteInfoLine(L"Setting shadow process environment variables...");
+    vector<size_t> snapshotIndexes;
+    for (size_t i = 0; i < m_latestSnapshotSet.snapshots.size(); ++i)
+        snapshotIndexes.push_back(i);
+    SetSnapshotEnvironment(snapshotIndexes);
+}
+
+// Update environment variables of the current process for a job running for some of the shadow copies
+void VssClient::SetJobEnvironment(size_t jobIndex, size_t jobCount, const vector<size_t>& snapshotIndexes)
+{
+    FunctionTracer ft(DBG_INFO);
+    ft.WriteDebugLine(L"Setting shadow process environment variables for job %u...", (unsigned)jobIndex + 1);
+    SetProcessEnvironmentVariable((LPCWSTR)L"SHADOW_JOB", to_wstring(jobIndex + 1).c_str());
+    SetProcessEnvironmentVariable((LPCWSTR)L"SHADOW_JOB_COUNT", to_wstring(jobCount).c_str());
+    SetSnapshotEnvironment(snapshotIndexes);
+}
+
+// Set the variables of the set, with the given shadow copies numbered from 1
+void VssClient::SetSnapshotEnvironment(const vector<size_t>& snapshotIndexes)
+{
+    FunctionTracer ft(DBG_INFO);
     SetProcessEnvironmentVariable((LPCWSTR)L"SHADOW_SET_ID", m_latestSnapshotSet.idString.c_str());
     wostringstream stringBuilder;
-    stringBuilder << m_latestSnapshotSet.snapshots.size();
+    stringBuilder << snapshotIndexes.size();
     SetProcessEnvironmentVariable((LPCWSTR)L"SHADOW_SET_COUNT", stringBuilder.str().c_str());
     stringBuilder.str(std::wstring{});
     for (size_t i = 0; i < m_latestSnapshotSet.snapshots.size(); ++i)
     {
+        // Remove the variables not used by this subset of the shadow copies, possibly set for a previous subset
+        const SnapshotInfo* pSnapshot = (i < snapshotIndexes.size()) ? &m_latestSnapshotSet.snapshots[snapshotIndexes[i]] : NULL;
         stringBuilder << L"SHADOW_ID_" << i+1;
-        SetProcessEnvironmentVariable(stringBuilder.str().c_str(), m_latestSnapshotSet.snapshots[i].idString.c_str());
+        SetProcessEnvironmentVariable(stringBuilder.str().c_str(), pSnapshot ? pSnapshot->idString.c_str() : NULL);
         stringBuilder.str(std::wstring{});
         stringBuilder << L"SHADOW_DEVICE_" << i+1;
-        SetProcessEnvironmentVariable(stringBuilder.str().c_str(), m_latestSnapshotSet.snapshots[i].deviceName.c_str());
+        SetProcessEnvironmentVariable(stringBuilder.str().c_str(), pSnapshot ? pSnapshot->deviceName.c_str() : NULL);
         stringBuilder.str(std::wstring{});
         stringBuilder << L"SHADOW_DRIVE_" << i+1;
-        if (m_latestSnapshotSet.snapshots[i].mount.empty())
+        if (pSnapshot == NULL || pSnapshot->mount.empty())
         {
             SetProcessEnvironmentVariable(stringBuilder.str().c_str(), NULL); // Remove any existing
         }
         else
         {
-            SetProcessEnvironmentVariable(stringBuilder.str().c_str(), m_latestSnapshotSet.snapshots[i].mount.c_str());
+            SetProcessEnvironmentVariable(stringBuilder.str().c_str(), pSnapshot->mount.c_str());
         }
         stringBuilder.str(std::wstring{});
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,691 @@
+// Main header
+#include "stdafx.h"
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Messages
+//
+
+
+// Wait for an overlapped pipe operation, or for the stop event
+// Returns the error of the operation, or ERROR_OPERATION_ABORTED if stopped
+static DWORD WaitForPipeOperation(HANDLE hPipe, OVERLAPPED& overlapped, BOOL bStarted, DWORD& cbTransferred, HANDLE hStopEvent)
+{
+    if (!bStarted && GetLastError() != ERROR_IO_PENDING)
+        return GetLastError();
+
+    if (hStopEvent != NULL)
+    {
+        HANDLE handles[2] = { overlapped.hEvent, hStopEvent };
+        if (WaitForMultipleObjects(2, handles, FALSE, INFINITE) != WAIT_OBJECT_0)
+            CancelIoEx(hPipe, &overlapped);
+    }
+
+    // Also waits for a cancelled operation to end, as the buffer and the OVERLAPPED must be valid until then
+    if (!GetOverlappedResult(hPipe, &overlapped, &cbTransferred, TRUE))
+        return GetLastError();
+    return NOERROR;
+}
+
+
+// Write a message of text lines
+void WriteDaemonMessage(HANDLE hPipe, const vector<wstring>& lines)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    wstring message;
+    for (size_t i = 0; i < lines.size(); ++i)
+    {
+        if (i > 0)
+            message += L'\n';
+        message += lines[i];
+    }
+    DWORD cbMessage = (DWORD)(message.length() * sizeof(WCHAR));
+    if (cbMessage > DAEMON_MAX_MESSAGE_SIZE)
+    {
+        ft.WriteErrorLine(L"ERROR: Message of %lu bytes is larger than the maximum of %lu bytes!", cbMessage, DAEMON_MAX_MESSAGE_SIZE);
+        throw(E_INVALIDARG);
+    }
+
+    OVERLAPPED overlapped = { 0 };
+    overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (overlapped.hEvent == NULL)
+        CHECK_WIN32_ERROR(GetLastError(), L"CreateEvent");
+    CAutoHandle hEventAutoCleanup(overlapped.hEvent);
+
+    DWORD cbWritten = 0;
+    BOOL bStarted = WriteFile(hPipe, message.c_str(), cbMessage, NULL, &overlapped);
+    CHECK_WIN32_ERROR(WaitForPipeOperation(hPipe, overlapped, bStarted, cbWritten, NULL), L"WriteFile(hPipe, message.c_str(), cbMessage, NULL, &overlapped)");
+}
+
+
+// Read a message of text lines
+bool ReadDaemonMessage(HANDLE hPipe, vector<wstring>& lines, HANDLE hStopEvent)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    OVERLAPPED overlapped = { 0 };
+    overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (overlapped.hEvent == NULL)
+        CHECK_WIN32_ERROR(GetLastError(), L"CreateEvent");
+    CAutoHandle hEventAutoCleanup(overlapped.hEvent);
+
+    vector<WCHAR> buffer(DAEMON_MAX_MESSAGE_SIZE / sizeof(WCHAR));
+    DWORD cbRead = 0;
+    BOOL bStarted = ReadFile(hPipe, &buffer[0], DAEMON_MAX_MESSAGE_SIZE, NULL, &overlapped);
+    DWORD dwError = WaitForPipeOperation(hPipe, overlapped, bStarted, cbRead, hStopEvent);
+    if (dwError == ERROR_BROKEN_PIPE || dwError == ERROR_PIPE_NOT_CONNECTED || dwError == ERROR_OPERATION_ABORTED)
+        return false;
+    if (dwError == ERROR_MORE_DATA)
+    {
+        ft.WriteErrorLine(L"ERROR: Received a message larger than the maximum of %lu bytes!", DAEMON_MAX_MESSAGE_SIZE);
+        throw(E_INVALIDARG);
+    }
+    CHECK_WIN32_ERROR(dwError, L"ReadFile(hPipe, &buffer[0], DAEMON_MAX_MESSAGE_SIZE, NULL, &overlapped)");
+
+    lines = SplitWString(wstring(&buffer[0], cbRead / sizeof(WCHAR)), L'\n');
+    ft.Trace(DBG_INFO, L"Received message '%s' of %u lines", lines[0].c_str(), (unsigned)lines.size());
+    return true;
+}
+
+
+// Format an error code for the FAILED response
+static wstring FormatHresult(HRESULT hr)
+{
+    WCHAR buffer[16];
+    StringCchPrintfW(buffer, ARRAYSIZE(buffer), L"0x%08lx", hr);
+    return buffer;
+}
+
+
+// Split the first line of a message into the command and its arguments
+static vector<wstring> SplitCommand(const vector<wstring>& lines)
+{
+    return SplitWString(lines.empty() ? wstring() : lines[0], L' ');
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Daemon
+//
+
+
+SnapshotDaemon* SnapshotDaemon::s_pRunningDaemon = NULL;
+
+
+SnapshotDaemon::SnapshotDaemon(const DaemonSettings& settings) :
+    m_settings(settings),
+    m_cSessions(0),
+    m_hListeningPipe(INVALID_HANDLE_VALUE),
+    m_cClientsCreated(0),
+    m_cRequests(0)
+{
+    InitializeCriticalSection(&m_lock);
+    m_hStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    m_hJobEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    m_hSessionsEndedEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+}
+
+
+SnapshotDaemon::~SnapshotDaemon()
+{
+    if (m_hListeningPipe != INVALID_HANDLE_VALUE)
+        CloseHandle(m_hListeningPipe);
+    if (m_hStopEvent != NULL)
+        CloseHandle(m_hStopEvent);
+    if (m_hJobEvent != NULL)
+        CloseHandle(m_hJobEvent);
+    if (m_hSessionsEndedEvent != NULL)
+        CloseHandle(m_hSessionsEndedEvent);
+    DeleteCriticalSection(&m_lock);
+}
+
+
+// Serve requests until stopped
+void SnapshotDaemon::Run()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    if (m_hStopEvent == NULL || m_hJobEvent == NULL || m_hSessionsEndedEvent == NULL)
+        CHECK_WIN32_ERROR(GetLastError(), L"CreateEvent");
+
+    // Fails if another daemon is already listening on the pipe
+    m_hListeningPipe = CreatePipeInstance(true);
+
+    // All the VSS calls are made from this thread
+    VssClient::InitializeCom();
+    PrepareNextClient();
+
+    s_pRunningDaemon = this;
+    SetConsoleCtrlHandler(ConsoleCtrlHandler, TRUE);
+
+    HANDLE hListenerThread = CreateThread(NULL, 0, ListenerThread, this, 0, NULL);
+    if (hListenerThread == NULL)
+    {
+        DWORD dwError = GetLastError();
+        SetConsoleCtrlHandler(ConsoleCtrlHandler, FALSE);
+        s_pRunningDaemon = NULL;
+        m_pNextClient.reset();
+        CoUninitialize();
+        CHECK_WIN32_ERROR(dwError, L"CreateThread(NULL, 0, ListenerThread, this, 0, NULL)");
+    }
+
+    ft.WriteInfoLine(L"Listening for requests on %s, press Ctrl+C to stop...", GetDaemonPipePath(m_settings.pipeName).c_str());
+
+    // Process the jobs one at a time, until stopped
+    HANDLE handles[2] = { m_hStopEvent, m_hJobEvent };
+    while (WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0 + 1)
+    {
+        while (WaitForSingleObject(m_hStopEvent, 0) != WAIT_OBJECT_0)
+        {
+            EnterCriticalSection(&m_lock);
+            bool bEmpty = m_jobs.empty();
+            Job job = {};
+            if (!bEmpty)
+            {
+                job = m_jobs.front();
+                m_jobs.erase(m_jobs.begin());
+            }
+            LeaveCriticalSection(&m_lock);
+            if (bEmpty)
+                break;
+
+            ProcessJob(job);
+        }
+    }
+
+    ft.WriteInfoLine(L"Stopping, releasing %u shadow copy sets...", (unsigned)m_clients.size());
+
+    // The sessions end when they see the stop event, and no more jobs are processed.
+    // The sessions waiting for their jobs are told that they are dropped.
+    EnterCriticalSection(&m_lock);
+    for (size_t i = 0; i < m_jobs.size(); ++i)
+    {
+        m_jobs[i].pSession->bJobDropped = true;
+        SetEvent(m_jobs[i].pSession->hJobDone);
+    }
+    m_jobs.clear();
+    if (m_cSessions == 0)
+        SetEvent(m_hSessionsEndedEvent);
+    LeaveCriticalSection(&m_lock);
+
+    m_clients.clear();
+    m_pNextClient.reset();
+    CoUninitialize();
+
+    WaitForSingleObject(hListenerThread, INFINITE);
+    CloseHandle(hListenerThread);
+    if (WaitForSingleObject(m_hSessionsEndedEvent, DAEMON_STOP_TIMEOUT) != WAIT_OBJECT_0)
+        ft.WriteErrorLine(L"WARNING: Not all connections were closed within %u seconds", DAEMON_STOP_TIMEOUT / 1000);
+
+    SetConsoleCtrlHandler(ConsoleCtrlHandler, FALSE);
+    s_pRunningDaemon = NULL;
+
+    ft.WriteInfoLine(L"Served %lu requests", m_cRequests);
+}
+
+
+// Create a pipe instance to wait for the next connection on
+HANDLE SnapshotDaemon::CreatePipeInstance(bool bFirst)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    wstring pipePath = GetDaemonPipePath(m_settings.pipeName);
+    HANDLE hPipe = CreateNamedPipe(
+        pipePath.c_str(),
+        PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | (bFirst ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+        PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+        PIPE_UNLIMITED_INSTANCES,
+        DAEMON_MAX_MESSAGE_SIZE,
+        DAEMON_MAX_MESSAGE_SIZE,
+        0,
+        NULL); // Default security: Full access for administrators and the creator only
+    if (hPipe == INVALID_HANDLE_VALUE)
+    {
+        DWORD dwError = GetLastError();
+        if (bFirst && dwError == ERROR_ACCESS_DENIED)
+            ft.WriteErrorLine(L"ERROR: The pipe %s is already in use, is another daemon running?", pipePath.c_str());
+        CHECK_WIN32_ERROR(dwError, L"CreateNamedPipe");
+    }
+    return hPipe;
+}
+
+
+// Accept connections, on the listener thread
+DWORD WINAPI SnapshotDaemon::ListenerThread(LPVOID pParameter)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    SnapshotDaemon* pDaemon = (SnapshotDaemon*)pParameter;
+    try
+    {
+        pDaemon->Listen();
+    }
+    catch (HRESULT hr)
+    {
+        // Without the listener no more requests can arrive, stop the whole daemon
+        ft.WriteErrorLine(L"ERROR: Could not accept more connections (0x%08lx), stopping", hr);
+        SetEvent(pDaemon->m_hStopEvent);
+    }
+    return 0;
+}
+
+
+void SnapshotDaemon::Listen()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    OVERLAPPED overlapped = { 0 };
+    overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (overlapped.hEvent == NULL)
+        CHECK_WIN32_ERROR(GetLastError(), L"CreateEvent");
+    CAutoHandle hEventAutoCleanup(overlapped.hEvent);
+
+    while (true)
+    {
+        // Wait for a client to connect to the listening instance
+        ResetEvent(overlapped.hEvent);
+        DWORD cbTransferred = 0;
+        BOOL bStarted = ConnectNamedPipe(m_hListeningPipe, &overlapped);
+        DWORD dwError = (!bStarted && GetLastError() == ERROR_PIPE_CONNECTED) ? NOERROR :
+            WaitForPipeOperation(m_hListeningPipe, overlapped, bStarted, cbTransferred, m_hStopEvent);
+        if (dwError == ERROR_OPERATION_ABORTED)
+            break;
+
+        // Hand the connected instance over to a new session, and listen on a new instance
+        HANDLE hPipe = m_hListeningPipe;
+        m_hListeningPipe = CreatePipeInstance(false);
+        if (dwError != NOERROR)
+        {
+            ft.WriteDebugLine(L"Connection failed with error %lu", dwError);
+            CloseHandle(hPipe);
+            continue;
+        }
+
+        Session* pSession = new Session();
+        pSession->pDaemon = this;
+        pSession->hPipe = hPipe;
+        pSession->hJobDone = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+        EnterCriticalSection(&m_lock);
+        m_cSessions++;
+        LeaveCriticalSection(&m_lock);
+
+        HANDLE hThread = (pSession->hJobDone == NULL) ? NULL : CreateThread(NULL, 0, SessionThread, pSession, 0, NULL);
+        if (hThread == NULL)
+        {
+            // Drop the connection, the session thread function only cleans up a session without an event
+            ft.WriteErrorLine(L"WARNING: Could not start a thread for a connection (error %lu)", GetLastError());
+            if (pSession->hJobDone != NULL)
+                CloseHandle(pSession->hJobDone);
+            pSession->hJobDone = NULL;
+            SessionThread(pSession);
+            continue;
+        }
+        CloseHandle(hThread);
+    }
+}
+
+
+// Serve a single connection, on its own thread
+DWORD WINAPI SnapshotDaemon::SessionThread(LPVOID pParameter)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    Session* pSession = (Session*)pParameter;
+    SnapshotDaemon* pDaemon = pSession->pDaemon;
+
+    if (pSession->hJobDone != NULL)
+    {
+        try
+        {
+            pDaemon->ServeSession(pSession);
+        }
+        catch (HRESULT hr)
+        {
+            ft.WriteDebugLine(L"Connection ended with error 0x%08lx", hr);
+        }
+        catch (bad_alloc)
+        {
+            ft.WriteErrorLine(L"ERROR: Memory allocation error!");
+        }
+        CloseHandle(pSession->hJobDone);
+    }
+
+    DisconnectNamedPipe(pSession->hPipe);
+    CloseHandle(pSession->hPipe);
+    delete pSession;
+
+    EnterCriticalSection(&pDaemon->m_lock);
+    if (--pDaemon->m_cSessions == 0 && WaitForSingleObject(pDaemon->m_hStopEvent, 0) == WAIT_OBJECT_0)
+        SetEvent(pDaemon->m_hSessionsEndedEvent);
+    LeaveCriticalSection(&pDaemon->m_lock);
+    return 0;
+}
+
+
+void SnapshotDaemon::ServeSession(Session* pSession)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    vector<wstring> request;
+    if (!ReadDaemonMessage(pSession->hPipe, request, m_hStopEvent))
+        return;
+
+    vector<wstring> command = SplitCommand(request);
+    if (command.size() != 2 || command[0] != L"CREATE" || _wtoi(command[1].c_str()) != DAEMON_PROTOCOL_VERSION || request.size() < 2)
+    {
+        ft.WriteErrorLine(L"WARNING: Received an invalid request '%s'", request[0].c_str());
+        WriteDaemonMessage(pSession->hPipe, vector<wstring>{ L"FAILED " + FormatHresult(E_INVALIDARG) });
+        return;
+    }
+    pSession->volumes.assign(request.begin() + 1, request.end());
+
+    JobResult result = RunJob(JOB_CREATE, pSession);
+    if (result != JOB_DONE)
+    {
+        WriteDaemonMessage(pSession->hPipe, vector<wstring>{ (result == JOB_QUEUE_FULL) ? L"BUSY" : L"STOPPING" });
+        return;
+    }
+
+    // From here on the shadow copies must be released, even if the client is gone
+    bool bReleaseRequested = false;
+    if (SUCCEEDED(pSession->hr))
+    {
+        try
+        {
+            vector<wstring> response;
+            response.push_back(L"CREATED " + pSession->snapshotSet.idString + L" " + pSession->backendName);
+            for (size_t i = 0; i < pSession->snapshotSet.snapshots.size(); ++i)
+                response.push_back(pSession->snapshotSet.snapshots[i].idString + L" " + pSession->snapshotSet.snapshots[i].deviceName);
+            WriteDaemonMessage(pSession->hPipe, response);
+
+            // Hold the shadow copies until the client releases them, or disconnects
+            vector<wstring> release;
+            bReleaseRequested = ReadDaemonMessage(pSession->hPipe, release, m_hStopEvent) && SplitCommand(release)[0] == L"RELEASE";
+        }
+        catch (HRESULT hr)
+        {
+            ft.WriteDebugLine(L"Connection failed with error 0x%08lx, releasing the shadow copies", hr);
+        }
+
+        if (RunJob(JOB_RELEASE, pSession) != JOB_DONE)
+            return; // Stopping, all shadow copies are released anyway
+    }
+
+    if (FAILED(pSession->hr))
+        WriteDaemonMessage(pSession->hPipe, vector<wstring>{ L"FAILED " + FormatHresult(pSession->hr) });
+    else if (bReleaseRequested)
+        WriteDaemonMessage(pSession->hPipe, vector<wstring>{ L"RELEASED" });
+}
+
+
+// Queue a job for the main thread and wait until it is done, or dropped because the daemon is stopping
+SnapshotDaemon::JobResult SnapshotDaemon::RunJob(JobType type, Session* pSession)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    EnterCriticalSection(&m_lock);
+    JobResult result = (WaitForSingleObject(m_hStopEvent, 0) == WAIT_OBJECT_0) ? JOB_STOPPING : JOB_DONE;
+    if (result == JOB_DONE && type == JOB_CREATE)
+    {
+        size_t cQueuedRequests = 0;
+        for (size_t i = 0; i < m_jobs.size(); ++i)
+        {
+            if (m_jobs[i].type == JOB_CREATE)
+                ++cQueuedRequests;
+        }
+        if (cQueuedRequests >= DAEMON_MAX_QUEUED_REQUESTS)
+            result = JOB_QUEUE_FULL;
+    }
+    if (result == JOB_DONE)
+        m_jobs.push_back(Job{ type, pSession });
+    LeaveCriticalSection(&m_lock);
+
+    if (result != JOB_DONE)
+        return result;
+
+    SetEvent(m_hJobEvent);
+
+    // Not the stop event: The main thread may be processing the job, and the session must live until it is done.
+    // When stopping, the main thread either finishes the job or drops it, and signals the event either way.
+    WaitForSingleObject(pSession->hJobDone, INFINITE);
+    return pSession->bJobDropped ? JOB_STOPPING : JOB_DONE;
+}
+
+
+// Process a job, on the main thread
+void SnapshotDaemon::ProcessJob(const Job& job)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    Session* pSession = job.pSession;
+    if (job.type == JOB_CREATE)
+    {
+        DWORD dwRequest = ++m_cRequests;
+        ft.WriteInfoLine(L"Request %lu: Creating shadow copy set of %u volumes...", dwRequest, (unsigned)pSession->volumes.size());
+        try
+        {
+            unique_ptr<VssClient> pClient = TakeClient();
+            pClient->CreateSnapshotSet(pSession->volumes);
+            pSession->snapshotSet = pClient->GetLatestSnapshotSet();
+            pSession->backendName = pClient->GetBackendName();
+            pSession->hr = S_OK;
+            m_clients[pSession] = move(pClient);
+            ft.WriteInfoLine(L"Request %lu: Created shadow copy set %s", dwRequest, pSession->snapshotSet.idString.c_str());
+        }
+        catch (HRESULT hr)
+        {
+            pSession->hr = hr;
+        }
+        catch (bad_alloc)
+        {
+            pSession->hr = E_OUTOFMEMORY;
+        }
+        if (FAILED(pSession->hr))
+            ft.WriteErrorLine(L"Request %lu: Failed with error 0x%08lx", dwRequest, pSession->hr);
+        SetEvent(pSession->hJobDone);
+
+        // Get ready for the next request while the client uses the shadow copies
+        PrepareNextClient();
+    }
+    else
+    {
+        // Releasing the backup components object releases the shadow copies
+        ft.WriteInfoLine(L"Releasing shadow copy set %s...", pSession->snapshotSet.idString.c_str());
+        m_clients.erase(pSession);
+        SetEvent(pSession->hJobDone);
+    }
+}
+
+
+// Take the prepared VSS client, or create one if none is prepared
+unique_ptr<VssClient> SnapshotDaemon::TakeClient()
+{
+    if (m_pNextClient)
+        return move(m_pNextClient);
+    return CreateClient();
+}
+
+
+// Create and initialize a VSS client for the next request in advance
+void SnapshotDaemon::PrepareNextClient()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    if (m_pNextClient)
+        return;
+
+    try
+    {
+        m_pNextClient = CreateClient();
+    }
+    catch (HRESULT hr)
+    {
+        // Tried again, and reported to the client, with the next request
+        ft.WriteErrorLine(L"WARNING: Could not prepare the VSS infrastructure for the next request (0x%08lx)", hr);
+    }
+}
+
+
+// Create and initialize a new VSS client
+unique_ptr<VssClient> SnapshotDaemon::CreateClient()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    unique_ptr<VssClient> pClient(new VssClient());
+    if (m_settings.simulate)
+    {
+        // Each simulated backend generates its own identifiers, so give each its own seed
+        SimulationSettings settings = m_settings.simulationSettings;
+        settings.seed += m_cClientsCreated;
+        pClient->UseSimulatedBackend(settings);
+    }
+    m_cClientsCreated++;
+    pClient->SetAsyncWaitSettings(m_settings.asyncWaitSettings);
+    pClient->InitializeBackend();
+    return pClient;
+}
+
+
+// Stop the running daemon on Ctrl+C, Ctrl+Break and closing of the console
+BOOL WINAPI SnapshotDaemon::ConsoleCtrlHandler(DWORD dwCtrlType)
+{
+    UNREFERENCED_PARAMETER(dwCtrlType);
+    SnapshotDaemon* pDaemon = s_pRunningDaemon;
+    if (pDaemon == NULL)
+        return FALSE;
+    SetEvent(pDaemon->m_hStopEvent);
+    return TRUE;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Client
+//
+
+
+DaemonClient::DaemonClient() :
+    m_hPipe(INVALID_HANDLE_VALUE)
+{
+}
+
+
+DaemonClient::~DaemonClient()
+{
+    if (m_hPipe != INVALID_HANDLE_VALUE)
+        CloseHandle(m_hPipe);
+}
+
+
+// Connect to the daemon
+void DaemonClient::Connect(const wstring& pipeName)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    wstring pipePath = GetDaemonPipePath(pipeName);
+    ft.WriteInfoLine(L"Connecting to the daemon on %s...", pipePath.c_str());
+
+    while (true)
+    {
+        m_hPipe = CreateFile(pipePath.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+        if (m_hPipe != INVALID_HANDLE_VALUE)
+            break;
+
+        // All instances are busy accepting other connections, wait for one
+        DWORD dwError = GetLastError();
+        if (dwError == ERROR_PIPE_BUSY && WaitNamedPipe(pipePath.c_str(), DAEMON_CONNECT_TIMEOUT))
+            continue;
+        if (dwError == ERROR_FILE_NOT_FOUND)
+            ft.WriteErrorLine(L"ERROR: No daemon is listening on %s, start one with -serve!", pipePath.c_str());
+        CHECK_WIN32_ERROR(dwError, L"CreateFile(pipePath.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL)");
+    }
+
+    DWORD dwMode = PIPE_READMODE_MESSAGE;
+    CHECK_WIN32(SetNamedPipeHandleState(m_hPipe, &dwMode, NULL, NULL));
+}
+
+
+// Ask the daemon to create a shadow copy set
+wstring DaemonClient::CreateSnapshotSet(const vector<wstring>& volumeList, SnapshotSetInfo& snapshotSet)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    ft.WriteInfoLine(L"Requesting shadow copy set of %u volumes from the daemon...", (unsigned)volumeList.size());
+
+    vector<wstring> request;
+    request.push_back(L"CREATE " + to_wstring(DAEMON_PROTOCOL_VERSION));
+    request.insert(request.end(), volumeList.begin(), volumeList.end());
+    WriteDaemonMessage(m_hPipe, request);
+
+    vector<wstring> response;
+    if (!ReadDaemonMessage(m_hPipe, response))
+    {
+        ft.WriteErrorLine(L"ERROR: The daemon closed the connection!");
+        throw(HRESULT_FROM_WIN32(ERROR_BROKEN_PIPE));
+    }
+
+    vector<wstring> command = SplitCommand(response);
+    if (command[0] == L"BUSY")
+    {
+        ft.WriteErrorLine(L"ERROR: The daemon has too many requests waiting, try again later!");
+        throw(HRESULT_FROM_WIN32(ERROR_BUSY));
+    }
+    if (command[0] == L"STOPPING")
+    {
+        ft.WriteErrorLine(L"ERROR: The daemon is stopping!");
+        throw(HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED));
+    }
+    if (command[0] == L"FAILED" && command.size() == 2)
+    {
+        HRESULT hr = (HRESULT)wcstoul(command[1].c_str(), NULL, 16);
+        ft.WriteErrorLine(L"ERROR: The daemon could not create the shadow copy set!");
+        ft.WriteErrorLine(L"- Returned HRESULT = 0x%08lx", hr);
+        ft.WriteErrorLine(L"- Error text: %s", FunctionTracer::HResult2String(hr).c_str());
+        throw(hr);
+    }
+    if (command[0] != L"CREATED" || command.size() != 3 || response.size() != volumeList.size() + 1)
+    {
+        ft.WriteErrorLine(L"ERROR: Unexpected response from the daemon '%s'!", response[0].c_str());
+        throw(E_UNEXPECTED);
+    }
+
+    snapshotSet.idString = command[1];
+    snapshotSet.id = WString2Guid(snapshotSet.idString);
+    snapshotSet.snapshots.clear();
+    for (size_t i = 1; i < response.size(); ++i)
+    {
+        size_t separatorPos = response[i].find(L' ');
+        SnapshotInfo snapshot;
+        snapshot.idString = response[i].substr(0, separatorPos);
+        snapshot.id = WString2Guid(snapshot.idString);
+        snapshot.deviceName = (separatorPos == wstring::npos) ? wstring() : response[i].substr(separatorPos + 1);
+        snapshotSet.snapshots.push_back(snapshot);
+    }
+
+    ft.WriteInfoLine(L"The daemon created shadow copy set %s", snapshotSet.idString.c_str());
+    return command[2];
+}
+
+
+// Ask the daemon to release the shadow copy set, and wait for it
+void DaemonClient::Release()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    ft.WriteInfoLine(L"Releasing the shadow copy set...");
+    WriteDaemonMessage(m_hPipe, vector<wstring>{ L"RELEASE" });
+
+    vector<wstring> response;
+    if (!ReadDaemonMessage(m_hPipe, response) || SplitCommand(response)[0] != L"RELEASED")
+        ft.WriteErrorLine(L"WARNING: The daemon did not confirm the release of the shadow copies");
+
+    CloseHandle(m_hPipe);
+    m_hPipe = INVALID_HANDLE_VALUE;
+}
@@ -0,0 +1,237 @@
+#pragma once
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Snapshot daemon
+//
+//  With the -serve option ShadowRun stays resident, and creates shadow copy
+//  sets on request from other ShadowRun processes started with the -connect
+//  option. COM and COM security are initialized once, and the backup
+//  components object for the next request is created and initialized for
+//  backup in advance, so a request only pays for the shadow copy creation
+//  itself. A backup components object can only create a single shadow copy
+//  set, so each request uses its own, and a new one is prepared as soon as
+//  the previous one has been taken.
+//
+//  The requests arrive on a local named pipe, one connection per request.
+//  Each connection is served by its own thread, but all VSS calls are made
+//  by the main thread, which takes the requests from a bounded queue one at
+//  a time, since VSS creates one shadow copy set at a time anyway. A request
+//  arriving while the queue is full is answered with BUSY, and a request
+//  not created because the daemon is stopping with STOPPING.
+//
+//  The shadow copies are auto-release: The daemon keeps them until the
+//  client sends RELEASE or disconnects, then releases the backup components
+//  object, and with it the shadow copies. So a client that crashes does not
+//  leave any shadow copies behind. The command, environment variables,
+//  SETVAR script and mounted drives are all handled by the client.
+//
+//  Protocol: Each message is a single pipe message of UTF-16 text lines
+//  separated by newlines, where the first line is the command followed by
+//  its space separated arguments.
+//
+//      Client                              Daemon
+//      CREATE {version}
+//      {volume}...
+//                                          CREATED {set id} {backend}
+//                                          {shadow copy id} {device}...
+//                                      or  FAILED {hresult}
+//                                      or  BUSY
+//                                      or  STOPPING
+//      RELEASE (or disconnect)
+//                                          RELEASED
+//
+
+// Pipe name used when none is given to -serve or -connect
+const LPCWSTR DAEMON_DEFAULT_PIPE_NAME = L"shadowrun";
+
+// Version of the protocol, sent with each request
+const DWORD DAEMON_PROTOCOL_VERSION = 1;
+
+// Maximum size of a message, in bytes
+const DWORD DAEMON_MAX_MESSAGE_SIZE = 65536;
+
+// Maximum number of requests waiting for the shadow copy creation
+const size_t DAEMON_MAX_QUEUED_REQUESTS = 16;
+
+// Milliseconds the client waits for a free pipe instance
+const DWORD DAEMON_CONNECT_TIMEOUT = 10000;
+
+// Milliseconds to wait for the connections to close when stopping
+const DWORD DAEMON_STOP_TIMEOUT = 10000;
+
+
+// Full path of the named pipe with the given name
+inline wstring GetDaemonPipePath(const wstring& pipeName)
+{
+    return L"\\\\.\\pipe\\" + pipeName;
+}
+
+// Write a message of text lines to a pipe opened for overlapped I/O
+void WriteDaemonMessage(HANDLE hPipe, const vector<wstring>& lines);
+
+// Read a message of text lines from a pipe opened for overlapped I/O
+// Returns false if the other end disconnected, or if the optional stop event was signalled
+bool ReadDaemonMessage(HANDLE hPipe, vector<wstring>& lines, HANDLE hStopEvent = NULL);
+
+
+// Settings for the daemon, given by the other options on the -serve command line
+struct DaemonSettings
+{
+    // Name of the pipe to listen on
+    wstring             pipeName = DAEMON_DEFAULT_PIPE_NAME;
+
+    // Use the simulated backend, with these settings
+    bool                simulate = false;
+    SimulationSettings  simulationSettings;
+
+    // Polling interval and deadlines for the asynchronous operations
+    AsyncWaitSettings   asyncWaitSettings;
+};
+
+
+class SnapshotDaemon
+{
+public:
+
+    SnapshotDaemon(const DaemonSettings& settings);
+
+    ~SnapshotDaemon();
+
+    // Serve requests until stopped with Ctrl+C, releasing all shadow copies before returning
+    void Run();
+
+private:
+
+    // A connection from a client
+    struct Session
+    {
+        SnapshotDaemon*     pDaemon = NULL;
+        HANDLE              hPipe = INVALID_HANDLE_VALUE;
+
+        // Signalled by the main thread when a job of this session is done, or dropped when stopping
+        HANDLE              hJobDone = NULL;
+        bool                bJobDropped = false;
+
+        // Volumes requested, and the result of the creation
+        vector<wstring>     volumes;
+        HRESULT             hr = S_OK;
+        SnapshotSetInfo     snapshotSet;
+        wstring             backendName;
+    };
+
+    enum JobType
+    {
+        JOB_CREATE,
+        JOB_RELEASE,
+    };
+
+    enum JobResult
+    {
+        JOB_DONE,
+        JOB_QUEUE_FULL,
+        JOB_STOPPING,
+    };
+
+    struct Job
+    {
+        JobType             type;
+        Session*            pSession;
+    };
+
+    // Create a pipe instance to wait for the next connection on
+    HANDLE CreatePipeInstance(bool bFirst);
+
+    // Accept connections and start a session thread for each, until stopped
+    static DWORD WINAPI ListenerThread(LPVOID pParameter);
+    void Listen();
+
+    // Serve the request of a single connection
+    static DWORD WINAPI SessionThread(LPVOID pParameter);
+    void ServeSession(Session* pSession);
+
+    // Queue a job for the main thread and wait until it is done, or dropped because the daemon is stopping.
+    // Once queued, the job is always waited for, as the main thread uses the session until then.
+    JobResult RunJob(JobType type, Session* pSession);
+
+    // Process a job taken from the queue, on the main thread
+    void ProcessJob(const Job& job);
+
+    // Take the prepared VSS client, or create one if none is prepared
+    unique_ptr<VssClient> TakeClient();
+
+    // Create and initialize a VSS client for the next request in advance, failures are only logged
+    void PrepareNextClient();
+
+    // Create and initialize a new VSS client
+    unique_ptr<VssClient> CreateClient();
+
+    // Ctrl+C handler, stopping the running daemon
+    static BOOL WINAPI ConsoleCtrlHandler(DWORD dwCtrlType);
+
+    //
+    //  Data members
+    //
+
+    DaemonSettings                      m_settings;
+
+    // Signalled when the daemon is stopping
+    HANDLE                              m_hStopEvent;
+
+    // Signalled when jobs are added to the queue
+    HANDLE                              m_hJobEvent;
+
+    // Signalled when the last session has ended after stopping
+    HANDLE                              m_hSessionsEndedEvent;
+
+    // Protects the job queue and the session count
+    CRITICAL_SECTION                    m_lock;
+    vector<Job>                         m_jobs;
+    size_t                              m_cSessions;
+
+    // Pipe instance waiting for the next connection
+    HANDLE                              m_hListeningPipe;
+
+    // Everything below is only used by the main thread
+
+    // VSS client prepared for the next request
+    unique_ptr<VssClient>               m_pNextClient;
+
+    // VSS clients holding the shadow copy sets, until released by their session
+    map<Session*, unique_ptr<VssClient>> m_clients;
+
+    // Number of VSS clients created, for the seeds of the simulated backends
+    DWORD                               m_cClientsCreated;
+
+    // Number of requests served
+    DWORD                               m_cRequests;
+
+    // The running daemon, for the Ctrl+C handler
+    static SnapshotDaemon*              s_pRunningDaemon;
+};
+
+
+// Client side of the daemon protocol, used with the -connect option
+class DaemonClient
+{
+public:
+
+    DaemonClient();
+
+    // Closing the connection releases the shadow copies
+    ~DaemonClient();
+
+    // Connect to the daemon listening on the pipe with the given name
+    void Connect(const wstring& pipeName);
+
+    // Ask the daemon to create a shadow copy set of the given volumes (unique volume names)
+    // Returns the name of the backend used by the daemon
+    wstring CreateSnapshotSet(const vector<wstring>& volumeList, SnapshotSetInfo& snapshotSet);
+
+    // Ask the daemon to release the shadow copy set, and wait for it
+    void Release();
+
+private:
+
+    HANDLE      m_hPipe;
+};
@@ -0,0 +1,460 @@
+// Main header
+#include "stdafx.h"
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Settings
+//
+
+
+// Parse the settings of the -copy-io option
+void CopySettings::Parse(const wstring& settings)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    vector<wstring> pairs = SplitWString(settings, L',');
+    for (size_t i = 0; i < pairs.size(); ++i)
+    {
+        size_t separatorPos = pairs[i].find(L':');
+        wstring name = pairs[i].substr(0, separatorPos);
+        wstring value = (separatorPos == wstring::npos) ? wstring() : pairs[i].substr(separatorPos + 1);
+        LPWSTR pwszEnd = NULL;
+        DWORD dwValue = wcstoul(value.c_str(), &pwszEnd, 10);
+        if (value.empty() || *pwszEnd != L'\0')
+        {
+            ft.WriteErrorLine(L"ERROR: Invalid copy setting '%s', expected name:number!", pairs[i].c_str());
+            throw(E_INVALIDARG);
+        }
+
+        if (IsEqual(name, L"threads") && dwValue > 0 && dwValue <= COPY_MAX_THREADS)
+            threads = dwValue;
+        else if (IsEqual(name, L"buffer") && dwValue > 0 && dwValue <= COPY_MAX_BUFFER_SIZE / 1024)
+            bufferSize = dwValue * 1024;
+        else
+        {
+            ft.WriteErrorLine(L"ERROR: Unknown or invalid copy setting '%s'!", pairs[i].c_str());
+            throw(E_INVALIDARG);
+        }
+    }
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  File tree copier
+//
+
+
+// Attributes kept on the copies, the others are set by the file system
+static const DWORD COPY_ATTRIBUTES = FILE_ATTRIBUTE_READONLY | FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM
+    | FILE_ATTRIBUTE_ARCHIVE | FILE_ATTRIBUTE_NOT_CONTENT_INDEXED;
+
+
+FileTreeCopier::FileTreeCopier(const CopySettings& settings) :
+    m_settings(settings),
+    m_pending(0),
+    m_hWorkEvent(NULL),
+    m_files(0),
+    m_directories(0),
+    m_bytes(0),
+    m_skipped(0),
+    m_errors(0)
+{
+}
+
+
+FileTreeCopier::~FileTreeCopier()
+{
+    for (size_t i = 0; i < m_workers.size(); ++i)
+    {
+        if (m_workers[i]->pBuffer != NULL)
+            VirtualFree(m_workers[i]->pBuffer, 0, MEM_RELEASE);
+        DeleteCriticalSection(&m_workers[i]->lock);
+    }
+    if (m_hWorkEvent != NULL)
+        CloseHandle(m_hWorkEvent);
+}
+
+
+// Copy the files and directories of each shadow copy of the set
+void FileTreeCopier::CopySnapshotSet(const SnapshotSetInfo& snapshotSet, const wstring& directory)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    if (!CreateDirectory(directory.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+    {
+        DWORD dwLastError = GetLastError();
+        ft.WriteErrorLine(L"ERROR: Could not create the copy directory '%s'!", directory.c_str());
+        CHECK_WIN32_ERROR(dwLastError, L"CreateDirectory");
+    }
+
+    // The root directory of the shadow copy device needs the trailing backslash
+    for (size_t i = 0; i < snapshotSet.snapshots.size(); ++i)
+    {
+        const SnapshotInfo& snapshot = snapshotSet.snapshots[i];
+        Copy(AppendBackslash(snapshot.deviceName), AppendBackslash(directory) + snapshot.idString);
+    }
+}
+
+
+// Copy the files and directories of the source directory into the target directory
+void FileTreeCopier::Copy(const wstring& sourceDirectory, const wstring& targetDirectory)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    // The target may get deeper than MAX_PATH, which needs a full path with the \\?\ prefix
+    wstring target = targetDirectory;
+    if (target.compare(0, 2, L"\\\\") != 0)
+    {
+        DWORD cchFull = GetFullPathName(targetDirectory.c_str(), 0, NULL, NULL);
+        CHECK_WIN32(cchFull != 0);
+        vector<WCHAR> fullPath(cchFull);
+        CHECK_WIN32(GetFullPathName(targetDirectory.c_str(), cchFull, fullPath.data(), NULL) != 0);
+        target = wstring(L"\\\\?\\") + fullPath.data();
+    }
+
+    ft.WriteInfoLine(L"Copying files of %s to %s with %lu threads...", sourceDirectory.c_str(), targetDirectory.c_str(), m_settings.threads);
+    ULONGLONG ullStartTime = GetTickCount64();
+    m_files = m_directories = m_bytes = m_skipped = m_errors = 0;
+
+    if (m_hWorkEvent == NULL)
+    {
+        m_hWorkEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+        CHECK_WIN32(m_hWorkEvent != NULL);
+    }
+    while (m_workers.size() < m_settings.threads)
+    {
+        unique_ptr<Worker> pWorker(new Worker());
+        pWorker->pCopier = this;
+        pWorker->index = m_workers.size();
+        InitializeCriticalSection(&pWorker->lock);
+        pWorker->pBuffer = (BYTE*)VirtualAlloc(NULL, m_settings.bufferSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (pWorker->pBuffer == NULL)
+        {
+            DeleteCriticalSection(&pWorker->lock);
+            throw(E_OUTOFMEMORY);
+        }
+        m_workers.push_back(move(pWorker));
+    }
+
+    // The root directory is the first work, of the first thread, the others steal from there
+    DirectoryNode* pRoot = new DirectoryNode();
+    pRoot->source = AppendBackslash(sourceDirectory);
+    pRoot->target = AppendBackslash(target);
+    WorkItem rootItem;
+    rootItem.pDirectory = pRoot;
+    Push(*m_workers[0], rootItem);
+
+    vector<HANDLE> threads;
+    for (size_t i = 0; i < m_workers.size(); ++i)
+    {
+        m_workers[i]->hThread = CreateThread(NULL, 0, WorkerThread, m_workers[i].get(), 0, NULL);
+        if (m_workers[i]->hThread == NULL)
+        {
+            // The threads already running do all the work
+            ft.WriteInfoLine(L"Could not start more than %u copy threads (0x%08lx)", (unsigned)i, HRESULT_FROM_WIN32(GetLastError()));
+            break;
+        }
+        threads.push_back(m_workers[i]->hThread);
+    }
+    if (threads.empty())
+        Run(*m_workers[0]);
+    else
+        WaitForMultipleObjects((DWORD)threads.size(), threads.data(), TRUE, INFINITE);
+    for (size_t i = 0; i < threads.size(); ++i)
+    {
+        CloseHandle(threads[i]);
+        m_workers[i]->hThread = NULL;
+    }
+
+    double seconds = (GetTickCount64() - ullStartTime) / 1000.0;
+    double megabytes = m_bytes / (1024.0 * 1024.0);
+    ft.WriteInfoLine(L"Copied %llu files (%.1f MB) in %llu directories in %.1f seconds (%.0f files/s, %.1f MB/s), %llu reparse points skipped",
+        (ULONGLONG)m_files, megabytes, (ULONGLONG)m_directories, seconds, (seconds > 0) ? m_files / seconds : 0.0,
+        (seconds > 0) ? megabytes / seconds : 0.0, (ULONGLONG)m_skipped);
+    if (m_errors > 0)
+        ft.WriteInfoLine(L"WARNING: %llu files or directories could not be copied", (ULONGLONG)m_errors);
+}
+
+
+DWORD WINAPI FileTreeCopier::WorkerThread(LPVOID pParameter)
+{
+    Worker* pWorker = (Worker*)pParameter;
+    pWorker->pCopier->Run(*pWorker);
+    return 0;
+}
+
+
+// Do work until there is none left anywhere
+void FileTreeCopier::Run(Worker& worker)
+{
+    while (true)
+    {
+        WorkItem item;
+        if (GetWork(worker, item))
+        {
+            try
+            {
+                if (item.fileName.empty())
+                    ListDirectory(worker, item.pDirectory);
+                else
+                    CopyOneFile(worker, item);
+            }
+            catch (bad_alloc)
+            {
+                ReportError(L"copy", item.fileName.empty() ? item.pDirectory->source : item.pDirectory->source + item.fileName, ERROR_NOT_ENOUGH_MEMORY);
+            }
+
+            // Released also when the work failed, so that the times of the directories above are still set
+            Release(item.pDirectory);
+            if (--m_pending == 0)
+                SetEvent(m_hWorkEvent);
+            continue;
+        }
+
+        // Work being done elsewhere can still queue more, otherwise everything is done
+        if (m_pending == 0)
+            break;
+        WaitForSingleObject(m_hWorkEvent, 10);
+    }
+
+    // Wake another thread waiting, which wakes the next one
+    SetEvent(m_hWorkEvent);
+}
+
+
+// Queue work on the queue of the worker
+void FileTreeCopier::Push(Worker& worker, WorkItem& item)
+{
+    ++m_pending;
+    EnterCriticalSection(&worker.lock);
+    try
+    {
+        worker.work.push_back(move(item));
+    }
+    catch (bad_alloc)
+    {
+        LeaveCriticalSection(&worker.lock);
+        --m_pending;
+        throw;
+    }
+    LeaveCriticalSection(&worker.lock);
+    SetEvent(m_hWorkEvent);
+}
+
+
+// Take work from the queue of the worker, or steal it from another one
+bool FileTreeCopier::GetWork(Worker& worker, WorkItem& item)
+{
+    // The latest work of its own, which keeps the walk depth first and the queues short
+    EnterCriticalSection(&worker.lock);
+    if (!worker.work.empty())
+    {
+        item = move(worker.work.back());
+        worker.work.pop_back();
+        LeaveCriticalSection(&worker.lock);
+        return true;
+    }
+    LeaveCriticalSection(&worker.lock);
+
+    // The oldest work of another one, typically a directory with more work below it
+    for (size_t i = 1; i < m_workers.size(); ++i)
+    {
+        Worker& other = *m_workers[(worker.index + i) % m_workers.size()];
+        EnterCriticalSection(&other.lock);
+        if (!other.work.empty())
+        {
+            item = move(other.work.front());
+            other.work.pop_front();
+            LeaveCriticalSection(&other.lock);
+            return true;
+        }
+        LeaveCriticalSection(&other.lock);
+    }
+    return false;
+}
+
+
+// Create the target directory, and queue the files and subdirectories
+void FileTreeCopier::ListDirectory(Worker& worker, DirectoryNode* pNode)
+{
+    if (!CreateDirectory(pNode->target.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+    {
+        ReportError(L"create directory", pNode->target, GetLastError());
+        return;
+    }
+
+    WIN32_FIND_DATA findData;
+    HANDLE hFind = FindFirstFileEx((pNode->source + L"*").c_str(), FindExInfoBasic, &findData, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+    if (hFind == INVALID_HANDLE_VALUE)
+    {
+        // The root directory of a volume can be empty, without the . and .. entries
+        if (GetLastError() != ERROR_FILE_NOT_FOUND)
+            ReportError(L"list directory", pNode->source, GetLastError());
+        m_directories++;
+        return;
+    }
+    CAutoSearchHandle autoCloseFind(hFind);
+    do
+    {
+        if (wcscmp(findData.cFileName, L".") == 0 || wcscmp(findData.cFileName, L"..") == 0)
+            continue;
+        if (findData.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+        {
+            m_skipped++;
+            continue;
+        }
+
+        // Counted in the directory before it is queued, as it may be done right away by another thread
+        WorkItem item;
+        if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        {
+            DirectoryNode* pChild = new DirectoryNode();
+            pChild->source = pNode->source + findData.cFileName + L"\\";
+            pChild->target = pNode->target + findData.cFileName + L"\\";
+            pChild->attributes = findData.dwFileAttributes;
+            pChild->creationTime = findData.ftCreationTime;
+            pChild->lastAccessTime = findData.ftLastAccessTime;
+            pChild->lastWriteTime = findData.ftLastWriteTime;
+            pChild->pParent = pNode;
+            item.pDirectory = pChild;
+        }
+        else
+        {
+            item.pDirectory = pNode;
+            item.fileName = findData.cFileName;
+            item.ullSize = ((ULONGLONG)findData.nFileSizeHigh << 32) | findData.nFileSizeLow;
+            item.attributes = findData.dwFileAttributes;
+            item.creationTime = findData.ftCreationTime;
+            item.lastAccessTime = findData.ftLastAccessTime;
+            item.lastWriteTime = findData.ftLastWriteTime;
+        }
+        InterlockedIncrement(&pNode->cPending);
+        try
+        {
+            Push(worker, item);
+        }
+        catch (bad_alloc)
+        {
+            // Not queued, the listing still holds the directory
+            InterlockedDecrement(&pNode->cPending);
+            if (item.fileName.empty())
+                delete item.pDirectory;
+            throw;
+        }
+    } while (FindNextFile(hFind, &findData));
+    if (GetLastError() != ERROR_NO_MORE_FILES)
+        ReportError(L"list directory", pNode->source, GetLastError());
+
+    m_directories++;
+}
+
+
+void FileTreeCopier::CopyOneFile(Worker& worker, const WorkItem& item)
+{
+    wstring source = item.pDirectory->source + item.fileName;
+    wstring target = item.pDirectory->target + item.fileName;
+
+    // Backup semantics read files regardless of their security, when running with the backup privilege
+    HANDLE hSource = CreateFile(source.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+        OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (hSource == INVALID_HANDLE_VALUE)
+    {
+        ReportError(L"open", source, GetLastError());
+        return;
+    }
+    CAutoHandle autoCloseSource(hSource);
+
+    HANDLE hTarget = CreateFile(target.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hTarget == INVALID_HANDLE_VALUE)
+    {
+        ReportError(L"create", target, GetLastError());
+        return;
+    }
+
+    // A file larger than the buffer is copied in pieces, with its size allocated first so it is not fragmented as it grows
+    DWORD dwError = NO_ERROR;
+    if (item.ullSize > m_settings.bufferSize)
+    {
+        FILE_END_OF_FILE_INFO endOfFile;
+        endOfFile.EndOfFile.QuadPart = item.ullSize;
+        SetFileInformationByHandle(hTarget, FileEndOfFileInfo, &endOfFile, sizeof(endOfFile));
+    }
+    ULONGLONG ullCopied = 0;
+    while (dwError == NO_ERROR)
+    {
+        DWORD cbRead = 0;
+        if (!ReadFile(hSource, worker.pBuffer, m_settings.bufferSize, &cbRead, NULL))
+            dwError = GetLastError();
+        else if (cbRead == 0)
+            break;
+        else
+        {
+            DWORD cbWritten = 0;
+            if (!WriteFile(hTarget, worker.pBuffer, cbRead, &cbWritten, NULL))
+                dwError = GetLastError();
+            ullCopied += cbRead;
+        }
+    }
+
+    // The size allocated is the size listed, the file may still be smaller
+    if (dwError == NO_ERROR && ullCopied != item.ullSize && !SetEndOfFile(hTarget))
+        dwError = GetLastError();
+    if (dwError == NO_ERROR && !SetFileTime(hTarget, &item.creationTime, &item.lastAccessTime, &item.lastWriteTime))
+        dwError = GetLastError();
+    CloseHandle(hTarget);
+    if (dwError == NO_ERROR && !SetFileAttributes(target.c_str(), (item.attributes & COPY_ATTRIBUTES) ? (item.attributes & COPY_ATTRIBUTES) : FILE_ATTRIBUTE_NORMAL))
+        dwError = GetLastError();
+
+    if (dwError != NO_ERROR)
+        ReportError(L"copy", source, dwError);
+    else
+    {
+        m_files++;
+        m_bytes += ullCopied;
+    }
+}
+
+
+// One piece of work in the directory is done, and if it was the last, the directory too
+void FileTreeCopier::Release(DirectoryNode* pNode)
+{
+    while (pNode != NULL && InterlockedDecrement(&pNode->cPending) == 0)
+    {
+        FinishDirectory(pNode);
+        DirectoryNode* pParent = pNode->pParent;
+        delete pNode;
+        pNode = pParent;
+    }
+}
+
+
+// Set the timestamps and attributes of a target directory
+void FileTreeCopier::FinishDirectory(DirectoryNode* pNode)
+{
+    // The root directory is not from the source tree
+    if (pNode->pParent == NULL)
+        return;
+
+    HANDLE hDirectory = CreateFile(pNode->target.c_str(), FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+        OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (hDirectory == INVALID_HANDLE_VALUE || !SetFileTime(hDirectory, &pNode->creationTime, &pNode->lastAccessTime, &pNode->lastWriteTime))
+        ReportError(L"set the times of", pNode->target, GetLastError());
+    if (hDirectory != INVALID_HANDLE_VALUE)
+        CloseHandle(hDirectory);
+    if ((pNode->attributes & COPY_ATTRIBUTES) != 0 && !SetFileAttributes(pNode->target.c_str(), pNode->attributes & COPY_ATTRIBUTES))
+        ReportError(L"set the attributes of", pNode->target, GetLastError());
+}
+
+
+// Report a file or directory that could not be copied
+void FileTreeCopier::ReportError(LPCWSTR action, const wstring& path, DWORD dwError)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    m_errors++;
+    ft.WriteInfoLine(L"Could not %s %s (0x%08lx)", action, path.c_str(), HRESULT_FROM_WIN32(dwError));
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+
+/////////////////////////////////////////////////////////////////////////
+//  File copy
+//
+//  With the -copy option the files and directories of each shadow copy are
+//  copied to a directory, without needing an external copy tool, which is
+//  typically limited by the time to open each file and to read and write
+//  its metadata, one file at a time. The shadow copy is read through its
+//  device, so it does not have to be mounted.
+//
+//  The directory tree is walked and copied by a number of threads at the
+//  same time, each with its own queue of work: directories to list and
+//  files to copy. A thread takes the latest work from its own queue, which
+//  keeps the queues short, and when its queue is empty it steals the oldest
+//  work from the queue of another thread, which is typically a directory
+//  high in the tree with much more work below it (work stealing). Each
+//  thread copies with its own buffer, a small file with a single read and
+//  write, and a large file in pieces of the buffer size, with its size
+//  allocated first. The timestamps and attributes of files and directories
+//  are kept, those of a directory set when everything in it is done.
+//  Reparse points, e.g. junctions, are neither followed nor copied, and
+//  alternate data streams and security descriptors are not copied. Files
+//  that cannot be copied are reported, and the copy goes on with the rest.
+//
+
+// Default and largest number of threads
+const DWORD COPY_DEFAULT_THREADS = 16;
+const DWORD COPY_MAX_THREADS = 64;
+
+// Default and largest size of the buffer of each thread, in bytes
+const DWORD COPY_DEFAULT_BUFFER_SIZE = 1024 * 1024;
+const DWORD COPY_MAX_BUFFER_SIZE = 64 * 1024 * 1024;
+
+
+// Settings for the copy, given by the -copy-io option on the command line
+struct CopySettings
+{
+    // Number of threads, and the size of the buffer of each
+    DWORD               threads = COPY_DEFAULT_THREADS;
+    DWORD               bufferSize = COPY_DEFAULT_BUFFER_SIZE;
+
+    // Parse a comma separated list of name:value pairs, as given to the -copy-io option:
+    // threads:number and buffer:kilobytes.
+    // Throws E_INVALIDARG on unknown names or invalid values.
+    void Parse(const wstring& settings);
+};
+
+
+// Copies directory trees with a number of threads
+class FileTreeCopier
+{
+public:
+
+    FileTreeCopier(const CopySettings& settings);
+
+    ~FileTreeCopier();
+
+    // Copy the files and directories of each shadow copy of the set to a directory in the directory, named by its shadow copy ID
+    void CopySnapshotSet(const SnapshotSetInfo& snapshotSet, const wstring& directory);
+
+    // Copy the files and directories of the source directory into the target directory, which is created if needed
+    void Copy(const wstring& sourceDirectory, const wstring& targetDirectory);
+
+private:
+
+    // A directory being copied, deleted when everything in it is done
+    struct DirectoryNode
+    {
+        wstring             source;         // With a trailing backslash
+        wstring             target;         // With a trailing backslash
+        DWORD               attributes = 0;
+        FILETIME            creationTime = {};
+        FILETIME            lastAccessTime = {};
+        FILETIME            lastWriteTime = {};
+        DirectoryNode*      pParent = NULL;
+
+        // Work not yet done in the directory: the listing, and each file and subdirectory
+        LONG volatile       cPending = 1;
+    };
+
+    // A directory to list, or a file to copy
+    struct WorkItem
+    {
+        DirectoryNode*      pDirectory = NULL;  // The directory to list, or the directory of the file
+        wstring             fileName;           // Empty for a directory to list
+        ULONGLONG           ullSize = 0;
+        DWORD               attributes = 0;
+        FILETIME            creationTime = {};
+        FILETIME            lastAccessTime = {};
+        FILETIME            lastWriteTime = {};
+    };
+
+    // A copy thread, with its own queue of work and its own buffer
+    struct Worker
+    {
+        FileTreeCopier*     pCopier = NULL;
+        size_t              index = 0;
+        HANDLE              hThread = NULL;
+        BYTE*               pBuffer = NULL;
+        CRITICAL_SECTION    lock;
+        deque<WorkItem>     work;
+    };
+
+    static DWORD WINAPI WorkerThread(LPVOID pParameter);
+
+    // Do work until there is none left anywhere
+    void Run(Worker& worker);
+
+    // Queue work on the queue of the worker
+    void Push(Worker& worker, WorkItem& item);
+
+    // Take work from the queue of the worker, or steal it from another one
+    bool GetWork(Worker& worker, WorkItem& item);
+
+    // Create the target directory, and queue the files and subdirectories.
+    // The listing is released from the directory by the caller, as is the file copied by CopyOneFile.
+    void ListDirectory(Worker& worker, DirectoryNode* pNode);
+
+    void CopyOneFile(Worker& worker, const WorkItem& item);
+
+    // One piece of work in the directory is done, and if it was the last, the directory too
+    void Release(DirectoryNode* pNode);
+
+    // Set the timestamps and attributes of a target directory
+    void FinishDirectory(DirectoryNode* pNode);
+
+    // Report a file or directory that could not be copied
+    void ReportError(LPCWSTR action, const wstring& path, DWORD dwError);
+
+    //
+    //  Data members
+    //
+
+    CopySettings                    m_settings;
+    vector<unique_ptr<Worker>>      m_workers;
+
+    // Work queued or being done, the copy is done when it is zero
+    atomic<LONGLONG>                m_pending;
+
+    // Signalled when work is queued, for the threads without any
+    HANDLE                          m_hWorkEvent;
+
+    atomic<ULONGLONG>               m_files;
+    atomic<ULONGLONG>               m_directories;
+    atomic<ULONGLONG>               m_bytes;
+    atomic<ULONGLONG>               m_skipped;
+    atomic<ULONGLONG>               m_errors;
+};
@@ -0,0 +1,451 @@
+// Main header
+#include "stdafx.h"
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  File indexer
+//
+
+
+static const char FILE_INDEX_MAGIC[8] = { 'S', 'R', 'F', 'I', 'N', 'D', 'E', 'X' };
+static const DWORD FILE_INDEX_VERSION = 1;
+
+
+// Hash of a path, the same for all cases of the letters
+static ULONGLONG HashPath(const WCHAR* pPath, DWORD cchPath)
+{
+    WCHAR upper[MAX_PATH];
+    XxHash64 hash;
+    while (cchPath > 0)
+    {
+        DWORD cchPart = min(cchPath, (DWORD)ARRAYSIZE(upper));
+        memcpy(upper, pPath, cchPart * sizeof(WCHAR));
+        CharUpperBuffW(upper, cchPart);
+        hash.Update((const BYTE*)upper, cchPart * sizeof(WCHAR));
+        pPath += cchPart;
+        cchPath -= cchPart;
+    }
+    return hash.GetHash();
+}
+
+
+// Order of paths with the same hash, ignoring case
+static int ComparePaths(const WCHAR* pPath1, DWORD cchPath1, const WCHAR* pPath2, DWORD cchPath2)
+{
+    return CompareStringOrdinal(pPath1, cchPath1, pPath2, cchPath2, TRUE) - CSTR_EQUAL;
+}
+
+
+// Write a path as a line of UTF-8 after the kind of change
+static void WriteChange(ofstream& changesFile, char kind, const wstring& path)
+{
+    string utf8;
+    int cbUtf8 = WideCharToMultiByte(CP_UTF8, 0, path.c_str(), (int)path.length(), NULL, 0, NULL, NULL);
+    if (cbUtf8 > 0)
+    {
+        utf8.resize(cbUtf8);
+        WideCharToMultiByte(CP_UTF8, 0, path.c_str(), (int)path.length(), &utf8[0], cbUtf8, NULL, NULL);
+    }
+    changesFile << kind << " " << utf8 << "\n";
+}
+
+
+FileIndexer::FileIndexer() :
+    m_pListBuffer(NULL),
+    m_hPreviousFile(INVALID_HANDLE_VALUE),
+    m_hPreviousMapping(NULL),
+    m_pPreviousHeader(NULL),
+    m_pPreviousEntries(NULL),
+    m_pPreviousPaths(NULL)
+{
+}
+
+
+FileIndexer::~FileIndexer()
+{
+    UnmapPrevious();
+    if (m_pListBuffer != NULL)
+        VirtualFree(m_pListBuffer, 0, MEM_RELEASE);
+}
+
+
+// Find the changes of each shadow copy of the set since the previous run
+void FileIndexer::IndexSnapshotSet(const SnapshotSetInfo& snapshotSet, const wstring& directory)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    if (!CreateDirectory(directory.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+    {
+        DWORD dwLastError = GetLastError();
+        ft.WriteErrorLine(L"ERROR: Could not create the index directory '%s'!", directory.c_str());
+        CHECK_WIN32_ERROR(dwLastError, L"CreateDirectory");
+    }
+
+    for (size_t i = 0; i < snapshotSet.snapshots.size(); ++i)
+    {
+        const SnapshotInfo& snapshot = snapshotSet.snapshots[i];
+
+        // The shadow copy has the serial number of its volume, which names the index of the volume
+        wstring rootDirectory = AppendBackslash(snapshot.deviceName);
+        DWORD dwSerialNumber = 0;
+        CHECK_WIN32(GetVolumeInformation(rootDirectory.c_str(), NULL, 0, &dwSerialNumber, NULL, NULL, NULL, 0));
+        WCHAR indexName[32];
+        StringCchPrintf(indexName, ARRAYSIZE(indexName), L"volume-%08lx.index", dwSerialNumber);
+
+        Index(rootDirectory, AppendBackslash(directory) + indexName, AppendBackslash(directory) + snapshot.idString + L".changes", snapshot.id);
+    }
+}
+
+
+// Find the changes of the directory tree since the index was written
+void FileIndexer::Index(const wstring& rootDirectory, const wstring& indexFileName, const wstring& changesFileName, const VSS_ID& snapshotId)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    ft.WriteInfoLine(L"Listing files of %s...", rootDirectory.c_str());
+    ULONGLONG ullStartTime = GetTickCount64();
+    ListTree(rootDirectory);
+    ft.WriteInfoLine(L"Listed %llu files and directories in %.1f seconds", (ULONGLONG)m_entries.size(), (GetTickCount64() - ullStartTime) / 1000.0);
+    if (!m_failedDirectories.empty())
+        ft.WriteInfoLine(L"WARNING: %u directories could not be listed, their entries are kept from the previous index", (unsigned)m_failedDirectories.size());
+
+    // A replacement left by an interrupted run is incomplete, the index it was to replace is still there
+    wstring newFileName = indexFileName + L".new";
+    DeleteFile(newFileName.c_str());
+    if (MapPrevious(indexFileName))
+        ft.WriteInfoLine(L"Comparing with index %s of shadow copy %s...", indexFileName.c_str(), Guid2WString(m_pPreviousHeader->snapshotId).c_str());
+    else
+        ft.WriteInfoLine(L"No previous index %s, all files and directories are added", indexFileName.c_str());
+    Compare(changesFileName);
+    UnmapPrevious();
+
+    WriteIndex(newFileName, snapshotId);
+    CHECK_WIN32(MoveFileEx(newFileName.c_str(), indexFileName.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH));
+
+    m_entries.clear();
+    m_paths.clear();
+    m_failedDirectories.clear();
+}
+
+
+// List the directory tree into m_entries, sorted
+void FileIndexer::ListTree(const wstring& rootDirectory)
+{
+    if (m_pListBuffer == NULL)
+    {
+        m_pListBuffer = (BYTE*)VirtualAlloc(NULL, INDEX_LIST_BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (m_pListBuffer == NULL)
+            throw(E_OUTOFMEMORY);
+    }
+
+    // Depth first, the paths are relative to the root without a leading backslash
+    vector<wstring> directories;
+    directories.push_back(wstring());
+    while (!directories.empty())
+    {
+        wstring directoryPath = directories.back();
+        directories.pop_back();
+        ListDirectory(rootDirectory, directoryPath, directories);
+    }
+
+    // Sorted by hash, and the paths with the same hash by path
+    const WCHAR* pPaths = m_paths.data();
+    sort(m_entries.begin(), m_entries.end(), [pPaths](const FileIndexEntry& entry1, const FileIndexEntry& entry2)
+    {
+        if (entry1.pathHash != entry2.pathHash)
+            return entry1.pathHash < entry2.pathHash;
+        return ComparePaths(pPaths + entry1.pathOffset, entry1.pathLength, pPaths + entry2.pathOffset, entry2.pathLength) < 0;
+    });
+}
+
+
+// Add the entries of a directory, and queue its subdirectories
+void FileIndexer::ListDirectory(const wstring& rootDirectory, const wstring& directoryPath, vector<wstring>& subdirectories)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    // Backup semantics open directories regardless of their security, when running with the backup privilege
+    HANDLE hDirectory = CreateFile((rootDirectory + directoryPath).c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (hDirectory == INVALID_HANDLE_VALUE)
+    {
+        ft.WriteInfoLine(L"Could not list directory %s%s (0x%08lx)", rootDirectory.c_str(), directoryPath.c_str(), HRESULT_FROM_WIN32(GetLastError()));
+        m_failedDirectories.push_back(directoryPath);
+        return;
+    }
+    CAutoHandle autoCloseDirectory(hDirectory);
+
+    // Each request fills the buffer with as many entries as fit
+    FILE_INFO_BY_HANDLE_CLASS infoClass = FileIdBothDirectoryRestartInfo;
+    while (GetFileInformationByHandleEx(hDirectory, infoClass, m_pListBuffer, INDEX_LIST_BUFFER_SIZE))
+    {
+        infoClass = FileIdBothDirectoryInfo;
+        for (BYTE* pNext = m_pListBuffer; pNext != NULL; )
+        {
+            FILE_ID_BOTH_DIR_INFO* pInfo = (FILE_ID_BOTH_DIR_INFO*)pNext;
+            pNext = (pInfo->NextEntryOffset != 0) ? pNext + pInfo->NextEntryOffset : NULL;
+
+            DWORD cchName = pInfo->FileNameLength / sizeof(WCHAR);
+            if ((cchName == 1 && pInfo->FileName[0] == L'.') || (cchName == 2 && pInfo->FileName[0] == L'.' && pInfo->FileName[1] == L'.'))
+                continue;
+
+            FileIndexEntry entry;
+            entry.pathOffset = m_paths.size();
+            if (!directoryPath.empty())
+            {
+                m_paths.insert(m_paths.end(), directoryPath.begin(), directoryPath.end());
+                m_paths.push_back(L'\\');
+            }
+            m_paths.insert(m_paths.end(), pInfo->FileName, pInfo->FileName + cchName);
+            entry.pathLength = (DWORD)(m_paths.size() - entry.pathOffset);
+            entry.pathHash = HashPath(m_paths.data() + entry.pathOffset, entry.pathLength);
+            entry.size = pInfo->EndOfFile.QuadPart;
+            entry.lastWriteTime = pInfo->LastWriteTime.QuadPart;
+            entry.fileId = pInfo->FileId.QuadPart;
+            entry.attributes = pInfo->FileAttributes;
+            m_entries.push_back(entry);
+
+            // Reparse points, e.g. junctions, are listed but not followed
+            if ((entry.attributes & FILE_ATTRIBUTE_DIRECTORY) && !(entry.attributes & FILE_ATTRIBUTE_REPARSE_POINT))
+                subdirectories.push_back(wstring(m_paths.data() + entry.pathOffset, entry.pathLength));
+        }
+    }
+    DWORD dwLastError = GetLastError();
+    if (dwLastError != ERROR_NO_MORE_FILES)
+    {
+        ft.WriteInfoLine(L"Could not list directory %s%s (0x%08lx)", rootDirectory.c_str(), directoryPath.c_str(), HRESULT_FROM_WIN32(dwLastError));
+        m_failedDirectories.push_back(directoryPath);
+    }
+}
+
+
+// Map the previous index, returns false if there is none
+bool FileIndexer::MapPrevious(const wstring& indexFileName)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    m_hPreviousFile = CreateFile(indexFileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (m_hPreviousFile == INVALID_HANDLE_VALUE)
+    {
+        DWORD dwLastError = GetLastError();
+        if (dwLastError == ERROR_FILE_NOT_FOUND)
+            return false;
+        ft.WriteErrorLine(L"ERROR: Could not open the index file '%s'!", indexFileName.c_str());
+        CHECK_WIN32_ERROR(dwLastError, L"CreateFile");
+    }
+    LARGE_INTEGER fileSize;
+    CHECK_WIN32(GetFileSizeEx(m_hPreviousFile, &fileSize));
+    if ((ULONGLONG)fileSize.QuadPart < sizeof(Header))
+    {
+        ft.WriteErrorLine(L"ERROR: The index file '%s' is not valid!", indexFileName.c_str());
+        throw(HRESULT_FROM_WIN32(ERROR_FILE_CORRUPT));
+    }
+
+    m_hPreviousMapping = CreateFileMapping(m_hPreviousFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    CHECK_WIN32(m_hPreviousMapping != NULL);
+    m_pPreviousHeader = (const Header*)MapViewOfFile(m_hPreviousMapping, FILE_MAP_READ, 0, 0, 0);
+    CHECK_WIN32(m_pPreviousHeader != NULL);
+    m_pPreviousEntries = (const FileIndexEntry*)(m_pPreviousHeader + 1);
+    m_pPreviousPaths = (const WCHAR*)(m_pPreviousEntries + m_pPreviousHeader->count);
+
+    // The entries are checked as they are compared, so that the paths are within the file
+    ULONGLONG ullCount = m_pPreviousHeader->count;
+    ULONGLONG cchPaths = m_pPreviousHeader->pathsLength;
+    if (memcmp(m_pPreviousHeader->magic, FILE_INDEX_MAGIC, sizeof(m_pPreviousHeader->magic)) != 0 || m_pPreviousHeader->version != FILE_INDEX_VERSION
+        || ullCount > (ULONGLONG)fileSize.QuadPart / sizeof(FileIndexEntry) || cchPaths > (ULONGLONG)fileSize.QuadPart / sizeof(WCHAR)
+        || sizeof(Header) + ullCount * sizeof(FileIndexEntry) + cchPaths * sizeof(WCHAR) != (ULONGLONG)fileSize.QuadPart)
+    {
+        ft.WriteErrorLine(L"ERROR: The index file '%s' is not valid!", indexFileName.c_str());
+        throw(HRESULT_FROM_WIN32(ERROR_FILE_CORRUPT));
+    }
+    return true;
+}
+
+
+void FileIndexer::UnmapPrevious()
+{
+    if (m_pPreviousHeader != NULL)
+        UnmapViewOfFile(m_pPreviousHeader);
+    if (m_hPreviousMapping != NULL)
+        CloseHandle(m_hPreviousMapping);
+    if (m_hPreviousFile != INVALID_HANDLE_VALUE)
+        CloseHandle(m_hPreviousFile);
+    m_pPreviousHeader = NULL;
+    m_pPreviousEntries = NULL;
+    m_pPreviousPaths = NULL;
+    m_hPreviousMapping = NULL;
+    m_hPreviousFile = INVALID_HANDLE_VALUE;
+}
+
+
+// True if the path is in a directory that could not be listed
+bool FileIndexer::IsInFailedDirectory(const wstring& path) const
+{
+    for (size_t i = 0; i < m_failedDirectories.size(); ++i)
+    {
+        const wstring& directory = m_failedDirectories[i];
+        if (directory.empty())
+            return true;
+        if (path.length() > directory.length() && path[directory.length()] == L'\\'
+            && CompareStringOrdinal(path.c_str(), (int)directory.length(), directory.c_str(), (int)directory.length(), TRUE) == CSTR_EQUAL)
+            return true;
+    }
+    return false;
+}
+
+
+// Compare the new entries with those of the previous index, and write the changes
+void FileIndexer::Compare(const wstring& changesFileName)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    wstring tempFileName = changesFileName + L".tmp";
+    ofstream changesFile(tempFileName.c_str(), ios::out | ios::trunc | ios::binary);
+    if (!changesFile)
+    {
+        ft.WriteErrorLine(L"ERROR: Could not create the changes file '%s'!", tempFileName.c_str());
+        throw(HRESULT_FROM_WIN32(ERROR_CANNOT_MAKE));
+    }
+
+    ULONGLONG ullAdded = 0, ullChanged = 0, ullDeleted = 0, ullKept = 0;
+    size_t cNew = m_entries.size();
+    ULONGLONG ullPreviousCount = (m_pPreviousHeader != NULL) ? m_pPreviousHeader->count : 0;
+    ULONGLONG cchPreviousPaths = (m_pPreviousHeader != NULL) ? m_pPreviousHeader->pathsLength : 0;
+    size_t i = 0;
+    ULONGLONG j = 0;
+    while (i < cNew || j < ullPreviousCount)
+    {
+        // Both lists are in the same order, so each entry is only compared with the current one of the other
+        int order;
+        if (j == ullPreviousCount)
+            order = -1;
+        else
+        {
+            const FileIndexEntry& previous = m_pPreviousEntries[j];
+            if (previous.pathOffset > cchPreviousPaths || previous.pathLength > cchPreviousPaths - previous.pathOffset)
+            {
+                ft.WriteErrorLine(L"ERROR: The index file of the previous run is not valid!");
+                throw(HRESULT_FROM_WIN32(ERROR_FILE_CORRUPT));
+            }
+            if (i == cNew)
+                order = 1;
+            else if (m_entries[i].pathHash != previous.pathHash)
+                order = (m_entries[i].pathHash < previous.pathHash) ? -1 : 1;
+            else
+                order = ComparePaths(m_paths.data() + m_entries[i].pathOffset, m_entries[i].pathLength,
+                    m_pPreviousPaths + previous.pathOffset, previous.pathLength);
+        }
+
+        if (order < 0)
+        {
+            WriteChange(changesFile, 'A', GetPath(m_entries[i]));
+            ullAdded++;
+            i++;
+        }
+        else if (order > 0)
+        {
+            // An entry not listed because its directory could not be listed is kept as it was, in the new index too
+            FileIndexEntry entry = m_pPreviousEntries[j];
+            wstring path = GetPreviousPath(entry);
+            if (IsInFailedDirectory(path))
+            {
+                entry.pathOffset = m_paths.size();
+                m_paths.insert(m_paths.end(), path.begin(), path.end());
+                m_entries.push_back(entry);
+                ullKept++;
+            }
+            else
+            {
+                WriteChange(changesFile, 'D', path);
+                ullDeleted++;
+            }
+            j++;
+        }
+        else
+        {
+            // A directory is changed only if it is not a directory any more, its times change with its files
+            const FileIndexEntry& current = m_entries[i];
+            const FileIndexEntry& previous = m_pPreviousEntries[j];
+            bool bDirectory = (current.attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+            if (bDirectory != ((previous.attributes & FILE_ATTRIBUTE_DIRECTORY) != 0)
+                || (!bDirectory && (current.size != previous.size || current.lastWriteTime != previous.lastWriteTime || current.fileId != previous.fileId)))
+            {
+                WriteChange(changesFile, 'M', GetPath(current));
+                ullChanged++;
+            }
+            i++;
+            j++;
+        }
+    }
+
+    // The entries kept were added in order, after the new ones
+    if (ullKept > 0)
+    {
+        const WCHAR* pPaths = m_paths.data();
+        inplace_merge(m_entries.begin(), m_entries.begin() + cNew, m_entries.end(), [pPaths](const FileIndexEntry& entry1, const FileIndexEntry& entry2)
+        {
+            if (entry1.pathHash != entry2.pathHash)
+                return entry1.pathHash < entry2.pathHash;
+            return ComparePaths(pPaths + entry1.pathOffset, entry1.pathLength, pPaths + entry2.pathOffset, entry2.pathLength) < 0;
+        });
+    }
+
+    changesFile.close();
+    if (changesFile.fail())
+    {
+        ft.WriteErrorLine(L"ERROR: Could not write the changes file '%s'!", tempFileName.c_str());
+        throw(HRESULT_FROM_WIN32(ERROR_WRITE_FAULT));
+    }
+    CHECK_WIN32(MoveFileEx(tempFileName.c_str(), changesFileName.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH));
+
+    ft.WriteInfoLine(L"Wrote changes %s: %llu added, %llu changed, %llu deleted, %llu kept from directories not listed",
+        changesFileName.c_str(), ullAdded, ullChanged, ullDeleted, ullKept);
+}
+
+
+// Write the new entries as the index
+void FileIndexer::WriteIndex(const wstring& indexFileName, const VSS_ID& snapshotId)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    HANDLE hFile = CreateFile(indexFileName.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        DWORD dwLastError = GetLastError();
+        ft.WriteErrorLine(L"ERROR: Could not create the index file '%s'!", indexFileName.c_str());
+        CHECK_WIN32_ERROR(dwLastError, L"CreateFile");
+    }
+    CAutoHandle autoCloseFile(hFile);
+
+    Header header = {};
+    memcpy(header.magic, FILE_INDEX_MAGIC, sizeof(header.magic));
+    header.version = FILE_INDEX_VERSION;
+    header.count = m_entries.size();
+    header.pathsLength = m_paths.size();
+    header.snapshotId = snapshotId;
+
+    // Written in pieces, which can be larger than a single write can take
+    const BYTE* parts[3] = { (const BYTE*)&header, (const BYTE*)m_entries.data(), (const BYTE*)m_paths.data() };
+    ULONGLONG partSizes[3] = { sizeof(header), m_entries.size() * sizeof(FileIndexEntry), m_paths.size() * sizeof(WCHAR) };
+    for (int part = 0; part < 3; ++part)
+    {
+        const BYTE* pData = parts[part];
+        ULONGLONG cbLeft = partSizes[part];
+        while (cbLeft > 0)
+        {
+            DWORD cbWrite = (DWORD)min(cbLeft, (ULONGLONG)(64 * 1024 * 1024));
+            DWORD cbWritten = 0;
+            if (!WriteFile(hFile, pData, cbWrite, &cbWritten, NULL))
+            {
+                DWORD dwLastError = GetLastError();
+                ft.WriteErrorLine(L"ERROR: Could not write the index file '%s'!", indexFileName.c_str());
+                CHECK_WIN32_ERROR(dwLastError, L"WriteFile");
+            }
+            pData += cbWritten;
+            cbLeft -= cbWritten;
+        }
+    }
+    CHECK_WIN32(FlushFileBuffers(hFile));
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+
+/////////////////////////////////////////////////////////////////////////
+//  File index
+//
+//  With the -changes option the files and directories of each shadow copy
+//  are listed and compared with an index of the previous run, kept in a
+//  directory, so that an incremental backup only has to look at the files
+//  added, changed and deleted since then, instead of comparing the whole
+//  tree itself. The shadow copy is read through its device, so it does not
+//  have to be mounted, and each directory is listed with its file IDs,
+//  sizes and times in a few large requests.
+//
+//  The index is a file for each volume, named by its serial number, which
+//  a shadow copy has in common with its volume, with a header, an entry for
+//  each file and directory sorted by the hash of its path (XXH64 of the
+//  path in upper case, as paths are not case sensitive), then the paths.
+//  The previous index is memory-mapped and compared with the sorted entries
+//  of the new listing in a single pass (merge join), writing the changes to
+//  a text file, a line for each with "A" (added), "M" (changed) or "D"
+//  (deleted) and the path. A file is changed if its size, last write time
+//  or file ID is not the same, the latter when the file was replaced by
+//  another one. The entries of directories that could not be listed are
+//  kept from the previous index, instead of being reported deleted. The
+//  new index replaces the previous one when the changes are written.
+//
+//  The directory has the following files:
+//
+//      volume-{serial}.index   Index of the latest run for the volume
+//      {shadow id}.changes     Changes since the previous run, as UTF-8
+//
+
+// Size of the buffer for the listing of a directory
+const DWORD INDEX_LIST_BUFFER_SIZE = 64 * 1024;
+
+
+// Entry of a file or directory in the index
+struct FileIndexEntry
+{
+    ULONGLONG           pathHash;
+    ULONGLONG           size;
+    ULONGLONG           lastWriteTime;
+    ULONGLONG           fileId;
+    ULONGLONG           pathOffset;     // In characters, from the start of the paths
+    DWORD               pathLength;     // In characters, without a terminating zero
+    DWORD               attributes;
+};
+
+
+// Lists the files of shadow copies and compares them with the index of the previous run
+class FileIndexer
+{
+public:
+
+    FileIndexer();
+
+    ~FileIndexer();
+
+    // Find the changes of each shadow copy of the set since the previous run, with the index in the directory
+    void IndexSnapshotSet(const SnapshotSetInfo& snapshotSet, const wstring& directory);
+
+    // Find the changes of the directory tree since the index was written, write them to the changes file, and replace the index
+    void Index(const wstring& rootDirectory, const wstring& indexFileName, const wstring& changesFileName, const VSS_ID& snapshotId);
+
+private:
+
+    // Header of the index file, followed by the entries and the paths
+    struct Header
+    {
+        char            magic[8];
+        DWORD           version;
+        DWORD           reserved1;
+        ULONGLONG       count;
+        ULONGLONG       pathsLength;    // In characters
+        VSS_ID          snapshotId;     // The shadow copy listed
+        BYTE            reserved2[24];
+    };
+
+    // List the directory tree into m_entries, sorted
+    void ListTree(const wstring& rootDirectory);
+
+    // Add the entries of a directory, and queue its subdirectories
+    void ListDirectory(const wstring& rootDirectory, const wstring& directoryPath, vector<wstring>& subdirectories);
+
+    // Map the previous index, returns false if there is none
+    bool MapPrevious(const wstring& indexFileName);
+
+    void UnmapPrevious();
+
+    // Compare the new entries with those of the previous index, and write the changes
+    void Compare(const wstring& changesFileName);
+
+    // Write the new entries as the index
+    void WriteIndex(const wstring& indexFileName, const VSS_ID& snapshotId);
+
+    // Path of an entry, of the new listing or of the previous index
+    wstring GetPath(const FileIndexEntry& entry) const { return wstring(m_paths.data() + entry.pathOffset, entry.pathLength); }
+    wstring GetPreviousPath(const FileIndexEntry& entry) const { return wstring(m_pPreviousPaths + entry.pathOffset, entry.pathLength); }
+
+    // True if the path is in a directory that could not be listed
+    bool IsInFailedDirectory(const wstring& path) const;
+
+    //
+    //  Data members
+    //
+
+    // The new listing, sorted when complete, and the directories that could not be listed
+    vector<FileIndexEntry>          m_entries;
+    vector<WCHAR>                   m_paths;
+    vector<wstring>                 m_failedDirectories;
+    BYTE*                           m_pListBuffer;
+
+    // The previous index, mapped
+    HANDLE                          m_hPreviousFile;
+    HANDLE                          m_hPreviousMapping;
+    const Header*                   m_pPreviousHeader;
+    const FileIndexEntry*           m_pPreviousEntries;
+    const WCHAR*                    m_pPreviousPaths;
+};
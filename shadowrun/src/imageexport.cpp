@@ -0,0 +1,552 @@
+// Main header
+#include "stdafx.h"
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Utilities
+//
+
+
+// DeviceIoControl on a handle opened for overlapped I/O, waiting for it to complete
+BOOL DeviceIoControlWait(HANDLE hDevice, DWORD dwIoControlCode, LPVOID lpInBuffer, DWORD nInBufferSize, LPVOID lpOutBuffer, DWORD nOutBufferSize, LPDWORD lpBytesReturned)
+{
+    OVERLAPPED overlapped = {};
+    overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (overlapped.hEvent == NULL)
+        return FALSE;
+    CAutoHandle autoCloseEvent(overlapped.hEvent);
+
+    if (!DeviceIoControl(hDevice, dwIoControlCode, lpInBuffer, nInBufferSize, lpOutBuffer, nOutBufferSize, lpBytesReturned, &overlapped)
+        && GetLastError() != ERROR_IO_PENDING)
+        return FALSE;
+    return GetOverlappedResult(hDevice, &overlapped, lpBytesReturned, TRUE);
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Settings
+//
+
+
+// Parse the settings of the -export-io option
+void ExportSettings::Parse(const wstring& settings)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    vector<wstring> pairs = SplitWString(settings, L',');
+    for (size_t i = 0; i < pairs.size(); ++i)
+    {
+        size_t separatorPos = pairs[i].find(L':');
+        wstring name = pairs[i].substr(0, separatorPos);
+        wstring value = (separatorPos == wstring::npos) ? wstring() : pairs[i].substr(separatorPos + 1);
+
+        // The compression algorithm and the checksums are given by name, all the others are numbers
+        if (IsEqual(name, L"compress"))
+        {
+            if (IsEqual(value, L"none"))
+                compression = 0;
+            else if (IsEqual(value, L"xpress"))
+                compression = COMPRESS_ALGORITHM_XPRESS;
+            else if (IsEqual(value, L"huff"))
+                compression = COMPRESS_ALGORITHM_XPRESS_HUFF;
+            else if (IsEqual(value, L"mszip"))
+                compression = COMPRESS_ALGORITHM_MSZIP;
+            else if (IsEqual(value, L"lzms"))
+                compression = COMPRESS_ALGORITHM_LZMS;
+            else
+            {
+                ft.WriteErrorLine(L"ERROR: Unknown compression '%s', expected none, xpress, huff, mszip or lzms!", value.c_str());
+                throw(E_INVALIDARG);
+            }
+            continue;
+        }
+        if (IsEqual(name, L"checksum"))
+        {
+            if (IsEqual(value, L"none"))
+                checksums = 0;
+            else if (IsEqual(value, L"crc32c"))
+                checksums = MANIFEST_CRC32C;
+            else if (IsEqual(value, L"xxh64"))
+                checksums = MANIFEST_XXH64;
+            else if (IsEqual(value, L"all"))
+                checksums = MANIFEST_CRC32C | MANIFEST_XXH64;
+            else
+            {
+                ft.WriteErrorLine(L"ERROR: Unknown checksum '%s', expected none, crc32c, xxh64 or all!", value.c_str());
+                throw(E_INVALIDARG);
+            }
+            continue;
+        }
+
+        LPWSTR pwszEnd = NULL;
+        DWORD dwValue = wcstoul(value.c_str(), &pwszEnd, 10);
+        if (value.empty() || *pwszEnd != L'\0')
+        {
+            ft.WriteErrorLine(L"ERROR: Invalid export setting '%s', expected name:number!", pairs[i].c_str());
+            throw(E_INVALIDARG);
+        }
+
+        if (IsEqual(name, L"block") && dwValue > 0 && dwValue <= EXPORT_MAX_BLOCK_SIZE / 1024 && (dwValue * 1024) % EXPORT_BLOCK_ALIGNMENT == 0)
+            blockSize = dwValue * 1024;
+        else if (IsEqual(name, L"depth") && dwValue > 0 && dwValue <= EXPORT_MAX_QUEUE_DEPTH)
+            queueDepth = dwValue;
+        else if (IsEqual(name, L"sparse") && dwValue <= 1)
+            sparse = (dwValue == 1);
+        else if (IsEqual(name, L"used") && dwValue <= 1)
+            usedOnly = (dwValue == 1);
+        else if (IsEqual(name, L"threads") && dwValue <= COMPRESSION_MAX_THREADS)
+            compressThreads = dwValue;
+        else
+        {
+            ft.WriteErrorLine(L"ERROR: Unknown or invalid export setting '%s'!", pairs[i].c_str());
+            throw(E_INVALIDARG);
+        }
+    }
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Image file sink
+//
+
+
+ImageFileSink::ImageFileSink(const wstring& fileName, bool bSparse) :
+    m_fileName(fileName),
+    m_bSparse(bSparse),
+    m_hFile(INVALID_HANDLE_VALUE),
+    m_ullSize(0),
+    m_ullBytesWritten(0),
+    m_ullBytesSkipped(0)
+{
+}
+
+
+ImageFileSink::~ImageFileSink()
+{
+    if (m_hFile != INVALID_HANDLE_VALUE)
+        CloseHandle(m_hFile);
+}
+
+
+void ImageFileSink::Begin(ULONGLONG ullDeviceSize)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    m_hFile = CreateFile(m_fileName.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (m_hFile == INVALID_HANDLE_VALUE)
+    {
+        DWORD dwLastError = GetLastError();
+        ft.WriteErrorLine(L"ERROR: Could not create the image file '%s'!", m_fileName.c_str());
+        CHECK_WIN32_ERROR(dwLastError, L"CreateFile");
+    }
+
+    if (m_bSparse)
+    {
+        // Not all file systems support sparse files, then the holes are just written as zeros
+        DWORD cbReturned = 0;
+        if (!DeviceIoControl(m_hFile, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &cbReturned, NULL))
+        {
+            ft.WriteInfoLine(L"The image file cannot be sparse (0x%08lx), writing all blocks", HRESULT_FROM_WIN32(GetLastError()));
+            m_bSparse = false;
+        }
+    }
+    m_ullSize = ullDeviceSize;
+}
+
+
+void ImageFileSink::Write(ULONGLONG ullOffset, const BYTE* pData, DWORD cbData)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    if (m_bSparse && IsZeroBlock(pData, cbData))
+    {
+        m_ullBytesSkipped += cbData;
+        return;
+    }
+
+    // Blocks are written in order, but there may be holes before this one
+    LARGE_INTEGER offset;
+    offset.QuadPart = ullOffset;
+    CHECK_WIN32(SetFilePointerEx(m_hFile, offset, NULL, FILE_BEGIN));
+    DWORD cbWritten = 0;
+    CHECK_WIN32(WriteFile(m_hFile, pData, cbData, &cbWritten, NULL));
+    m_ullBytesWritten += cbWritten;
+}
+
+
+void ImageFileSink::End()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    // Any hole at the end still counts in the size of the image
+    LARGE_INTEGER size;
+    size.QuadPart = m_ullSize;
+    CHECK_WIN32(SetFilePointerEx(m_hFile, size, NULL, FILE_BEGIN));
+    CHECK_WIN32(SetEndOfFile(m_hFile));
+    CloseHandle(m_hFile);
+    m_hFile = INVALID_HANDLE_VALUE;
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Device reader
+//
+
+
+DeviceReader::DeviceReader(const ExportSettings& settings) :
+    m_settings(settings),
+    m_hDevice(INVALID_HANDLE_VALUE),
+    m_ullSize(0),
+    m_ullBytesRead(0)
+{
+}
+
+
+DeviceReader::~DeviceReader()
+{
+    CancelReads();
+    for (size_t i = 0; i < m_slots.size(); ++i)
+    {
+        if (m_slots[i].pBuffer != NULL)
+            VirtualFree(m_slots[i].pBuffer, 0, MEM_RELEASE);
+        if (m_slots[i].overlapped.hEvent != NULL)
+            CloseHandle(m_slots[i].overlapped.hEvent);
+    }
+    if (m_hDevice != INVALID_HANDLE_VALUE)
+        CloseHandle(m_hDevice);
+}
+
+
+// Open the device
+void DeviceReader::Open(const wstring& deviceName)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    m_deviceName = deviceName;
+    m_hDevice = CreateFile(deviceName.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+        FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED, NULL);
+    if (m_hDevice == INVALID_HANDLE_VALUE)
+    {
+        DWORD dwLastError = GetLastError();
+        ft.WriteErrorLine(L"ERROR: Could not open the device %s!", deviceName.c_str());
+        CHECK_WIN32_ERROR(dwLastError, L"CreateFile");
+    }
+
+    GET_LENGTH_INFORMATION lengthInfo;
+    DWORD cbReturned = 0;
+    CHECK_WIN32(DeviceIoControlWait(m_hDevice, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0, &lengthInfo, sizeof(lengthInfo), &cbReturned));
+    m_ullSize = lengthInfo.Length.QuadPart;
+    ft.WriteDebugLine(L"Device %s is %llu bytes", deviceName.c_str(), m_ullSize);
+}
+
+
+// Read the entire device, passing each block in order to the sink
+void DeviceReader::Read(ExportSink& sink)
+{
+    Extent extent;
+    extent.offset = 0;
+    extent.length = m_ullSize;
+    Read(vector<Extent>(1, extent), sink);
+}
+
+
+// Read the given extents of the device, passing each block in order to the sink
+void DeviceReader::Read(const vector<Extent>& extents, ExportSink& sink)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    // The buffers are page aligned, which is enough for unbuffered reads with any sector size
+    m_slots.resize(m_settings.queueDepth);
+    for (size_t i = 0; i < m_slots.size(); ++i)
+    {
+        if (m_slots[i].pBuffer == NULL)
+        {
+            m_slots[i].pBuffer = (BYTE*)VirtualAlloc(NULL, m_settings.blockSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+            if (m_slots[i].pBuffer == NULL)
+                throw(E_OUTOFMEMORY);
+        }
+        if (m_slots[i].overlapped.hEvent == NULL)
+        {
+            m_slots[i].overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+            CHECK_WIN32(m_slots[i].overlapped.hEvent != NULL);
+        }
+    }
+
+    sink.Begin(m_ullSize);
+    try
+    {
+        ReadExtents(extents, sink);
+    }
+    catch (...)
+    {
+        CancelReads();
+        throw;
+    }
+    sink.End();
+}
+
+
+// Read the given extents of the device, keeping the reads outstanding across extents
+void DeviceReader::ReadExtents(const vector<Extent>& extents, ExportSink& sink)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    // Position of the next read, as the extent and the offset within it
+    size_t iExtent = 0;
+    ULONGLONG ullExtentOffset = 0;
+    auto startNextRead = [&](Slot& slot) -> bool
+    {
+        while (iExtent < extents.size() && ullExtentOffset >= extents[iExtent].length)
+        {
+            ++iExtent;
+            ullExtentOffset = 0;
+        }
+        if (iExtent >= extents.size())
+            return false;
+        DWORD cbRead = (DWORD)min((ULONGLONG)m_settings.blockSize, extents[iExtent].length - ullExtentOffset);
+        StartRead(slot, extents[iExtent].offset + ullExtentOffset, cbRead);
+        ullExtentOffset += cbRead;
+        return true;
+    };
+
+    // The slots are used round-robin, so waiting for them in the same order gives the blocks in order
+    for (size_t i = 0; i < m_slots.size(); ++i)
+    {
+        if (!startNextRead(m_slots[i]))
+            break;
+    }
+
+    size_t iSlot = 0;
+    while (m_slots[iSlot].bPending)
+    {
+        Slot& slot = m_slots[iSlot];
+        WaitForRead(slot);
+        m_ullBytesRead += slot.cbRead;
+        sink.Write(slot.ullOffset, slot.pBuffer, slot.cbRead);
+        startNextRead(slot);
+        iSlot = (iSlot + 1) % m_slots.size();
+    }
+}
+
+
+// Start a read into the slot
+void DeviceReader::StartRead(Slot& slot, ULONGLONG ullOffset, DWORD cbRead)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    slot.ullOffset = ullOffset;
+    slot.cbRead = cbRead;
+    slot.overlapped.Offset = (DWORD)ullOffset;
+    slot.overlapped.OffsetHigh = (DWORD)(ullOffset >> 32);
+    ResetEvent(slot.overlapped.hEvent);
+    if (!ReadFile(m_hDevice, slot.pBuffer, cbRead, NULL, &slot.overlapped) && GetLastError() != ERROR_IO_PENDING)
+    {
+        DWORD dwLastError = GetLastError();
+        ft.WriteErrorLine(L"ERROR: Could not read %lu bytes at offset %llu of %s!", cbRead, ullOffset, m_deviceName.c_str());
+        CHECK_WIN32_ERROR(dwLastError, L"ReadFile");
+    }
+    slot.bPending = true;
+}
+
+
+// Wait for the read of the slot to complete
+void DeviceReader::WaitForRead(Slot& slot)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    DWORD cbTransferred = 0;
+    BOOL bResult = GetOverlappedResult(m_hDevice, &slot.overlapped, &cbTransferred, TRUE);
+    DWORD dwLastError = GetLastError();
+    slot.bPending = false;
+    if (!bResult)
+    {
+        ft.WriteErrorLine(L"ERROR: Could not read %lu bytes at offset %llu of %s!", slot.cbRead, slot.ullOffset, m_deviceName.c_str());
+        CHECK_WIN32_ERROR(dwLastError, L"ReadFile");
+    }
+    if (cbTransferred != slot.cbRead)
+    {
+        ft.WriteErrorLine(L"ERROR: Read only %lu of %lu bytes at offset %llu of %s!", cbTransferred, slot.cbRead, slot.ullOffset, m_deviceName.c_str());
+        throw(HRESULT_FROM_WIN32(ERROR_HANDLE_EOF));
+    }
+}
+
+
+// Cancel and wait for all outstanding reads
+void DeviceReader::CancelReads()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    // The buffers must not be released while the reads into them are still outstanding
+    for (size_t i = 0; i < m_slots.size(); ++i)
+    {
+        if (m_slots[i].bPending)
+        {
+            CancelIoEx(m_hDevice, &m_slots[i].overlapped);
+            DWORD cbTransferred = 0;
+            GetOverlappedResult(m_hDevice, &m_slots[i].overlapped, &cbTransferred, TRUE);
+            m_slots[i].bPending = false;
+        }
+    }
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Image exporter
+//
+
+
+ImageExporter::ImageExporter(const ExportSettings& settings) :
+    m_settings(settings)
+{
+}
+
+
+// Export each shadow copy of the set to an image file in the directory, or the changes since a previous shadow copy
+void ImageExporter::ExportSnapshotSet(const SnapshotSetInfo& snapshotSet, const wstring& directory, const vector<SnapshotInfo>* pPrevious)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    if (!CreateDirectory(directory.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+    {
+        DWORD dwLastError = GetLastError();
+        ft.WriteErrorLine(L"ERROR: Could not create the export directory '%s'!", directory.c_str());
+        CHECK_WIN32_ERROR(dwLastError, L"CreateDirectory");
+    }
+
+    for (size_t i = 0; i < snapshotSet.snapshots.size(); ++i)
+    {
+        const SnapshotInfo& snapshot = snapshotSet.snapshots[i];
+        wstring fileBase = AppendBackslash(directory) + snapshot.idString;
+
+        // Without a previous shadow copy to compare with, the full image is the change
+        if (pPrevious != NULL && i < pPrevious->size() && !(*pPrevious)[i].deviceName.empty())
+        {
+            BlockDiffer differ(m_settings);
+            if (differ.Diff(snapshot, (*pPrevious)[i], fileBase))
+                continue;
+        }
+        Export(snapshot.deviceName, fileBase + L".img");
+    }
+}
+
+
+// Export a device to an image file
+void ImageExporter::Export(const wstring& deviceName, const wstring& fileName)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    ft.WriteInfoLine(L"Exporting %s to image file %s%s...", deviceName.c_str(), fileName.c_str(), (m_settings.compression != 0) ? L".cmp" : L"");
+    ULONGLONG ullStartTime = GetTickCount64();
+
+    DeviceReader reader(m_settings);
+    reader.Open(deviceName);
+
+    // The free clusters are left out, as holes in a sparse image or zeros in a regular one
+    if (m_settings.compression != 0)
+    {
+        CompressedFileSink sink(fileName + L".cmp", m_settings);
+        ReadImage(reader, sink, fileName);
+
+        double seconds = (GetTickCount64() - ullStartTime) / 1000.0;
+        double megabytes = reader.GetBytesRead() / (1024.0 * 1024.0);
+        ft.WriteInfoLine(L"Exported %.1f MB of %.1f MB in %.1f seconds (%.1f MB/s), compressed with %s to %.1f MB and %.1f MB of zeros left out",
+            megabytes, reader.GetSize() / (1024.0 * 1024.0), seconds, (seconds > 0) ? megabytes / seconds : 0.0,
+            GetCompressionName(m_settings.compression), sink.GetBytesWritten() / (1024.0 * 1024.0), sink.GetBytesSkipped() / (1024.0 * 1024.0));
+        return;
+    }
+
+    ImageFileSink sink(fileName, m_settings.sparse);
+    ReadImage(reader, sink, fileName);
+
+    double seconds = (GetTickCount64() - ullStartTime) / 1000.0;
+    double megabytes = reader.GetBytesRead() / (1024.0 * 1024.0);
+    ft.WriteInfoLine(L"Exported %.1f MB of %.1f MB in %.1f seconds (%.1f MB/s), %.1f MB written and %.1f MB of zeros left sparse",
+        megabytes, reader.GetSize() / (1024.0 * 1024.0), seconds, (seconds > 0) ? megabytes / seconds : 0.0,
+        sink.GetBytesWritten() / (1024.0 * 1024.0), sink.GetBytesSkipped() / (1024.0 * 1024.0));
+}
+
+
+// Export each shadow copy of the set into the chunk store in the directory
+void ImageExporter::StoreSnapshotSet(const SnapshotSetInfo& snapshotSet, const wstring& directory)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    ChunkStore store;
+    store.Open(directory);
+
+    for (size_t i = 0; i < snapshotSet.snapshots.size(); ++i)
+    {
+        const SnapshotInfo& snapshot = snapshotSet.snapshots[i];
+        wstring recipeFileName = AppendBackslash(directory) + snapshot.idString + L".recipe";
+        ft.WriteInfoLine(L"Storing %s with recipe %s...", snapshot.deviceName.c_str(), recipeFileName.c_str());
+        ULONGLONG ullStartTime = GetTickCount64();
+        ULONGLONG ullBytesAdded = store.GetBytesAdded();
+        ULONGLONG ullBytesFound = store.GetBytesFound();
+
+        DeviceReader reader(m_settings);
+        reader.Open(snapshot.deviceName);
+
+        // The free clusters are left out of the recipe, like chunks of zeros
+        ChunkStoreSink sink(store, recipeFileName);
+        ostringstream header;
+        header << "shadow " << WString2String(snapshot.idString) << "\n";
+        header << "set " << WString2String(snapshotSet.idString) << "\n";
+        sink.SetHeader(header.str());
+        ReadDevice(reader, sink);
+
+        double seconds = (GetTickCount64() - ullStartTime) / 1000.0;
+        double megabytes = reader.GetBytesRead() / (1024.0 * 1024.0);
+        ft.WriteInfoLine(L"Stored %.1f MB of %.1f MB in %.1f seconds (%.1f MB/s), %llu chunks, %.1f MB new, %.1f MB already in the store and %.1f MB of zeros",
+            megabytes, reader.GetSize() / (1024.0 * 1024.0), seconds, (seconds > 0) ? megabytes / seconds : 0.0, sink.GetChunkCount(),
+            (store.GetBytesAdded() - ullBytesAdded) / (1024.0 * 1024.0), (store.GetBytesFound() - ullBytesFound) / (1024.0 * 1024.0),
+            sink.GetBytesSkipped() / (1024.0 * 1024.0));
+    }
+    ft.WriteInfoLine(L"The store has %llu chunks", store.GetChunkCount());
+}
+
+
+// Read the device into the sink
+void ImageExporter::ReadDevice(DeviceReader& reader, ExportSink& sink)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    vector<Extent> extents;
+    VolumeBitmap bitmap;
+    if (m_settings.usedOnly && bitmap.GetUsedExtents(reader.GetHandle(), reader.GetSize(), extents))
+    {
+        ft.WriteInfoLine(L"Reading %llu clusters in use of %lu bytes, in %u extents...",
+            bitmap.GetUsedClusters(), bitmap.GetClusterSize(), (unsigned)extents.size());
+        reader.Read(extents, sink);
+    }
+    else
+    {
+        if (m_settings.usedOnly)
+            ft.WriteInfoLine(L"The clusters in use are only known for NTFS volumes, reading the entire device...");
+        reader.Read(sink);
+    }
+}
+
+
+// Read the device into the sink of an image file, and write the manifest of the image if so configured
+void ImageExporter::ReadImage(DeviceReader& reader, ExportSink& sink, const wstring& fileName)
+{
+    if (m_settings.checksums == 0)
+    {
+        ReadDevice(reader, sink);
+        return;
+    }
+
+    // The checksums are of the image, not of the compressed file
+    ManifestSink manifestSink(sink, fileName + L".manifest", m_settings.checksums);
+    ReadDevice(reader, manifestSink);
+}
@@ -0,0 +1,203 @@
+#pragma once
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Image export
+//
+//  With the -export option ShadowRun copies the block device of each
+//  shadow copy in the set to an image file, without needing any external
+//  tool. The device is read with unbuffered reads of large blocks into
+//  page aligned buffers, keeping a number of reads outstanding at the same
+//  time (the queue depth), and the blocks are passed on in order to a sink
+//  writing the image file, while the next reads are already in progress.
+//
+//  The image is raw: The byte at a given offset in the image is the byte
+//  at the same offset of the volume. By default it is also sparse: Blocks
+//  of only zeros are not written, and take no space on disk. Optionally
+//  only the clusters in use are read, see VolumeBitmap, and the free ones
+//  are left as holes.
+//
+
+// Default size of each read, and number of reads outstanding at the same time
+const DWORD EXPORT_DEFAULT_BLOCK_SIZE = 1024 * 1024;
+const DWORD EXPORT_DEFAULT_QUEUE_DEPTH = 8;
+
+// Block sizes must be a multiple of this, to keep the unbuffered reads aligned with any sector size
+const DWORD EXPORT_BLOCK_ALIGNMENT = 64 * 1024;
+
+// Largest block size and queue depth allowed
+const DWORD EXPORT_MAX_BLOCK_SIZE = 64 * 1024 * 1024;
+const DWORD EXPORT_MAX_QUEUE_DEPTH = 64;
+
+
+// DeviceIoControl on a handle opened for overlapped I/O, waiting for it to complete
+// Returns FALSE with the last error set on failure, like DeviceIoControl
+BOOL DeviceIoControlWait(HANDLE hDevice, DWORD dwIoControlCode, LPVOID lpInBuffer, DWORD nInBufferSize, LPVOID lpOutBuffer, DWORD nOutBufferSize, LPDWORD lpBytesReturned);
+
+
+// Settings for the export, given by the -export-io option on the command line
+struct ExportSettings
+{
+    // Size of each read, and number of reads outstanding at the same time
+    DWORD               blockSize = EXPORT_DEFAULT_BLOCK_SIZE;
+    DWORD               queueDepth = EXPORT_DEFAULT_QUEUE_DEPTH;
+
+    // Do not write blocks of only zeros to the image file
+    bool                sparse = true;
+
+    // Only read the clusters in use of NTFS volumes, leaving the free clusters as zeros in the image file
+    bool                usedOnly = false;
+
+    // Compress the image and delta files with this COMPRESS_ALGORITHM_*, zero if not, on this number of threads, zero for one per processor
+    DWORD               compression = 0;
+    DWORD               compressThreads = 0;
+
+    // Checksums of the images to write to a manifest next to them, MANIFEST_* flags, zero if none
+    DWORD               checksums = 0;
+
+    // Parse a comma separated list of name:value pairs, as given to the -export-io option:
+    // block:kilobytes, depth:number, sparse:0 or 1, used:0 or 1, compress:none, xpress, huff, mszip or lzms, threads:number
+    // and checksum:none, crc32c, xxh64 or all.
+    // Throws E_INVALIDARG on unknown names or invalid values.
+    void Parse(const wstring& settings);
+};
+
+
+// Receives the blocks read from a device, in order of their offsets
+class ExportSink
+{
+public:
+
+    virtual ~ExportSink() {}
+
+    // Called before the first block, with the size of the device
+    virtual void Begin(ULONGLONG ullDeviceSize) = 0;
+
+    // Called for each block read
+    virtual void Write(ULONGLONG ullOffset, const BYTE* pData, DWORD cbData) = 0;
+
+    // Called after the last block
+    virtual void End() = 0;
+};
+
+
+// Writes the blocks to a raw image file, optionally sparse
+class ImageFileSink : public ExportSink
+{
+public:
+
+    ImageFileSink(const wstring& fileName, bool bSparse);
+
+    ~ImageFileSink();
+
+    virtual void Begin(ULONGLONG ullDeviceSize);
+    virtual void Write(ULONGLONG ullOffset, const BYTE* pData, DWORD cbData);
+    virtual void End();
+
+    // Bytes written to the file, and bytes left as sparse holes
+    ULONGLONG GetBytesWritten() { return m_ullBytesWritten; }
+    ULONGLONG GetBytesSkipped() { return m_ullBytesSkipped; }
+
+private:
+
+    wstring         m_fileName;
+    bool            m_bSparse;
+    HANDLE          m_hFile;
+    ULONGLONG       m_ullSize;
+    ULONGLONG       m_ullBytesWritten;
+    ULONGLONG       m_ullBytesSkipped;
+};
+
+
+// Reads a block device with unbuffered overlapped reads
+class DeviceReader
+{
+public:
+
+    DeviceReader(const ExportSettings& settings);
+
+    // Cancels and waits for any outstanding reads
+    ~DeviceReader();
+
+    // Open the device, e.g. the device name of a shadow copy
+    void Open(const wstring& deviceName);
+
+    // Size of the device, and bytes read from it, in bytes
+    ULONGLONG GetSize() { return m_ullSize; }
+    ULONGLONG GetBytesRead() { return m_ullBytesRead; }
+
+    // Handle of the open device
+    HANDLE GetHandle() { return m_hDevice; }
+
+    // Read the entire device, passing each block in order to the sink
+    void Read(ExportSink& sink);
+
+    // Read only the given extents of the device, in order of their offsets, passing each block in order to the sink
+    void Read(const vector<Extent>& extents, ExportSink& sink);
+
+private:
+
+    // A buffer with the read being done into it
+    struct Slot
+    {
+        BYTE*           pBuffer = NULL;
+        OVERLAPPED      overlapped = {};
+        ULONGLONG       ullOffset = 0;
+        DWORD           cbRead = 0;
+        bool            bPending = false;
+    };
+
+    // Read the given extents of the device, keeping the reads outstanding across extents
+    void ReadExtents(const vector<Extent>& extents, ExportSink& sink);
+
+    // Start a read into the slot
+    void StartRead(Slot& slot, ULONGLONG ullOffset, DWORD cbRead);
+
+    // Wait for the read of the slot to complete
+    void WaitForRead(Slot& slot);
+
+    // Cancel and wait for all outstanding reads
+    void CancelReads();
+
+    //
+    //  Data members
+    //
+
+    ExportSettings          m_settings;
+
+    wstring                 m_deviceName;
+    HANDLE                  m_hDevice;
+    ULONGLONG               m_ullSize;
+    ULONGLONG               m_ullBytesRead;
+
+    vector<Slot>            m_slots;
+};
+
+
+// Export each shadow copy of a set to an image file, or into a chunk store
+class ImageExporter
+{
+public:
+
+    ImageExporter(const ExportSettings& settings);
+
+    // Export each shadow copy of the set to an image file in the directory, named by its shadow copy ID,
+    // or if given a previous shadow copy of each, in the same order, the changes since it, see BlockDiffer
+    void ExportSnapshotSet(const SnapshotSetInfo& snapshotSet, const wstring& directory, const vector<SnapshotInfo>* pPrevious = NULL);
+
+    // Export a device to an image file
+    void Export(const wstring& deviceName, const wstring& fileName);
+
+    // Export each shadow copy of the set into the chunk store in the directory, with a recipe named by its shadow copy ID
+    void StoreSnapshotSet(const SnapshotSetInfo& snapshotSet, const wstring& directory);
+
+private:
+
+    // Read the device into the sink, only the clusters in use if so configured and known
+    void ReadDevice(DeviceReader& reader, ExportSink& sink);
+
+    // Read the device into the sink of an image file, and write the manifest of the image if so configured
+    void ReadImage(DeviceReader& reader, ExportSink& sink, const wstring& fileName);
+
+    ExportSettings          m_settings;
+};
@@ -0,0 +1,138 @@
+// Main header
+#include "stdafx.h"
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Job pool
+//
+
+
+JobPool::JobPool(VssClient& client, DWORD maxConcurrency, OutputCapture* pCapture) :
+    m_client(client),
+    m_maxConcurrency(min(max(maxConcurrency, (DWORD)1), JOBPOOL_MAX_CONCURRENCY)),
+    m_pCapture(pCapture)
+{
+}
+
+
+// Add a job for the given shadow copies, as indexes in the set
+void JobPool::Add(const vector<size_t>& snapshotIndexes)
+{
+    Job job;
+    job.snapshotIndexes = snapshotIndexes;
+    m_jobs.push_back(job);
+}
+
+
+// Run the command once for each job, and print a summary
+DWORD JobPool::Run(const wstring& command, const vector<wstring>& arguments, bool quoteArguments, bool expandArguments)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    ft.WriteInfoLine(L"Running %u jobs, %lu at a time...", (unsigned)m_jobs.size(), m_maxConcurrency);
+    ULONGLONG ullStartTime = GetTickCount64();
+
+    // Process handles of the running jobs, and the index of their job
+    vector<HANDLE> processes;
+    vector<size_t> running;
+
+    size_t iNextJob = 0;
+    while (iNextJob < m_jobs.size() || !processes.empty())
+    {
+        // Start jobs until the limit is reached
+        while (iNextJob < m_jobs.size() && processes.size() < m_maxConcurrency)
+        {
+            Job& job = m_jobs[iNextJob];
+            try
+            {
+                m_client.SetJobEnvironment(iNextJob, m_jobs.size(), job.snapshotIndexes);
+                job.ullStartTime = GetTickCount64();
+                HANDLE hProcess = m_pCapture
+                    ? m_pCapture->StartCommand(L"job " + to_wstring(iNextJob + 1), command, arguments, quoteArguments, expandArguments)
+                    : StartCommand(command, arguments, quoteArguments, expandArguments);
+                processes.push_back(hProcess);
+                running.push_back(iNextJob);
+            }
+            catch (HRESULT hr)
+            {
+                job.hr = hr;
+            }
+            ++iNextJob;
+        }
+
+        if (processes.empty())
+            continue;
+
+        // Wait for any of the running jobs to exit
+        DWORD dwWait = WaitForMultipleObjects((DWORD)processes.size(), processes.data(), FALSE, INFINITE);
+        if (dwWait >= WAIT_OBJECT_0 + processes.size())
+        {
+            // Should not happen, but do not leave the commands behind without their handles
+            DWORD dwLastError = GetLastError();
+            for (size_t i = 0; i < processes.size(); ++i)
+                WaitForCommand(processes[i]);
+            CHECK_WIN32_ERROR(dwLastError, L"WaitForMultipleObjects");
+        }
+
+        size_t iDone = dwWait - WAIT_OBJECT_0;
+        Job& job = m_jobs[running[iDone]];
+        job.ullExecTime = GetTickCount64() - job.ullStartTime;
+        if (!GetExitCodeProcess(processes[iDone], &job.dwExitCode))
+            job.hr = HRESULT_FROM_WIN32(GetLastError());
+        CloseHandle(processes[iDone]);
+        ft.WriteInfoLine(L"Job %u completed with exit code %lu", (unsigned)running[iDone] + 1, job.dwExitCode);
+
+        processes.erase(processes.begin() + iDone);
+        running.erase(running.begin() + iDone);
+    }
+
+    // The summary comes after the last output of the jobs
+    if (m_pCapture)
+        m_pCapture->Flush();
+
+    PrintSummary(GetTickCount64() - ullStartTime);
+
+    // Errors starting the command are errors of ShadowRun, not of the command
+    DWORD dwExitCode = 0;
+    for (size_t i = 0; i < m_jobs.size(); ++i)
+    {
+        if (FAILED(m_jobs[i].hr))
+            throw(m_jobs[i].hr);
+        if (dwExitCode == 0)
+            dwExitCode = m_jobs[i].dwExitCode;
+    }
+    return dwExitCode;
+}
+
+
+// Print the timings and results of the jobs
+void JobPool::PrintSummary(ULONGLONG ullElapsed)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    ft.WriteInfoLine(L"-----------------------------------------------------");
+    ft.WriteInfoLine(L"Job  Volumes  Command  Result");
+    ULONGLONG ullExecTotal = 0;
+    for (size_t i = 0; i < m_jobs.size(); ++i)
+    {
+        const Job& job = m_jobs[i];
+
+        WCHAR result[32];
+        if (FAILED(job.hr))
+            StringCchPrintfW(result, ARRAYSIZE(result), L"error 0x%08lx", job.hr);
+        else
+            StringCchPrintfW(result, ARRAYSIZE(result), L"exit code %lu", job.dwExitCode);
+
+        ft.WriteInfoLine(L"%3u  %7u  %6.1fs  %s",
+            (unsigned)i + 1,
+            (unsigned)job.snapshotIndexes.size(),
+            job.ullExecTime / 1000.0,
+            result);
+        ullExecTotal += job.ullExecTime;
+    }
+
+    ft.WriteInfoLine(L"Completed %u jobs in %.1f seconds (%.1f seconds of commands)",
+        (unsigned)m_jobs.size(), ullElapsed / 1000.0, ullExecTotal / 1000.0);
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Job pool
+//
+//  With the -jobs or -shard options ShadowRun runs the command once for
+//  each shadow copy, or for each group (shard) of shadow copies, of the
+//  same shadow copy set, instead of once for the whole set. The jobs run
+//  concurrently, up to a limit, so several volumes can be copied from the
+//  same point in time in parallel.
+//
+//  Each job sees the environment variables of the set as if the set only
+//  contained its own shadow copies, numbered from 1, so a command written
+//  for a single volume works unchanged: SHADOW_SET_COUNT, SHADOW_ID_n,
+//  SHADOW_DEVICE_n and SHADOW_DRIVE_n. In addition SHADOW_JOB is the
+//  number of the job, from 1, and SHADOW_JOB_COUNT the number of jobs.
+//
+//  All jobs are started and waited for by the calling thread: The process
+//  environment is changed and the command started for one job at a time,
+//  and the running jobs are waited for with a single wait.
+//
+
+// Maximum number of jobs running at the same time, limited by the wait
+const DWORD JOBPOOL_MAX_CONCURRENCY = MAXIMUM_WAIT_OBJECTS;
+
+
+class JobPool
+{
+public:
+
+    // Run the jobs for the shadow copies of the current set of the client,
+    // with at most the given number of jobs running at the same time,
+    // and their output captured if given an output capture
+    JobPool(VssClient& client, DWORD maxConcurrency, OutputCapture* pCapture = NULL);
+
+    // Add a job for the given shadow copies, as indexes in the set
+    void Add(const vector<size_t>& snapshotIndexes);
+
+    // Run the command once for each job, and print a summary
+    // Returns the first non-zero exit code of the jobs, in the order the jobs were added,
+    // and throws the error of the first job that could not be started, if any
+    DWORD Run(const wstring& command, const vector<wstring>& arguments, bool quoteArguments, bool expandArguments);
+
+private:
+
+    struct Job
+    {
+        vector<size_t>      snapshotIndexes;
+
+        // Result
+        HRESULT             hr = S_OK;
+        DWORD               dwExitCode = 0;
+
+        // Milliseconds running the command
+        ULONGLONG           ullStartTime = 0;
+        ULONGLONG           ullExecTime = 0;
+    };
+
+    // Print the timings and results of the jobs
+    void PrintSummary(ULONGLONG ullElapsed);
+
+    //
+    //  Data members
+    //
+
+    VssClient&                  m_client;
+
+    DWORD                       m_maxConcurrency;
+
+    OutputCapture*              m_pCapture;
+
+    vector<Job>                 m_jobs;
+};
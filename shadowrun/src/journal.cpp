@@ -0,0 +1,271 @@
+// Main header
+#include "stdafx.h"
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Settings
+//
+
+
+// Parse the settings of the -journal option
+void JournalSettings::Parse(const wstring& settings)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    vector<wstring> pairs = SplitWString(settings, L',');
+    for (size_t i = 0; i < pairs.size(); ++i)
+    {
+        size_t separatorPos = pairs[i].find(L':');
+        wstring name = pairs[i].substr(0, separatorPos);
+        wstring value = (separatorPos == wstring::npos) ? wstring() : pairs[i].substr(separatorPos + 1);
+        if (value.empty())
+        {
+            ft.WriteErrorLine(L"ERROR: Invalid journal setting '%s', expected name:value!", pairs[i].c_str());
+            throw(E_INVALIDARG);
+        }
+
+        LPWSTR pwszEnd = NULL;
+        DWORD dwValue = wcstoul(value.c_str(), &pwszEnd, 10);
+        if (IsEqual(name, L"directory"))
+            directory = value;
+        else if (IsEqual(name, L"crash-at") && *pwszEnd == L'\0' && dwValue > 0)
+            crashAt = dwValue;
+        else
+        {
+            ft.WriteErrorLine(L"ERROR: Unknown or invalid journal setting '%s'!", pairs[i].c_str());
+            throw(E_INVALIDARG);
+        }
+    }
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Cleanup journal
+//
+
+
+static const WCHAR JOURNAL_FILE_PATTERN[] = L"ShadowRun-*.journal";
+
+
+// Checksum of a record, with the checksum itself being zero
+template<class T> static DWORD GetRecordChecksum(const T& record)
+{
+    T copy = record;
+    copy.crc32c = 0;
+    return Crc32c(0, (const BYTE*)&copy, sizeof(copy));
+}
+
+
+CleanupJournal::CleanupJournal(const JournalSettings& settings) :
+    m_settings(settings),
+    m_hFile(INVALID_HANDLE_VALUE),
+    m_step(0)
+{
+    if (settings.directory.empty())
+    {
+        WCHAR wszTempPath[MAX_PATH + 1];
+        DWORD cchTempPath = GetTempPath(ARRAYSIZE(wszTempPath), wszTempPath);
+        m_directory = AppendBackslash(wstring(wszTempPath, (cchTempPath < ARRAYSIZE(wszTempPath)) ? cchTempPath : 0)) + L"ShadowRun\\";
+    }
+    else
+        m_directory = AppendBackslash(settings.directory);
+}
+
+
+CleanupJournal::~CleanupJournal()
+{
+    // Kept, as it is not known if everything in it has been undone
+    Close(false);
+}
+
+
+// Undo what ended processes left behind according to their journals
+void CleanupJournal::Recover(VssBackend* pBackend)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    WIN32_FIND_DATA findData;
+    HANDLE hFind = FindFirstFile((m_directory + JOURNAL_FILE_PATTERN).c_str(), &findData);
+    if (hFind == INVALID_HANDLE_VALUE)
+        return;
+    CAutoSearchHandle autoCloseFind(hFind);
+    do
+    {
+        wstring fileName = m_directory + findData.cFileName;
+        if (fileName != m_fileName && Replay(fileName, pBackend))
+            ft.WriteDebugLine(L"Replayed journal %s", fileName.c_str());
+    } while (FindNextFile(hFind, &findData));
+}
+
+
+// Undo what is recorded in the journal file
+bool CleanupJournal::Replay(const wstring& fileName, VssBackend* pBackend)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    // The journal of a running process is open, and cannot be opened here
+    HANDLE hFile = CreateFile(fileName.c_str(), GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+    vector<JournalRecord> records;
+    {
+        CAutoHandle autoCloseFile(hFile);
+        JournalRecord record;
+        DWORD cbRead = 0;
+        while (ReadFile(hFile, &record, sizeof(record), &cbRead, NULL) && cbRead == sizeof(record) && record.crc32c == GetRecordChecksum(record))
+        {
+            record.drive[ARRAYSIZE(record.drive) - 1] = L'\0';
+            record.deviceName[ARRAYSIZE(record.deviceName) - 1] = L'\0';
+            records.push_back(record);
+        }
+    }
+    ft.WriteInfoLine(L"Recovering from an interrupted run, with journal %s...", fileName.c_str());
+
+    // The mounts not removed are removed, the latest first
+    for (size_t i = records.size(); i-- > 0; )
+    {
+        if (records[i].kind != JOURNAL_MOUNT)
+            continue;
+        bool bUnmounted = false;
+        for (size_t j = i + 1; j < records.size() && !bUnmounted; ++j)
+        {
+            bUnmounted = records[j].kind == JOURNAL_UNMOUNT && wcscmp(records[j].drive, records[i].drive) == 0
+                && wcscmp(records[j].deviceName, records[i].deviceName) == 0;
+        }
+        if (bUnmounted)
+            continue;
+
+        // Only the definition of the shadow copy is removed, not something else defined on the drive since
+        if (DefineDosDevice(DDD_REMOVE_DEFINITION | DDD_EXACT_MATCH_ON_REMOVE, records[i].drive, records[i].deviceName))
+            ft.WriteInfoLine(L"- Unmounted shadow copy %s (%s)", records[i].drive, records[i].deviceName);
+        else
+            ft.WriteDebugLine(L"- Shadow copy %s (%s) was not mounted (0x%08lx)", records[i].drive, records[i].deviceName, HRESULT_FROM_WIN32(GetLastError()));
+    }
+
+    // The non-persistent shadow copies are normally deleted by VSS when their process ends
+    for (size_t i = 0; i < records.size(); ++i)
+    {
+        if (records[i].kind != JOURNAL_SNAPSHOT_SET)
+            continue;
+        wstring setIdString = Guid2WString(records[i].setId);
+        if (pBackend == NULL)
+        {
+            ft.WriteDebugLine(L"- Shadow copy set %s left to VSS", setIdString.c_str());
+            continue;
+        }
+        LONG lDeleted = 0;
+        VSS_ID nondeletedId = GUID_NULL;
+        HRESULT hr = pBackend->DeleteSnapshots(records[i].setId, VSS_OBJECT_SNAPSHOT_SET, TRUE, &lDeleted, &nondeletedId);
+        if (hr == VSS_E_OBJECT_NOT_FOUND)
+            ft.WriteDebugLine(L"- Shadow copy set %s is already deleted", setIdString.c_str());
+        else if (SUCCEEDED(hr))
+            ft.WriteInfoLine(L"- Deleted %ld shadow copies of set %s", lDeleted, setIdString.c_str());
+        else
+            ft.WriteInfoLine(L"- Could not delete shadow copy set %s (0x%08lx)", setIdString.c_str(), hr);
+    }
+
+    // Everything that can be undone is undone, and doing it again would not change anything
+    if (!DeleteFile(fileName.c_str()))
+        ft.WriteInfoLine(L"Could not delete journal %s (0x%08lx)", fileName.c_str(), HRESULT_FROM_WIN32(GetLastError()));
+    return true;
+}
+
+
+// Create the journal of this process
+void CleanupJournal::Open()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    if (!CreateDirectory(m_directory.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+    {
+        DWORD dwLastError = GetLastError();
+        ft.WriteErrorLine(L"ERROR: Could not create the journal directory '%s'!", m_directory.c_str());
+        CHECK_WIN32_ERROR(dwLastError, L"CreateDirectory");
+    }
+
+    // Named by the process and the time, as a process ID can be used again
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    WCHAR fileName[64];
+    StringCchPrintf(fileName, ARRAYSIZE(fileName), L"ShadowRun-%lu-%08lx%08lx.journal", GetCurrentProcessId(), now.dwHighDateTime, now.dwLowDateTime);
+    m_fileName = m_directory + fileName;
+
+    // Not shared, which tells the recovery of other processes that this one is running
+    m_hFile = CreateFile(m_fileName.c_str(), GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_WRITE_THROUGH, NULL);
+    if (m_hFile == INVALID_HANDLE_VALUE)
+    {
+        DWORD dwLastError = GetLastError();
+        ft.WriteErrorLine(L"ERROR: Could not create the journal file '%s'!", m_fileName.c_str());
+        CHECK_WIN32_ERROR(dwLastError, L"CreateFile");
+    }
+    ft.WriteDebugLine(L"Recording shadow copy sets and mounts in journal %s", m_fileName.c_str());
+}
+
+
+void CleanupJournal::RecordSnapshotSet(const VSS_ID& setId)
+{
+    JournalRecord record = {};
+    record.kind = JOURNAL_SNAPSHOT_SET;
+    record.setId = setId;
+    Append(record);
+}
+
+
+void CleanupJournal::RecordMount(const wstring& drive, const wstring& deviceName)
+{
+    JournalRecord record = {};
+    record.kind = JOURNAL_MOUNT;
+    StringCchCopy(record.drive, ARRAYSIZE(record.drive), drive.c_str());
+    StringCchCopy(record.deviceName, ARRAYSIZE(record.deviceName), deviceName.c_str());
+    Append(record);
+}
+
+
+void CleanupJournal::RecordUnmount(const wstring& drive, const wstring& deviceName)
+{
+    JournalRecord record = {};
+    record.kind = JOURNAL_UNMOUNT;
+    StringCchCopy(record.drive, ARRAYSIZE(record.drive), drive.c_str());
+    StringCchCopy(record.deviceName, ARRAYSIZE(record.deviceName), deviceName.c_str());
+    Append(record);
+}
+
+
+// Write the record through to disk, and terminate the process if this is the step to crash at
+void CleanupJournal::Append(JournalRecord& record)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    if (m_hFile == INVALID_HANDLE_VALUE)
+        return;
+    record.crc32c = GetRecordChecksum(record);
+    DWORD cbWritten = 0;
+    if (!WriteFile(m_hFile, &record, sizeof(record), &cbWritten, NULL) || !FlushFileBuffers(m_hFile))
+    {
+        DWORD dwLastError = GetLastError();
+        ft.WriteErrorLine(L"ERROR: Could not write the journal file '%s'!", m_fileName.c_str());
+        CHECK_WIN32_ERROR(dwLastError, L"WriteFile");
+    }
+
+    if (++m_step == m_settings.crashAt)
+    {
+        ft.WriteInfoLine(L"Terminating the process after step %lu of the journal, as requested", m_step);
+        TerminateProcess(GetCurrentProcess(), ERROR_PROCESS_ABORTED);
+    }
+}
+
+
+// Close the journal, and delete it if everything in it has been undone
+void CleanupJournal::Close(bool bDelete)
+{
+    if (m_hFile == INVALID_HANDLE_VALUE)
+        return;
+    CloseHandle(m_hFile);
+    m_hFile = INVALID_HANDLE_VALUE;
+    if (bDelete)
+        DeleteFile(m_fileName.c_str());
+}
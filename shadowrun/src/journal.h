@@ -0,0 +1,99 @@
+#pragma once
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Cleanup journal
+//
+//  A shadowrun process that dies while shadow copies are mounted, e.g. when
+//  it is killed, leaves the DOS devices of the mounts behind, and their
+//  drive letters stay taken. To undo that, each run records in a journal
+//  file what it is about to create, before it creates it (write-ahead):
+//  the shadow copy set before DoSnapshotSet, and each mount before the DOS
+//  device is defined, and records each mount removed. The journal file is
+//  deleted when everything in it has been undone, normally when the VSS
+//  client is released at the end of the run.
+//
+//  Each run first recovers what ended processes left behind: a journal
+//  file in the directory that is not in use, i.e. whose process has ended,
+//  is replayed by removing the mounts not removed, and deleting the shadow
+//  copy sets if they are still there, which is normally done by VSS itself
+//  for the non-persistent shadow copies of shadowrun. Undoing something
+//  that was never created, because the process died just before it, does
+//  nothing, so the replay can be repeated if it is interrupted itself.
+//
+//  The journal is a file of fixed size records, each with a CRC32C, written
+//  through to disk before going on. A record torn by a crash while it was
+//  written ends the journal. For testing the recovery, the process can be
+//  terminated right after a given step of the journal is written.
+//
+
+// Kinds of records
+const DWORD JOURNAL_SNAPSHOT_SET = 1;    // A shadow copy set is about to be created
+const DWORD JOURNAL_MOUNT = 2;           // A shadow copy is about to be mounted
+const DWORD JOURNAL_UNMOUNT = 3;         // A shadow copy has been unmounted
+
+
+// Settings for the journal, given by the -journal option on the command line
+struct JournalSettings
+{
+    // Directory of the journal files, empty for ShadowRun in the temporary directory
+    wstring             directory;
+
+    // Step of the journal after which the process is terminated, to test the recovery, 0 for none
+    DWORD               crashAt = 0;
+
+    // Parse a comma separated list of name:value pairs, as given to the -journal option:
+    // directory:path and crash-at:number.
+    // Throws E_INVALIDARG on unknown names or invalid values.
+    void Parse(const wstring& settings);
+};
+
+
+// Write-ahead journal of the shadow copy sets and mounts of this process, and recovery of those of ended processes
+class CleanupJournal
+{
+public:
+
+    CleanupJournal(const JournalSettings& settings);
+
+    ~CleanupJournal();
+
+    // Undo what ended processes left behind according to their journals, deleting their shadow copy sets
+    // with the backend if given
+    void Recover(VssBackend* pBackend);
+
+    // Create the journal of this process
+    void Open();
+
+    void RecordSnapshotSet(const VSS_ID& setId);
+
+    void RecordMount(const wstring& drive, const wstring& deviceName);
+
+    void RecordUnmount(const wstring& drive, const wstring& deviceName);
+
+    // Close the journal, and delete it if everything in it has been undone
+    void Close(bool bDelete);
+
+private:
+
+    struct JournalRecord
+    {
+        DWORD           kind;
+        DWORD           crc32c;         // Of the record with this being zero
+        VSS_ID          setId;
+        WCHAR           drive[4];
+        WCHAR           deviceName[MAX_PATH];
+    };
+
+    // Write the record through to disk, and terminate the process if this is the step to crash at
+    void Append(JournalRecord& record);
+
+    // Undo what is recorded in the journal file, returns false if it is in use by a running process
+    bool Replay(const wstring& fileName, VssBackend* pBackend);
+
+    JournalSettings                 m_settings;
+    wstring                         m_directory;
+    wstring                         m_fileName;
+    HANDLE                          m_hFile;
+    DWORD                           m_step;
+};
@@ -56,7 +56,7 @@ const int MAX_VPRINTF_BUFFER_SIZE = 4096;
     HRESULT hr = StringCchVPrintfW(                 \
         WString2Buffer(buffer),                     \
         buffer.length(),                            \
-        param.c_str(),                              \
+        param,                                      \
         marker );                                   \
     if (FAILED(hr)                                  \
         && (hr != STRSAFE_E_INSUFFICIENT_BUFFER))   \
@@ -0,0 +1,179 @@
+// Main header
+#include "stdafx.h"
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Manifest sink
+//
+
+
+// Zeros to checksum for the holes of the image
+static const BYTE s_zeros[64 * 1024] = {};
+
+
+ManifestSink::ManifestSink(ExportSink& next, const wstring& manifestFileName, DWORD checksums) :
+    m_next(next),
+    m_manifestFileName(manifestFileName),
+    m_checksums(checksums),
+    m_ullSize(0),
+    m_ullPosition(0),
+    m_crc32c(0),
+    m_bZeroExtentKnown(false)
+{
+}
+
+
+void ManifestSink::Begin(ULONGLONG ullDeviceSize)
+{
+    m_ullSize = ullDeviceSize;
+    m_next.Begin(ullDeviceSize);
+}
+
+
+void ManifestSink::Write(ULONGLONG ullOffset, const BYTE* pData, DWORD cbData)
+{
+    AddZeros(ullOffset);
+    AddData(pData, cbData);
+    m_next.Write(ullOffset, pData, cbData);
+}
+
+
+void ManifestSink::End()
+{
+    AddZeros(m_ullSize);
+    m_next.End();
+    WriteManifest();
+}
+
+
+// Add zeros until the offset
+void ManifestSink::AddZeros(ULONGLONG ullEnd)
+{
+    while (m_ullPosition < ullEnd)
+    {
+        // Whole extents of zeros all have the same checksums
+        if (m_ullPosition % MANIFEST_EXTENT_SIZE == 0 && ullEnd - m_ullPosition >= MANIFEST_EXTENT_SIZE)
+        {
+            if (!m_bZeroExtentKnown)
+            {
+                XxHash64 zeroXxh64;
+                for (ULONGLONG i = 0; i < MANIFEST_EXTENT_SIZE; i += sizeof(s_zeros))
+                {
+                    if (m_checksums & MANIFEST_CRC32C)
+                        m_zeroExtent.crc32c = Crc32c(m_zeroExtent.crc32c, s_zeros, sizeof(s_zeros));
+                    if (m_checksums & MANIFEST_XXH64)
+                        zeroXxh64.Update(s_zeros, sizeof(s_zeros));
+                }
+                m_zeroExtent.xxh64 = zeroXxh64.GetHash();
+                m_bZeroExtentKnown = true;
+            }
+            m_extents.push_back(m_zeroExtent);
+            m_ullPosition += MANIFEST_EXTENT_SIZE;
+            continue;
+        }
+        AddData(s_zeros, (DWORD)min((ULONGLONG)sizeof(s_zeros), ullEnd - m_ullPosition));
+    }
+}
+
+
+// Add data at the current position
+void ManifestSink::AddData(const BYTE* pData, DWORD cbData)
+{
+    while (cbData > 0)
+    {
+        ULONGLONG ullExtentEnd = (m_ullPosition / MANIFEST_EXTENT_SIZE + 1) * MANIFEST_EXTENT_SIZE;
+        DWORD cbPart = (DWORD)min((ULONGLONG)cbData, ullExtentEnd - m_ullPosition);
+        if (m_checksums & MANIFEST_CRC32C)
+            m_crc32c = Crc32c(m_crc32c, pData, cbPart);
+        if (m_checksums & MANIFEST_XXH64)
+            m_xxh64.Update(pData, cbPart);
+        m_ullPosition += cbPart;
+        pData += cbPart;
+        cbData -= cbPart;
+
+        // The last extent ends with the image
+        if (m_ullPosition == ullExtentEnd || m_ullPosition == m_ullSize)
+            FinishExtent();
+    }
+}
+
+
+// Add the checksums of the current extent
+void ManifestSink::FinishExtent()
+{
+    ExtentChecksum extent;
+    extent.crc32c = m_crc32c;
+    extent.xxh64 = m_xxh64.GetHash();
+    m_extents.push_back(extent);
+    m_crc32c = 0;
+    m_xxh64.Reset();
+}
+
+
+void ManifestSink::WriteManifest()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    // The checksums of the whole image are those of the extent checksums, as little-endian bytes
+    DWORD imageCrc32c = 0;
+    XxHash64 imageXxh64;
+    for (size_t i = 0; i < m_extents.size(); ++i)
+    {
+        imageCrc32c = Crc32c(imageCrc32c, (const BYTE*)&m_extents[i].crc32c, sizeof(m_extents[i].crc32c));
+        imageXxh64.Update((const BYTE*)&m_extents[i].xxh64, sizeof(m_extents[i].xxh64));
+    }
+
+    ofstream manifestFile(m_manifestFileName.c_str(), ios::out | ios::trunc);
+    if (!manifestFile)
+    {
+        ft.WriteErrorLine(L"ERROR: Could not create the manifest file '%s'!", m_manifestFileName.c_str());
+        throw(HRESULT_FROM_WIN32(ERROR_CANNOT_MAKE));
+    }
+
+    char text[32];
+    manifestFile << "size " << m_ullSize << "\n";
+    manifestFile << "extent " << MANIFEST_EXTENT_SIZE << "\n";
+    if (m_checksums & MANIFEST_CRC32C)
+    {
+        StringCchPrintfA(text, ARRAYSIZE(text), "%08lx", imageCrc32c);
+        manifestFile << "crc32c " << text << "\n";
+    }
+    if (m_checksums & MANIFEST_XXH64)
+    {
+        StringCchPrintfA(text, ARRAYSIZE(text), "%016llx", imageXxh64.GetHash());
+        manifestFile << "xxh64 " << text << "\n";
+    }
+    manifestFile << "\n";
+
+    for (size_t i = 0; i < m_extents.size(); ++i)
+    {
+        manifestFile << (i * MANIFEST_EXTENT_SIZE) << " ";
+        if (m_checksums & MANIFEST_CRC32C)
+        {
+            StringCchPrintfA(text, ARRAYSIZE(text), "%08lx", m_extents[i].crc32c);
+            manifestFile << text;
+        }
+        else
+            manifestFile << "-";
+        manifestFile << " ";
+        if (m_checksums & MANIFEST_XXH64)
+        {
+            StringCchPrintfA(text, ARRAYSIZE(text), "%016llx", m_extents[i].xxh64);
+            manifestFile << text;
+        }
+        else
+            manifestFile << "-";
+        manifestFile << "\n";
+    }
+
+    manifestFile.close();
+    if (manifestFile.fail())
+    {
+        ft.WriteErrorLine(L"ERROR: Could not write the manifest file '%s'!", m_manifestFileName.c_str());
+        throw(HRESULT_FROM_WIN32(ERROR_WRITE_FAULT));
+    }
+    ft.WriteInfoLine(L"Wrote manifest %s with checksums of %u extents (CRC32C with %s)",
+        m_manifestFileName.c_str(), (unsigned)m_extents.size(), GetCrc32cImplementation());
+}
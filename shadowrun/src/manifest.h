@@ -0,0 +1,77 @@
+#pragma once
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Manifest
+//
+//  With the checksum setting of -export-io a manifest is written next to
+//  each image file, with checksums of the image computed while it is
+//  exported, from the blocks already in memory, so that the image can be
+//  verified later by reading only the image, not the volume once more. The
+//  checksums are of the content of the image, the same whether the image
+//  file is sparse, compressed or not, and the free clusters not read with
+//  used:1 count as the zeros they are in the image.
+//
+//  The image is checksummed in extents of MANIFEST_EXTENT_SIZE, so that a
+//  damaged image can be narrowed down to the extents that differ, and the
+//  checksum of the whole image is the checksum of the extent checksums in
+//  order (each as little-endian bytes). The manifest is a text file, a
+//  header of name value lines, then an "offset crc32c xxh64" line for each
+//  extent, with the checksums in hexadecimal, either being "-" if not
+//  computed.
+//
+
+// Size of the extents of the image with a checksum in the manifest
+const ULONGLONG MANIFEST_EXTENT_SIZE = 64 * 1024 * 1024;
+
+// Checksums to compute, combined as flags
+const DWORD MANIFEST_CRC32C = 0x1;
+const DWORD MANIFEST_XXH64 = 0x2;
+
+
+// Computes the checksums of the blocks passed on to another sink, and writes the manifest at the end
+class ManifestSink : public ExportSink
+{
+public:
+
+    ManifestSink(ExportSink& next, const wstring& manifestFileName, DWORD checksums);
+
+    virtual void Begin(ULONGLONG ullDeviceSize);
+    virtual void Write(ULONGLONG ullOffset, const BYTE* pData, DWORD cbData);
+    virtual void End();
+
+private:
+
+    struct ExtentChecksum
+    {
+        DWORD           crc32c = 0;
+        ULONGLONG       xxh64 = 0;
+    };
+
+    // Add zeros until the offset, for the holes of the image
+    void AddZeros(ULONGLONG ullEnd);
+
+    // Add data at the current position
+    void AddData(const BYTE* pData, DWORD cbData);
+
+    // Add the checksums of the current extent, and start the next one
+    void FinishExtent();
+
+    void WriteManifest();
+
+    ExportSink&                 m_next;
+    wstring                     m_manifestFileName;
+    DWORD                       m_checksums;
+    ULONGLONG                   m_ullSize;
+
+    // Data checksummed so far, and the checksums of the current extent
+    ULONGLONG                   m_ullPosition;
+    DWORD                       m_crc32c;
+    XxHash64                    m_xxh64;
+
+    vector<ExtentChecksum>      m_extents;
+
+    // Checksums of a whole extent of only zeros, computed once when first needed
+    bool                        m_bZeroExtentKnown;
+    ExtentChecksum              m_zeroExtent;
+};
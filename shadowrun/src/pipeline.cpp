@@ -0,0 +1,375 @@
+// Main header
+#include "stdafx.h"
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Settings
+//
+
+
+// Parse the settings of the -pipeline option
+void PipelineSettings::Parse(const wstring& settings)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    vector<wstring> pairs = SplitWString(settings, L',');
+    for (size_t i = 0; i < pairs.size(); ++i)
+    {
+        size_t separatorPos = pairs[i].find(L':');
+        wstring name = pairs[i].substr(0, separatorPos);
+        wstring value = (separatorPos == wstring::npos) ? wstring() : pairs[i].substr(separatorPos + 1);
+        LPWSTR pwszEnd = NULL;
+        DWORD dwValue = wcstoul(value.c_str(), &pwszEnd, 10);
+        if (value.empty() || *pwszEnd != L'\0' || dwValue == 0)
+        {
+            ft.WriteErrorLine(L"ERROR: Invalid pipeline setting '%s', expected name:number with a positive number!", pairs[i].c_str());
+            throw(E_INVALIDARG);
+        }
+
+        if (IsEqual(name, L"create"))
+            createConcurrency = dwValue;
+        else if (IsEqual(name, L"exec"))
+            execConcurrency = dwValue;
+        else if (IsEqual(name, L"volume"))
+            volumeConcurrency = dwValue;
+        else
+        {
+            ft.WriteErrorLine(L"ERROR: Unknown pipeline setting '%s'!", name.c_str());
+            throw(E_INVALIDARG);
+        }
+    }
+}
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Pipeline
+//
+
+
+SnapshotPipeline::SnapshotPipeline(const PipelineSettings& settings, OutputCapture* pCapture) :
+    m_settings(settings),
+    m_pCapture(pCapture),
+    m_nextSet(0)
+{
+    m_hCreateSlots = CreateSemaphore(NULL, m_settings.createConcurrency, m_settings.createConcurrency, NULL);
+    m_hExecSlots = CreateSemaphore(NULL, m_settings.execConcurrency, m_settings.execConcurrency, NULL);
+    InitializeCriticalSection(&m_environmentLock);
+}
+
+
+SnapshotPipeline::~SnapshotPipeline()
+{
+    if (m_hCreateSlots != NULL)
+        CloseHandle(m_hCreateSlots);
+    if (m_hExecSlots != NULL)
+        CloseHandle(m_hExecSlots);
+    for (auto it = m_volumeSlots.begin(); it != m_volumeSlots.end(); ++it)
+        CloseHandle(it->second);
+    DeleteCriticalSection(&m_environmentLock);
+}
+
+
+// Add a set of volumes
+void SnapshotPipeline::Add(const vector<wstring>& volumeList)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    Set set;
+    set.index = (DWORD)m_sets.size() + 1;
+    set.volumes = volumeList;
+
+    // The slots are taken in the order of the lowercase volume names, the same for all sets
+    vector<wstring> volumes;
+    for (size_t i = 0; i < volumeList.size(); ++i)
+    {
+        wstring volume = volumeList[i];
+        transform(volume.begin(), volume.end(), volume.begin(), towlower);
+        volumes.push_back(volume);
+    }
+    sort(volumes.begin(), volumes.end());
+    volumes.erase(unique(volumes.begin(), volumes.end()), volumes.end());
+    for (size_t i = 0; i < volumes.size(); ++i)
+    {
+        auto it = m_volumeSlots.find(volumes[i]);
+        if (it == m_volumeSlots.end())
+        {
+            HANDLE hSlots = CreateSemaphore(NULL, m_settings.volumeConcurrency, m_settings.volumeConcurrency, NULL);
+            if (hSlots == NULL)
+                CHECK_WIN32_ERROR(GetLastError(), L"CreateSemaphore");
+            it = m_volumeSlots.insert(make_pair(volumes[i], hSlots)).first;
+        }
+        set.volumeSlots.push_back(it->second);
+    }
+
+    m_sets.push_back(set);
+}
+
+
+// Take all the sets through the pipeline
+DWORD SnapshotPipeline::Run()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    if (m_hCreateSlots == NULL || m_hExecSlots == NULL)
+        CHECK_WIN32_ERROR(GetLastError(), L"CreateSemaphore");
+
+    // Enough workers to keep both the create and the exec stage busy
+    DWORD cWorkers = min(m_settings.createConcurrency + m_settings.execConcurrency, (DWORD)MAXIMUM_WAIT_OBJECTS);
+    cWorkers = min(cWorkers, (DWORD)m_sets.size());
+    ft.WriteInfoLine(L"Processing %u shadow copy sets using %lu threads (create %lu, exec %lu, volume %lu at a time)...",
+        (unsigned)m_sets.size(), cWorkers, m_settings.createConcurrency, m_settings.execConcurrency, m_settings.volumeConcurrency);
+
+    // The workers use the multithreaded apartment, COM security is initialized for the process here
+    VssClient::InitializeCom();
+
+    ULONGLONG ullStartTime = GetTickCount64();
+    m_nextSet = 0;
+    vector<HANDLE> threads;
+    for (DWORD i = 0; i < cWorkers; ++i)
+    {
+        HANDLE hThread = CreateThread(NULL, 0, WorkerThread, this, 0, NULL);
+        if (hThread == NULL)
+        {
+            // The started workers process all the sets
+            ft.WriteErrorLine(L"WARNING: Could not start a pipeline thread (error %lu), continuing with %u threads",
+                GetLastError(), (unsigned)threads.size());
+            break;
+        }
+        threads.push_back(hThread);
+    }
+
+    if (!threads.empty())
+    {
+        WaitForMultipleObjects((DWORD)threads.size(), &threads[0], TRUE, INFINITE);
+        for (size_t i = 0; i < threads.size(); ++i)
+            CloseHandle(threads[i]);
+    }
+    CoUninitialize();
+
+    // The summary comes after the last output of the commands
+    if (m_pCapture)
+        m_pCapture->Flush();
+
+    PrintSummary(GetTickCount64() - ullStartTime);
+
+    // Report the first failure, or the first non-zero exit code
+    DWORD dwExitCode = 0;
+    for (size_t i = 0; i < m_sets.size(); ++i)
+    {
+        if (FAILED(m_sets[i].hr))
+            throw(m_sets[i].hr);
+        if (dwExitCode == 0)
+            dwExitCode = m_sets[i].dwExitCode;
+    }
+    return dwExitCode;
+}
+
+
+// Take the sets from the shared queue through the pipeline until it is empty
+void SnapshotPipeline::ProcessSets()
+{
+    while (true)
+    {
+        size_t iSet = m_nextSet++;
+        if (iSet >= m_sets.size())
+            break;
+        ProcessSet(m_sets[iSet]);
+    }
+}
+
+
+// Take a set through all the stages
+void SnapshotPipeline::ProcessSet(Set& set)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    set.bProcessed = true;
+    ULONGLONG ullStartTime = GetTickCount64();
+
+    // No other set may hold too many shadow copies of the same volumes
+    for (size_t i = 0; i < set.volumeSlots.size(); ++i)
+        WaitForSingleObject(set.volumeSlots[i], INFINITE);
+
+    WaitForSingleObject(m_hCreateSlots, INFINITE);
+    ULONGLONG ullCreateStartTime = GetTickCount64();
+    set.ullWaitTime = ullCreateStartTime - ullStartTime;
+    unique_ptr<VssClient> pClient;
+    try
+    {
+        pClient = CreateSet(set);
+    }
+    catch (HRESULT hr)
+    {
+        set.hr = hr;
+    }
+    catch (bad_alloc)
+    {
+        set.hr = E_OUTOFMEMORY;
+    }
+    ReleaseSemaphore(m_hCreateSlots, 1, NULL);
+    set.ullCreateTime = GetTickCount64() - ullCreateStartTime;
+
+    if (pClient && !m_settings.execCommand.empty())
+    {
+        WaitForSingleObject(m_hExecSlots, INFINITE);
+        ULONGLONG ullExecStartTime = GetTickCount64();
+        set.ullWaitTime += ullExecStartTime - ullCreateStartTime - set.ullCreateTime;
+        try
+        {
+            ExecSet(set, *pClient);
+        }
+        catch (HRESULT hr)
+        {
+            set.hr = hr;
+        }
+        ReleaseSemaphore(m_hExecSlots, 1, NULL);
+        set.ullExecTime = GetTickCount64() - ullExecStartTime;
+    }
+
+    // Releasing the backup components object releases the shadow copies
+    ULONGLONG ullReleaseStartTime = GetTickCount64();
+    if (pClient)
+    {
+        ft.WriteInfoLine(L"Set %lu: Releasing shadow copy set %s...", set.index, pClient->GetLatestSnapshotSet().idString.c_str());
+        if (m_settings.mountSnapshots)
+            pClient->UnmountSnapshots();
+        pClient.reset();
+    }
+    set.ullReleaseTime = GetTickCount64() - ullReleaseStartTime;
+
+    for (size_t i = set.volumeSlots.size(); i-- > 0; )
+        ReleaseSemaphore(set.volumeSlots[i], 1, NULL);
+}
+
+
+// Create, and mount, the shadow copy set
+unique_ptr<VssClient> SnapshotPipeline::CreateSet(Set& set)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    ft.WriteInfoLine(L"Set %lu: Creating shadow copy set of %u volumes...", set.index, (unsigned)set.volumes.size());
+
+    unique_ptr<VssClient> pClient(new VssClient());
+    if (m_settings.simulate)
+    {
+        // Each simulated backend generates its own identifiers, so give each its own seed
+        SimulationSettings settings = m_settings.simulationSettings;
+        settings.seed += set.index - 1;
+        pClient->UseSimulatedBackend(settings);
+    }
+    pClient->SetAsyncWaitSettings(m_settings.asyncWaitSettings);
+    pClient->InitializeBackend();
+    pClient->CreateSnapshotSet(set.volumes);
+
+    if (m_settings.mountSnapshots)
+    {
+        // Picking free drive letters and mounting must not be interleaved with other sets
+        EnterCriticalSection(&m_environmentLock);
+        try
+        {
+            pClient->MountSnapshots(L"");
+        }
+        catch (HRESULT)
+        {
+            LeaveCriticalSection(&m_environmentLock);
+            throw;
+        }
+        LeaveCriticalSection(&m_environmentLock);
+    }
+
+    return pClient;
+}
+
+
+// Run the command for the set
+void SnapshotPipeline::ExecSet(Set& set, VssClient& client)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    ft.WriteInfoLine(L"Set %lu: Running the command for shadow copy set %s...", set.index, client.GetLatestSnapshotSet().idString.c_str());
+
+    // The command inherits the environment, and its arguments are expanded with it, when it is started
+    HANDLE hProcess = NULL;
+    EnterCriticalSection(&m_environmentLock);
+    try
+    {
+        if (m_settings.setProcessEnvironment)
+            client.SetProcessEnvironment();
+        hProcess = m_pCapture
+            ? m_pCapture->StartCommand(L"set " + to_wstring(set.index), m_settings.execCommand, m_settings.execArguments, m_settings.addExecArgumentQuotes, m_settings.expandExecArgumentEnvVars)
+            : StartCommand(m_settings.execCommand, m_settings.execArguments, m_settings.addExecArgumentQuotes, m_settings.expandExecArgumentEnvVars);
+    }
+    catch (HRESULT)
+    {
+        LeaveCriticalSection(&m_environmentLock);
+        throw;
+    }
+    LeaveCriticalSection(&m_environmentLock);
+
+    set.dwExitCode = WaitForCommand(hProcess);
+    ft.WriteInfoLine(L"Set %lu: Command completed with exit code %lu", set.index, set.dwExitCode);
+}
+
+
+// Worker thread
+DWORD WINAPI SnapshotPipeline::WorkerThread(LPVOID pParameter)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    SnapshotPipeline* pPipeline = (SnapshotPipeline*)pParameter;
+
+    // The VSS clients may be released by another worker than the one creating them
+    HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+    if (FAILED(hr))
+    {
+        // The other workers process the remaining sets
+        ft.WriteErrorLine(L"WARNING: Could not initialize COM for a pipeline thread (0x%08lx)", hr);
+        return 0;
+    }
+
+    pPipeline->ProcessSets();
+
+    CoUninitialize();
+    return 0;
+}
+
+
+// Print the timings and results of the sets
+void SnapshotPipeline::PrintSummary(ULONGLONG ullElapsed)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    ft.WriteInfoLine(L"");
+    ft.WriteInfoLine(L"Set  Volumes  Waiting  Create  Command  Release  Result");
+    for (size_t i = 0; i < m_sets.size(); ++i)
+    {
+        Set& set = m_sets[i];
+        if (!set.bProcessed)
+            set.hr = E_UNEXPECTED; // No worker could be started
+
+        WCHAR result[32];
+        if (FAILED(set.hr))
+            StringCchPrintfW(result, ARRAYSIZE(result), L"error 0x%08lx", set.hr);
+        else if (!m_settings.execCommand.empty())
+            StringCchPrintfW(result, ARRAYSIZE(result), L"exit code %lu", set.dwExitCode);
+        else
+            StringCchCopyW(result, ARRAYSIZE(result), L"ok");
+
+        ft.WriteInfoLine(L"%3lu  %7u  %6.1fs  %5.1fs  %6.1fs  %6.1fs  %s",
+            set.index,
+            (unsigned)set.volumes.size(),
+            set.ullWaitTime / 1000.0,
+            set.ullCreateTime / 1000.0,
+            set.ullExecTime / 1000.0,
+            set.ullReleaseTime / 1000.0,
+            result);
+    }
+
+    double seconds = ullElapsed / 1000.0;
+    ft.WriteInfoLine(L"Completed %u shadow copy sets in %.1f seconds (%.1f sets per minute)",
+        (unsigned)m_sets.size(), seconds, (seconds > 0) ? m_sets.size() * 60.0 / seconds : 0.0);
+}
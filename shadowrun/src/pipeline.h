@@ -0,0 +1,144 @@
+#pragma once
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Snapshot pipeline
+//
+//  With one or more -set options ShadowRun creates several independent
+//  shadow copy sets, and runs the command once for each of them. Each set
+//  goes through the stages create (including mount), exec and release, and
+//  the stages of different sets overlap: While the command runs for one
+//  set, the next set is already being created and mounted.
+//
+//  Each set is taken through all its stages by one of a pool of worker
+//  threads, and the stages are bounded by counting semaphores:
+//  - create: Shadow copy sets being created at the same time. VSS itself
+//    only creates one shadow copy set at a time, so this defaults to 1.
+//  - exec: Commands running at the same time.
+//  - volume: Sets holding shadow copies of the same volume at the same
+//    time. A set takes the slots of all its volumes, in a fixed order so
+//    that sets sharing volumes cannot deadlock, before it is created.
+//
+//  Each set uses its own VSS client, and with it its own backup components
+//  object, which is released with its shadow copies when the command is
+//  done. The process environment and the drive letters are shared by all
+//  sets, so setting the environment variables and starting the command, and
+//  mounting, is done by one set at a time.
+//
+
+// Default maximum number of sets in each stage at the same time
+const DWORD PIPELINE_DEFAULT_CREATE_CONCURRENCY = 1;
+const DWORD PIPELINE_DEFAULT_EXEC_CONCURRENCY = 2;
+const DWORD PIPELINE_DEFAULT_VOLUME_CONCURRENCY = 1;
+
+
+// Settings for the pipeline, given by the other options on the command line
+struct PipelineSettings
+{
+    // Maximum number of sets being created, running the command, and holding each volume, at the same time
+    DWORD               createConcurrency = PIPELINE_DEFAULT_CREATE_CONCURRENCY;
+    DWORD               execConcurrency = PIPELINE_DEFAULT_EXEC_CONCURRENCY;
+    DWORD               volumeConcurrency = PIPELINE_DEFAULT_VOLUME_CONCURRENCY;
+
+    // Use the simulated backend, with these settings
+    bool                simulate = false;
+    SimulationSettings  simulationSettings;
+
+    // Polling interval and deadlines for the asynchronous operations
+    AsyncWaitSettings   asyncWaitSettings;
+
+    // Command to execute for each set, none if empty, and how
+    wstring             execCommand;
+    vector<wstring>     execArguments;
+    bool                addExecArgumentQuotes = true;
+    bool                expandExecArgumentEnvVars = true;
+
+    // Set the environment variables of the set for the command, and mount its shadow copies
+    bool                setProcessEnvironment = false;
+    bool                mountSnapshots = false;
+
+    // Parse a comma separated list of name:value pairs, as given to the -pipeline option:
+    // create:number, exec:number and volume:number.
+    // Throws E_INVALIDARG on unknown names or invalid values.
+    void Parse(const wstring& settings);
+};
+
+
+class SnapshotPipeline
+{
+public:
+
+    // The output of the commands is captured if given an output capture
+    SnapshotPipeline(const PipelineSettings& settings, OutputCapture* pCapture = NULL);
+
+    ~SnapshotPipeline();
+
+    // Add a set of volumes (unique volume names) to create a shadow copy set of
+    void Add(const vector<wstring>& volumeList);
+
+    // Take all the sets through the pipeline, and print a summary
+    // Returns the first non-zero exit code of the commands, in the order the sets were added,
+    // and throws the error of the first failed set, if any
+    DWORD Run();
+
+private:
+
+    struct Set
+    {
+        DWORD               index = 0;
+        vector<wstring>     volumes;
+
+        // Slots of the volumes, in the order they are taken
+        vector<HANDLE>      volumeSlots;
+
+        // Result
+        bool                bProcessed = false;
+        HRESULT             hr = S_OK;
+        DWORD               dwExitCode = 0;
+
+        // Milliseconds waiting for slots, creating, running the command and releasing
+        ULONGLONG           ullWaitTime = 0;
+        ULONGLONG           ullCreateTime = 0;
+        ULONGLONG           ullExecTime = 0;
+        ULONGLONG           ullReleaseTime = 0;
+    };
+
+    // Take the sets from the shared queue through the pipeline until it is empty
+    void ProcessSets();
+
+    // Take a set through all the stages
+    void ProcessSet(Set& set);
+
+    // Create, and mount, the shadow copy set
+    unique_ptr<VssClient> CreateSet(Set& set);
+
+    // Run the command for the set
+    void ExecSet(Set& set, VssClient& client);
+
+    // Worker thread
+    static DWORD WINAPI WorkerThread(LPVOID pParameter);
+
+    // Print the timings and results of the sets
+    void PrintSummary(ULONGLONG ullElapsed);
+
+    //
+    //  Data members
+    //
+
+    PipelineSettings            m_settings;
+
+    OutputCapture*              m_pCapture;
+
+    vector<Set>                 m_sets;
+
+    // Index in m_sets of the next set to process
+    atomic<size_t>              m_nextSet;
+
+    // Semaphores bounding the stages
+    HANDLE                      m_hCreateSlots;
+    HANDLE                      m_hExecSlots;
+    map<wstring, HANDLE>        m_volumeSlots;
+
+    // Serializes the changes of the process environment and the drive letters
+    CRITICAL_SECTION            m_environmentLock;
+};
@@ -101,6 +101,29 @@ void PrintUsage(bool startWithNewline)
         L"  -ne, -no-expand     - Do not expand environment variable references in arguments specified with -arg or after --\n" // Added (not from orginal vshadow)
         L"  -arg={string}       - Argument to append after the -exec command, repeat or use -- for multiple arguments\n" // Added (not from orginal vshadow)
         L"  -log-level={string} - Log level, one of: trace, debug, info (default), notice (unused), error or silent\n" // Added (not from orginal vshadow), replaces tracing from original vshadow
+        L"  -simulate[={list}]  - Use a simulated in-memory VSS provider, optionally with settings name:value,...\n" // Added (not from orginal vshadow)
+        L"  -set={volumes}      - Shadow copy set of comma separated volumes, repeat to run the command for several sets\n" // Added (not from orginal vshadow)
+        L"  -pipeline={list}    - Sets at a time in the stages of -set, with settings name:value,... (create, exec, volume)\n" // Added (not from orginal vshadow)
+        L"  -serve[={name}]     - Run as daemon creating shadow copies for -connect, on named pipe (default shadowrun)\n" // Added (not from orginal vshadow)
+        L"  -connect[={name}]   - Let the daemon on the named pipe (default shadowrun) create the shadow copies\n" // Added (not from orginal vshadow)
+        L"  -jobs[={n}]         - Run the -exec command once for each shadow copy, optionally at most n at a time\n" // Added (not from orginal vshadow)
+        L"  -shard={numbers}    - Run the -exec command once for the comma separated volume numbers, repeat for more jobs\n" // Added (not from orginal vshadow)
+        L"  -capture            - Capture the output of the -exec command, prefixing each line with time and job\n" // Added (not from orginal vshadow)
+        L"  -capture-file={file} - Also write the captured output to a log file, rotated by size\n" // Added (not from orginal vshadow)
+        L"  -capture-rotate={list} - Rotation of the -capture-file, with settings name:value,... (size in MB, count)\n" // Added (not from orginal vshadow)
+        L"  -export={directory} - Export each shadow copy to a raw image file {shadow id}.img in the directory\n" // Added (not from orginal vshadow)
+        L"  -export-io={list}   - Reads and compression of -export and -store, with settings name:value,... (block, depth, sparse, used, compress, threads, checksum)\n" // Added (not from orginal vshadow)
+        L"  -diff[={ids}]       - Export only the changes since the latest, or given, previous shadow copies of the volumes\n" // Added (not from orginal vshadow)
+        L"  -store={directory}  - Export each shadow copy into a deduplicating chunk store in the directory\n" // Added (not from orginal vshadow)
+        L"  -copy={directory}   - Copy the files of each shadow copy to a directory {shadow id} in the directory\n" // Added (not from orginal vshadow)
+        L"  -copy-io={list}     - Threads of -copy, with settings name:value,... (threads, buffer in KB)\n" // Added (not from orginal vshadow)
+        L"  -changes={directory} - List the files changed since the previous run, with an index of each volume in the directory\n" // Added (not from orginal vshadow)
+        L"  -catalog={file}     - Record the run, its shadow copies, mounts and results in a catalog file kept across runs\n" // Added (not from orginal vshadow)
+        L"  -journal={list}     - Journal to undo what interrupted runs left behind, with settings name:value,... (directory, crash-at)\n" // Added (not from orginal vshadow)
+        L"  -history={file} [{days}|{id}] - Print the runs recorded in a catalog file, of the last days or of an ID, as single argument\n" // Added (not from orginal vshadow)
+        L"  -timeout={list}     - Cancel the shadow copy creation if still pending after DoSnapshotSet:seconds, settings name:value,...\n" // Added (not from orginal vshadow)
+        L"  -trace-file={file}  - Record trace messages in a binary trace file instead of printing them\n" // Added (not from orginal vshadow)
+        L"  -decode-trace={file} - Print the trace messages recorded in a binary trace file, as single argument\n" // Added (not from orginal vshadow)
         L"  -- {args}...        - Special flag that makes all following arguments being passed directly to the -exec\n" // Added (not from orginal vshadow)
     );
 }
@@ -142,6 +165,22 @@ int CommandLineParser::Run(vector<wstring>& arguments)
         return EXIT_SUCCESS; // Default value: 0
     }
 
+    // Check for trace file decoding request (single argument -decode-trace={file})
+    wstring traceFileName;
+    if (arguments.size() == 1 && MatchArgument(arguments[0], L"decode-trace", traceFileName, true, false))
+    {
+        DecodeTraceFile(traceFileName);
+        return EXIT_SUCCESS; // Default value: 0
+    }
+
+    // Check for catalog printing request (single argument -history={file}, optionally followed by a number of days or an ID)
+    wstring historyFileName;
+    if ((arguments.size() == 1 || arguments.size() == 2) && MatchArgument(arguments[0], L"history", historyFileName, true, false))
+    {
+        PrintCatalog(historyFileName, (arguments.size() == 2) ? arguments[1] : wstring());
+        return EXIT_SUCCESS; // Default value: 0
+    }
+
     // Handle -log-level or -tracing argument
     int logLevel = -1;
     for (vector<wstring>::iterator it = arguments.begin(); it != arguments.end(); )
@@ -206,7 +245,32 @@ int CommandLineParser::Run(vector<wstring>& arguments)
         ft.WriteDebugLine(L"Using default log level"); // Will not be logged, as long as default log level is info
     }
 
-    return MainRoutine(arguments);
+    // Handle -trace-file argument: Trace messages are recorded in the file, regardless of log level, until the run is completed
+    TraceBuffer traceBuffer;
+    for (vector<wstring>::iterator it = arguments.begin(); it != arguments.end(); ++it)
+    {
+        if (MatchArgument(*it, L"trace-file", traceFileName, true, false))
+        {
+            ft.WriteDebugLine(L"Recording trace messages in file '%s'", traceFileName.c_str());
+            traceBuffer.Start(traceFileName);
+            FunctionTracer::SetTraceBuffer(&traceBuffer);
+            arguments.erase(it);
+            break;
+        }
+    }
+
+    int exitCode;
+    try
+    {
+        exitCode = MainRoutine(arguments);
+    }
+    catch(...)
+    {
+        FunctionTracer::SetTraceBuffer(NULL);
+        throw;
+    }
+    FunctionTracer::SetTraceBuffer(NULL);
+    return exitCode;
 }
 
 
@@ -268,6 +332,53 @@ int CommandLineParser::MainRoutine(vector<wstring>& arguments)
     // Wait after shadow copy has been created
     bool waitBeforeCleanup = false;
 
+    // Use the simulated backend instead of the VSS infrastructure
+    bool simulate = false;
+
+    // Run as daemon, creating shadow copies for the clients, with these settings
+    bool serve = false;
+    DaemonSettings daemonSettings;
+
+    // Let the daemon listening on this pipe create the shadow copies, empty if not
+    wstring connectPipeName;
+
+    // Run the command as separate jobs for the shadow copies, for each shard if any
+    // and else for each shadow copy, with this many at a time (0 for all)
+    bool runJobs = false;
+    DWORD jobConcurrency = 0;
+    vector<vector<size_t>> jobShards;
+
+    // Capture the output of the command, with these settings
+    OutputCaptureSettings outputCaptureSettings;
+
+    // Export the shadow copies to image files in this directory, empty if not, with these settings
+    wstring exportDirectory;
+    ExportSettings exportSettings;
+
+    // Export only the changes since the previous shadow copies, the latest ones or among these if any
+    bool exportDiff = false;
+    vector<VSS_ID> diffSnapshotIds;
+
+    // Export the shadow copies into the chunk store in this directory, empty if not, with the export settings
+    wstring storeDirectory;
+
+    // Copy the files of the shadow copies to this directory, empty if not, with these settings
+    wstring copyDirectory;
+    CopySettings copySettings;
+
+    // List the changes of the files of the shadow copies with the index in this directory, empty if not
+    wstring changesDirectory;
+
+    // Record the run in this catalog file, empty if not
+    wstring catalogFileName;
+
+    // Record the shadow copy set and mounts in a journal with these settings, to undo them if the run is interrupted
+    JournalSettings journalSettings;
+
+    // Shadow copy sets to create in a pipeline, given with -set, with these settings
+    vector<vector<wstring>> pipelineSets;
+    PipelineSettings pipelineSettings;
+
     ft.WriteDebugLine(L"Checking options...");
 
     try
@@ -378,6 +489,219 @@ int CommandLineParser::MainRoutine(vector<wstring>& arguments)
                 continue;
             }
 
+            // Check for the simulation option
+            if (MatchArgument(arguments[argIndex], L"simulate") || MatchArgument(arguments[argIndex], L"simulate", value, true, true))
+            {
+                SimulationSettings settings;
+                if (!MatchArgument(arguments[argIndex], L"simulate"))
+                    settings.Parse(value);
+                ft.WriteDebugLine(L"- Use simulated VSS provider (seed %lu, snapshot latency %lu ms, call latency %lu ms)",
+                    settings.seed, settings.snapshotLatency, settings.callLatency);
+                m_vssClient.UseSimulatedBackend(settings);
+                simulate = true;
+                daemonSettings.simulate = true;
+                daemonSettings.simulationSettings = settings;
+                continue;
+            }
+
+            // Check for the asynchronous operation timeout option
+            if (MatchArgument(arguments[argIndex], L"timeout", value, true, false))
+            {
+                AsyncWaitSettings settings;
+                settings.Parse(value);
+                ft.WriteDebugLine(L"- Asynchronous operation timeouts: %s", value.c_str());
+                m_vssClient.SetAsyncWaitSettings(settings);
+                daemonSettings.asyncWaitSettings = settings;
+                continue;
+            }
+
+            // Check for a shadow copy set to create in the pipeline
+            if (MatchArgument(arguments[argIndex], L"set", value, true, false))
+            {
+                vector<wstring> volumes = SplitWString(value, L',');
+                vector<wstring> volumeList;
+                for (size_t i = 0; i < volumes.size(); ++i)
+                {
+                    if (!(IsVolume(volumes[i]) || IsUNCPath((VSS_PWSZ)volumes[i].c_str())))
+                    {
+                        ft.WriteErrorLine(L"ERROR: Parameter %s of -set is expected to be a volume or a file share path!", volumes[i].c_str());
+                        throw(E_INVALIDARG);
+                    }
+                    volumeList.push_back(GetUniqueVolumeNameForPath(volumes[i]));
+                }
+                ft.WriteDebugLine(L"- Shadow copy set %u of %u volumes '%s'", (unsigned)pipelineSets.size() + 1, (unsigned)volumeList.size(), value.c_str());
+                pipelineSets.push_back(volumeList);
+                continue;
+            }
+
+            // Check for the pipeline option
+            if (MatchArgument(arguments[argIndex], L"pipeline", value, true, false))
+            {
+                pipelineSettings.Parse(value);
+                ft.WriteDebugLine(L"- Pipeline concurrency: create %lu, exec %lu, volume %lu",
+                    pipelineSettings.createConcurrency, pipelineSettings.execConcurrency, pipelineSettings.volumeConcurrency);
+                continue;
+            }
+
+            // With -set, all arguments after -- are passed on to the command
+            if (!pipelineSets.empty() && MatchArgument(arguments[argIndex], L"-"))
+            {
+                execArguments.insert(execArguments.end(), arguments.begin() + argIndex + 1, arguments.end());
+                break;
+            }
+
+            // Check for the daemon option
+            if (MatchArgument(arguments[argIndex], L"serve") || MatchArgument(arguments[argIndex], L"serve", daemonSettings.pipeName, true, false))
+            {
+                if (MatchArgument(arguments[argIndex], L"serve"))
+                    daemonSettings.pipeName = DAEMON_DEFAULT_PIPE_NAME;
+                ft.WriteDebugLine(L"- Run as daemon on pipe '%s'", daemonSettings.pipeName.c_str());
+                serve = true;
+                continue;
+            }
+
+            // Check for the daemon client option
+            if (MatchArgument(arguments[argIndex], L"connect") || MatchArgument(arguments[argIndex], L"connect", connectPipeName, true, false))
+            {
+                if (MatchArgument(arguments[argIndex], L"connect"))
+                    connectPipeName = DAEMON_DEFAULT_PIPE_NAME;
+                ft.WriteDebugLine(L"- Let the daemon on pipe '%s' create the shadow copies", connectPipeName.c_str());
+                continue;
+            }
+
+            // Check for the jobs option
+            if (MatchArgument(arguments[argIndex], L"jobs") || MatchArgument(arguments[argIndex], L"jobs", value, true, false))
+            {
+                if (!MatchArgument(arguments[argIndex], L"jobs"))
+                {
+                    LPWSTR pwszEnd = NULL;
+                    jobConcurrency = wcstoul(value.c_str(), &pwszEnd, 10);
+                    if (value.empty() || *pwszEnd != L'\0' || jobConcurrency == 0)
+                    {
+                        ft.WriteErrorLine(L"ERROR: Invalid number of jobs '%s'!", value.c_str());
+                        return errorCodeStart; // Default value: 1
+                    }
+                }
+                ft.WriteDebugLine(L"- Run the command as separate jobs, %lu at a time (0 for all)", jobConcurrency);
+                runJobs = true;
+                continue;
+            }
+
+            // Check for the shard option, the numbers are positions in the list of volumes, from 1
+            if (MatchArgument(arguments[argIndex], L"shard", value, true, false))
+            {
+                vector<wstring> numbers = SplitWString(value, L',');
+                vector<size_t> shard;
+                for (size_t i = 0; i < numbers.size(); ++i)
+                {
+                    LPWSTR pwszEnd = NULL;
+                    unsigned long number = wcstoul(numbers[i].c_str(), &pwszEnd, 10);
+                    if (numbers[i].empty() || *pwszEnd != L'\0' || number == 0)
+                    {
+                        ft.WriteErrorLine(L"ERROR: Invalid volume number '%s' in -shard, expected numbers from 1!", numbers[i].c_str());
+                        return errorCodeStart; // Default value: 1
+                    }
+                    shard.push_back(number - 1);
+                }
+                ft.WriteDebugLine(L"- Run the command as job %u for volumes '%s'", (unsigned)jobShards.size() + 1, value.c_str());
+                jobShards.push_back(shard);
+                runJobs = true; // Implied
+                continue;
+            }
+
+            // Check for the output capture options
+            if (MatchArgument(arguments[argIndex], L"capture"))
+            {
+                ft.WriteDebugLine(L"- Capture the output of the command");
+                outputCaptureSettings.enabled = true;
+                continue;
+            }
+            if (MatchArgument(arguments[argIndex], L"capture-file", outputCaptureSettings.logFile, true, false))
+            {
+                ft.WriteDebugLine(L"- Write the captured output to log file '%s'", outputCaptureSettings.logFile.c_str());
+                outputCaptureSettings.enabled = true; // Implied
+                continue;
+            }
+            if (MatchArgument(arguments[argIndex], L"capture-rotate", value, true, false))
+            {
+                outputCaptureSettings.Parse(value);
+                ft.WriteDebugLine(L"- Rotate the capture log file at %lu MB, keeping %lu old files",
+                    outputCaptureSettings.rotateSize, outputCaptureSettings.rotateCount);
+                continue;
+            }
+
+            // Check for the export options
+            if (MatchArgument(arguments[argIndex], L"export", exportDirectory, true, false))
+            {
+                ft.WriteDebugLine(L"- Export the shadow copies to image files in '%s'", exportDirectory.c_str());
+                continue;
+            }
+            if (MatchArgument(arguments[argIndex], L"export-io", value, true, false))
+            {
+                exportSettings.Parse(value);
+                ft.WriteDebugLine(L"- Export with blocks of %lu bytes, %lu at a time, %s, %s, compression %s, checksums 0x%lx",
+                    exportSettings.blockSize, exportSettings.queueDepth, exportSettings.sparse ? L"sparse" : L"not sparse",
+                    exportSettings.usedOnly ? L"clusters in use only" : L"all clusters", GetCompressionName(exportSettings.compression),
+                    exportSettings.checksums);
+                continue;
+            }
+
+            // Check for the diff option
+            if (MatchArgument(arguments[argIndex], L"diff") || MatchArgument(arguments[argIndex], L"diff", value, true, false))
+            {
+                if (!MatchArgument(arguments[argIndex], L"diff"))
+                {
+                    vector<wstring> ids = SplitWString(value, L',');
+                    for (size_t i = 0; i < ids.size(); ++i)
+                        diffSnapshotIds.push_back(WString2Guid(ids[i]));
+                }
+                ft.WriteDebugLine(L"- Export the changes since previous shadow copies, among %u given", (unsigned)diffSnapshotIds.size());
+                exportDiff = true;
+                continue;
+            }
+
+            // Check for the store option
+            if (MatchArgument(arguments[argIndex], L"store", storeDirectory, true, false))
+            {
+                ft.WriteDebugLine(L"- Export the shadow copies into the chunk store in '%s'", storeDirectory.c_str());
+                continue;
+            }
+
+            // Check for the copy options
+            if (MatchArgument(arguments[argIndex], L"copy", copyDirectory, true, false))
+            {
+                ft.WriteDebugLine(L"- Copy the files of the shadow copies to '%s'", copyDirectory.c_str());
+                continue;
+            }
+            if (MatchArgument(arguments[argIndex], L"copy-io", value, true, false))
+            {
+                copySettings.Parse(value);
+                ft.WriteDebugLine(L"- Copy with %lu threads, with buffers of %lu bytes", copySettings.threads, copySettings.bufferSize);
+                continue;
+            }
+
+            // Check for the changes option
+            if (MatchArgument(arguments[argIndex], L"changes", changesDirectory, true, false))
+            {
+                ft.WriteDebugLine(L"- List the changed files of the shadow copies with the index in '%s'", changesDirectory.c_str());
+                continue;
+            }
+
+            // Check for the journal option
+            if (MatchArgument(arguments[argIndex], L"journal", value, true, false))
+            {
+                journalSettings.Parse(value);
+                ft.WriteDebugLine(L"- Journal in '%s', crash at step %lu", journalSettings.directory.c_str(), journalSettings.crashAt);
+                continue;
+            }
+
+            // Check for the catalog option
+            if (MatchArgument(arguments[argIndex], L"catalog", catalogFileName, true, false))
+            {
+                ft.WriteDebugLine(L"- Record the run in the catalog '%s'", catalogFileName.c_str());
+                continue;
+            }
+
             // Create no-writer shadow copies (deprecated option kept only for compatibility with vshadow)
             if (MatchArgument(arguments[argIndex], L"nw"))
             {
@@ -424,15 +748,101 @@ int CommandLineParser::MainRoutine(vector<wstring>& arguments)
                     }
                 }
 
-                // Initialize the VSS client
-                m_vssClient.Initialize();
+                // The simulated shadow copy devices do not exist, so they cannot be mounted or exported
+                if (simulate && (mountSnapshots || !exportDirectory.empty() || !storeDirectory.empty() || !copyDirectory.empty() || !changesDirectory.empty()))
+                {
+                    ft.WriteErrorLine(L"ERROR: Options -mount, -drive, -export, -store, -copy and -changes cannot be combined with -simulate!");
+                    return errorCodeStart; // Default value: 1
+                }
+
+                // The daemon only serves requests, the volumes are given by the clients
+                if (serve || !pipelineSets.empty())
+                {
+                    ft.WriteErrorLine(L"ERROR: Options -serve and -set cannot be combined with volumes!");
+                    return errorCodeStart; // Default value: 1
+                }
+
+                if (exportDiff && exportDirectory.empty())
+                {
+                    ft.WriteErrorLine(L"ERROR: Option -diff requires -export!");
+                    return errorCodeStart; // Default value: 1
+                }
+
+                // The previous shadow copies are looked up through the VSS client, which is not initialized when connected to a daemon
+                if (exportDiff && !connectPipeName.empty())
+                {
+                    ft.WriteErrorLine(L"ERROR: Option -diff cannot be combined with -connect!");
+                    return errorCodeStart; // Default value: 1
+                }
+
+                // The jobs are for the shadow copies of the single set, and need a command to run
+                if (runJobs && execCommand.empty())
+                {
+                    ft.WriteErrorLine(L"ERROR: Options -jobs and -shard require -exec!");
+                    return errorCodeStart; // Default value: 1
+                }
+                for (size_t i = 0; i < jobShards.size(); ++i)
+                {
+                    for (size_t j = 0; j < jobShards[i].size(); ++j)
+                    {
+                        if (jobShards[i][j] >= volumeList.size())
+                        {
+                            ft.WriteErrorLine(L"ERROR: Volume number %u of -shard is larger than the number of volumes!", (unsigned)jobShards[i][j] + 1);
+                            return errorCodeStart; // Default value: 1
+                        }
+                    }
+                }
+
+                // Record the run (optional), from here on a run without an end in the catalog was interrupted
+                SnapshotCatalog catalog(catalogFileName);
+                SnapshotCatalog* pCatalog = catalogFileName.empty() ? NULL : &catalog;
+                if (pCatalog)
+                    pCatalog->BeginRun(GetCommandLine());
+
+                // Create the shadow copy set, or let the daemon create it and keep it until the connection is closed
+                DaemonClient daemonClient;
+                if (connectPipeName.empty())
+                {
+                    // Initialize the VSS client
+                    m_vssClient.Initialize();
+
+                    // Undo what interrupted runs left behind, and record what this run creates before creating it
+                    m_vssClient.OpenJournal(journalSettings);
+
+                    // Create the shadow copy set
+                    m_vssClient.CreateSnapshotSet(volumeList);
+                }
+                else
+                {
+                    // The shadow copy set is the daemon's, only the mounts are recorded
+                    m_vssClient.OpenJournal(journalSettings);
+
+                    SnapshotSetInfo snapshotSet;
+                    daemonClient.Connect(connectPipeName);
+                    wstring backendName = daemonClient.CreateSnapshotSet(volumeList, snapshotSet);
+                    m_vssClient.UseSnapshotSet(snapshotSet);
 
-                // Create the shadow copy set
-                m_vssClient.CreateSnapshotSet(volumeList);
+                    if ((mountSnapshots || !exportDirectory.empty() || !storeDirectory.empty() || !copyDirectory.empty() || !changesDirectory.empty()) && backendName == L"simulated")
+                    {
+                        ft.WriteErrorLine(L"ERROR: Options -mount, -drive, -export, -store, -copy and -changes cannot be used with a daemon running with -simulate!");
+
+                        // The run is already recorded, and ends here with the error
+                        if (pCatalog)
+                            pCatalog->EndRun(errorCodeStart);
+                        return errorCodeStart; // Default value: 1
+                    }
+                }
+
+                if (pCatalog)
+                    pCatalog->AddSnapshotSet(m_vssClient.GetLatestSnapshotSet(), volumeList);
 
                 // Mount drives (optional) - do it before environmentScript and setProcessEnvironment because they include the mounted drives information!
                 if (mountSnapshots)
+                {
                     m_vssClient.MountSnapshots(mountDriveLetters);
+                    if (pCatalog)
+                        pCatalog->AddMounts(m_vssClient.GetLatestSnapshotSet());
+                }
 
                 // Generate management scripts (optional)
                 if (environmentScript.length() > 0)
@@ -442,9 +852,67 @@ int CommandLineParser::MainRoutine(vector<wstring>& arguments)
                 if (setProcessEnvironment)
                     m_vssClient.SetProcessEnvironment();
 
-                // Executing the custom command (optional)
-                if (execCommand.length() > 0)
+                // Export the shadow copies to image files (optional), before the command which may use them
+                if (!exportDirectory.empty())
+                {
+                    ImageExporter exporter(exportSettings);
+                    vector<SnapshotInfo> previousSnapshots;
+                    if (exportDiff)
+                        FindPreviousSnapshots(m_vssClient.GetBackend(), m_vssClient.GetLatestSnapshotSet(), diffSnapshotIds, previousSnapshots);
+                    exporter.ExportSnapshotSet(m_vssClient.GetLatestSnapshotSet(), exportDirectory, exportDiff ? &previousSnapshots : NULL);
+                }
+                if (!storeDirectory.empty())
+                {
+                    ImageExporter exporter(exportSettings);
+                    exporter.StoreSnapshotSet(m_vssClient.GetLatestSnapshotSet(), storeDirectory);
+                }
+
+                // Copy the files of the shadow copies (optional), also before the command
+                if (!copyDirectory.empty())
+                {
+                    FileTreeCopier copier(copySettings);
+                    copier.CopySnapshotSet(m_vssClient.GetLatestSnapshotSet(), copyDirectory);
+                }
+
+                // List the changed files of the shadow copies (optional), also before the command
+                if (!changesDirectory.empty())
+                {
+                    FileIndexer indexer;
+                    indexer.IndexSnapshotSet(m_vssClient.GetLatestSnapshotSet(), changesDirectory);
+                }
+
+                // Executing the custom command (optional), as a single command or as separate jobs
+                OutputCapture outputCapture(outputCaptureSettings);
+                if (outputCaptureSettings.enabled && execCommand.length() > 0)
+                    outputCapture.Open();
+                OutputCapture* pOutputCapture = outputCaptureSettings.enabled ? &outputCapture : NULL;
+                ULONGLONG ullCommandStartTick = GetTickCount64();
+                if (runJobs)
+                {
+                    JobPool jobPool(m_vssClient, (jobConcurrency == 0) ? JOBPOOL_MAX_CONCURRENCY : jobConcurrency, pOutputCapture);
+                    if (jobShards.empty())
+                    {
+                        for (size_t i = 0; i < m_vssClient.GetSnapshotCount(); ++i)
+                            jobPool.Add(vector<size_t>(1, i));
+                    }
+                    else
+                    {
+                        for (size_t i = 0; i < jobShards.size(); ++i)
+                            jobPool.Add(jobShards[i]);
+                    }
+                    exitCode = jobPool.Run(execCommand, execArguments, addExecArgumentQuotes, expandExecArgumentEnvVars);
+                }
+                else if (execCommand.length() > 0 && pOutputCapture)
+                {
+                    // The output is done when the command exits, unless it has left children holding on to it
+                    HANDLE hProcess = pOutputCapture->StartCommand(L"exec", execCommand, execArguments, addExecArgumentQuotes, expandExecArgumentEnvVars);
+                    pOutputCapture->Flush();
+                    exitCode = WaitForCommand(hProcess);
+                }
+                else if (execCommand.length() > 0)
                     exitCode = ExecCommand(execCommand, execArguments, addExecArgumentQuotes, expandExecArgumentEnvVars);
+                if (pCatalog && execCommand.length() > 0)
+                    pCatalog->AddCommandResult(exitCode, GetTickCount64() - ullCommandStartTick);
 
                 if (waitBeforeCleanup)
                 {
@@ -456,6 +924,12 @@ int CommandLineParser::MainRoutine(vector<wstring>& arguments)
                 if (mountSnapshots)
                     m_vssClient.UnmountSnapshots();
 
+                if (!connectPipeName.empty())
+                    daemonClient.Release();
+
+                if (pCatalog)
+                    pCatalog->EndRun(exitCode);
+
                 ft.WriteInfoLine(L"ShadowRun completed with exit code %d", exitCode);
 
                 return exitCode; // Default value: 0
@@ -469,6 +943,57 @@ int CommandLineParser::MainRoutine(vector<wstring>& arguments)
             return errorCodeStart;  // Default value: 1
         }
 
+        // Create the shadow copy sets given with -set, running the command for each
+        if (!pipelineSets.empty())
+        {
+            // Each set needs its own script, drive letters and confirmation, and is created by this process
+            if (!environmentScript.empty() || !mountDriveLetters.empty() || waitBeforeCleanup || serve || !connectPipeName.empty() || runJobs || !exportDirectory.empty() || exportDiff || !storeDirectory.empty() || !copyDirectory.empty() || !changesDirectory.empty() || !catalogFileName.empty())
+            {
+                ft.WriteErrorLine(L"ERROR: Options -script, -drive, -wait, -serve, -connect, -jobs, -shard, -export, -diff, -store, -copy, -changes and -catalog cannot be combined with -set!");
+                return errorCodeStart; // Default value: 1
+            }
+            if (simulate && mountSnapshots)
+            {
+                ft.WriteErrorLine(L"ERROR: Options -mount and -drive cannot be combined with -simulate!");
+                return errorCodeStart; // Default value: 1
+            }
+
+            pipelineSettings.simulate = simulate;
+            pipelineSettings.simulationSettings = daemonSettings.simulationSettings;
+            pipelineSettings.asyncWaitSettings = daemonSettings.asyncWaitSettings;
+            pipelineSettings.execCommand = execCommand;
+            pipelineSettings.execArguments = execArguments;
+            pipelineSettings.addExecArgumentQuotes = addExecArgumentQuotes;
+            pipelineSettings.expandExecArgumentEnvVars = expandExecArgumentEnvVars;
+            pipelineSettings.setProcessEnvironment = setProcessEnvironment;
+            pipelineSettings.mountSnapshots = mountSnapshots;
+
+            OutputCapture outputCapture(outputCaptureSettings);
+            if (outputCaptureSettings.enabled && !execCommand.empty())
+                outputCapture.Open();
+            SnapshotPipeline pipeline(pipelineSettings, outputCaptureSettings.enabled ? &outputCapture : NULL);
+            for (size_t i = 0; i < pipelineSets.size(); ++i)
+                pipeline.Add(pipelineSets[i]);
+            exitCode = pipeline.Run();
+
+            ft.WriteInfoLine(L"ShadowRun completed with exit code %d", exitCode);
+            return exitCode;
+        }
+
+        // Run as daemon until stopped
+        if (serve)
+        {
+            // The daemon creates shadow copies for its clients, which record their own runs
+            if (!catalogFileName.empty())
+            {
+                ft.WriteErrorLine(L"ERROR: Option -catalog cannot be combined with -serve!");
+                return errorCodeStart; // Default value: 1
+            }
+            SnapshotDaemon daemon(daemonSettings);
+            daemon.Run();
+            return EXIT_SUCCESS; // Default value: 0
+        }
+
         ft.WriteErrorLine(L"ERROR: Missing volume parameter!");
         PrintUsage(true);
         return errorCodeStart; // Default value: 1
@@ -11,9 +11,28 @@
 #include <vds.h>
 
 // Our includes
+#include "tracebuffer.h"
 #include "tracing.h"
 #include "util.h"
+#include "backend.h"
+#include "journal.h"
+#include "asyncwaiter.h"
 #include "vssclient.h"
+#include "daemon.h"
+#include "capture.h"
+#include "volumebitmap.h"
+#include "blockcompare.h"
+#include "imageexport.h"
+#include "compression.h"
+#include "checksum.h"
+#include "manifest.h"
+#include "blockdiff.h"
+#include "chunkstore.h"
+#include "filecopy.h"
+#include "fileindex.h"
+#include "catalog.h"
+#include "pipeline.h"
+#include "jobpool.h"
 
 
 // Shadow Copy Provider GUID {b5946137-7b9f-4925-af80-51abd60b20d5}
@@ -17,15 +17,23 @@
 
 #include <comdef.h>
 #include <shlwapi.h>
+#include <winioctl.h>
+#include <bcrypt.h>
+#include <compressapi.h>
 
 
 // STL includes
 #include <vector>
+#include <deque>
+#include <map>
 #include <algorithm>
 #include <string>
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <memory>
+#include <atomic>
+#include <type_traits>
 
 using namespace std;
 
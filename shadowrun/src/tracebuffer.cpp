@@ -0,0 +1,541 @@
+// Main header
+#include "stdafx.h"
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Trace records
+//
+
+
+// Store an integer argument
+void TraceRecord::AddValue(TraceArgType type, ULONGLONG value)
+{
+    size_t size = (type == TRACE_ARG_INT32) ? sizeof(INT32) : sizeof(ULONGLONG);
+    if (argCount == TRACE_RECORD_MAX_ARGS || payloadSize + size > TRACE_RECORD_PAYLOAD_SIZE)
+        return;
+    if (type == TRACE_ARG_INT32)
+    {
+        INT32 value32 = (INT32)value;
+        memcpy(payload + payloadSize, &value32, size);
+    }
+    else
+    {
+        memcpy(payload + payloadSize, &value, size);
+    }
+    argTypes[argCount++] = (BYTE)type;
+    payloadSize += (WORD)size;
+}
+
+
+void TraceRecord::AddArg(double value)
+{
+    ULONGLONG bits;
+    memcpy(&bits, &value, sizeof(bits));
+    AddValue(TRACE_ARG_DOUBLE, bits);
+}
+
+
+void TraceRecord::AddArg(const wchar_t* value)
+{
+    AddString(TRACE_ARG_WSTR, value, value ? wcslen(value) : 0, sizeof(wchar_t));
+}
+
+
+void TraceRecord::AddArg(const char* value)
+{
+    AddString(TRACE_ARG_STR, value, value ? strlen(value) : 0, sizeof(char));
+}
+
+
+// Store a string argument, truncated to the remaining space
+void TraceRecord::AddString(TraceArgType type, const void* value, size_t length, size_t charSize)
+{
+    if (argCount == TRACE_RECORD_MAX_ARGS || payloadSize + sizeof(WORD) > TRACE_RECORD_PAYLOAD_SIZE)
+        return;
+    size_t available = (TRACE_RECORD_PAYLOAD_SIZE - payloadSize - sizeof(WORD)) / charSize;
+    WORD count = (WORD)min(length, available);
+    memcpy(payload + payloadSize, &count, sizeof(WORD));
+    memcpy(payload + payloadSize + sizeof(WORD), value, count * charSize);
+    argTypes[argCount++] = (BYTE)type;
+    payloadSize += (WORD)(sizeof(WORD) + count * charSize);
+}
+
+
+TraceRing::TraceRing():
+    m_head(0), m_tail(0)
+{
+    ZeroMemory(m_siteCache, sizeof(m_siteCache));
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Trace buffer
+//
+
+
+thread_local TraceRing* TraceBuffer::t_pRing = NULL;
+
+
+TraceBuffer::TraceBuffer():
+    m_hThread(NULL), m_hFlushEvent(NULL), m_hStopEvent(NULL), m_sitesWritten(0), m_dropped(0)
+{
+    InitializeSRWLock(&m_lock);
+}
+
+
+TraceBuffer::~TraceBuffer()
+{
+    Stop();
+}
+
+
+// Create the trace file and start the background thread
+void TraceBuffer::Start(const wstring& fileName)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    m_file.open(fileName.c_str(), ios::out | ios::binary | ios::trunc);
+    if (!m_file)
+    {
+        ft.WriteErrorLine(L"ERROR: Cannot create trace file '%s'!", fileName.c_str());
+        throw(E_INVALIDARG);
+    }
+
+    TraceFileHeader header;
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    header.signature = TRACE_FILE_SIGNATURE;
+    header.version = TRACE_FILE_VERSION;
+    header.frequency = frequency.QuadPart;
+    m_file.write((const char*)&header, sizeof(header));
+
+    m_hFlushEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    m_hStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (m_hFlushEvent == NULL || m_hStopEvent == NULL)
+    {
+        HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+        ft.WriteErrorLine(L"ERROR: Cannot create trace events! (0x%08lx)", hr);
+        throw(hr);
+    }
+
+    m_hThread = CreateThread(NULL, 0, FlushThread, this, 0, NULL);
+    if (m_hThread == NULL)
+    {
+        HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+        ft.WriteErrorLine(L"ERROR: Cannot start trace thread! (0x%08lx)", hr);
+        throw(hr);
+    }
+}
+
+
+// Write all remaining records, stop the background thread and close the file
+// Must not be called while other threads are recording
+void TraceBuffer::Stop()
+{
+    if (m_hThread != NULL)
+    {
+        SetEvent(m_hStopEvent);
+        WaitForSingleObject(m_hThread, INFINITE);
+        CloseHandle(m_hThread);
+        m_hThread = NULL;
+    }
+    if (m_hFlushEvent != NULL)
+    {
+        CloseHandle(m_hFlushEvent);
+        m_hFlushEvent = NULL;
+    }
+    if (m_hStopEvent != NULL)
+    {
+        CloseHandle(m_hStopEvent);
+        m_hStopEvent = NULL;
+    }
+    if (m_file.is_open())
+    {
+        Flush();
+        TraceChunkHeader chunk = { TRACE_CHUNK_DROPPED, 1 };
+        ULONGLONG dropped = m_dropped.load();
+        m_file.write((const char*)&chunk, sizeof(chunk));
+        m_file.write((const char*)&dropped, sizeof(dropped));
+        m_file.close();
+    }
+    t_pRing = NULL;
+}
+
+
+// Ring buffer of the current thread, created on first use
+TraceRing* TraceBuffer::GetThreadRing()
+{
+    if (t_pRing == NULL)
+    {
+        unique_ptr<TraceRing> pRing(new TraceRing());
+        AcquireSRWLockExclusive(&m_lock);
+        m_rings.push_back(move(pRing));
+        t_pRing = m_rings.back().get();
+        ReleaseSRWLockExclusive(&m_lock);
+    }
+    return t_pRing;
+}
+
+
+// Fill in the record header, returns NULL if the ring is full
+TraceRecord* TraceBuffer::BeginRecord(TraceRing* pRing, LPCWSTR file, int line, LPCWSTR functionName, LPCWSTR format)
+{
+    TraceRecord* pRecord = pRing->Begin();
+    if (pRecord == NULL)
+    {
+        m_dropped++;
+        return NULL;
+    }
+
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    TraceSite site = { file, line, functionName, format };
+    pRecord->timestamp = counter.QuadPart;
+    pRecord->siteId = GetSiteId(pRing, site);
+    pRecord->threadId = GetCurrentThreadId();
+    pRecord->argCount = 0;
+    pRecord->reserved = 0;
+    pRecord->payloadSize = 0;
+    return pRecord;
+}
+
+
+// Identifier of a call site, added to the call site table if new
+// The table is only locked the first time a thread sees a call site
+DWORD TraceBuffer::GetSiteId(TraceRing* pRing, const TraceSite& site)
+{
+    ULONG index = (ULONG)(((ULONG_PTR)site.format >> 1) ^ (ULONG)site.line) & (TRACE_SITE_CACHE_SIZE - 1);
+    if (pRing->m_siteCache[index] == site)
+        return pRing->m_siteCacheIds[index];
+
+    DWORD siteId = 0;
+    AcquireSRWLockExclusive(&m_lock);
+    while (siteId < m_sites.size() && !(m_sites[siteId] == site))
+        siteId++;
+    if (siteId == m_sites.size())
+        m_sites.push_back(site);
+    ReleaseSRWLockExclusive(&m_lock);
+
+    pRing->m_siteCache[index] = site;
+    pRing->m_siteCacheIds[index] = siteId;
+    return siteId;
+}
+
+
+// Write new call sites and all published records to file
+void TraceBuffer::Flush()
+{
+    // Copy the list of rings, and write the call sites added so far. Any record
+    // published before this point refers to one of these.
+    AcquireSRWLockShared(&m_lock);
+    vector<TraceRing*> rings;
+    for (size_t i = 0; i < m_rings.size(); i++)
+        rings.push_back(m_rings[i].get());
+    if (m_sitesWritten < m_sites.size())
+    {
+        TraceChunkHeader chunk = { TRACE_CHUNK_SITES, (DWORD)(m_sites.size() - m_sitesWritten) };
+        m_file.write((const char*)&chunk, sizeof(chunk));
+        for (; m_sitesWritten < m_sites.size(); m_sitesWritten++)
+        {
+            const TraceSite& site = m_sites[m_sitesWritten];
+            TraceSiteHeader siteHeader = { (DWORD)m_sitesWritten, (DWORD)site.line,
+                (DWORD)wcslen(site.file), (DWORD)wcslen(site.function), (DWORD)wcslen(site.format) };
+            m_file.write((const char*)&siteHeader, sizeof(siteHeader));
+            m_file.write((const char*)site.file, siteHeader.fileLength * sizeof(WCHAR));
+            m_file.write((const char*)site.function, siteHeader.functionLength * sizeof(WCHAR));
+            m_file.write((const char*)site.format, siteHeader.formatLength * sizeof(WCHAR));
+        }
+    }
+    ReleaseSRWLockShared(&m_lock);
+
+    for (size_t i = 0; i < rings.size(); i++)
+    {
+        TraceRing* pRing = rings[i];
+        ULONG tail = pRing->m_tail.load(memory_order_relaxed);
+        ULONG head = pRing->m_head.load(memory_order_acquire);
+        if (head == tail)
+            continue;
+
+        TraceChunkHeader chunk = { TRACE_CHUNK_RECORDS, head - tail };
+        m_file.write((const char*)&chunk, sizeof(chunk));
+
+        // Write the records in up to two contiguous parts, before and after the end of the ring
+        ULONG first = tail & (TRACE_RING_SIZE - 1);
+        ULONG count = min(head - tail, TRACE_RING_SIZE - first);
+        m_file.write((const char*)&pRing->m_records[first], count * sizeof(TraceRecord));
+        if (count < head - tail)
+            m_file.write((const char*)&pRing->m_records[0], (head - tail - count) * sizeof(TraceRecord));
+
+        pRing->m_tail.store(head, memory_order_release);
+    }
+    m_file.flush();
+}
+
+
+// Background thread
+DWORD WINAPI TraceBuffer::FlushThread(LPVOID pParameter)
+{
+    TraceBuffer* pBuffer = (TraceBuffer*)pParameter;
+    HANDLE handles[] = { pBuffer->m_hStopEvent, pBuffer->m_hFlushEvent };
+    while (WaitForMultipleObjects(2, handles, FALSE, TRACE_FLUSH_INTERVAL) != WAIT_OBJECT_0)
+        pBuffer->Flush();
+    return 0;
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Trace file decoder
+//
+
+
+// Argument read from a trace record
+struct TraceArg
+{
+    TraceArgType    type;
+    ULONGLONG       value;
+    wstring         wideString;
+    string          narrowString;
+};
+
+
+// Read the arguments stored in a record
+static vector<TraceArg> ReadTraceArgs(const TraceRecord& record)
+{
+    vector<TraceArg> args;
+    size_t offset = 0;
+    for (int i = 0; i < record.argCount && i < TRACE_RECORD_MAX_ARGS; i++)
+    {
+        TraceArg arg;
+        arg.type = (TraceArgType)record.argTypes[i];
+        arg.value = 0;
+        if (arg.type == TRACE_ARG_INT32)
+        {
+            INT32 value32;
+            memcpy(&value32, record.payload + offset, sizeof(value32));
+            arg.value = (ULONGLONG)(LONGLONG)value32;
+            offset += sizeof(value32);
+        }
+        else if (arg.type == TRACE_ARG_INT64 || arg.type == TRACE_ARG_DOUBLE)
+        {
+            memcpy(&arg.value, record.payload + offset, sizeof(arg.value));
+            offset += sizeof(arg.value);
+        }
+        else
+        {
+            WORD count;
+            memcpy(&count, record.payload + offset, sizeof(count));
+            offset += sizeof(count);
+            if (arg.type == TRACE_ARG_WSTR)
+            {
+                arg.wideString.resize(count);
+                memcpy(&arg.wideString[0], record.payload + offset, count * sizeof(WCHAR));
+                offset += count * sizeof(WCHAR);
+            }
+            else
+            {
+                arg.narrowString.resize(count);
+                memcpy(&arg.narrowString[0], record.payload + offset, count);
+                offset += count;
+            }
+        }
+        if (offset > record.payloadSize)
+            break;
+        args.push_back(arg);
+    }
+    return args;
+}
+
+
+// Format a single argument with a printf conversion specification
+// The specification is rebuilt from the flags, width and precision given in the format string,
+// and the type of the stored argument, so that a mismatch cannot crash the decoder.
+static wstring FormatTraceArg(const wstring& flags, WCHAR conversion, const TraceArg& arg)
+{
+    WCHAR buffer[MAX_VPRINTF_BUFFER_SIZE];
+    wstring spec = L"%" + flags;
+    switch (arg.type)
+    {
+    case TRACE_ARG_INT32:
+        spec += wcschr(L"diouxXc", conversion) ? wstring(1, conversion) : wstring(L"d");
+        StringCchPrintfW(buffer, MAX_VPRINTF_BUFFER_SIZE, spec.c_str(), (INT32)arg.value);
+        break;
+    case TRACE_ARG_INT64:
+        if (conversion == L'p')
+        {
+            spec += L"p";
+            StringCchPrintfW(buffer, MAX_VPRINTF_BUFFER_SIZE, spec.c_str(), (void*)(ULONG_PTR)arg.value);
+        }
+        else
+        {
+            spec += wcschr(L"diouxX", conversion) ? wstring(L"ll") + conversion : wstring(L"lld");
+            StringCchPrintfW(buffer, MAX_VPRINTF_BUFFER_SIZE, spec.c_str(), (LONGLONG)arg.value);
+        }
+        break;
+    case TRACE_ARG_DOUBLE:
+        {
+            double value;
+            memcpy(&value, &arg.value, sizeof(value));
+            spec += wcschr(L"eEfFgGaA", conversion) ? wstring(1, conversion) : wstring(L"g");
+            StringCchPrintfW(buffer, MAX_VPRINTF_BUFFER_SIZE, spec.c_str(), value);
+        }
+        break;
+    case TRACE_ARG_WSTR:
+        spec += L"ls";
+        StringCchPrintfW(buffer, MAX_VPRINTF_BUFFER_SIZE, spec.c_str(), arg.wideString.c_str());
+        break;
+    case TRACE_ARG_STR:
+        spec += L"hs";
+        StringCchPrintfW(buffer, MAX_VPRINTF_BUFFER_SIZE, spec.c_str(), arg.narrowString.c_str());
+        break;
+    default:
+        return L"?";
+    }
+    return buffer;
+}
+
+
+// Format a trace message from the format string of the call site and the arguments in the record
+// Arguments missing from the record, because they did not fit, are shown as "..."
+static wstring FormatTraceMessage(const wstring& format, const TraceRecord& record)
+{
+    vector<TraceArg> args = ReadTraceArgs(record);
+    size_t argIndex = 0;
+    wstring message;
+    for (size_t i = 0; i < format.length(); i++)
+    {
+        if (format[i] != L'%')
+        {
+            message += format[i];
+            continue;
+        }
+        if (i + 1 < format.length() && format[i + 1] == L'%')
+        {
+            message += L'%';
+            i++;
+            continue;
+        }
+
+        // Flags, width and precision are kept, with any '*' replaced by the value of the argument
+        wstring flags;
+        for (i++; i < format.length() && wcschr(L"-+ #0123456789.*", format[i]); i++)
+        {
+            if (format[i] == L'*')
+                flags += (argIndex < args.size()) ? to_wstring((INT32)args[argIndex++].value) : L"0";
+            else
+                flags += format[i];
+        }
+
+        // Size prefixes are skipped, the stored type of the argument is used instead
+        while (i < format.length() && wcschr(L"hlLwIjzt3264", format[i]))
+            i++;
+        if (i == format.length())
+            break;
+
+        if (argIndex < args.size())
+            message += FormatTraceArg(flags, format[i], args[argIndex++]);
+        else
+            message += L"...";
+    }
+    return message;
+}
+
+
+// Print the trace messages in a trace file, in the same format as they are printed by -log-level=trace
+void DecodeTraceFile(const wstring& fileName)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    ifstream file(fileName.c_str(), ios::in | ios::binary);
+    TraceFileHeader header;
+    if (!file || !file.read((char*)&header, sizeof(header)))
+    {
+        ft.WriteErrorLine(L"ERROR: Cannot read trace file '%s'!", fileName.c_str());
+        throw(E_INVALIDARG);
+    }
+    if (header.signature != TRACE_FILE_SIGNATURE || header.version != TRACE_FILE_VERSION)
+    {
+        ft.WriteErrorLine(L"ERROR: File '%s' is not a trace file written by this version of ShadowRun!", fileName.c_str());
+        throw(E_INVALIDARG);
+    }
+
+    // Read the whole file, records are written per thread so they must be sorted on time
+    struct DecodedSite
+    {
+        wstring     fileName;
+        int         line;
+        wstring     function;
+        wstring     format;
+    };
+    vector<DecodedSite> sites;
+    vector<TraceRecord> records;
+    ULONGLONG dropped = 0;
+    bool complete = false;
+    TraceChunkHeader chunk;
+    while (file.read((char*)&chunk, sizeof(chunk)))
+    {
+        if (chunk.type == TRACE_CHUNK_SITES)
+        {
+            for (DWORD i = 0; i < chunk.count && file; i++)
+            {
+                TraceSiteHeader siteHeader;
+                if (!file.read((char*)&siteHeader, sizeof(siteHeader)))
+                    break;
+                DecodedSite site;
+                site.line = (int)siteHeader.line;
+                site.fileName.resize(siteHeader.fileLength);
+                site.function.resize(siteHeader.functionLength);
+                site.format.resize(siteHeader.formatLength);
+                file.read((char*)&site.fileName[0], siteHeader.fileLength * sizeof(WCHAR));
+                file.read((char*)&site.function[0], siteHeader.functionLength * sizeof(WCHAR));
+                file.read((char*)&site.format[0], siteHeader.formatLength * sizeof(WCHAR));
+                if (sites.size() <= siteHeader.siteId)
+                    sites.resize(siteHeader.siteId + 1);
+                sites[siteHeader.siteId] = site;
+            }
+        }
+        else if (chunk.type == TRACE_CHUNK_RECORDS)
+        {
+            size_t first = records.size();
+            records.resize(first + chunk.count);
+            if (!file.read((char*)&records[first], chunk.count * sizeof(TraceRecord)))
+            {
+                records.resize(first + (size_t)file.gcount() / sizeof(TraceRecord));
+                break;
+            }
+        }
+        else if (chunk.type == TRACE_CHUNK_DROPPED)
+        {
+            if (file.read((char*)&dropped, sizeof(dropped)))
+                complete = true;
+            break;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    stable_sort(records.begin(), records.end(),
+        [](const TraceRecord& a, const TraceRecord& b) { return a.timestamp < b.timestamp; });
+
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        const TraceRecord& record = records[i];
+        if (record.siteId >= sites.size())
+            continue;
+        const DecodedSite& site = sites[record.siteId];
+        size_t pos = site.fileName.find_last_of(L"\\");
+        wstring siteFileName = (pos == wstring::npos)? site.fileName: site.fileName.substr(pos+1);
+        wprintf(L"[[%40s @ %10s:%4d]] %s\n", site.function.c_str(), siteFileName.c_str(), site.line,
+            FormatTraceMessage(site.format, record).c_str());
+    }
+
+    if (!complete)
+        ft.WriteErrorLine(L"WARNING: Trace file '%s' is incomplete, the program writing it may have been terminated", fileName.c_str());
+    if (dropped > 0)
+        ft.WriteErrorLine(L"WARNING: %llu trace records were dropped because the trace buffer was full", dropped);
+}
@@ -0,0 +1,269 @@
+#pragma once
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Binary trace file
+//
+//  With the -trace-file option trace messages are not formatted and printed,
+//  but stored as fixed size binary records in a ring buffer owned by the
+//  tracing thread, and written to the file by a background thread. The call
+//  site (file, line, function and format string) of a message is stored once,
+//  in a table of call sites, and the arguments are stored unformatted. So
+//  recording a message does not format anything, and never waits for the
+//  background thread: If the ring buffer is full the record is dropped and
+//  counted. The file is rendered into the regular trace output by the
+//  -decode-trace option.
+//
+//  File layout: A TraceFileHeader followed by chunks, each starting with a
+//  TraceChunkHeader. A call site is always written before the first record
+//  referring to it. The file is written and read by the same program, so the
+//  structures are stored as they are in memory.
+//
+
+// Identifies a trace file ("SRTF")
+const DWORD TRACE_FILE_SIGNATURE = 0x46545253;
+const DWORD TRACE_FILE_VERSION = 1;
+
+// Number of records in the ring buffer of each thread, must be a power of two
+const ULONG TRACE_RING_SIZE = 1024;
+
+// Number of call sites remembered by each thread without locking the call site table, must be a power of two
+const ULONG TRACE_SITE_CACHE_SIZE = 64;
+
+// Maximum number of arguments stored in a record
+const int TRACE_RECORD_MAX_ARGS = 16;
+
+// Space for the arguments in a record, long strings are truncated to fit
+const int TRACE_RECORD_PAYLOAD_SIZE = 220;
+
+// Milliseconds between each time the background thread writes records to file
+const DWORD TRACE_FLUSH_INTERVAL = 100;
+
+
+// Type of an argument stored in a record
+enum TraceArgType
+{
+    TRACE_ARG_INT32,
+    TRACE_ARG_INT64,
+    TRACE_ARG_DOUBLE,
+    TRACE_ARG_WSTR,     // WORD character count followed by the characters
+    TRACE_ARG_STR,      // WORD character count followed by the characters
+};
+
+
+// Type of a chunk in the file
+enum TraceChunkType
+{
+    TRACE_CHUNK_SITES,      // TraceSiteHeader entries, each followed by the file, function and format strings
+    TRACE_CHUNK_RECORDS,    // TraceRecord entries
+    TRACE_CHUNK_DROPPED,    // ULONGLONG with the number of dropped records, at the end of the file
+};
+
+
+struct TraceFileHeader
+{
+    DWORD       signature;
+    DWORD       version;
+    LONGLONG    frequency;      // From QueryPerformanceFrequency
+};
+
+
+struct TraceChunkHeader
+{
+    DWORD       type;           // TraceChunkType
+    DWORD       count;          // Number of entries
+};
+
+
+struct TraceSiteHeader
+{
+    DWORD       siteId;
+    DWORD       line;
+    DWORD       fileLength;     // Character counts of the strings following the header
+    DWORD       functionLength;
+    DWORD       formatLength;
+};
+
+
+// Fixed size trace record
+struct TraceRecord
+{
+    LONGLONG    timestamp;      // From QueryPerformanceCounter
+    DWORD       siteId;
+    DWORD       threadId;
+    BYTE        argCount;
+    BYTE        argTypes[TRACE_RECORD_MAX_ARGS];
+    BYTE        reserved;
+    WORD        payloadSize;
+    BYTE        payload[TRACE_RECORD_PAYLOAD_SIZE];
+
+    // Store an argument, in the same way as they are passed to printf
+    void AddArg(const wchar_t* value);
+    void AddArg(const char* value);
+    void AddArg(const void* value) { AddValue(TRACE_ARG_INT64, (ULONGLONG)(ULONG_PTR)value); }
+    void AddArg(double value);
+
+    template<typename T>
+    typename enable_if<is_integral<T>::value || is_enum<T>::value>::type AddArg(T value)
+    {
+        if (sizeof(T) > sizeof(INT32))
+            AddValue(TRACE_ARG_INT64, (ULONGLONG)value);
+        else
+            AddValue(TRACE_ARG_INT32, (ULONGLONG)(INT32)value);
+    }
+
+private:
+
+    // Store an integer argument
+    void AddValue(TraceArgType type, ULONGLONG value);
+
+    // Store a string argument, truncated to the remaining space
+    void AddString(TraceArgType type, const void* value, size_t length, size_t charSize);
+};
+
+static_assert(sizeof(TraceRecord) == 256, "Unexpected trace record size");
+
+
+// Call site of a trace message
+struct TraceSite
+{
+    LPCWSTR     file;
+    int         line;
+    LPCWSTR     function;
+    LPCWSTR     format;
+
+    bool operator==(const TraceSite& other) const
+    {
+        return format == other.format && line == other.line && function == other.function && file == other.file;
+    }
+};
+
+
+// Single producer single consumer ring buffer of records
+// Written only by the owning thread and read only by the background thread
+class TraceRing
+{
+public:
+
+    TraceRing();
+
+    // Next free record, or NULL if the ring is full
+    TraceRecord* Begin()
+    {
+        ULONG head = m_head.load(memory_order_relaxed);
+        if (head - m_tail.load(memory_order_acquire) == TRACE_RING_SIZE)
+            return NULL;
+        return &m_records[head & (TRACE_RING_SIZE - 1)];
+    }
+
+    // Publish the record returned by Begin, returns true if the ring is now half full
+    bool Commit()
+    {
+        ULONG head = m_head.load(memory_order_relaxed) + 1;
+        m_head.store(head, memory_order_release);
+        return head - m_tail.load(memory_order_relaxed) == TRACE_RING_SIZE / 2;
+    }
+
+    // Cache of site identifiers used by the owning thread, indexed by a hash of the call site
+    TraceSite           m_siteCache[TRACE_SITE_CACHE_SIZE];
+    DWORD               m_siteCacheIds[TRACE_SITE_CACHE_SIZE];
+
+    TraceRecord         m_records[TRACE_RING_SIZE];
+
+    // Next record to be written by the owning thread
+    atomic<ULONG>       m_head;
+
+    // Keep the indexes written by the two threads on separate cache lines
+    BYTE                m_padding[64];
+
+    // Next record to be read by the background thread
+    atomic<ULONG>       m_tail;
+};
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Writes trace records to a binary trace file
+//
+
+class TraceBuffer
+{
+public:
+
+    TraceBuffer();
+
+    ~TraceBuffer();
+
+    // Create the trace file and start the background thread
+    // Throws HRESULT on failure
+    void Start(const wstring& fileName);
+
+    // Write all remaining records, stop the background thread and close the file
+    void Stop();
+
+    // Record a trace message
+    template<typename... Args>
+    void Record(LPCWSTR file, int line, LPCWSTR functionName, LPCWSTR format, Args... args)
+    {
+        TraceRing* pRing = GetThreadRing();
+        TraceRecord* pRecord = BeginRecord(pRing, file, line, functionName, format);
+        if (pRecord == NULL)
+            return;
+        int expand[] = { 0, (pRecord->AddArg(args), 0)... };
+        (void)expand;
+        if (pRing->Commit())
+            SetEvent(m_hFlushEvent);
+    }
+
+private:
+
+    // Ring buffer of the current thread, created on first use
+    TraceRing* GetThreadRing();
+
+    // Fill in the record header, returns NULL (and counts the record as dropped) if the ring is full
+    TraceRecord* BeginRecord(TraceRing* pRing, LPCWSTR file, int line, LPCWSTR functionName, LPCWSTR format);
+
+    // Identifier of a call site, added to the call site table if new
+    DWORD GetSiteId(TraceRing* pRing, const TraceSite& site);
+
+    // Write new call sites and all published records to file
+    void Flush();
+
+    // Background thread
+    static DWORD WINAPI FlushThread(LPVOID pParameter);
+
+    //
+    //  Data members
+    //
+
+    // Ring buffer of the current thread
+    static thread_local TraceRing*  t_pRing;
+
+    ofstream                        m_file;
+
+    HANDLE                          m_hThread;
+
+    // Signaled to flush before the next interval, when a ring is half full
+    HANDLE                          m_hFlushEvent;
+
+    // Signaled to stop the background thread
+    HANDLE                          m_hStopEvent;
+
+    // Protects m_rings and m_sites
+    SRWLOCK                         m_lock;
+
+    vector<unique_ptr<TraceRing>>   m_rings;
+
+    // Call site table, indexed by site identifier
+    vector<TraceSite>               m_sites;
+
+    // Number of call sites written to file
+    size_t                          m_sitesWritten;
+
+    // Number of records dropped because a ring was full
+    atomic<ULONGLONG>               m_dropped;
+};
+
+
+// Print the trace messages in a trace file, in the same format as they are printed by -log-level=trace
+// Throws HRESULT on failure
+void DecodeTraceFile(const wstring& fileName);
@@ -10,56 +10,23 @@
 
 
 int FunctionTracer::m_logLevel = FunctionTracer::LOGLEVEL_INFO;
+TraceBuffer* FunctionTracer::m_pTraceBuffer = NULL;
 
 
-// Console logging routine for error messages
+// Console logging routine for error, info and debug messages
 // Can throw HRESULT on invalid formats
-void FunctionTracer::WriteErrorLine(wstring format, ...)
+void FunctionTracer::WriteLevelLine(int level, LPCWSTR format, ...)
 {
-    if (m_logLevel >= LOGLEVEL_ERROR)
-    {
-        wstring buffer;
-        VPRINTF_VAR_PARAMS(buffer, format);
-        fwprintf(stderr, L"%s\n", buffer.c_str());
-        if (m_logLevel >= LOGLEVEL_TRACE)
-            Trace(m_fileName, m_lineNumber, m_functionName, L"OUTPUT: %s", buffer.c_str());
-    }
-}
-
-
-// Console logging routine for information messages
-// Can throw HRESULT on invalid formats
-void FunctionTracer::WriteInfoLine(wstring format, ...)
-{
-    if (m_logLevel >= LOGLEVEL_INFO)
-    {
-        wstring buffer;
-        VPRINTF_VAR_PARAMS(buffer, format);
-        wprintf(L"%s\n", buffer.c_str());
-        if (m_logLevel >= LOGLEVEL_TRACE)
-            Trace(m_fileName, m_lineNumber, m_functionName, L"OUTPUT: %s", buffer.c_str());
-    }
-}
-
-
-// Console logging routine for debug messages
-// Can throw HRESULT on invalid formats
-void FunctionTracer::WriteDebugLine(wstring format, ...)
-{
-    if (m_logLevel >= LOGLEVEL_DEBUG)
-    {
-        wstring buffer;
-        VPRINTF_VAR_PARAMS(buffer, format);
-        wprintf(L"%s\n", buffer.c_str());
-        if (m_logLevel >= LOGLEVEL_TRACE)
-            Trace(m_fileName, m_lineNumber, m_functionName, L"OUTPUT: %s", buffer.c_str());
-    }
+    wstring buffer;
+    VPRINTF_VAR_PARAMS(buffer, format);
+    fwprintf(level == LOGLEVEL_ERROR ? stderr : stdout, L"%s\n", buffer.c_str());
+    Trace(m_fileName, m_lineNumber, m_functionName, L"OUTPUT: %s", buffer.c_str());
 }
 
 
 // Console logging routine
 // Can throw HRESULT on invalid formats
-void FunctionTracer::WriteLine(wstring format, ...)
+void FunctionTracer::WriteLine(LPCWSTR format, ...)
 {
     wstring buffer;
     VPRINTF_VAR_PARAMS(buffer, format);
@@ -69,7 +36,7 @@ void FunctionTracer::WriteLine(wstring format, ...)
 
 // Console logging routine
 // Can throw HRESULT on invalid formats
-void FunctionTracer::Write(wstring format, ...)
+void FunctionTracer::Write(LPCWSTR format, ...)
 {
     wstring buffer;
     VPRINTF_VAR_PARAMS(buffer, format);
@@ -79,43 +46,30 @@ void FunctionTracer::Write(wstring format, ...)
 
 // Console logging routine for trace messages
 // Can throw HRESULT on invalid formats
-void FunctionTracer::Trace(wstring file, int line, wstring functionName, wstring format, ...)
+void FunctionTracer::WriteTrace(LPCWSTR file, int line, LPCWSTR functionName, LPCWSTR format, ...)
 {
-    if (m_logLevel >= LOGLEVEL_TRACE)
-    {
-        wstring buffer;
-        VPRINTF_VAR_PARAMS(buffer, format);
-
-        size_t pos = file.find_last_of(L"\\");
-        wstring fileName = (pos == wstring::npos)? file: file.substr(pos+1);
-
-        // TODO - put here your own implementation of a tracing routine, if needed
-        wprintf(L"[[%40s @ %10s:%4d]] %s\n", functionName.c_str(), fileName.c_str(), line, buffer.c_str());
-    }
-}
+    wstring buffer;
+    VPRINTF_VAR_PARAMS(buffer, format);
 
+    LPCWSTR fileName = wcsrchr(file, L'\\');
+    fileName = (fileName == NULL)? file: fileName+1;
 
-// Constructor
-FunctionTracer::FunctionTracer(wstring fileName, INT lineNumber, wstring functionName):
-    m_fileName(fileName), m_lineNumber(lineNumber), m_functionName(functionName)
-{
-    if (m_logLevel >= LOGLEVEL_TRACE)
-        Trace(m_fileName, m_lineNumber, m_functionName, L"ENTER %s", m_functionName.c_str());
+    // TODO - put here your own implementation of a tracing routine, if needed
+    wprintf(L"[[%40s @ %10s:%4d]] %s\n", functionName, fileName, line, buffer.c_str());
 }
 
 
-// Destructor
-FunctionTracer::~FunctionTracer()
+// Set log level
+void FunctionTracer::SetLogLevel(int level)
 {
-    if (m_logLevel >= LOGLEVEL_TRACE)
-        Trace(m_fileName, m_lineNumber, m_functionName, L"EXIT %s", m_functionName.c_str());;
+    m_logLevel = level;
 }
 
 
-// Set log level
-void FunctionTracer::SetLogLevel(int level)
+// Set the buffer that trace messages are recorded in
+void FunctionTracer::SetTraceBuffer(TraceBuffer* pTraceBuffer)
 {
-    m_logLevel = level;
+    m_pTraceBuffer = pTraceBuffer;
 }
 
 
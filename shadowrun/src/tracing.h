@@ -6,12 +6,21 @@
 //
 
 
-// Very simple tracing/logging class 
+// Highest log level compiled into the program. Messages above this level are
+// removed by the compiler, e.g. define as 4 (LOGLEVEL_DEBUG) to build without
+// the function enter/exit and COM call tracing.
+#ifndef FUNCTIONTRACER_MAX_LOGLEVEL
+#define FUNCTIONTRACER_MAX_LOGLEVEL 5
+#endif
+
+
+// Very simple tracing/logging class
+// The file and function names given to the constructor (see DBG_INFO) must be
+// string literals, they are referenced and not copied. All level checks are
+// inlined, so a disabled message costs a comparison and no formatting.
 class FunctionTracer
 {
 public:
-    FunctionTracer(wstring fileName, INT lineNumber, wstring functionName);
-    ~FunctionTracer();
 
     enum LogLevel
     {
@@ -23,23 +32,72 @@ public:
         LOGLEVEL_TRACE,
     };
 
+    FunctionTracer(LPCWSTR fileName, INT lineNumber, LPCWSTR functionName):
+        m_fileName(fileName), m_lineNumber(lineNumber), m_functionName(functionName)
+    {
+        Trace(m_fileName, m_lineNumber, m_functionName, L"ENTER %s", m_functionName);
+    }
+
+    ~FunctionTracer()
+    {
+        Trace(m_fileName, m_lineNumber, m_functionName, L"EXIT %s", m_functionName);
+    }
+
+    // Returns true if messages of the given level are logged
+    static bool IsEnabled(int level)
+    {
+        return level <= FUNCTIONTRACER_MAX_LOGLEVEL && level <= m_logLevel;
+    }
+
+    // Returns true if trace messages are logged, or recorded in a trace file
+    static bool IsTraceEnabled()
+    {
+        return LOGLEVEL_TRACE <= FUNCTIONTRACER_MAX_LOGLEVEL && (LOGLEVEL_TRACE <= m_logLevel || m_pTraceBuffer != NULL);
+    }
+
     // Tracing routine
-    void Trace(wstring file, int line, wstring functionName, wstring format, ...);
+    // When a trace buffer is set the message is recorded there instead of being printed
+    template<typename... Args>
+    void Trace(LPCWSTR file, int line, LPCWSTR functionName, LPCWSTR format, Args... args)
+    {
+        if (IsTraceEnabled())
+        {
+            if (m_pTraceBuffer != NULL)
+                m_pTraceBuffer->Record(file, line, functionName, format, args...);
+            else
+                WriteTrace(file, line, functionName, format, args...);
+        }
+    }
 
     // Console logging routine for debug messages
-    void WriteDebugLine(wstring format, ...);
+    template<typename... Args>
+    void WriteDebugLine(LPCWSTR format, Args... args)
+    {
+        if (IsEnabled(LOGLEVEL_DEBUG))
+            WriteLevelLine(LOGLEVEL_DEBUG, format, args...);
+    }
 
     // Console logging routine for info messages
-    void WriteInfoLine(wstring format, ...);
+    template<typename... Args>
+    void WriteInfoLine(LPCWSTR format, Args... args)
+    {
+        if (IsEnabled(LOGLEVEL_INFO))
+            WriteLevelLine(LOGLEVEL_INFO, format, args...);
+    }
 
     // Console logging routine for error messages
-    void WriteErrorLine(wstring format, ...);
+    template<typename... Args>
+    void WriteErrorLine(LPCWSTR format, Args... args)
+    {
+        if (IsEnabled(LOGLEVEL_ERROR))
+            WriteLevelLine(LOGLEVEL_ERROR, format, args...);
+    }
 
     // Console logging routine
-    void WriteLine(wstring format, ...);
+    void WriteLine(LPCWSTR format, ...);
 
     // Console logging routine
-    void Write(wstring format, ...);
+    void Write(LPCWSTR format, ...);
 
     // Converts a HRESULT into a printable message
     static wstring  HResult2String(HRESULT hrError);
@@ -47,17 +105,27 @@ public:
     // Set log level
     static void SetLogLevel(int level);
 
+    // Set the buffer that trace messages are recorded in, or NULL to print them
+    static void SetTraceBuffer(TraceBuffer* pTraceBuffer);
+
 private:
 
+    // Format and print a trace message, called when tracing is enabled
+    static void WriteTrace(LPCWSTR file, int line, LPCWSTR functionName, LPCWSTR format, ...);
+
+    // Format and print a message of the given level, called when the level is enabled
+    void WriteLevelLine(int level, LPCWSTR format, ...);
+
     //
     //  Data members
     //
 
     static int  m_logLevel;
 
-    wstring     m_fileName;
+    static TraceBuffer* m_pTraceBuffer;
+
+    LPCWSTR     m_fileName;
     int         m_lineNumber;
-    wstring     m_functionName;
+    LPCWSTR     m_functionName;
 
 };
-
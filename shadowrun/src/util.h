@@ -6,6 +6,8 @@
 // COM interface smart pointer types (_com_ptr_t)
 _COM_SMARTPTR_TYPEDEF(IVssBackupComponents, __uuidof(IVssBackupComponents)); // typedef _com_ptr_t<...> IVssBackupComponentsPtr;
 _COM_SMARTPTR_TYPEDEF(IVssBackupComponentsEx4, __uuidof(IVssBackupComponentsEx4)); // typedef _com_ptr_t<...> IVssBackupComponentsEx4Ptr;
+_COM_SMARTPTR_TYPEDEF(IVssAsync, __uuidof(IVssAsync)); // typedef _com_ptr_t<...> IVssAsyncPtr;
+_COM_SMARTPTR_TYPEDEF(IVssEnumObject, __uuidof(IVssEnumObject)); // typedef _com_ptr_t<...> IVssEnumObjectPtr;
 
 
 //for IsUNCPath method
@@ -192,6 +194,16 @@ inline wstring Guid2WString(GUID guid)
 }
 
 
+// Orders GUIDs, for using them as map keys
+struct ltguid
+{
+    bool operator()(GUID guid1, GUID guid2) const
+    {
+        return memcmp(&guid1, &guid2, sizeof(GUID)) < 0;
+    }
+};
+
+
 // Convert the given BSTR (potentially NULL) into a valid wstring
 inline wstring BSTR2WString(BSTR bstr)
 {
@@ -201,7 +213,7 @@ inline wstring BSTR2WString(BSTR bstr)
 
 
 // Case insensitive comparison
-inline bool IsEqual(wstring str1, wstring str2)
+inline bool IsEqual(const wstring & str1, const wstring & str2)
 {
     return (_wcsicmp(str1.c_str(), str2.c_str()) == 0);
 }
@@ -209,7 +221,7 @@ inline bool IsEqual(wstring str1, wstring str2)
 
 // Returns TRUE if the string is already present in the string list  
 // (performs case insensitive comparison)
-inline bool FindStringInList(wstring str, vector<wstring> stringList)
+inline bool FindStringInList(const wstring & str, const vector<wstring> & stringList)
 {
     // Check to see if the volume is already added 
     for (size_t i = 0; i < stringList.size( ); ++i)
@@ -436,18 +448,71 @@ inline wstring GetDisplayNameForVolume(wstring volumeName)
 
 
 
-// Execute a command
-inline DWORD ExecCommand(wstring command, vector<wstring> arguments, bool quoteArguments, bool expandArguments)
+// Start a command, returns the process handle to wait for with WaitForCommand.
+// Environment variable references in the arguments are expanded with the current
+// process environment, which is also inherited by the command.
+// The standard output and error of the command can optionally be redirected to the given
+// inheritable handles, e.g. pipes, then no other handles are inherited by the command
+// except for a duplicate of our standard input.
+inline HANDLE StartCommand(wstring command, vector<wstring> arguments, bool quoteArguments, bool expandArguments, HANDLE hStdOutput = NULL, HANDLE hStdError = NULL)
 {
     FunctionTracer ft(DBG_INFO);
 
-    STARTUPINFO si;
+    STARTUPINFOEX si;
     PROCESS_INFORMATION pi;
 
     ZeroMemory(&si, sizeof(si));
-    si.cb = sizeof(si);
+    si.StartupInfo.cb = sizeof(si.StartupInfo);
     ZeroMemory(&pi, sizeof(pi));
 
+    // With redirection the handles must be inherited, but only those of this command:
+    // Other commands may be started at the same time, and a command holding on to the
+    // write end of another command's pipe would keep its reader from ever finishing.
+    // The duplicated standard input and the attribute list are only needed until the command is started.
+    vector<BYTE> attributeListBuffer;
+    struct RedirectionCleanup
+    {
+        HANDLE hStdInput = NULL;
+        LPPROC_THREAD_ATTRIBUTE_LIST pAttributeList = NULL;
+        ~RedirectionCleanup()
+        {
+            if (hStdInput != NULL)
+                CloseHandle(hStdInput);
+            if (pAttributeList != NULL)
+                DeleteProcThreadAttributeList(pAttributeList);
+        }
+    } redirection;
+    vector<HANDLE> inheritedHandles;
+    if (hStdOutput != NULL && hStdError != NULL)
+    {
+        HANDLE hOurStdInput = GetStdHandle(STD_INPUT_HANDLE);
+        if (hOurStdInput != NULL && hOurStdInput != INVALID_HANDLE_VALUE)
+        {
+            if (DuplicateHandle(GetCurrentProcess(), hOurStdInput, GetCurrentProcess(), &redirection.hStdInput, 0, TRUE, DUPLICATE_SAME_ACCESS))
+                inheritedHandles.push_back(redirection.hStdInput);
+            else
+                redirection.hStdInput = NULL; // The command will have no standard input
+        }
+        inheritedHandles.push_back(hStdOutput);
+        if (hStdError != hStdOutput)
+            inheritedHandles.push_back(hStdError);
+
+        si.StartupInfo.cb = sizeof(si);
+        si.StartupInfo.dwFlags |= STARTF_USESTDHANDLES;
+        si.StartupInfo.hStdInput = redirection.hStdInput;
+        si.StartupInfo.hStdOutput = hStdOutput;
+        si.StartupInfo.hStdError = hStdError;
+
+        SIZE_T attributeListSize = 0;
+        InitializeProcThreadAttributeList(NULL, 1, 0, &attributeListSize);
+        attributeListBuffer.resize(attributeListSize);
+        CHECK_WIN32(InitializeProcThreadAttributeList((LPPROC_THREAD_ATTRIBUTE_LIST)attributeListBuffer.data(), 1, 0, &attributeListSize));
+        redirection.pAttributeList = (LPPROC_THREAD_ATTRIBUTE_LIST)attributeListBuffer.data();
+        CHECK_WIN32(UpdateProcThreadAttribute(redirection.pAttributeList, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST,
+            inheritedHandles.data(), inheritedHandles.size() * sizeof(HANDLE), NULL, NULL));
+        si.lpAttributeList = redirection.pAttributeList;
+    }
+
     //
     // Security Remarks - CreateProcess
     // 
@@ -524,28 +589,43 @@ inline DWORD ExecCommand(wstring command, vector<wstring> arguments, bool quoteA
         (LPWSTR)command.c_str(), // Command line.
         NULL,             // Process handle not inheritable.
         NULL,             // Thread handle not inheritable.
-        FALSE,            // Set handle inheritance to FALSE.
-        0,                // No creation flags.
+        si.lpAttributeList != NULL, // Set handle inheritance to FALSE, unless redirected.
+        si.lpAttributeList != NULL ? EXTENDED_STARTUPINFO_PRESENT : 0, // No creation flags, unless redirected.
         NULL,             // Use parent's environment block.
         NULL,             // Use parent's starting directory.
-        &si,              // Pointer to STARTUPINFO structure.
+        (LPSTARTUPINFO)&si, // Pointer to STARTUPINFO structure.
         &pi ))             // Pointer to PROCESS_INFORMATION structure.
 
-    // Close process and thread handles automatically when we wil leave this function
-    CAutoHandle autoCleanupHandleProcess(pi.hProcess);
-    CAutoHandle autoCleanupHandleThread(pi.hThread);
+    // The thread handle is not needed
+    CloseHandle(pi.hThread);
+    return pi.hProcess;
+}
+
+// Wait for a command started with StartCommand to exit, and close its process handle
+inline DWORD WaitForCommand(HANDLE hProcess)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    // Close process handle automatically when we wil leave this function
+    CAutoHandle autoCleanupHandleProcess(hProcess);
 
     // Wait until child process exits.
-    CHECK_WIN32( WaitForSingleObject( pi.hProcess, INFINITE ) == WAIT_OBJECT_0);
+    CHECK_WIN32( WaitForSingleObject( hProcess, INFINITE ) == WAIT_OBJECT_0);
     ft.WriteInfoLine(L"-----------------------------------------------------");
 
     // Checking the exit code
     DWORD dwExitCode = 0;
-    CHECK_WIN32( GetExitCodeProcess( pi.hProcess, &dwExitCode ) );
+    CHECK_WIN32( GetExitCodeProcess( hProcess, &dwExitCode ) );
     ft.WriteInfoLine(L"Command completed with exit code %d", dwExitCode);
     return dwExitCode;
 }
 
+// Execute a command
+inline DWORD ExecCommand(wstring command, vector<wstring> arguments, bool quoteArguments, bool expandArguments)
+{
+    return WaitForCommand(StartCommand(command, arguments, quoteArguments, expandArguments));
+}
+
 inline wchar_t GetNextAvailableDriveLetter()
 {
     FunctionTracer ft(DBG_INFO);
@@ -0,0 +1,131 @@
+// Main header
+#include "stdafx.h"
+
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Volume bitmap
+//
+
+
+VolumeBitmap::VolumeBitmap(DWORD mergeGap) :
+    m_mergeGap(mergeGap),
+    m_clusterSize(0),
+    m_ullUsedClusters(0)
+{
+}
+
+
+// Get the extents of the volume holding clusters in use, in order of their offsets
+bool VolumeBitmap::GetUsedExtents(HANDLE hVolume, ULONGLONG ullVolumeSize, vector<Extent>& extents)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    extents.clear();
+    m_ullUsedClusters = 0;
+
+    // Only NTFS is known to have its first cluster at the start of the volume
+    NTFS_VOLUME_DATA_BUFFER volumeData;
+    DWORD cbReturned = 0;
+    if (!DeviceIoControlWait(hVolume, FSCTL_GET_NTFS_VOLUME_DATA, NULL, 0, &volumeData, sizeof(volumeData), &cbReturned))
+    {
+        ft.WriteDebugLine(L"The volume is not NTFS (0x%08lx)", HRESULT_FROM_WIN32(GetLastError()));
+        return false;
+    }
+    m_clusterSize = volumeData.BytesPerCluster;
+    ULONGLONG ullTotalClusters = volumeData.TotalClusters.QuadPart;
+    ft.WriteDebugLine(L"NTFS volume of %llu clusters of %lu bytes", ullTotalClusters, m_clusterSize);
+
+    vector<BYTE> buffer(VOLUME_BITMAP_BUFFER_SIZE);
+    VOLUME_BITMAP_BUFFER* pBitmap = (VOLUME_BITMAP_BUFFER*)buffer.data();
+    const DWORD cbHeader = FIELD_OFFSET(VOLUME_BITMAP_BUFFER, Buffer);
+
+    // Cluster where the current run of clusters in use started, or ullTotalClusters if not in a run
+    ULONGLONG ullRunStart = ullTotalClusters;
+    STARTING_LCN_INPUT_BUFFER input;
+    input.StartingLcn.QuadPart = 0;
+    while ((ULONGLONG)input.StartingLcn.QuadPart < ullTotalClusters)
+    {
+        if (!DeviceIoControlWait(hVolume, FSCTL_GET_VOLUME_BITMAP, &input, sizeof(input), pBitmap, (DWORD)buffer.size(), &cbReturned)
+            && GetLastError() != ERROR_MORE_DATA)
+        {
+            DWORD dwLastError = GetLastError();
+            ft.WriteErrorLine(L"ERROR: Could not get the allocation bitmap of the volume!");
+            CHECK_WIN32_ERROR(dwLastError, L"FSCTL_GET_VOLUME_BITMAP");
+        }
+
+        // The piece starts at a multiple of 8 clusters, at or before the cluster asked for
+        ULONGLONG ullFirst = pBitmap->StartingLcn.QuadPart;
+        ULONGLONG cClusters = min((ULONGLONG)pBitmap->BitmapSize.QuadPart, (ULONGLONG)(cbReturned - cbHeader) * 8);
+        if (cClusters == 0)
+            break;
+
+        for (ULONGLONG i = 0; i < cClusters; )
+        {
+            // Whole bytes of only free or only used clusters are skipped at once
+            BYTE bits = pBitmap->Buffer[i / 8];
+            if ((i % 8) == 0 && i + 8 <= cClusters && (bits == 0x00 || bits == 0xFF))
+            {
+                bool bUsed = (bits == 0xFF);
+                if (bUsed && ullRunStart == ullTotalClusters)
+                    ullRunStart = ullFirst + i;
+                else if (!bUsed && ullRunStart != ullTotalClusters)
+                {
+                    AddExtent(extents, ullRunStart * m_clusterSize, (ullFirst + i - ullRunStart) * m_clusterSize);
+                    m_ullUsedClusters += ullFirst + i - ullRunStart;
+                    ullRunStart = ullTotalClusters;
+                }
+                i += 8;
+                continue;
+            }
+
+            bool bUsed = (bits & (1 << (i % 8))) != 0;
+            if (bUsed && ullRunStart == ullTotalClusters)
+                ullRunStart = ullFirst + i;
+            else if (!bUsed && ullRunStart != ullTotalClusters)
+            {
+                AddExtent(extents, ullRunStart * m_clusterSize, (ullFirst + i - ullRunStart) * m_clusterSize);
+                m_ullUsedClusters += ullFirst + i - ullRunStart;
+                ullRunStart = ullTotalClusters;
+            }
+            ++i;
+        }
+        input.StartingLcn.QuadPart = ullFirst + cClusters;
+    }
+
+    // A run lasting until the last cluster
+    ULONGLONG ullEnd = min((ULONGLONG)input.StartingLcn.QuadPart, ullTotalClusters);
+    if (ullRunStart < ullEnd)
+    {
+        AddExtent(extents, ullRunStart * m_clusterSize, (ullEnd - ullRunStart) * m_clusterSize);
+        m_ullUsedClusters += ullEnd - ullRunStart;
+    }
+
+    // The area after the last cluster holds the backup boot sector
+    ULONGLONG ullClustersEnd = ullTotalClusters * m_clusterSize;
+    if (ullClustersEnd < ullVolumeSize)
+        AddExtent(extents, ullClustersEnd, ullVolumeSize - ullClustersEnd);
+
+    ft.WriteDebugLine(L"%llu of %llu clusters in use, in %u extents", m_ullUsedClusters, ullTotalClusters, (unsigned)extents.size());
+    return true;
+}
+
+
+// Add a range in bytes, merging it with the last extent if the gap between them is small
+void VolumeBitmap::AddExtent(vector<Extent>& extents, ULONGLONG ullOffset, ULONGLONG ullLength)
+{
+    if (!extents.empty())
+    {
+        Extent& last = extents.back();
+        if (ullOffset - (last.offset + last.length) <= m_mergeGap)
+        {
+            last.length = ullOffset + ullLength - last.offset;
+            return;
+        }
+    }
+    Extent extent;
+    extent.offset = ullOffset;
+    extent.length = ullLength;
+    extents.push_back(extent);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Volume bitmap
+//
+//  The allocation bitmap of an NTFS volume, the contents of its $Bitmap
+//  file, has one bit for each cluster telling if it is in use. It is read
+//  from the open volume with FSCTL_GET_VOLUME_BITMAP, in pieces, and the
+//  runs of clusters in use are turned into the extents of the volume that
+//  need to be read to get all its data. Free clusters between two extents
+//  are read anyway if the gap is small, to keep the reads large.
+//
+//  On NTFS the first cluster starts at the start of the volume, so the
+//  cluster numbers convert directly to offsets. The area after the last
+//  cluster, holding the backup boot sector, is always included.
+//
+
+// Free bytes between two runs of clusters in use that are read anyway
+const DWORD VOLUME_BITMAP_DEFAULT_MERGE_GAP = 1024 * 1024;
+
+// Size of the buffer for each piece of the bitmap, each byte covers 8 clusters
+const DWORD VOLUME_BITMAP_BUFFER_SIZE = 1024 * 1024;
+
+
+// A range of a device, in bytes
+struct Extent
+{
+    ULONGLONG           offset = 0;
+    ULONGLONG           length = 0;
+};
+
+
+class VolumeBitmap
+{
+public:
+
+    VolumeBitmap(DWORD mergeGap = VOLUME_BITMAP_DEFAULT_MERGE_GAP);
+
+    // Get the extents of the volume holding clusters in use, in order of their offsets
+    // Returns false if the volume is not NTFS, then there are no extents
+    bool GetUsedExtents(HANDLE hVolume, ULONGLONG ullVolumeSize, vector<Extent>& extents);
+
+    // Size of a cluster, and number of clusters in use, of the last volume
+    DWORD GetClusterSize() { return m_clusterSize; }
+    ULONGLONG GetUsedClusters() { return m_ullUsedClusters; }
+
+private:
+
+    // Add a range in bytes, merging it with the last extent if the gap between them is small
+    void AddExtent(vector<Extent>& extents, ULONGLONG ullOffset, ULONGLONG ullLength);
+
+    //
+    //  Data members
+    //
+
+    DWORD               m_mergeGap;
+    DWORD               m_clusterSize;
+    ULONGLONG           m_ullUsedClusters;
+};
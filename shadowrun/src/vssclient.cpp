@@ -7,6 +7,8 @@
 VssClient::VssClient()
 {
     m_bCoInitializeCalled = false;
+    m_bBackendInitialized = false;
+    m_pBackend.reset(new ComVssBackend());
 }
 
 
@@ -17,9 +19,18 @@ VssClient::~VssClient()
     // Try to unmount any still mounted snapshots
     UnmountSnapshotsSilent();
 
-    // Release the IVssBackupComponents interface 
+    // Release the backend, and with it the IVssBackupComponents interface
     // WARNING: this must be done BEFORE calling CoUninitialize()
-    m_pVssObject = NULL;
+    m_pBackend.reset();
+
+    // Everything in the journal is undone, unless a shadow copy could not be unmounted
+    if (m_pJournal)
+    {
+        bool bMounted = false;
+        for (size_t i = 0; i < m_latestSnapshotSet.snapshots.size(); ++i)
+            bMounted = bMounted || !m_latestSnapshotSet.snapshots[i].mount.empty();
+        m_pJournal->Close(!bMounted);
+    }
     
     // Call CoUninitialize if the CoInitialize was performed sucesfully
     if (m_bCoInitializeCalled)
@@ -27,6 +38,20 @@ VssClient::~VssClient()
 }
 
 
+// Replace the VSS infrastructure with the simulated backend
+void VssClient::UseSimulatedBackend(const SimulationSettings& settings)
+{
+    m_pBackend.reset(new SimulatedVssBackend(settings));
+}
+
+
+// Polling interval and deadlines for the asynchronous operations
+void VssClient::SetAsyncWaitSettings(const AsyncWaitSettings& settings)
+{
+    m_asyncWaitSettings = settings;
+}
+
+
 // Initialize the COM infrastructure and the internal pointers
 void VssClient::Initialize()
 {
@@ -35,11 +60,24 @@ void VssClient::Initialize()
     ft.WriteInfoLine(L"Initializing VSS infrastructure...");
 
     // Initialize COM
-    CHECK_COM(CoInitializeEx(NULL, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE));
+    InitializeCom();
     m_bCoInitializeCalled = true;
 
+    // Create and initialize the backup components object
+    InitializeBackend();
+}
+
+
+// Initialize COM and COM security for the calling thread, as needed for the VSS calls
+void VssClient::InitializeCom()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    // Initialize COM
+    CHECK_COM(CoInitializeEx(NULL, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE));
+
     // Initialize COM security
-    CHECK_COM( 
+    HRESULT hr =
         CoInitializeSecurity(
             NULL,                           //  Allow *all* VSS writers to communicate back!
             -1,                             //  Default COM authentication service
@@ -50,39 +88,54 @@ void VssClient::Initialize()
             NULL,                           //  Default COM authentication settings
             EOAC_DYNAMIC_CLOAKING,          //  Cloaking
             NULL                            //  Reserved parameter
-            ) );
+            );
+    if (FAILED(hr))
+    {
+        CoUninitialize();
+        CHECK_COM_ERROR(hr, L"CoInitializeSecurity");
+    }
+}
 
-    // Create the internal backup components object
-    CHECK_COM(CreateVssBackupComponents(&m_pVssObject));
-    
-    // Initialize for backup
-    CHECK_COM(m_pVssObject->InitializeForBackup())
 
-    // Set the context, different than the default context
+// Create and initialize the backup components object, COM must already be initialized
+void VssClient::InitializeBackend()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    // Create and initialize the backup components object, with a different than the default context
     DWORD dwContext = VSS_CTX_FILE_SHARE_BACKUP; // Specifies an auto-release, nonpersistent shadow copy created without writer involvement.
     ft.WriteDebugLine(L"Setting the VSS context to FILE_SHARE_BACKUP (0x%08lx)", dwContext);
     ft.WriteDebugLine(L"Context is auto-release, nonpersistent shadow copy without writer involvement");
-    CHECK_COM(m_pVssObject->SetContext(dwContext));
+    ft.WriteDebugLine(L"Using the %s backend", m_pBackend->GetName());
+    m_pBackend->Initialize(dwContext);
+    m_bBackendInitialized = true;
+}
 
-    // Set various properties per backup components instance
-    CHECK_COM(m_pVssObject->SetBackupState(true, true, VSS_BT_FULL, false));
+
+// Undo what interrupted runs left behind, then record what this client creates
+void VssClient::OpenJournal(const JournalSettings& settings)
+{
+    m_pJournal.reset(new CleanupJournal(settings));
+    m_pJournal->Recover(m_bBackendInitialized ? m_pBackend.get() : NULL);
+    m_pJournal->Open();
 }
 
 
 
 // Waits for the completion of the asynchronous operation
-void VssClient::WaitAndCheckForAsyncOperation(IVssAsync* pAsync)
+void VssClient::WaitAndCheckForAsyncOperation(IVssAsync* pAsync, LPCWSTR operationName)
 {
     FunctionTracer ft(DBG_INFO);
 
     ft.WriteInfoLine(L"Waiting for the asynchronous operation to finish...");
 
-    // Wait until the async operation finishes
-    CHECK_COM(pAsync->Wait());
+    // Wait until the async operation finishes, or is cancelled because of its deadline
+    AsyncWaiter waiter(m_asyncWaitSettings);
+    waiter.Add(pAsync, operationName);
+    waiter.WaitAll();
 
     // Check the result of the asynchronous operation
-    HRESULT hrReturned = S_OK;
-    CHECK_COM(pAsync->QueryStatus(&hrReturned, NULL));
+    HRESULT hrReturned = waiter.GetResult(0);
 
     // Check if the async operation succeeded...
     if(FAILED(hrReturned))
@@ -32,9 +32,32 @@ public:
     // Destructor
     ~VssClient();
 
+    // Replace the VSS infrastructure with the simulated backend (must be called before Initialize)
+    void UseSimulatedBackend(const SimulationSettings& settings);
+
+    // Polling interval and deadlines for the asynchronous operations
+    void SetAsyncWaitSettings(const AsyncWaitSettings& settings);
+
     // Initialize the internal pointers
     void Initialize();
 
+    // Initialize COM and COM security for the calling thread, as done by Initialize
+    static void InitializeCom();
+
+    // Initialize the backend only, on a thread where InitializeCom has already been called
+    void InitializeBackend();
+
+    // Undo what interrupted runs left behind according to their journals, then record the shadow copy
+    // set and mounts of this client in a journal of its own before creating them
+    // (after Initialize, or without it the shadow copy sets of interrupted runs are left to VSS)
+    void OpenJournal(const JournalSettings& settings);
+
+    // Short name of the backend, for logging
+    LPCWSTR GetBackendName() { return m_pBackend->GetName(); }
+
+    // The backend issuing the VSS calls, for queries made outside this class
+    VssBackend* GetBackend() { return m_pBackend.get(); }
+
     //
     //  Shadow copy creation related methods
     //
@@ -51,12 +74,25 @@ public:
     // Finalizing snapshot set information
     void SnapshotSetCreated();
 
+    // Latest shadow copy set created by CreateSnapshotSet
+    const SnapshotSetInfo& GetLatestSnapshotSet() { return m_latestSnapshotSet; }
+
+    // Use a shadow copy set created elsewhere, e.g. by the daemon, for the methods below
+    void UseSnapshotSet(const SnapshotSetInfo& snapshotSet);
+
     // Generate the SETVAR script for this shadow copy set
     void GenerateEnvironmentScript(wstring stringFileName);
 
     // Set environment variables for this shadow copy set
     void SetProcessEnvironment();
 
+    // Set environment variables for a job running for some of the shadow copies of this set:
+    // SHADOW_JOB and SHADOW_JOB_COUNT, and the variables of the set with only the given shadow copies
+    void SetJobEnvironment(size_t jobIndex, size_t jobCount, const vector<size_t>& snapshotIndexes);
+
+    // Number of shadow copies in this shadow copy set
+    size_t GetSnapshotCount() { return m_latestSnapshotSet.snapshots.size(); }
+
     // Mount volume snapshots as drives
     wstring MountSnapshots(wstring driveLetters);
 
@@ -67,8 +103,12 @@ private:
 
     void SetProcessEnvironmentVariable(LPCWSTR name, LPCWSTR value);
 
-    // Waits for the async operation to finish
-    void WaitAndCheckForAsyncOperation(IVssAsync*  pAsync);
+    // Set the variables of the set, with the given shadow copies numbered from 1
+    void SetSnapshotEnvironment(const vector<size_t>& snapshotIndexes);
+
+    // Waits for the async operation to finish, cancelling it if its deadline passes
+    // The operation name selects the deadline, see AsyncWaitSettings
+    void WaitAndCheckForAsyncOperation(IVssAsync*  pAsync, LPCWSTR operationName);
 
     void UnmountSnapshotsSilent();
 
@@ -82,12 +122,20 @@ private:
     // Needed to pair each succesfull call to CoInitialize with a corresponding CoUninitialize
     bool                            m_bCoInitializeCalled;
 
-    // The IVssBackupComponents interface is automatically released when this object is destructed.
-    // Needed to issue VSS calls 
-    IVssBackupComponentsPtr         m_pVssObject;
+    // The backend issuing the VSS calls, automatically released when this object is destructed.
+    unique_ptr<VssBackend>          m_pBackend;
+
+    // TRUE if the backend has been initialized
+    bool                            m_bBackendInitialized;
+
+    // Journal of the shadow copy set and mounts, NULL if none
+    unique_ptr<CleanupJournal>      m_pJournal;
 
     // Latest shadow copy set
     SnapshotSetInfo                 m_latestSnapshotSet;
 
+    // Polling interval and deadlines for the asynchronous operations
+    AsyncWaitSettings               m_asyncWaitSettings;
+
 };
 
@@ -0,0 +1,180 @@
+// Main header
+#include "stdafx.h"
+
+
+// Names of the asynchronous operations waited for by VssClient, as given to the -timeout option
+static const LPCWSTR g_asyncOperationNames[] =
+{
+    L"GatherWriterMetadata",
+    L"GatherWriterStatus",
+    L"PrepareForBackup",
+    L"DoSnapshotSet",
+    L"BackupComplete",
+    L"ImportSnapshots",
+    L"BreakSnapshotSetEx",
+    L"RecoverSet",
+    L"PreRestore",
+    L"PostRestore",
+};
+
+
+
+// Parse a comma separated list of name:value pairs
+void AsyncWaitSettings::Parse(wstring settings)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    vector<wstring> pairs = SplitWString(settings, L',');
+    for (unsigned i = 0; i < pairs.size(); i++)
+    {
+        size_t separatorPos = pairs[i].find(L':');
+        wstring name = pairs[i].substr(0, separatorPos);
+        wstring value = (separatorPos == wstring::npos) ? wstring() : pairs[i].substr(separatorPos + 1);
+        LPWSTR pwszEnd = NULL;
+        DWORD dwValue = wcstoul(value.c_str(), &pwszEnd, 10);
+        if (value.empty() || *pwszEnd != L'\0')
+        {
+            ft.WriteLine(L"ERROR: Invalid timeout setting '%s', expected name:number!", pairs[i].c_str());
+            throw(E_INVALIDARG);
+        }
+
+        if (IsEqual(name, L"poll") && dwValue > 0)
+        {
+            pollInterval = dwValue;
+            continue;
+        }
+        if (IsEqual(name, L"progress"))
+        {
+            progressInterval = dwValue * 1000;
+            continue;
+        }
+        if (IsEqual(name, L"default"))
+        {
+            defaultTimeout = dwValue;
+            continue;
+        }
+
+        bool bKnownOperation = false;
+        for (unsigned j = 0; j < ARRAYSIZE(g_asyncOperationNames); j++)
+            bKnownOperation = bKnownOperation || IsEqual(name, g_asyncOperationNames[j]);
+        if (!bKnownOperation)
+        {
+            ft.WriteLine(L"ERROR: Unknown or invalid timeout setting '%s'!", pairs[i].c_str());
+            throw(E_INVALIDARG);
+        }
+        operationTimeouts[ToLowerCase(name)] = dwValue;
+    }
+}
+
+
+// Milliseconds until the given operation is cancelled, INFINITE for no deadline
+DWORD AsyncWaitSettings::GetTimeout(LPCWSTR operationName) const
+{
+    auto it = operationTimeouts.find(ToLowerCase(operationName));
+    DWORD dwSeconds = (it != operationTimeouts.end()) ? it->second : defaultTimeout;
+    return (dwSeconds == 0) ? INFINITE : dwSeconds * 1000;
+}
+
+
+
+AsyncWaiter::AsyncWaiter(const AsyncWaitSettings & settings):
+    m_settings(settings)
+{
+}
+
+
+// Add an operation to wait for, its deadline counts from now
+size_t AsyncWaiter::Add(IVssAsync * pAsync, LPCWSTR operationName)
+{
+    Operation operation;
+    operation.pAsync = pAsync;
+    operation.name = operationName;
+    operation.dwTimeout = m_settings.GetTimeout(operationName);
+    operation.ullStartTime = GetTickCount64();
+    operation.ullCancelTime = 0;
+    operation.bCancelled = false;
+    operation.bDone = false;
+    operation.hrResult = VSS_S_ASYNC_PENDING;
+    m_operations.push_back(operation);
+    return m_operations.size() - 1;
+}
+
+
+// Wait until all the operations are done
+void AsyncWaiter::WaitAll()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    ULONGLONG ullLastProgress = GetTickCount64();
+    while(true)
+    {
+        ULONGLONG ullNow = GetTickCount64();
+
+        unsigned cPending = 0;
+        for (size_t i = 0; i < m_operations.size(); i++)
+        {
+            if (!m_operations[i].bDone && !Poll(m_operations[i], ullNow))
+                cPending++;
+        }
+
+        if (cPending == 0)
+            break;
+
+        // Tell which operations we are still waiting for
+        if (m_settings.progressInterval > 0 && ullNow - ullLastProgress >= m_settings.progressInterval)
+        {
+            for (size_t i = 0; i < m_operations.size(); i++)
+            {
+                if (!m_operations[i].bDone)
+                    ft.WriteLine(L"(Still waiting for %s after %u seconds%s...)",
+                        m_operations[i].name.c_str(),
+                        (unsigned)((ullNow - m_operations[i].ullStartTime) / 1000),
+                        m_operations[i].bCancelled ? L", cancelled" : L"");
+            }
+            ullLastProgress = ullNow;
+        }
+
+        Sleep(m_settings.pollInterval);
+    }
+}
+
+
+// Poll an operation, returns true when it is done
+bool AsyncWaiter::Poll(Operation & operation, ULONGLONG ullNow)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    HRESULT hrStatus = S_OK;
+    CHECK_COM(operation.pAsync->QueryStatus(&hrStatus, NULL));
+
+    if (hrStatus != VSS_S_ASYNC_PENDING)
+    {
+        // A cancelled operation was cancelled by us, because of its deadline
+        operation.hrResult = (operation.bCancelled && hrStatus == VSS_S_ASYNC_CANCELLED) ? HRESULT_FROM_WIN32(ERROR_TIMEOUT) : hrStatus;
+        operation.bDone = true;
+        return true;
+    }
+
+    if (operation.bCancelled)
+    {
+        // Give up on an operation that does not stop after being cancelled
+        if (ullNow - operation.ullCancelTime >= ASYNC_CANCEL_GRACE_PERIOD)
+        {
+            ft.WriteLine(L"WARNING: %s did not stop within %u seconds after being cancelled, giving up",
+                operation.name.c_str(), ASYNC_CANCEL_GRACE_PERIOD / 1000);
+            operation.hrResult = HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+            operation.bDone = true;
+            return true;
+        }
+    }
+    else if (operation.dwTimeout != INFINITE && ullNow - operation.ullStartTime >= operation.dwTimeout)
+    {
+        ft.WriteLine(L"(%s did not finish within %u seconds, cancelling it...)", operation.name.c_str(), operation.dwTimeout / 1000);
+        HRESULT hrCancel = operation.pAsync->Cancel();
+        ft.Trace(DBG_INFO, L"Cancel returned 0x%08lx", hrCancel);
+        operation.bCancelled = true;
+        operation.ullCancelTime = ullNow;
+    }
+
+    return false;
+}
@@ -0,0 +1,1002 @@
+// Main header
+#include "stdafx.h"
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Backend using the VSS infrastructure
+//
+
+
+// Create the internal backup components object and initialize it
+void ComVssBackend::Initialize(DWORD dwContext, wstring xmlDoc, bool bDuringRestore)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    m_dwContext = dwContext;
+
+    // Create the internal backup components object
+    CHECK_COM( CreateVssBackupComponents(&m_pVssObject) );
+
+    // Call either Initialize for backup or for restore
+    if (bDuringRestore)
+    {
+        CHECK_COM(m_pVssObject->InitializeForRestore(CComBSTR(xmlDoc.c_str())))
+    }
+    else
+    {
+        // Initialize for backup
+        if (xmlDoc.length() == 0)
+            CHECK_COM(m_pVssObject->InitializeForBackup())
+        else
+            CHECK_COM(m_pVssObject->InitializeForBackup(CComBSTR(xmlDoc.c_str())))
+
+#ifdef VSS_SERVER
+
+        // Set the context, if different than the default context
+        if (dwContext != VSS_CTX_BACKUP)
+        {
+            ft.WriteLine(L"- Setting the VSS context to: 0x%08lx", dwContext);
+            CHECK_COM(m_pVssObject->SetContext(dwContext) );
+        }
+
+#else
+
+        UNREFERENCED_PARAMETER(dwContext);
+
+#endif
+
+    }
+
+    // Set various properties per backup components instance
+    CHECK_COM(m_pVssObject->SetBackupState(true, true, VSS_BT_FULL, false));
+}
+
+
+VSS_TIMESTAMP ComVssBackend::GetCurrentTimestamp()
+{
+    FILETIME ftNow = {0};
+    ::GetSystemTimeAsFileTime(&ftNow);
+    return ((VSS_TIMESTAMP)ftNow.dwHighDateTime << 32) | ftNow.dwLowDateTime;
+}
+
+
+// A backup components object can only be used from the apartment it was created in,
+// so each worker thread gets its own, initialized with the same context
+unique_ptr<VssBackend> ComVssBackend::CreateWorkerBackend()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    unique_ptr<VssBackend> pWorker(new ComVssBackend());
+    pWorker->Initialize(m_dwContext, L"", false);
+    return pWorker;
+}
+
+
+HRESULT ComVssBackend::GatherWriterMetadata(IVssAsync** ppAsync)
+{
+    return m_pVssObject->GatherWriterMetadata(ppAsync);
+}
+
+
+HRESULT ComVssBackend::GetWriterMetadataCount(UINT* pcWriters)
+{
+    return m_pVssObject->GetWriterMetadataCount(pcWriters);
+}
+
+
+HRESULT ComVssBackend::GetWriterMetadata(UINT iWriter, VssWriter& writer)
+{
+    VSS_ID idInstance = GUID_NULL;
+    CComPtr<IVssExamineWriterMetadata> pMetadata;
+    HRESULT hr = m_pVssObject->GetWriterMetadata(iWriter, &idInstance, &pMetadata);
+    if (FAILED(hr))
+        return hr;
+
+    writer.Initialize(pMetadata);
+    return S_OK;
+}
+
+
+HRESULT ComVssBackend::GetWriterMetadataXml(UINT iWriter, wstring& xml)
+{
+    VSS_ID idInstance = GUID_NULL;
+    CComPtr<IVssExamineWriterMetadata> pMetadata;
+    HRESULT hr = m_pVssObject->GetWriterMetadata(iWriter, &idInstance, &pMetadata);
+    if (FAILED(hr))
+        return hr;
+
+    CComBSTR bstrXML;
+    hr = pMetadata->SaveAsXML(&bstrXML);
+    if (FAILED(hr))
+        return hr;
+
+    xml = BSTR2WString(bstrXML);
+    return S_OK;
+}
+
+
+HRESULT ComVssBackend::GatherWriterStatus(IVssAsync** ppAsync)
+{
+    return m_pVssObject->GatherWriterStatus(ppAsync);
+}
+
+
+HRESULT ComVssBackend::GetWriterStatusCount(UINT* pcWriters)
+{
+    return m_pVssObject->GetWriterStatusCount(pcWriters);
+}
+
+
+HRESULT ComVssBackend::GetWriterStatus(UINT iWriter, VSS_ID* pidInstance, VSS_ID* pidWriter, BSTR* pbstrWriter, VSS_WRITER_STATE* pnStatus, HRESULT* phResultFailure)
+{
+    return m_pVssObject->GetWriterStatus(iWriter, pidInstance, pidWriter, pbstrWriter, pnStatus, phResultFailure);
+}
+
+
+HRESULT ComVssBackend::GetWriterComponentsCount(UINT* pcComponents)
+{
+    return m_pVssObject->GetWriterComponentsCount(pcComponents);
+}
+
+
+HRESULT ComVssBackend::AddComponent(VSS_ID instanceId, VSS_ID writerId, VSS_COMPONENT_TYPE ct, LPCWSTR wszLogicalPath, LPCWSTR wszComponentName)
+{
+    return m_pVssObject->AddComponent(instanceId, writerId, ct, wszLogicalPath, wszComponentName);
+}
+
+
+HRESULT ComVssBackend::SetBackupSucceeded(VSS_ID instanceId, VSS_ID writerId, VSS_COMPONENT_TYPE ct, LPCWSTR wszLogicalPath, LPCWSTR wszComponentName, bool bSucceded)
+{
+    return m_pVssObject->SetBackupSucceeded(instanceId, writerId, ct, wszLogicalPath, wszComponentName, bSucceded);
+}
+
+
+HRESULT ComVssBackend::PrepareForBackup(IVssAsync** ppAsync)
+{
+    return m_pVssObject->PrepareForBackup(ppAsync);
+}
+
+
+HRESULT ComVssBackend::BackupComplete(IVssAsync** ppAsync)
+{
+    return m_pVssObject->BackupComplete(ppAsync);
+}
+
+
+HRESULT ComVssBackend::StartSnapshotSet(VSS_ID* pSnapshotSetId)
+{
+    return m_pVssObject->StartSnapshotSet(pSnapshotSetId);
+}
+
+
+HRESULT ComVssBackend::AddToSnapshotSet(VSS_PWSZ pwszVolumeName, VSS_ID ProviderId, VSS_ID* pidSnapshot)
+{
+    return m_pVssObject->AddToSnapshotSet(pwszVolumeName, ProviderId, pidSnapshot);
+}
+
+
+HRESULT ComVssBackend::DoSnapshotSet(IVssAsync** ppAsync)
+{
+    return m_pVssObject->DoSnapshotSet(ppAsync);
+}
+
+
+HRESULT ComVssBackend::GetSnapshotProperties(VSS_ID SnapshotId, VSS_SNAPSHOT_PROP* pProp)
+{
+    return m_pVssObject->GetSnapshotProperties(SnapshotId, pProp);
+}
+
+
+HRESULT ComVssBackend::Query(VSS_ID QueriedObjectId, VSS_OBJECT_TYPE eQueriedObjectType, VSS_OBJECT_TYPE eReturnedObjectsType, IVssEnumObject** ppEnum)
+{
+    return m_pVssObject->Query(QueriedObjectId, eQueriedObjectType, eReturnedObjectsType, ppEnum);
+}
+
+
+HRESULT ComVssBackend::DeleteSnapshots(VSS_ID SourceObjectId, VSS_OBJECT_TYPE eSourceObjectType, BOOL bForceDelete, LONG* plDeletedSnapshots, VSS_ID* pNondeletedSnapshotID)
+{
+    return m_pVssObject->DeleteSnapshots(SourceObjectId, eSourceObjectType, bForceDelete, plDeletedSnapshots, pNondeletedSnapshotID);
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Simulated asynchronous operation
+//
+//  Completes a given number of milliseconds after creation, with the given
+//  result. Behaves like the IVssAsync objects returned by VSS: QueryStatus
+//  reports VSS_S_ASYNC_PENDING until then, and Cancel turns a pending
+//  operation into VSS_S_ASYNC_CANCELLED, after the given cancel latency.
+//
+
+class SimulatedAsync : public IVssAsync
+{
+public:
+
+    SimulatedAsync(DWORD dwLatency, DWORD dwCancelLatency, HRESULT hrResult):
+        m_lRefCount(1), m_lCancelled(FALSE), m_hrResult(hrResult), m_dwCancelLatency(dwCancelLatency), m_ullCancelTime(0)
+    {
+        m_ullCompletionTime = GetTickCount64() + dwLatency;
+    }
+
+    // IUnknown
+
+    STDMETHOD(QueryInterface)(REFIID riid, void** ppvObject)
+    {
+        if (ppvObject == NULL)
+            return E_POINTER;
+        if (riid != __uuidof(IUnknown) && riid != __uuidof(IVssAsync))
+        {
+            *ppvObject = NULL;
+            return E_NOINTERFACE;
+        }
+        *ppvObject = static_cast<IVssAsync*>(this);
+        AddRef();
+        return S_OK;
+    }
+
+    STDMETHOD_(ULONG, AddRef)()
+    {
+        return InterlockedIncrement(&m_lRefCount);
+    }
+
+    STDMETHOD_(ULONG, Release)()
+    {
+        LONG lRefCount = InterlockedDecrement(&m_lRefCount);
+        if (lRefCount == 0)
+            delete this;
+        return lRefCount;
+    }
+
+    // IVssAsync
+
+    STDMETHOD(Cancel)()
+    {
+        if (IsCompleted())
+            return VSS_S_ASYNC_FINISHED;
+        if (InterlockedExchange(&m_lCancelled, TRUE))
+            return VSS_S_ASYNC_CANCELLED;
+        m_ullCancelTime = GetTickCount64();
+        return S_OK;
+    }
+
+    STDMETHOD(Wait)(DWORD dwMilliseconds)
+    {
+        ULONGLONG ullNow = GetTickCount64();
+        if (!m_lCancelled && ullNow < m_ullCompletionTime)
+        {
+            ULONGLONG ullRemaining = m_ullCompletionTime - ullNow;
+            Sleep((dwMilliseconds == INFINITE || ullRemaining < dwMilliseconds) ? (DWORD)ullRemaining : dwMilliseconds);
+        }
+        return S_OK;
+    }
+
+    STDMETHOD(QueryStatus)(HRESULT* pHrResult, INT* pReserved)
+    {
+        UNREFERENCED_PARAMETER(pReserved);
+        if (pHrResult == NULL)
+            return E_POINTER;
+        if (m_lCancelled && GetTickCount64() - m_ullCancelTime >= m_dwCancelLatency)
+            *pHrResult = VSS_S_ASYNC_CANCELLED;
+        else if (!IsCompleted())
+            *pHrResult = VSS_S_ASYNC_PENDING;
+        else if (FAILED(m_hrResult))
+            *pHrResult = m_hrResult;
+        else
+            *pHrResult = VSS_S_ASYNC_FINISHED;
+        return S_OK;
+    }
+
+private:
+
+    bool IsCompleted()
+    {
+        return GetTickCount64() >= m_ullCompletionTime;
+    }
+
+    volatile LONG   m_lRefCount;
+    volatile LONG   m_lCancelled;
+    HRESULT         m_hrResult;
+    ULONGLONG       m_ullCompletionTime;
+
+    // Time after Cancel until the operation reports being cancelled
+    DWORD           m_dwCancelLatency;
+    ULONGLONG       m_ullCancelTime;
+};
+
+
+// Allocate a copy of the string with CoTaskMemAlloc, as expected by VssFreeSnapshotProperties
+static VSS_PWSZ CoTaskMemStrDup(const wstring& str)
+{
+    size_t cb = (str.length() + 1) * sizeof(WCHAR);
+    VSS_PWSZ pwsz = (VSS_PWSZ)CoTaskMemAlloc(cb);
+    if (pwsz == NULL)
+        throw(E_OUTOFMEMORY);
+    memcpy(pwsz, str.c_str(), cb);
+    return pwsz;
+}
+
+
+// Copy the properties, with new allocations for the strings
+static void CopySnapshotProperties(const VSS_SNAPSHOT_PROP& source, VSS_SNAPSHOT_PROP& target)
+{
+    target = source;
+    target.m_pwszSnapshotDeviceObject = CoTaskMemStrDup(source.m_pwszSnapshotDeviceObject);
+    target.m_pwszOriginalVolumeName = CoTaskMemStrDup(source.m_pwszOriginalVolumeName);
+    target.m_pwszOriginatingMachine = CoTaskMemStrDup(source.m_pwszOriginatingMachine);
+    target.m_pwszServiceMachine = CoTaskMemStrDup(source.m_pwszServiceMachine);
+    target.m_pwszExposedName = NULL;
+    target.m_pwszExposedPath = NULL;
+}
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Simulated enumeration of shadow copies
+//
+//  Returns copies of the properties captured when the enumeration was
+//  created, in the same way as the IVssEnumObject returned by Query.
+//  Shadow copies deleted while enumerating are still returned.
+//
+
+class SimulatedEnumObject : public IVssEnumObject
+{
+public:
+
+    // Takes ownership of the given properties
+    SimulatedEnumObject(vector<VSS_SNAPSHOT_PROP>& snapshots, DWORD dwNextLatency):
+        m_lRefCount(1), m_position(0), m_dwNextLatency(dwNextLatency)
+    {
+        m_snapshots.swap(snapshots);
+    }
+
+    ~SimulatedEnumObject()
+    {
+        for (unsigned i = 0; i < m_snapshots.size(); i++)
+            ::VssFreeSnapshotProperties(&m_snapshots[i]);
+    }
+
+    // IUnknown
+
+    STDMETHOD(QueryInterface)(REFIID riid, void** ppvObject)
+    {
+        if (ppvObject == NULL)
+            return E_POINTER;
+        if (riid != __uuidof(IUnknown) && riid != __uuidof(IVssEnumObject))
+        {
+            *ppvObject = NULL;
+            return E_NOINTERFACE;
+        }
+        *ppvObject = static_cast<IVssEnumObject*>(this);
+        AddRef();
+        return S_OK;
+    }
+
+    STDMETHOD_(ULONG, AddRef)()
+    {
+        return InterlockedIncrement(&m_lRefCount);
+    }
+
+    STDMETHOD_(ULONG, Release)()
+    {
+        LONG lRefCount = InterlockedDecrement(&m_lRefCount);
+        if (lRefCount == 0)
+            delete this;
+        return lRefCount;
+    }
+
+    // IVssEnumObject
+
+    STDMETHOD(Next)(ULONG celt, VSS_OBJECT_PROP* rgelt, ULONG* pceltFetched)
+    {
+        if (rgelt == NULL || pceltFetched == NULL)
+            return E_POINTER;
+
+        if (m_dwNextLatency > 0)
+            Sleep(m_dwNextLatency);
+
+        ULONG ulFetched = 0;
+        for (; ulFetched < celt && m_position < m_snapshots.size(); ++ulFetched, ++m_position)
+        {
+            rgelt[ulFetched].Type = VSS_OBJECT_SNAPSHOT;
+            CopySnapshotProperties(m_snapshots[m_position], rgelt[ulFetched].Obj.Snap);
+        }
+
+        *pceltFetched = ulFetched;
+        return (ulFetched == celt) ? S_OK : S_FALSE;
+    }
+
+    STDMETHOD(Skip)(ULONG celt)
+    {
+        m_position = min(m_position + celt, m_snapshots.size());
+        return (m_position < m_snapshots.size()) ? S_OK : S_FALSE;
+    }
+
+    STDMETHOD(Reset)()
+    {
+        m_position = 0;
+        return S_OK;
+    }
+
+    STDMETHOD(Clone)(IVssEnumObject** ppenum)
+    {
+        if (ppenum == NULL)
+            return E_POINTER;
+        vector<VSS_SNAPSHOT_PROP> snapshots(m_snapshots.size());
+        for (unsigned i = 0; i < m_snapshots.size(); i++)
+            CopySnapshotProperties(m_snapshots[i], snapshots[i]);
+        SimulatedEnumObject* pClone = new SimulatedEnumObject(snapshots, m_dwNextLatency);
+        pClone->m_position = m_position;
+        *ppenum = pClone;
+        return S_OK;
+    }
+
+private:
+
+    volatile LONG               m_lRefCount;
+    vector<VSS_SNAPSHOT_PROP>   m_snapshots;
+    size_t                      m_position;
+    DWORD                       m_dwNextLatency;
+};
+
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Simulated backend
+//
+
+
+// Parse the settings of the -simulate option
+void SimulationSettings::Parse(wstring settings)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    if (settings.length() == 0)
+        return;
+
+    vector<wstring> pairs = SplitWString(settings, L',');
+    for (unsigned i = 0; i < pairs.size(); i++)
+    {
+        size_t separatorPos = pairs[i].find(L':');
+        wstring name = pairs[i].substr(0, separatorPos);
+        wstring value = (separatorPos == wstring::npos) ? wstring() : pairs[i].substr(separatorPos + 1);
+
+        // The only setting that is not a number
+        if (IsEqual(name, L"writer-metadata") && !value.empty())
+        {
+            writerMetadata = value;
+            continue;
+        }
+
+        LPWSTR pwszEnd = NULL;
+        DWORD dwValue = wcstoul(value.c_str(), &pwszEnd, 0);
+        if (value.empty() || *pwszEnd != L'\0')
+        {
+            ft.WriteLine(L"ERROR: Invalid simulation setting '%s', expected name:number!", pairs[i].c_str());
+            throw(E_INVALIDARG);
+        }
+
+        if (IsEqual(name, L"seed"))
+            seed = dwValue;
+        else if (IsEqual(name, L"writers"))
+            writers = dwValue;
+        else if (IsEqual(name, L"components"))
+            components = dwValue;
+        else if (IsEqual(name, L"volumes") && dwValue > 0)
+            volumes = dwValue;
+        else if (IsEqual(name, L"snapshots"))
+            snapshots = dwValue;
+        else if (IsEqual(name, L"call-latency"))
+            callLatency = dwValue;
+        else if (IsEqual(name, L"enum-latency"))
+            enumLatency = dwValue;
+        else if (IsEqual(name, L"writer-latency"))
+            writerLatency = dwValue;
+        else if (IsEqual(name, L"snapshot-latency"))
+            snapshotLatency = dwValue;
+        else if (IsEqual(name, L"delete-latency"))
+            deleteLatency = dwValue;
+        else if (IsEqual(name, L"cancel-latency"))
+            cancelLatency = dwValue;
+        else if (IsEqual(name, L"snapshot-failure"))
+            snapshotFailure = (HRESULT)dwValue;
+        else
+        {
+            ft.WriteLine(L"ERROR: Unknown or invalid simulation setting '%s'!", pairs[i].c_str());
+            throw(E_INVALIDARG);
+        }
+    }
+}
+
+
+SimulatedVssBackend::SimulatedVssBackend(const SimulationSettings& settings):
+    m_settings(settings),
+    m_deviceCounter(0),
+    m_dwContext(VSS_CTX_BACKUP),
+    m_bWriterMetadataGathered(false),
+    m_snapshotSetId(GUID_NULL)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    InitializeSRWLock(&m_snapshotsLock);
+
+    // Never start the xorshift generator from zero
+    m_randomState = 0x9E3779B97F4A7C15ull ^ settings.seed;
+
+    // Start the clock at 2022-01-01 00:00:00 UTC
+    m_clock = 132854688000000000ll;
+
+    // The first volume is the system volume, so that the writer components
+    // on it can be selected when shadow copying the system drive.
+    wstring windowsDirectory(MAX_PATH, L'\0');
+    wstring systemVolume;
+    UINT uLength = GetWindowsDirectory(WString2Buffer(windowsDirectory), (UINT)windowsDirectory.length());
+    if (uLength > 0 && GetUniqueVolumeNameForPathNoThrow(windowsDirectory, systemVolume))
+        m_volumes.push_back(systemVolume);
+    while (m_volumes.size() < m_settings.volumes)
+        m_volumes.push_back(L"\\\\?\\Volume" + Guid2WString(NewId()) + L"\\");
+
+    // Create the existing shadow copies, one per hour up until the start time,
+    // distributed round-robin over the volumes
+    for (DWORD i = 0; i < m_settings.snapshots; i++)
+    {
+        SimulatedSnapshot snapshot;
+        snapshot.id = NewId();
+        snapshot.setId = NewId();
+        snapshot.originalVolumeName = m_volumes[i % m_volumes.size()];
+        snapshot.deviceName = L"\\\\?\\GLOBALROOT\\Device\\SimulatedShadowCopy" + to_wstring(++m_deviceCounter);
+        snapshot.creationTimestamp = m_clock - (VSS_TIMESTAMP)(m_settings.snapshots - i) * 36000000000ll;
+        snapshot.attributes = VSS_CTX_CLIENT_ACCESSIBLE;
+        AddSnapshot(snapshot);
+    }
+
+    if (m_settings.writerMetadata.empty())
+        CreateWriters();
+    else
+    {
+        WriterMetadataReader reader;
+        reader.ReadFromFile(m_settings.writerMetadata, m_writers, m_writerDocuments);
+    }
+}
+
+
+// Generate the synthetic writers.
+// The components of each writer form a tree with two top-level components
+// and four children per component. Every third component is not selectable.
+void SimulatedVssBackend::CreateWriters()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    for (DWORD w = 0; w < m_settings.writers; w++)
+    {
+        VssWriter writer;
+        writer.name = L"Simulated Writer " + to_wstring(w);
+        writer.id = Guid2WString(NewId());
+        writer.instanceId = Guid2WString(NewId());
+        writer.writerRestoreConditions = VSS_WRE_ALWAYS;
+        writer.supportsRestore = true;
+        writer.restoreMethod = VSS_RME_RESTORE_IF_CAN_REPLACE;
+
+        const DWORD topLevelCount = 2;
+        for (DWORD c = 0; c < m_settings.components; c++)
+        {
+            VssComponent component;
+            component.writerName = writer.name;
+            component.name = L"Component" + to_wstring(c);
+            if (c >= topLevelCount)
+            {
+                const VssComponent& parent = writer.components[(c - topLevelCount) / 4];
+                component.logicalPath = parent.fullPath.substr(1);
+            }
+            component.caption = L"Simulated component " + to_wstring(c);
+            component.type = VSS_CT_FILEGROUP;
+            component.isSelectable = (c % 3 != 1);
+
+            component.fullPath = AppendBackslash(component.logicalPath) + component.name;
+            if (component.fullPath[0] != L'\\')
+                component.fullPath = wstring(L"\\") + component.fullPath;
+
+            VssFileDescriptor descriptor;
+            descriptor.type = VSS_FDT_FILELIST;
+            descriptor.affectedVolume = m_volumes[(w + c) % m_volumes.size()];
+            descriptor.path = descriptor.affectedVolume + L"Simulated\\" + to_wstring(w) + L"\\" + to_wstring(c) + L"\\";
+            descriptor.expandedPath = descriptor.path;
+            descriptor.filespec = L"*";
+            component.descriptors.push_back(descriptor);
+            component.affectedPaths.push_back(descriptor.expandedPath);
+            component.affectedVolumes.push_back(descriptor.affectedVolume);
+
+            writer.components.push_back(component);
+        }
+
+        writer.DiscoverTopLevelComponents();
+        m_writers.push_back(writer);
+    }
+}
+
+
+// Initialize the simulated backup components object
+void SimulatedVssBackend::Initialize(DWORD dwContext, wstring xmlDoc, bool bDuringRestore)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    UNREFERENCED_PARAMETER(xmlDoc);
+
+    // Restore needs a real backup components document
+    if (bDuringRestore)
+    {
+        ft.WriteLine(L"ERROR: Restore is not supported by the simulated VSS provider!");
+        throw(E_NOTIMPL);
+    }
+
+    ft.WriteLine(L"- Using simulated VSS provider (seed %lu)", m_settings.seed);
+
+    m_dwContext = dwContext;
+}
+
+
+// Spend the configured time of a synchronous call
+void SimulatedVssBackend::SimulateCallLatency()
+{
+    if (m_settings.callLatency > 0)
+        Sleep(m_settings.callLatency);
+}
+
+
+// Generate the next identifier from the seeded xorshift64* sequence
+VSS_ID SimulatedVssBackend::NewId()
+{
+    ULONGLONG ullValues[2];
+    for (int i = 0; i < 2; ++i)
+    {
+        m_randomState ^= m_randomState >> 12;
+        m_randomState ^= m_randomState << 25;
+        m_randomState ^= m_randomState >> 27;
+        ullValues[i] = m_randomState * 0x2545F4914F6CDD1Dull;
+    }
+
+    VSS_ID id;
+    memcpy(&id, ullValues, sizeof(id));
+
+    // Mark as a version 4 (random) GUID
+    id.Data3 = (id.Data3 & 0x0FFF) | 0x4000;
+    id.Data4[0] = (id.Data4[0] & 0x3F) | 0x80;
+    return id;
+}
+
+
+HRESULT SimulatedVssBackend::GatherWriterMetadata(IVssAsync** ppAsync)
+{
+    SimulateCallLatency();
+
+    // Like VSS, allow this only once per backup components object
+    if (m_bWriterMetadataGathered)
+        return VSS_E_BAD_STATE;
+    m_bWriterMetadataGathered = true;
+
+    *ppAsync = new SimulatedAsync(m_settings.writerLatency, m_settings.cancelLatency, S_OK);
+    return S_OK;
+}
+
+
+HRESULT SimulatedVssBackend::GetWriterMetadataCount(UINT* pcWriters)
+{
+    if (!m_bWriterMetadataGathered)
+        return VSS_E_BAD_STATE;
+
+    *pcWriters = (UINT)m_writers.size();
+    return S_OK;
+}
+
+
+HRESULT SimulatedVssBackend::GetWriterMetadata(UINT iWriter, VssWriter& writer)
+{
+    SimulateCallLatency();
+
+    if (!m_bWriterMetadataGathered)
+        return VSS_E_BAD_STATE;
+    if (iWriter >= m_writers.size())
+        return E_INVALIDARG;
+
+    writer = m_writers[iWriter];
+    return S_OK;
+}
+
+
+HRESULT SimulatedVssBackend::GetWriterMetadataXml(UINT iWriter, wstring& xml)
+{
+    SimulateCallLatency();
+
+    // The synthetic writers have no XML representation, only the ones read from a file
+    if (m_writerDocuments.size() != m_writers.size())
+        return E_NOTIMPL;
+
+    if (!m_bWriterMetadataGathered)
+        return VSS_E_BAD_STATE;
+    if (iWriter >= m_writers.size())
+        return E_INVALIDARG;
+
+    xml = m_writerDocuments[iWriter];
+    return S_OK;
+}
+
+
+HRESULT SimulatedVssBackend::GatherWriterStatus(IVssAsync** ppAsync)
+{
+    SimulateCallLatency();
+
+    if (!m_bWriterMetadataGathered)
+        return VSS_E_BAD_STATE;
+
+    *ppAsync = new SimulatedAsync(m_settings.writerLatency, m_settings.cancelLatency, S_OK);
+    return S_OK;
+}
+
+
+HRESULT SimulatedVssBackend::GetWriterStatusCount(UINT* pcWriters)
+{
+    *pcWriters = (UINT)m_writers.size();
+    return S_OK;
+}
+
+
+HRESULT SimulatedVssBackend::GetWriterStatus(UINT iWriter, VSS_ID* pidInstance, VSS_ID* pidWriter, BSTR* pbstrWriter, VSS_WRITER_STATE* pnStatus, HRESULT* phResultFailure)
+{
+    if (iWriter >= m_writers.size())
+        return E_INVALIDARG;
+
+    *pidInstance = WString2Guid(m_writers[iWriter].instanceId);
+    *pidWriter = WString2Guid(m_writers[iWriter].id);
+    *pbstrWriter = SysAllocString(m_writers[iWriter].name.c_str());
+    *pnStatus = VSS_WS_STABLE;
+    *phResultFailure = S_OK;
+    return S_OK;
+}
+
+
+HRESULT SimulatedVssBackend::GetWriterComponentsCount(UINT* pcComponents)
+{
+    *pcComponents = (UINT)m_writersWithComponents.size();
+    return S_OK;
+}
+
+
+HRESULT SimulatedVssBackend::AddComponent(VSS_ID instanceId, VSS_ID writerId, VSS_COMPONENT_TYPE ct, LPCWSTR wszLogicalPath, LPCWSTR wszComponentName)
+{
+    UNREFERENCED_PARAMETER(writerId);
+    UNREFERENCED_PARAMETER(ct);
+    UNREFERENCED_PARAMETER(wszLogicalPath);
+    UNREFERENCED_PARAMETER(wszComponentName);
+
+    SimulateCallLatency();
+
+    wstring instance = Guid2WString(instanceId);
+    if (!FindStringInList(instance, m_writersWithComponents))
+        m_writersWithComponents.push_back(instance);
+    return S_OK;
+}
+
+
+HRESULT SimulatedVssBackend::SetBackupSucceeded(VSS_ID instanceId, VSS_ID writerId, VSS_COMPONENT_TYPE ct, LPCWSTR wszLogicalPath, LPCWSTR wszComponentName, bool bSucceded)
+{
+    UNREFERENCED_PARAMETER(writerId);
+    UNREFERENCED_PARAMETER(ct);
+    UNREFERENCED_PARAMETER(wszLogicalPath);
+    UNREFERENCED_PARAMETER(wszComponentName);
+    UNREFERENCED_PARAMETER(bSucceded);
+
+    SimulateCallLatency();
+
+    if (!FindStringInList(Guid2WString(instanceId), m_writersWithComponents))
+        return VSS_E_OBJECT_NOT_FOUND;
+    return S_OK;
+}
+
+
+HRESULT SimulatedVssBackend::PrepareForBackup(IVssAsync** ppAsync)
+{
+    SimulateCallLatency();
+
+    *ppAsync = new SimulatedAsync(m_settings.writerLatency, m_settings.cancelLatency, S_OK);
+    return S_OK;
+}
+
+
+HRESULT SimulatedVssBackend::BackupComplete(IVssAsync** ppAsync)
+{
+    SimulateCallLatency();
+
+    *ppAsync = new SimulatedAsync(m_settings.writerLatency, m_settings.cancelLatency, S_OK);
+    return S_OK;
+}
+
+
+HRESULT SimulatedVssBackend::StartSnapshotSet(VSS_ID* pSnapshotSetId)
+{
+    SimulateCallLatency();
+
+    if (m_snapshotSetId != GUID_NULL)
+        return VSS_E_SNAPSHOT_SET_IN_PROGRESS;
+
+    m_snapshotSetId = NewId();
+    *pSnapshotSetId = m_snapshotSetId;
+    return S_OK;
+}
+
+
+HRESULT SimulatedVssBackend::AddToSnapshotSet(VSS_PWSZ pwszVolumeName, VSS_ID ProviderId, VSS_ID* pidSnapshot)
+{
+    UNREFERENCED_PARAMETER(ProviderId);
+
+    SimulateCallLatency();
+
+    if (m_snapshotSetId == GUID_NULL)
+        return VSS_E_BAD_STATE;
+
+    for (unsigned i = 0; i < m_pendingSnapshots.size(); i++)
+        if (IsEqual(m_pendingSnapshots[i].originalVolumeName, pwszVolumeName))
+            return VSS_E_OBJECT_ALREADY_EXISTS;
+
+    SimulatedSnapshot snapshot;
+    snapshot.id = NewId();
+    snapshot.setId = m_snapshotSetId;
+    snapshot.originalVolumeName = pwszVolumeName;
+    snapshot.creationTimestamp = 0;
+    snapshot.attributes = (LONG)m_dwContext;
+    m_pendingSnapshots.push_back(snapshot);
+
+    *pidSnapshot = snapshot.id;
+    return S_OK;
+}
+
+
+HRESULT SimulatedVssBackend::DoSnapshotSet(IVssAsync** ppAsync)
+{
+    SimulateCallLatency();
+
+    if (m_snapshotSetId == GUID_NULL || m_pendingSnapshots.empty())
+        return VSS_E_BAD_STATE;
+
+    // The shadow copies are created right away, but the asynchronous
+    // operation does not report completion before the configured latency.
+    if (SUCCEEDED(m_settings.snapshotFailure))
+    {
+        m_clock += 10000000ll; // One second later than the previous set
+        for (unsigned i = 0; i < m_pendingSnapshots.size(); i++)
+        {
+            m_pendingSnapshots[i].deviceName = L"\\\\?\\GLOBALROOT\\Device\\SimulatedShadowCopy" + to_wstring(++m_deviceCounter);
+            m_pendingSnapshots[i].creationTimestamp = m_clock;
+            AddSnapshot(m_pendingSnapshots[i]);
+        }
+    }
+    m_pendingSnapshots.clear();
+    m_snapshotSetId = GUID_NULL;
+
+    *ppAsync = new SimulatedAsync(m_settings.snapshotLatency, m_settings.cancelLatency, m_settings.snapshotFailure);
+    return S_OK;
+}
+
+
+// Fill the given properties structure from the simulated shadow copy, in a set of the given number of shadow copies
+void SimulatedVssBackend::GetSnapshotProperties(const SimulatedSnapshot& snapshot, LONG lSnapshotsCount, VSS_SNAPSHOT_PROP* pProp)
+{
+    ZeroMemory(pProp, sizeof(*pProp));
+    pProp->m_SnapshotId = snapshot.id;
+    pProp->m_SnapshotSetId = snapshot.setId;
+    pProp->m_pwszSnapshotDeviceObject = CoTaskMemStrDup(snapshot.deviceName);
+    pProp->m_pwszOriginalVolumeName = CoTaskMemStrDup(snapshot.originalVolumeName);
+    pProp->m_pwszOriginatingMachine = CoTaskMemStrDup(L"SIMULATED");
+    pProp->m_pwszServiceMachine = CoTaskMemStrDup(L"SIMULATED");
+    pProp->m_ProviderId = VSS_SWPRV_ProviderId;
+    pProp->m_lSnapshotAttributes = snapshot.attributes;
+    pProp->m_tsCreationTimestamp = snapshot.creationTimestamp;
+    pProp->m_eStatus = VSS_SS_CREATED;
+    pProp->m_lSnapshotsCount = lSnapshotsCount;
+}
+
+
+// Add a shadow copy to m_snapshots and m_positions
+void SimulatedVssBackend::AddSnapshot(const SimulatedSnapshot& snapshot)
+{
+    m_positions[snapshot.id] = m_snapshots.size();
+    m_snapshots.push_back(snapshot);
+}
+
+
+HRESULT SimulatedVssBackend::GetSnapshotProperties(VSS_ID SnapshotId, VSS_SNAPSHOT_PROP* pProp)
+{
+    SimulateCallLatency();
+
+    map<VSS_ID, size_t, ltguid>::iterator it = m_positions.find(SnapshotId);
+    if (it == m_positions.end())
+        return VSS_E_OBJECT_NOT_FOUND;
+
+    const SimulatedSnapshot& snapshot = m_snapshots[it->second];
+    LONG lSnapshotsCount = 0;
+    for (unsigned i = 0; i < m_snapshots.size(); i++)
+        if (m_snapshots[i].setId == snapshot.setId)
+            lSnapshotsCount++;
+
+    GetSnapshotProperties(snapshot, lSnapshotsCount, pProp);
+    return S_OK;
+}
+
+
+HRESULT SimulatedVssBackend::Query(VSS_ID QueriedObjectId, VSS_OBJECT_TYPE eQueriedObjectType, VSS_OBJECT_TYPE eReturnedObjectsType, IVssEnumObject** ppEnum)
+{
+    SimulateCallLatency();
+
+    // Only the query used by VSHADOW.EXE is supported: All shadow copies in the system
+    if (QueriedObjectId != GUID_NULL || eQueriedObjectType != VSS_OBJECT_NONE || eReturnedObjectsType != VSS_OBJECT_SNAPSHOT)
+        return E_INVALIDARG;
+
+    // The shadow copies of each set are counted once, not for each shadow copy
+    map<VSS_ID, LONG, ltguid> snapshotsPerSet;
+    for (unsigned i = 0; i < m_snapshots.size(); i++)
+        snapshotsPerSet[m_snapshots[i].setId]++;
+
+    // Capture the current properties, the enumeration object hands out copies of them
+    vector<VSS_SNAPSHOT_PROP> snapshots(m_snapshots.size());
+    for (unsigned i = 0; i < m_snapshots.size(); i++)
+        GetSnapshotProperties(m_snapshots[i], snapshotsPerSet[m_snapshots[i].setId], &snapshots[i]);
+
+    HRESULT hr = snapshots.empty() ? S_FALSE : S_OK;
+    *ppEnum = new SimulatedEnumObject(snapshots, m_settings.enumLatency);
+    return hr;
+}
+
+
+HRESULT SimulatedVssBackend::DeleteSnapshots(VSS_ID SourceObjectId, VSS_OBJECT_TYPE eSourceObjectType, BOOL bForceDelete, LONG* plDeletedSnapshots, VSS_ID* pNondeletedSnapshotID)
+{
+    UNREFERENCED_PARAMETER(bForceDelete);
+
+    SimulateCallLatency();
+
+    if (eSourceObjectType != VSS_OBJECT_SNAPSHOT && eSourceObjectType != VSS_OBJECT_SNAPSHOT_SET)
+        return E_INVALIDARG;
+
+    *plDeletedSnapshots = 0;
+    *pNondeletedSnapshotID = GUID_NULL;
+
+    AcquireSRWLockExclusive(&m_snapshotsLock);
+    if (eSourceObjectType == VSS_OBJECT_SNAPSHOT)
+    {
+        // Found by ID and replaced by the last one, so that pruning
+        // many shadow copies one at a time does not move the others
+        map<VSS_ID, size_t, ltguid>::iterator it = m_positions.find(SourceObjectId);
+        if (it != m_positions.end())
+        {
+            size_t position = it->second;
+            m_positions.erase(it);
+            if (position + 1 < m_snapshots.size())
+            {
+                m_snapshots[position] = move(m_snapshots.back());
+                m_positions[m_snapshots[position].id] = position;
+            }
+            m_snapshots.pop_back();
+            *plDeletedSnapshots = 1;
+        }
+    }
+    else
+    {
+        // Removed in a single pass, with the positions of the others found again
+        vector<SimulatedSnapshot>::iterator newEnd = remove_if(m_snapshots.begin(), m_snapshots.end(),
+            [&](const SimulatedSnapshot& snapshot) { return snapshot.setId == SourceObjectId; });
+        *plDeletedSnapshots = (LONG)(m_snapshots.end() - newEnd);
+        if (*plDeletedSnapshots > 0)
+        {
+            m_snapshots.erase(newEnd, m_snapshots.end());
+            m_positions.clear();
+            for (size_t i = 0; i < m_snapshots.size(); i++)
+                m_positions[m_snapshots[i].id] = i;
+        }
+    }
+    ReleaseSRWLockExclusive(&m_snapshotsLock);
+
+    // Spend the deletion time outside the lock, so that deletions from several threads overlap
+    if (m_settings.deleteLatency > 0)
+        Sleep(m_settings.deleteLatency * (DWORD)*plDeletedSnapshots);
+
+    return (*plDeletedSnapshots == 0) ? VSS_E_OBJECT_NOT_FOUND : S_OK;
+}
@@ -0,0 +1,350 @@
+#pragma once
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Snapshot backends
+//
+//  VssClient issues the calls for writer handling, shadow copy creation,
+//  query and deletion through a backend implementing the VssBackend
+//  interface. The methods mirror the corresponding IVssBackupComponents
+//  methods and return HRESULT values the same way, so they are called
+//  through the regular CHECK_COM macro.
+//
+//  There are two implementations:
+//  - ComVssBackend: Forwards to IVssBackupComponents.
+//  - SimulatedVssBackend: In-memory provider with synthetic writers and
+//    shadow copies, configurable latencies and failures. Used for running
+//    VSHADOW.EXE without administrator privileges, and for reproducible
+//    timing of the creation, query and deletion code paths. The writers
+//    can instead be read from writer metadata saved with -wm3, to list
+//    and select the components of another machine without VSS.
+//
+//  The less common operations (break, expose, revert, import and restore)
+//  are not part of the interface. They use the IVssBackupComponents object
+//  returned by GetBackupComponents, which is NULL for the simulated backend.
+//
+
+class VssBackend
+{
+public:
+
+    virtual ~VssBackend() {}
+
+    // Create the backup components object and initialize it for backup or restore
+    virtual void Initialize(DWORD dwContext, wstring xmlDoc, bool bDuringRestore) = 0;
+
+    // Short name for logging
+    virtual LPCWSTR GetName() = 0;
+
+    // The underlying IVssBackupComponents object, or NULL if there is none
+    virtual IVssBackupComponents* GetBackupComponents() = 0;
+
+    // Current time, as the creation timestamps of the shadow copies
+    virtual VSS_TIMESTAMP GetCurrentTimestamp() = 0;
+
+    // Create a backend for calling DeleteSnapshots from a worker thread, which must have initialized COM.
+    // Returns NULL if DeleteSnapshots on this backend can be called from any thread.
+    virtual unique_ptr<VssBackend> CreateWorkerBackend() = 0;
+
+    //
+    //  Writer related methods
+    //
+
+    virtual HRESULT GatherWriterMetadata(IVssAsync** ppAsync) = 0;
+
+    virtual HRESULT GetWriterMetadataCount(UINT* pcWriters) = 0;
+
+    // Get the metadata for the given writer, converted into the in-memory representation
+    virtual HRESULT GetWriterMetadata(UINT iWriter, VssWriter& writer) = 0;
+
+    // Get the metadata for the given writer, in XML format
+    virtual HRESULT GetWriterMetadataXml(UINT iWriter, wstring& xml) = 0;
+
+    virtual HRESULT GatherWriterStatus(IVssAsync** ppAsync) = 0;
+
+    virtual HRESULT GetWriterStatusCount(UINT* pcWriters) = 0;
+
+    virtual HRESULT GetWriterStatus(UINT iWriter, VSS_ID* pidInstance, VSS_ID* pidWriter, BSTR* pbstrWriter, VSS_WRITER_STATE* pnStatus, HRESULT* phResultFailure) = 0;
+
+    virtual HRESULT GetWriterComponentsCount(UINT* pcComponents) = 0;
+
+    virtual HRESULT AddComponent(VSS_ID instanceId, VSS_ID writerId, VSS_COMPONENT_TYPE ct, LPCWSTR wszLogicalPath, LPCWSTR wszComponentName) = 0;
+
+    virtual HRESULT SetBackupSucceeded(VSS_ID instanceId, VSS_ID writerId, VSS_COMPONENT_TYPE ct, LPCWSTR wszLogicalPath, LPCWSTR wszComponentName, bool bSucceded) = 0;
+
+    virtual HRESULT PrepareForBackup(IVssAsync** ppAsync) = 0;
+
+    virtual HRESULT BackupComplete(IVssAsync** ppAsync) = 0;
+
+    //
+    //  Shadow copy related methods
+    //
+
+    virtual HRESULT StartSnapshotSet(VSS_ID* pSnapshotSetId) = 0;
+
+    virtual HRESULT AddToSnapshotSet(VSS_PWSZ pwszVolumeName, VSS_ID ProviderId, VSS_ID* pidSnapshot) = 0;
+
+    virtual HRESULT DoSnapshotSet(IVssAsync** ppAsync) = 0;
+
+    virtual HRESULT GetSnapshotProperties(VSS_ID SnapshotId, VSS_SNAPSHOT_PROP* pProp) = 0;
+
+    virtual HRESULT Query(VSS_ID QueriedObjectId, VSS_OBJECT_TYPE eQueriedObjectType, VSS_OBJECT_TYPE eReturnedObjectsType, IVssEnumObject** ppEnum) = 0;
+
+    virtual HRESULT DeleteSnapshots(VSS_ID SourceObjectId, VSS_OBJECT_TYPE eSourceObjectType, BOOL bForceDelete, LONG* plDeletedSnapshots, VSS_ID* pNondeletedSnapshotID) = 0;
+};
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Backend using the VSS infrastructure
+//
+
+class ComVssBackend : public VssBackend
+{
+public:
+
+    ComVssBackend(): m_dwContext(VSS_CTX_BACKUP) {}
+
+    virtual void Initialize(DWORD dwContext, wstring xmlDoc, bool bDuringRestore);
+
+    virtual LPCWSTR GetName() { return L"VSS"; }
+
+    virtual IVssBackupComponents* GetBackupComponents() { return m_pVssObject; }
+
+    virtual VSS_TIMESTAMP GetCurrentTimestamp();
+
+    virtual unique_ptr<VssBackend> CreateWorkerBackend();
+
+    virtual HRESULT GatherWriterMetadata(IVssAsync** ppAsync);
+
+    virtual HRESULT GetWriterMetadataCount(UINT* pcWriters);
+
+    virtual HRESULT GetWriterMetadata(UINT iWriter, VssWriter& writer);
+
+    virtual HRESULT GetWriterMetadataXml(UINT iWriter, wstring& xml);
+
+    virtual HRESULT GatherWriterStatus(IVssAsync** ppAsync);
+
+    virtual HRESULT GetWriterStatusCount(UINT* pcWriters);
+
+    virtual HRESULT GetWriterStatus(UINT iWriter, VSS_ID* pidInstance, VSS_ID* pidWriter, BSTR* pbstrWriter, VSS_WRITER_STATE* pnStatus, HRESULT* phResultFailure);
+
+    virtual HRESULT GetWriterComponentsCount(UINT* pcComponents);
+
+    virtual HRESULT AddComponent(VSS_ID instanceId, VSS_ID writerId, VSS_COMPONENT_TYPE ct, LPCWSTR wszLogicalPath, LPCWSTR wszComponentName);
+
+    virtual HRESULT SetBackupSucceeded(VSS_ID instanceId, VSS_ID writerId, VSS_COMPONENT_TYPE ct, LPCWSTR wszLogicalPath, LPCWSTR wszComponentName, bool bSucceded);
+
+    virtual HRESULT PrepareForBackup(IVssAsync** ppAsync);
+
+    virtual HRESULT BackupComplete(IVssAsync** ppAsync);
+
+    virtual HRESULT StartSnapshotSet(VSS_ID* pSnapshotSetId);
+
+    virtual HRESULT AddToSnapshotSet(VSS_PWSZ pwszVolumeName, VSS_ID ProviderId, VSS_ID* pidSnapshot);
+
+    virtual HRESULT DoSnapshotSet(IVssAsync** ppAsync);
+
+    virtual HRESULT GetSnapshotProperties(VSS_ID SnapshotId, VSS_SNAPSHOT_PROP* pProp);
+
+    virtual HRESULT Query(VSS_ID QueriedObjectId, VSS_OBJECT_TYPE eQueriedObjectType, VSS_OBJECT_TYPE eReturnedObjectsType, IVssEnumObject** ppEnum);
+
+    virtual HRESULT DeleteSnapshots(VSS_ID SourceObjectId, VSS_OBJECT_TYPE eSourceObjectType, BOOL bForceDelete, LONG* plDeletedSnapshots, VSS_ID* pNondeletedSnapshotID);
+
+private:
+
+    // The IVssBackupComponents interface is automatically released when this object is destructed.
+    // Needed to issue VSS calls
+    CComPtr<IVssBackupComponents>   m_pVssObject;
+
+    // Context given to Initialize, also used for the worker backends
+    DWORD                           m_dwContext;
+};
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Simulated backend
+//
+
+// Settings for the simulated backend
+struct SimulationSettings
+{
+    SimulationSettings():
+        seed(1),
+        writers(4),
+        components(8),
+        volumes(2),
+        snapshots(0),
+        callLatency(0),
+        enumLatency(0),
+        writerLatency(0),
+        snapshotLatency(0),
+        deleteLatency(0),
+        cancelLatency(0),
+        snapshotFailure(S_OK)
+        {};
+
+    // Parse a comma separated list of name:value pairs, as given to the -simulate option.
+    // Throws E_INVALIDARG on unknown names or invalid values.
+    void Parse(wstring settings);
+
+    // File with the writer metadata XML of the writers, as listed by -wm3, instead of the synthetic writers
+    wstring writerMetadata;
+
+    // Seed for generated identifiers: The same seed gives the same identifiers
+    DWORD   seed;
+
+    // Number of writers, and number of components per writer
+    DWORD   writers;
+    DWORD   components;
+
+    // Number of volumes referenced by the writer components and the existing shadow copies.
+    // The first one is the system volume, the others are synthetic.
+    DWORD   volumes;
+
+    // Number of shadow copies existing from before, one per hour back in time
+    DWORD   snapshots;
+
+    // Time (milliseconds) spent in each synchronous call
+    DWORD   callLatency;
+
+    // Time (milliseconds) spent in each IVssEnumObject::Next call
+    DWORD   enumLatency;
+
+    // Time (milliseconds) until the asynchronous writer operations complete
+    DWORD   writerLatency;
+
+    // Time (milliseconds) until the asynchronous DoSnapshotSet operation completes
+    DWORD   snapshotLatency;
+
+    // Time (milliseconds) spent for each deleted shadow copy
+    DWORD   deleteLatency;
+
+    // Time (milliseconds) after a cancellation until an asynchronous operation reports being cancelled
+    DWORD   cancelLatency;
+
+    // Error returned by the DoSnapshotSet operation, S_OK for success
+    HRESULT snapshotFailure;
+};
+
+
+// Shadow copy kept by the simulated backend
+struct SimulatedSnapshot
+{
+    VSS_ID          id;
+    VSS_ID          setId;
+    wstring         originalVolumeName;
+    wstring         deviceName;
+    VSS_TIMESTAMP   creationTimestamp;
+    LONG            attributes;
+};
+
+
+class SimulatedVssBackend : public VssBackend
+{
+public:
+
+    SimulatedVssBackend(const SimulationSettings& settings);
+
+    virtual void Initialize(DWORD dwContext, wstring xmlDoc, bool bDuringRestore);
+
+    virtual LPCWSTR GetName() { return L"simulated"; }
+
+    virtual IVssBackupComponents* GetBackupComponents() { return NULL; }
+
+    virtual VSS_TIMESTAMP GetCurrentTimestamp() { return m_clock; }
+
+    virtual unique_ptr<VssBackend> CreateWorkerBackend() { return NULL; }
+
+    virtual HRESULT GatherWriterMetadata(IVssAsync** ppAsync);
+
+    virtual HRESULT GetWriterMetadataCount(UINT* pcWriters);
+
+    virtual HRESULT GetWriterMetadata(UINT iWriter, VssWriter& writer);
+
+    virtual HRESULT GetWriterMetadataXml(UINT iWriter, wstring& xml);
+
+    virtual HRESULT GatherWriterStatus(IVssAsync** ppAsync);
+
+    virtual HRESULT GetWriterStatusCount(UINT* pcWriters);
+
+    virtual HRESULT GetWriterStatus(UINT iWriter, VSS_ID* pidInstance, VSS_ID* pidWriter, BSTR* pbstrWriter, VSS_WRITER_STATE* pnStatus, HRESULT* phResultFailure);
+
+    virtual HRESULT GetWriterComponentsCount(UINT* pcComponents);
+
+    virtual HRESULT AddComponent(VSS_ID instanceId, VSS_ID writerId, VSS_COMPONENT_TYPE ct, LPCWSTR wszLogicalPath, LPCWSTR wszComponentName);
+
+    virtual HRESULT SetBackupSucceeded(VSS_ID instanceId, VSS_ID writerId, VSS_COMPONENT_TYPE ct, LPCWSTR wszLogicalPath, LPCWSTR wszComponentName, bool bSucceded);
+
+    virtual HRESULT PrepareForBackup(IVssAsync** ppAsync);
+
+    virtual HRESULT BackupComplete(IVssAsync** ppAsync);
+
+    virtual HRESULT StartSnapshotSet(VSS_ID* pSnapshotSetId);
+
+    virtual HRESULT AddToSnapshotSet(VSS_PWSZ pwszVolumeName, VSS_ID ProviderId, VSS_ID* pidSnapshot);
+
+    virtual HRESULT DoSnapshotSet(IVssAsync** ppAsync);
+
+    virtual HRESULT GetSnapshotProperties(VSS_ID SnapshotId, VSS_SNAPSHOT_PROP* pProp);
+
+    virtual HRESULT Query(VSS_ID QueriedObjectId, VSS_OBJECT_TYPE eQueriedObjectType, VSS_OBJECT_TYPE eReturnedObjectsType, IVssEnumObject** ppEnum);
+
+    virtual HRESULT DeleteSnapshots(VSS_ID SourceObjectId, VSS_OBJECT_TYPE eSourceObjectType, BOOL bForceDelete, LONG* plDeletedSnapshots, VSS_ID* pNondeletedSnapshotID);
+
+private:
+
+    // Spend the configured time of a synchronous call
+    void SimulateCallLatency();
+
+    // Generate the next identifier from the seeded sequence
+    VSS_ID NewId();
+
+    // Generate the synthetic writers
+    void CreateWriters();
+
+    // Fill the given properties structure from the simulated shadow copy, in a set of the given number of shadow copies
+    void GetSnapshotProperties(const SimulatedSnapshot& snapshot, LONG lSnapshotsCount, VSS_SNAPSHOT_PROP* pProp);
+
+    // Add a shadow copy to m_snapshots and m_positions
+    void AddSnapshot(const SimulatedSnapshot& snapshot);
+
+    //
+    //  Data members
+    //
+
+    SimulationSettings              m_settings;
+
+    // State of the identifier generator
+    ULONGLONG                       m_randomState;
+
+    // Simulated clock used for the creation timestamps
+    VSS_TIMESTAMP                   m_clock;
+
+    // Counter used for the shadow copy device names
+    DWORD                           m_deviceCounter;
+
+    DWORD                           m_dwContext;
+
+    // Names of the volumes used by the synthetic writers and shadow copies
+    vector<wstring>                 m_volumes;
+
+    // Synthetic writers, or the ones read from the writer metadata file with their XML documents,
+    // and the ones that have components added to the backup
+    vector<VssWriter>               m_writers;
+    vector<wstring>                 m_writerDocuments;
+    vector<wstring>                 m_writersWithComponents;
+    bool                            m_bWriterMetadataGathered;
+
+    // Shadow copy set being built, GUID_NULL if none
+    VSS_ID                          m_snapshotSetId;
+
+    // Shadow copies added to the set being built
+    vector<SimulatedSnapshot>       m_pendingSnapshots;
+
+    // All shadow copies known by the simulated provider, and their positions in it by ID
+    vector<SimulatedSnapshot>       m_snapshots;
+    map<VSS_ID, size_t, ltguid>     m_positions;
+
+    // Protects m_snapshots and m_positions in DeleteSnapshots, which can be called from several threads
+    SRWLOCK                         m_snapshotsLock;
+};
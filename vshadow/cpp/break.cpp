@@ -37,7 +37,8 @@ void VssClient::BreakSnapshotSet(VSS_ID snapshotSetID, bool makeReadWrite, vecto
         ft.WriteLine(L"- Calling BreakSnapshotSet on " WSTR_GUID_FMT L" ...", GUID_PRINTF_ARG(snapshotSetID));
 
         // Break the shadow copy set
-        CHECK_COM(m_pVssObject->BreakSnapshotSet(snapshotSetID));
+        CHECK_COM(GetVssObject()->BreakSnapshotSet(snapshotSetID));
+        m_snapshotIndex.Invalidate();
 
         // If we want to delay read-write treatment, fill out the volume name list and return
         if (pVolumeNames)
@@ -56,7 +57,8 @@ void VssClient::BreakSnapshotSet(VSS_ID snapshotSetID, bool makeReadWrite, vecto
         ft.WriteLine(L"- Calling BreakSnapshotSet on " WSTR_GUID_FMT L" ...", GUID_PRINTF_ARG(snapshotSetID));
 
         // Just break the snapshot set
-        CHECK_COM(m_pVssObject->BreakSnapshotSet(snapshotSetID));
+        CHECK_COM(GetVssObject()->BreakSnapshotSet(snapshotSetID));
+        m_snapshotIndex.Invalidate();
 
         ft.WriteLine(L"Break done.");
     }
@@ -77,14 +79,15 @@ void VssClient::BreakSnapshotSetEx(VSS_ID snapshotSetID, DWORD dwBreakExFlags)
 
 
     CComPtr<IVssBackupComponentsEx2> pVssObjectEx;
-    CHECK_COM(m_pVssObject->QueryInterface(__uuidof(IVssBackupComponentsEx2), (void**)&pVssObjectEx));
+    CHECK_COM(GetVssObject()->QueryInterface(__uuidof(IVssBackupComponentsEx2), (void**)&pVssObjectEx));
 
     CComPtr<IVssAsync>  pAsync;
 
     CHECK_COM(pVssObjectEx->BreakSnapshotSetEx(snapshotSetID, dwBreakExFlags, &pAsync));
 
     // Waits for the async operation to finish and checks the result
-    WaitAndCheckForAsyncOperation(pAsync);
+    WaitAndCheckForAsyncOperation(pAsync, L"BreakSnapshotSetEx");
+    m_snapshotIndex.Invalidate();
 
     ft.WriteLine(L"BreakEx done.");
 
@@ -113,7 +116,7 @@ void VssClient::DoResync(DWORD dwResyncFlags)
 
     CComPtr<IVssBackupComponentsEx3> pVssObjectEx3;
 
-    CHECK_COM(m_pVssObject->QueryInterface(__uuidof(IVssBackupComponentsEx3), (void**)&pVssObjectEx3));
+    CHECK_COM(GetVssObject()->QueryInterface(__uuidof(IVssBackupComponentsEx3), (void**)&pVssObjectEx3));
 
     // Iterate resync pairs and add them to the recovery set
     for ( map<VSS_ID,wstring,ltguid>::iterator pair = m_resyncPairs.begin();
@@ -135,7 +138,7 @@ void VssClient::DoResync(DWORD dwResyncFlags)
 
     CHECK_COM(pVssObjectEx3->RecoverSet(dwResyncFlags, &pAsync));
 
-    WaitAndCheckForAsyncOperation(pAsync);
+    WaitAndCheckForAsyncOperation(pAsync, L"RecoverSet");
 
     ft.WriteLine(L"Resync done.");
 
@@ -153,40 +156,21 @@ vector<wstring> VssClient::GetSnapshotDevices(VSS_ID snapshotSetID)
 
     vector<wstring> volumes;
         
-    // Get list all snapshots. 
-    CComPtr<IVssEnumObject> pIEnumSnapshots;
-    CHECK_COM( m_pVssObject->Query( GUID_NULL, VSS_OBJECT_NONE, VSS_OBJECT_SNAPSHOT, &pIEnumSnapshots ) );
+    // Get the snapshots part of this set
+    vector<VSS_SNAPSHOT_PROP *> snapshots = GetSnapshotIndex().GetSnapshotSet(snapshotSetID);
 
-    // Enumerate all snapshots. 
-    VSS_OBJECT_PROP Prop;
-    VSS_SNAPSHOT_PROP& Snap = Prop.Obj.Snap;
-    while(true)
+    for (size_t i = 0; i < snapshots.size(); i++)
     {
-        // Get the next element
-        ULONG ulFetched = 0;
-        CHECK_COM(pIEnumSnapshots->Next( 1, &Prop, &ulFetched ));
-
-        // We reached the end of list
-        if (ulFetched == 0)
-            break;
-
-        // Automatically call VssFreeSnapshotProperties on this structure at the end of scope
-        CAutoSnapPointer snapAutoCleanup(&Snap);
-
-        // Ignore snapshots not part of this set
-        if (Snap.m_SnapshotSetId == snapshotSetID)
-        {
-            // Get the snapshot device object name which is a volume guid name for persistent snapshot
-            // and a device name for non persistent snapshot.
-            // The volume guid name and the device name we obtained here might change after breaksnapshot
-            // depending on if the disk signature is reverted, but those cached names should still work
-            // as symbolic links, in which case they can not persist after reboot.
-            wstring snapshotDeviceObjectName = Snap.m_pwszSnapshotDeviceObject;
-
-            // Add it to the array
-            ft.WriteLine(L"- Will convert %s to read-write ...", snapshotDeviceObjectName.c_str());
-            volumes.push_back(snapshotDeviceObjectName);
-        }
+        // Get the snapshot device object name which is a volume guid name for persistent snapshot
+        // and a device name for non persistent snapshot.
+        // The volume guid name and the device name we obtained here might change after breaksnapshot
+        // depending on if the disk signature is reverted, but those cached names should still work
+        // as symbolic links, in which case they can not persist after reboot.
+        wstring snapshotDeviceObjectName = snapshots[i]->m_pwszSnapshotDeviceObject;
+
+        // Add it to the array
+        ft.WriteLine(L"- Will convert %s to read-write ...", snapshotDeviceObjectName.c_str());
+        volumes.push_back(snapshotDeviceObjectName);
     }
 
     // Return the list of snapshot volumes
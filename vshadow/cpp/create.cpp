@@ -24,6 +24,7 @@ void VssClient::CreateSnapshotSet(
     )
 {
     FunctionTracer ft(DBG_INFO);
+    ScopedPhase phase(m_phaseTimer, L"CreateSnapshotSet");
 
     bool bSnapshotWithWriters = ((m_dwContext & VSS_VOLSNAP_ATTR_NO_WRITERS) == 0);
 
@@ -36,7 +37,11 @@ void VssClient::CreateSnapshotSet(
         SelectComponentsForBackup(volumeList, excludedWriterList, includedWriterList);
 
     // Start the shadow set
-    CHECK_COM(m_pVssObject->StartSnapshotSet(&m_latestSnapshotSetID))
+    {
+        ScopedPhase startPhase(m_phaseTimer, L"StartSnapshotSet");
+        CHECK_COM(m_pBackend->StartSnapshotSet(&m_latestSnapshotSetID))
+        startPhase.Complete();
+    }
     ft.WriteLine(L"Creating shadow set " WSTR_GUID_FMT L" ...", GUID_PRINTF_ARG(m_latestSnapshotSetID));
 
     // Add the specified volumes to the shadow set
@@ -54,6 +59,7 @@ void VssClient::CreateSnapshotSet(
     if (m_dwContext & VSS_VOLSNAP_ATTR_DELAYED_POSTSNAPSHOT)
     {
         ft.WriteLine(L"\nFast snapshot created. Exiting... \n");
+        phase.Complete();
         return;
     }
 
@@ -64,9 +70,13 @@ void VssClient::CreateSnapshotSet(
     // List all the created shadow copies
     if ((m_dwContext & VSS_VOLSNAP_ATTR_TRANSPORTABLE) == 0)
     {
+        ScopedPhase queryPhase(m_phaseTimer, L"QuerySnapshotSet");
         ft.WriteLine(L"\nList of created shadow copies: \n");
         QuerySnapshotSet(m_latestSnapshotSetID);
+        queryPhase.Complete();
     }
+
+    phase.Complete();
 }
 
 
@@ -74,17 +84,20 @@ void VssClient::CreateSnapshotSet(
 void VssClient::PrepareForBackup()
 {
     FunctionTracer ft(DBG_INFO);
+    ScopedPhase phase(m_phaseTimer, L"PrepareForBackup");
 
     ft.WriteLine(L"Preparing for backup ... ");
 
     CComPtr<IVssAsync>  pAsync;
-    CHECK_COM(m_pVssObject->PrepareForBackup(&pAsync));
+    CHECK_COM(m_pBackend->PrepareForBackup(&pAsync));
 
     // Waits for the async operation to finish and checks the result
-    WaitAndCheckForAsyncOperation(pAsync);
+    WaitAndCheckForAsyncOperation(pAsync, L"PrepareForBackup");
 
     // Check selected writer status
     CheckSelectedWriterStatus();
+
+    phase.Complete();
 }
 
 
@@ -92,6 +105,7 @@ void VssClient::PrepareForBackup()
 void VssClient::AddToSnapshotSet(vector<wstring> volumeList)
 {
     FunctionTracer ft(DBG_INFO);
+    ScopedPhase phase(m_phaseTimer, L"AddToSnapshotSet");
 
     // Preserve the list of volumes for script generation 
     m_latestVolumeList = volumeList;
@@ -107,11 +121,13 @@ void VssClient::AddToSnapshotSet(vector<wstring> volumeList)
             GetDisplayNameForVolume(volume).c_str());
 
         VSS_ID SnapshotID;
-        CHECK_COM(m_pVssObject->AddToSnapshotSet((LPWSTR)volume.c_str(), GUID_NULL, &SnapshotID));
+        CHECK_COM(m_pBackend->AddToSnapshotSet((LPWSTR)volume.c_str(), GUID_NULL, &SnapshotID));
 
         // Preserve this shadow ID for script generation 
         m_latestSnapshotIdList.push_back(SnapshotID);
     }
+
+    phase.Complete();
 }
 
 
@@ -120,19 +136,24 @@ void VssClient::AddToSnapshotSet(vector<wstring> volumeList)
 void VssClient::DoSnapshotSet()
 {
     FunctionTracer ft(DBG_INFO);
+    ScopedPhase phase(m_phaseTimer, L"DoSnapshotSet");
 
     ft.WriteLine(L"Creating the shadow (DoSnapshotSet) ... ");
 
     CComPtr<IVssAsync>  pAsync;
-    CHECK_COM(m_pVssObject->DoSnapshotSet(&pAsync));
+    CHECK_COM(m_pBackend->DoSnapshotSet(&pAsync));
 
     // Waits for the async operation to finish and checks the result
-    WaitAndCheckForAsyncOperation(pAsync);
+    WaitAndCheckForAsyncOperation(pAsync, L"DoSnapshotSet");
+
+    // The new shadow copies are not in the snapshot index
+    m_snapshotIndex.Invalidate();
 
     // Do not attempt to continue with delayed snapshot ...
     if (m_dwContext & VSS_VOLSNAP_ATTR_DELAYED_POSTSNAPSHOT)
     {
         ft.WriteLine(L"\nFast DoSnapshotSet finished. \n");
+        phase.Complete();
         return;
     }
 
@@ -140,6 +161,7 @@ void VssClient::DoSnapshotSet()
     CheckSelectedWriterStatus();
 
     ft.WriteLine(L"Shadow copy set succesfully created.");
+    phase.Complete();
 }
 
 
@@ -147,13 +169,15 @@ void VssClient::DoSnapshotSet()
 void VssClient::BackupComplete(bool succeeded)
 {
     FunctionTracer ft(DBG_INFO);
+    ScopedPhase phase(m_phaseTimer, L"BackupComplete");
 
     unsigned cWriters = 0;
-    CHECK_COM(m_pVssObject->GetWriterComponentsCount(&cWriters));
+    CHECK_COM(m_pBackend->GetWriterComponentsCount(&cWriters));
 
     if (cWriters == 0)
     {
         ft.WriteLine(L"- There were no writer components in this backup");
+        phase.Complete();
         return;
     } else if (succeeded)
         ft.WriteLine(L"- Mark all writers as succesfully backed up... ");
@@ -165,14 +189,15 @@ void VssClient::BackupComplete(bool succeeded)
     ft.WriteLine(L"Completing the backup (BackupComplete) ... ");
 
     CComPtr<IVssAsync>  pAsync;
-    CHECK_COM(m_pVssObject->BackupComplete(&pAsync));
+    CHECK_COM(m_pBackend->BackupComplete(&pAsync));
 
     // Waits for the async operation to finish and checks the result
-    WaitAndCheckForAsyncOperation(pAsync);
+    WaitAndCheckForAsyncOperation(pAsync, L"BackupComplete");
 
     // Check selected writer status
     CheckSelectedWriterStatus();
 
+    phase.Complete();
 }
 
 
@@ -180,15 +205,17 @@ void VssClient::BackupComplete(bool succeeded)
 void VssClient::SaveBackupComponentsDocument(wstring fileName)
 {
     FunctionTracer ft(DBG_INFO);
+    ScopedPhase phase(m_phaseTimer, L"SaveBackupComponentsDocument");
 
     ft.WriteLine(L"Saving the backup components document ... ");
 
     // Get the Backup Components in XML format
     CComBSTR bstrXML;
-    CHECK_COM(m_pVssObject->SaveAsXML(&bstrXML));
+    CHECK_COM(GetVssObject()->SaveAsXML(&bstrXML));
 
     // Save the XML string to the file
     WriteFile(fileName, BSTR2WString(bstrXML));
+    phase.Complete();
 }
 
 
@@ -219,7 +246,7 @@ void VssClient::GenerateSetvarScript(wstring stringFileName)
         if ((m_dwContext & VSS_VOLSNAP_ATTR_TRANSPORTABLE) == 0)
         {
             VSS_SNAPSHOT_PROP Snap;
-            CHECK_COM(m_pVssObject->GetSnapshotProperties(WString2Guid(snapshotID), &Snap));
+            CHECK_COM(m_pBackend->GetSnapshotProperties(WString2Guid(snapshotID), &Snap));
 
             // Automatically call VssFreeSnapshotProperties on this structure at the end of scope
             CAutoSnapPointer snapAutoCleanup(&Snap);
@@ -240,10 +267,13 @@ void VssClient::ImportSnapshotSet()
     ft.WriteLine(L"Importing the transportable snapshot set ... ");
 
     CComPtr<IVssAsync>  pAsync;
-    CHECK_COM(m_pVssObject->ImportSnapshots(&pAsync));
+    CHECK_COM(GetVssObject()->ImportSnapshots(&pAsync));
 
     // Waits for the async operation to finish and checks the result
-    WaitAndCheckForAsyncOperation(pAsync);
+    WaitAndCheckForAsyncOperation(pAsync, L"ImportSnapshots");
+
+    // The imported shadow copies are not in the snapshot index
+    m_snapshotIndex.Invalidate();
 
     ft.WriteLine(L"Shadow copy set succesfully imported.");
 }
@@ -269,7 +299,7 @@ void VssClient::SetBackupSucceeded(bool succeeded)
                 continue;
 
             // Call SetBackupSucceeded for this component
-            CHECK_COM(m_pVssObject->SetBackupSucceeded(
+            CHECK_COM(m_pBackend->SetBackupSucceeded(
                 WString2Guid(writer.instanceId),
                 WString2Guid(writer.id),
                 component.type,
@@ -21,38 +21,20 @@ void VssClient::DeleteAllSnapshots()
     FunctionTracer ft(DBG_INFO);
 
     // Get list all shadow copies. 
-    CComPtr<IVssEnumObject> pIEnumSnapshots;
-    HRESULT hr = m_pVssObject->Query( GUID_NULL, 
-            VSS_OBJECT_NONE, 
-            VSS_OBJECT_SNAPSHOT, 
-            &pIEnumSnapshots );
-
-    CHECK_COM_ERROR(hr, L"m_pVssObject->Query(GUID_NULL, VSS_OBJECT_NONE, VSS_OBJECT_SNAPSHOT, &pIEnumSnapshots )")
+    SnapshotIndex & index = GetSnapshotIndex();
 
     // If there are no shadow copies, just return
-    if (hr == S_FALSE) 
+    if (index.GetCount() == 0) 
     {
         ft.WriteLine(L"\nThere are no shadow copies on the system\n");
         return;
     } 
 
-    // Enumerate all shadow copies. Delete each one
-    VSS_OBJECT_PROP Prop;
-    VSS_SNAPSHOT_PROP& Snap = Prop.Obj.Snap;
-    
-    while(true)
+    // Delete each shadow copy, the volumes in parallel
+    ParallelDeleter deleter(m_pBackend.get(), m_deleteConcurrency);
+    for (size_t i = 0; i < index.GetCount(); i++)
     {
-        // Get the next element
-        ULONG ulFetched;
-        hr = pIEnumSnapshots->Next( 1, &Prop, &ulFetched );
-        CHECK_COM_ERROR(hr, L"pIEnumSnapshots->Next( 1, &Prop, &ulFetched )")
-
-        // We reached the end of list
-        if (ulFetched == 0)
-            break;
-
-        // Automatically call VssFreeSnapshotProperties on this structure at the end of scope
-        CAutoSnapPointer snapAutoCleanup(&Snap);
+        VSS_SNAPSHOT_PROP & Snap = index.GetSnapshot(i);
 
         // Print the deleted shadow copy...
         ft.WriteLine(L"- Deleting shadow copy " WSTR_GUID_FMT L" on %s from provider " WSTR_GUID_FMT L" [0x%08lx]...", 
@@ -61,23 +43,13 @@ void VssClient::DeleteAllSnapshots()
             GUID_PRINTF_ARG(Snap.m_ProviderId),
             Snap.m_lSnapshotAttributes);
 
-        // Perform the actual deletion
-        LONG lSnapshots = 0;
-        VSS_ID idNonDeletedSnapshotID = GUID_NULL;
-        hr = m_pVssObject->DeleteSnapshots(
-            Snap.m_SnapshotId, 
-            VSS_OBJECT_SNAPSHOT,
-            FALSE,
-            &lSnapshots,
-            &idNonDeletedSnapshotID);
-
-        if (FAILED(hr))
-        {
-            ft.WriteLine(L"Error while deleting shadow copies...");
-            ft.WriteLine(L"- Last shadow copy that could not be deleted: " WSTR_GUID_FMT, GUID_PRINTF_ARG(idNonDeletedSnapshotID));
-            CHECK_COM_ERROR(hr, L"m_pVssObject->DeleteSnapshots(Snap.m_SnapshotId, VSS_OBJECT_SNAPSHOT,FALSE,&lSnapshots,&idNonDeleted)");
-        }
+        deleter.Add(Snap);
     }
+
+    // Perform the actual deletions
+    index.Invalidate();
+    deleter.Run();
+    deleter.CheckFailures();
 }
 
 
@@ -89,21 +61,36 @@ void VssClient::DeleteSnapshotSet(VSS_ID snapshotSetID)
     // Print the deleted shadow copy...
     ft.WriteLine(L"- Deleting shadow copy set " WSTR_GUID_FMT L" ...", GUID_PRINTF_ARG(snapshotSetID));
 
+    // Delete the shadow copies of the set, the volumes in parallel
+    vector<VSS_SNAPSHOT_PROP *> snapshots = GetSnapshotIndex().GetSnapshotSet(snapshotSetID);
+    if (snapshots.size() > 1 && m_deleteConcurrency > 1)
+    {
+        ParallelDeleter deleter(m_pBackend.get(), m_deleteConcurrency);
+        for (size_t i = 0; i < snapshots.size(); i++)
+            deleter.Add(*snapshots[i]);
+
+        m_snapshotIndex.Invalidate();
+        deleter.Run();
+        deleter.CheckFailures();
+        return;
+    }
+
     // Perform the actual deletion
     LONG lSnapshots = 0;
     VSS_ID idNonDeletedSnapshotID = GUID_NULL;
-    HRESULT hr = m_pVssObject->DeleteSnapshots(
+    HRESULT hr = m_pBackend->DeleteSnapshots(
         snapshotSetID, 
         VSS_OBJECT_SNAPSHOT_SET,
         FALSE,
         &lSnapshots,
         &idNonDeletedSnapshotID);
+    m_snapshotIndex.Invalidate();
 
     if (FAILED(hr))
     {
         ft.WriteLine(L"Error while deleting shadow copies...");
         ft.WriteLine(L"- Last shadow copy that could not be deleted: " WSTR_GUID_FMT, GUID_PRINTF_ARG(idNonDeletedSnapshotID));
-        CHECK_COM_ERROR(hr, L"m_pVssObject->DeleteSnapshots(snapshotSetID, VSS_OBJECT_SNAPSHOT_SET,FALSE,&lSnapshots,&idNonDeleted)");
+        CHECK_COM_ERROR(hr, L"m_pBackend->DeleteSnapshots(snapshotSetID, VSS_OBJECT_SNAPSHOT_SET,FALSE,&lSnapshots,&idNonDeleted)");
     }
 }
 
@@ -113,59 +100,18 @@ void VssClient::DeleteOldestSnapshot(const wstring& stringVolumeName)
 
     wstring uniqueVolume = GetUniqueVolumeNameForPath(stringVolumeName);
 
-    // Get list all shadow copies. 
-    CComPtr<IVssEnumObject> pIEnumSnapshots;
-    HRESULT hr = m_pVssObject->Query( GUID_NULL, 
-            VSS_OBJECT_NONE, 
-            VSS_OBJECT_SNAPSHOT, 
-            &pIEnumSnapshots );
+    // Get the shadow copies on this volume, oldest first
+    vector<VSS_SNAPSHOT_PROP *> snapshots = GetSnapshotIndex().GetSnapshotsForVolume(uniqueVolume);
 
-    CHECK_COM_ERROR(hr, L"m_pVssObject->Query(GUID_NULL, VSS_OBJECT_NONE, VSS_OBJECT_SNAPSHOT, &pIEnumSnapshots )")
-
-    // If there are no shadow copies, just return
-    if (hr == S_FALSE) 
+    if (snapshots.empty())
     {
         ft.WriteLine(L"\nThere are no shadow copies on the system\n");
         return;
-    } 
-
-    // Enumerate all shadow copies. Delete each one
-    VSS_OBJECT_PROP Prop;
-    VSS_SNAPSHOT_PROP& Snap = Prop.Obj.Snap;
-    
-    VSS_ID OldestSnapshotId = GUID_NULL; 
-    VSS_ID OldestProviderId = GUID_NULL;
-    LONG OldestAttributes = 0;
-    VSS_TIMESTAMP OldestSnapshotTimestamp = 0x7FFFFFFFFFFFFFFF; 
-    while(true)
-    {
-        // Get the next element
-        ULONG ulFetched;
-        hr = pIEnumSnapshots->Next( 1, &Prop, &ulFetched );
-        CHECK_COM_ERROR(hr, L"pIEnumSnapshots->Next( 1, &Prop, &ulFetched )")
-
-        // We reached the end of list
-        if (ulFetched == 0)
-            break;
-
-        // Automatically call VssFreeSnapshotProperties on this structure at the end of scope
-        CAutoSnapPointer snapAutoCleanup(&Snap);
-
-        if (IsEqual( Snap.m_pwszOriginalVolumeName, uniqueVolume ) &&
-            OldestSnapshotTimestamp > Snap.m_tsCreationTimestamp)
-        {
-            OldestSnapshotId = Snap.m_SnapshotId;
-            OldestSnapshotTimestamp = Snap.m_tsCreationTimestamp;
-            OldestProviderId = Snap.m_ProviderId;
-            OldestAttributes = Snap.m_lSnapshotAttributes;
-        }
     }
 
-    if (OldestSnapshotId == GUID_NULL)
-    {
-        ft.WriteLine(L"\nThere are no shadow copies on the system\n");
-        return;
-    }
+    VSS_ID OldestSnapshotId = snapshots[0]->m_SnapshotId;
+    VSS_ID OldestProviderId = snapshots[0]->m_ProviderId;
+    LONG OldestAttributes = snapshots[0]->m_lSnapshotAttributes;
 
     // Print the deleted shadow copy...
     ft.WriteLine(L"- Deleting shadow copy " WSTR_GUID_FMT L" on %s from provider " WSTR_GUID_FMT L" [0x%08lx]...", 
@@ -177,18 +123,19 @@ void VssClient::DeleteOldestSnapshot(const wstring& stringVolumeName)
         // Perform the actual deletion
         LONG lSnapshots = 0;
         VSS_ID idNonDeletedSnapshotID = GUID_NULL;
-        hr = m_pVssObject->DeleteSnapshots(
+        HRESULT hr = m_pBackend->DeleteSnapshots(
             OldestSnapshotId, 
             VSS_OBJECT_SNAPSHOT,
             FALSE,
             &lSnapshots,
             &idNonDeletedSnapshotID);
+        m_snapshotIndex.Invalidate();
 
         if (FAILED(hr))
         {
             ft.WriteLine(L"Error while deleting shadow copies...");
             ft.WriteLine(L"- Last shadow copy that could not be deleted: " WSTR_GUID_FMT, GUID_PRINTF_ARG(idNonDeletedSnapshotID));
-            CHECK_COM_ERROR(hr, L"m_pVssObject->DeleteSnapshots(OldestSnapshotId, VSS_OBJECT_SNAPSHOT,FALSE,&lSnapshots,&idNonDeleted)");
+            CHECK_COM_ERROR(hr, L"m_pBackend->DeleteSnapshots(OldestSnapshotId, VSS_OBJECT_SNAPSHOT,FALSE,&lSnapshots,&idNonDeleted)");
         }
 
 }
@@ -204,18 +151,103 @@ void VssClient::DeleteSnapshot(VSS_ID snapshotID)
     // Perform the actual deletion
     LONG lSnapshots = 0;
     VSS_ID idNonDeletedSnapshotID = GUID_NULL;
-    HRESULT hr = m_pVssObject->DeleteSnapshots(
+    HRESULT hr = m_pBackend->DeleteSnapshots(
         snapshotID, 
         VSS_OBJECT_SNAPSHOT,
         FALSE,
         &lSnapshots,
         &idNonDeletedSnapshotID);
+    m_snapshotIndex.Invalidate();
 
     if (FAILED(hr))
     {
         ft.WriteLine(L"Error while deleting shadow copies...");
         ft.WriteLine(L"- Last shadow copy that could not be deleted: " WSTR_GUID_FMT, GUID_PRINTF_ARG(idNonDeletedSnapshotID));
-        CHECK_COM_ERROR(hr, L"m_pVssObject->DeleteSnapshots(snapshotID, VSS_OBJECT_SNAPSHOT,FALSE,&lSnapshots,&idNonDeleted)");
+        CHECK_COM_ERROR(hr, L"m_pBackend->DeleteSnapshots(snapshotID, VSS_OBJECT_SNAPSHOT,FALSE,&lSnapshots,&idNonDeleted)");
     }
 }
 
+
+
+// Delete the shadow copies not kept by the retention policy, on all volumes
+void VssClient::PruneSnapshots(const RetentionPolicy & policy, bool bDryRun)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    // Get list all shadow copies. 
+    SnapshotIndex & index = GetSnapshotIndex();
+
+    // If there are no shadow copies, just return
+    if (index.GetCount() == 0) 
+    {
+        ft.WriteLine(L"\nThere are no shadow copies on the system\n");
+        return;
+    } 
+
+    VSS_TIMESTAMP now = m_pBackend->GetCurrentTimestamp();
+
+    // Plan the deletions on each volume
+    vector<VSS_SNAPSHOT_PROP *> deletedSnapshots;
+    vector<wstring> volumes = index.GetVolumes();
+    for (unsigned iVolume = 0; iVolume < volumes.size(); iVolume++)
+    {
+        vector<RetentionEntry> plan = PlanRetention(policy, index.GetSnapshotsForVolume(volumes[iVolume]), now);
+
+        size_t cDeleted = 0;
+        for (size_t i = 0; i < plan.size(); i++)
+        {
+            if (!plan[i].IsKept())
+            {
+                deletedSnapshots.push_back(plan[i].pSnapshot);
+                cDeleted++;
+            }
+        }
+
+        ft.WriteLine(L"- Volume %s: Keeping %u and deleting %u of %u shadow copies", 
+            volumes[iVolume].c_str(), 
+            (unsigned)(plan.size() - cDeleted), 
+            (unsigned)cDeleted, 
+            (unsigned)plan.size());
+
+        // List the decisions, newest first
+        if (bDryRun)
+        {
+            for (size_t i = plan.size(); i-- > 0; )
+                ft.WriteLine(L"   - %s " WSTR_GUID_FMT L" created %s (%s)", 
+                    plan[i].IsKept() ? L"Keep  " : L"Delete",
+                    GUID_PRINTF_ARG(plan[i].pSnapshot->m_SnapshotId),
+                    VssTimeToString(plan[i].pSnapshot->m_tsCreationTimestamp).c_str(),
+                    plan[i].Describe().c_str());
+        }
+    }
+
+    if (bDryRun)
+    {
+        ft.WriteLine(L"\nDry run: %u shadow copies would be deleted\n", (unsigned)deletedSnapshots.size());
+        return;
+    }
+
+    if (deletedSnapshots.empty())
+        return;
+
+    // Delete all planned shadow copies, the volumes in parallel
+    ParallelDeleter deleter(m_pBackend.get(), m_deleteConcurrency);
+    for (size_t i = 0; i < deletedSnapshots.size(); i++)
+    {
+        VSS_SNAPSHOT_PROP & Snap = *deletedSnapshots[i];
+
+        // Print the deleted shadow copy...
+        ft.WriteLine(L"- Deleting shadow copy " WSTR_GUID_FMT L" on %s from provider " WSTR_GUID_FMT L" [0x%08lx]...", 
+            GUID_PRINTF_ARG(Snap.m_SnapshotId),
+            Snap.m_pwszOriginalVolumeName,
+            GUID_PRINTF_ARG(Snap.m_ProviderId),
+            Snap.m_lSnapshotAttributes);
+
+        deleter.Add(Snap);
+    }
+
+    // Perform the actual deletions
+    index.Invalidate();
+    deleter.Run();
+    deleter.CheckFailures();
+}
@@ -0,0 +1,177 @@
+// Main header
+#include "stdafx.h"
+
+
+
+ParallelDeleter::ParallelDeleter(VssBackend * pBackend, DWORD maxConcurrency):
+    m_pBackend(pBackend), m_maxConcurrency(maxConcurrency), m_nextVolume(0)
+{
+    // The calling thread is one of the workers, and waits for all the others at once
+    if (m_maxConcurrency == 0)
+        m_maxConcurrency = 1;
+    if (m_maxConcurrency > MAXIMUM_WAIT_OBJECTS + 1)
+        m_maxConcurrency = MAXIMUM_WAIT_OBJECTS + 1;
+}
+
+
+// Add a shadow copy to delete
+void ParallelDeleter::Add(const VSS_SNAPSHOT_PROP & snapshot)
+{
+    Deletion deletion;
+    deletion.snapshotId = snapshot.m_SnapshotId;
+    deletion.volumeName = snapshot.m_pwszOriginalVolumeName ? snapshot.m_pwszOriginalVolumeName : L"";
+    deletion.hr = S_OK;
+    deletion.idNonDeletedSnapshotID = GUID_NULL;
+    m_deletions.push_back(deletion);
+}
+
+
+// Delete all the added shadow copies
+void ParallelDeleter::Run()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    // Partition the shadow copies by volume
+    map<wstring, size_t> volumePositions;
+    m_volumes.clear();
+    for (size_t i = 0; i < m_deletions.size(); i++)
+    {
+        wstring volume = ToLowerCase(m_deletions[i].volumeName);
+        auto it = volumePositions.find(volume);
+        if (it == volumePositions.end())
+        {
+            it = volumePositions.insert(make_pair(volume, m_volumes.size())).first;
+            m_volumes.push_back(vector<size_t>());
+        }
+        m_volumes[it->second].push_back(i);
+    }
+
+    // Start with the volumes having most shadow copies, so that they do not end up last on a single worker
+    stable_sort(m_volumes.begin(), m_volumes.end(),
+        [](const vector<size_t> & first, const vector<size_t> & second) { return first.size() > second.size(); });
+    m_nextVolume = 0;
+
+    DWORD cWorkers = (DWORD)min((size_t)m_maxConcurrency, m_volumes.size());
+    ft.WriteLine(L"- Deleting %u shadow copies on %u volumes using %u threads ...",
+        (unsigned)m_deletions.size(), (unsigned)m_volumes.size(), cWorkers);
+
+    // Start the other workers, the calling thread is the first one
+    vector<HANDLE> threads;
+    for (DWORD i = 1; i < cWorkers; i++)
+    {
+        HANDLE hThread = CreateThread(NULL, 0, WorkerThread, this, 0, NULL);
+        if (hThread == NULL)
+        {
+            // The started workers, and this thread, still delete all the volumes
+            ft.WriteLine(L"WARNING: Could not start a deletion thread (error %d), continuing with %u threads",
+                GetLastError(), (unsigned)threads.size() + 1);
+            break;
+        }
+        threads.push_back(hThread);
+    }
+
+    DeleteVolumes(m_pBackend);
+
+    if (!threads.empty())
+    {
+        WaitForMultipleObjects((DWORD)threads.size(), &threads[0], TRUE, INFINITE);
+        for (size_t i = 0; i < threads.size(); i++)
+            CloseHandle(threads[i]);
+    }
+}
+
+
+// Print a summary of the failed deletions, and throw the error of the first one
+void ParallelDeleter::CheckFailures()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    size_t cFailed = 0;
+    HRESULT hrFirstFailure = S_OK;
+    for (size_t i = 0; i < m_deletions.size(); i++)
+    {
+        Deletion & deletion = m_deletions[i];
+        if (SUCCEEDED(deletion.hr))
+            continue;
+
+        if (cFailed++ == 0)
+        {
+            hrFirstFailure = deletion.hr;
+            ft.WriteLine(L"Error while deleting shadow copies...");
+        }
+
+        ft.WriteLine(L"- Shadow copy " WSTR_GUID_FMT L" on %s could not be deleted: 0x%08lx",
+            GUID_PRINTF_ARG(deletion.snapshotId),
+            deletion.volumeName.c_str(),
+            deletion.hr);
+        if (deletion.idNonDeletedSnapshotID != GUID_NULL && deletion.idNonDeletedSnapshotID != deletion.snapshotId)
+            ft.WriteLine(L"   - Last shadow copy that could not be deleted: " WSTR_GUID_FMT, GUID_PRINTF_ARG(deletion.idNonDeletedSnapshotID));
+    }
+
+    ft.WriteLine(L"\nDeleted %u of %u shadow copies\n",
+        (unsigned)(m_deletions.size() - cFailed),
+        (unsigned)m_deletions.size());
+
+    CHECK_COM_ERROR(hrFirstFailure, L"m_pBackend->DeleteSnapshots(snapshotId, VSS_OBJECT_SNAPSHOT,FALSE,&lSnapshots,&idNonDeleted)");
+}
+
+
+// Delete the volumes taken from the shared queue until it is empty
+void ParallelDeleter::DeleteVolumes(VssBackend * pBackend)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    while(true)
+    {
+        size_t iVolume = m_nextVolume++;
+        if (iVolume >= m_volumes.size())
+            break;
+
+        // Each deletion is only written by the thread deleting its volume
+        vector<size_t> & positions = m_volumes[iVolume];
+        for (size_t i = 0; i < positions.size(); i++)
+        {
+            Deletion & deletion = m_deletions[positions[i]];
+            ft.Trace(DBG_INFO, L"Deleting shadow copy " WSTR_GUID_FMT, GUID_PRINTF_ARG(deletion.snapshotId));
+
+            LONG lSnapshots = 0;
+            deletion.hr = pBackend->DeleteSnapshots(
+                deletion.snapshotId,
+                VSS_OBJECT_SNAPSHOT,
+                FALSE,
+                &lSnapshots,
+                &deletion.idNonDeletedSnapshotID);
+        }
+    }
+}
+
+
+// Worker thread, deleting volumes with its own backend
+DWORD WINAPI ParallelDeleter::WorkerThread(LPVOID pParameter)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    ParallelDeleter * pDeleter = (ParallelDeleter *)pParameter;
+
+    HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+    if (FAILED(hr))
+    {
+        ft.WriteLine(L"WARNING: Could not initialize COM for a deletion thread (0x%08lx)", hr);
+        return 0;
+    }
+
+    // The worker backend must be released before CoUninitialize
+    try
+    {
+        unique_ptr<VssBackend> pWorkerBackend = pDeleter->m_pBackend->CreateWorkerBackend();
+        pDeleter->DeleteVolumes(pWorkerBackend ? pWorkerBackend.get() : pDeleter->m_pBackend);
+    }
+    catch(HRESULT hrError)
+    {
+        // The other workers delete the remaining volumes
+        ft.WriteLine(L"WARNING: Could not create the backend of a deletion thread (0x%08lx)", hrError);
+    }
+
+    CoUninitialize();
+    return 0;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Parallel shadow copy deletion
+//
+//  Deletes a list of shadow copies on a bounded number of worker threads.
+//  The shadow copies are partitioned by original volume: The shadow copies
+//  of a volume are deleted one at a time, in the order they were added, by
+//  a single worker, while different volumes are deleted in parallel. Each
+//  worker thread uses its own backend, as returned by CreateWorkerBackend.
+//
+//  The deletions do not stop at the first failure. The failures are
+//  collected and reported together when all the deletions are done.
+//
+
+// Default maximum number of volumes to delete shadow copies from at the same time
+const DWORD DEFAULT_DELETE_CONCURRENCY = 4;
+
+
+class ParallelDeleter
+{
+public:
+
+    // With a maximum concurrency of 1, the shadow copies are deleted by the calling thread
+    ParallelDeleter(VssBackend * pBackend, DWORD maxConcurrency);
+
+    // Add a shadow copy to delete
+    void Add(const VSS_SNAPSHOT_PROP & snapshot);
+
+    // Number of shadow copies added
+    size_t GetCount() { return m_deletions.size(); }
+
+    // Delete all the added shadow copies, failures are not thrown but kept for CheckFailures
+    void Run();
+
+    // Print a summary of the failed deletions, and throw the error of the first one
+    void CheckFailures();
+
+private:
+
+    struct Deletion
+    {
+        VSS_ID      snapshotId;
+        wstring     volumeName;
+
+        // Result of DeleteSnapshots, and the shadow copy it reported as not deleted
+        HRESULT     hr;
+        VSS_ID      idNonDeletedSnapshotID;
+    };
+
+    // Delete the volumes taken from the shared queue until it is empty
+    void DeleteVolumes(VssBackend * pBackend);
+
+    // Worker thread, deleting volumes with its own backend
+    static DWORD WINAPI WorkerThread(LPVOID pParameter);
+
+    //
+    //  Data members
+    //
+
+    VssBackend *                m_pBackend;
+
+    DWORD                       m_maxConcurrency;
+
+    // Shadow copies to delete, in the order they were added
+    vector<Deletion>            m_deletions;
+
+    // Positions in m_deletions for each volume
+    vector<vector<size_t>>      m_volumes;
+
+    // Index in m_volumes of the next volume to delete from
+    atomic<size_t>              m_nextVolume;
+};
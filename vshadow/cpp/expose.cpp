@@ -26,7 +26,7 @@ void VssClient::ExposeSnapshotLocally(VSS_ID snapshotID, wstring path)
     // Make sure that the expose operation is valid for this snapshot.
     // Get the shadow copy properties
     VSS_SNAPSHOT_PROP Snap;
-    HRESULT hr = m_pVssObject->GetSnapshotProperties(snapshotID, &Snap);
+    HRESULT hr = m_pBackend->GetSnapshotProperties(snapshotID, &Snap);
     if (hr == VSS_E_OBJECT_NOT_FOUND)
     {
         ft.WriteLine(L"\nERROR: there is no snapshot with the given ID");
@@ -114,12 +114,15 @@ void VssClient::ExposeSnapshotLocally(VSS_ID snapshotID, wstring path)
 
     // Expose locally the shadow copy set
     LPWSTR pwszExposed = NULL;
-    CHECK_COM(m_pVssObject->ExposeSnapshot(snapshotID, NULL, 
+    CHECK_COM(GetVssObject()->ExposeSnapshot(snapshotID, NULL, 
         VSS_VOLSNAP_ATTR_EXPOSED_LOCALLY, (VSS_PWSZ)path.c_str(), &pwszExposed));
 
     // Automatically call CoTaskMemFree on this pointer at the end of scope
     CAutoComPointer ptrAutoCleanup(pwszExposed);
 
+    // The exposed name is not in the snapshot index
+    m_snapshotIndex.Invalidate();
+
     ft.WriteLine(L"- Shadow copy exposed as '%s'", pwszExposed);
 }
 
@@ -136,7 +139,7 @@ void VssClient::ExposeSnapshotRemotely(VSS_ID snapshotID, wstring shareName, wst
     // Make sure that the expose operation is valid for this snapshot.
     // Get the shadow copy properties
     VSS_SNAPSHOT_PROP Snap;
-    HRESULT hr = m_pVssObject->GetSnapshotProperties(snapshotID, &Snap);
+    HRESULT hr = m_pBackend->GetSnapshotProperties(snapshotID, &Snap);
     if (hr == VSS_E_OBJECT_NOT_FOUND)
     {
         ft.WriteLine(L"\nERROR: there is no snapshot with the given ID");
@@ -172,7 +175,7 @@ void VssClient::ExposeSnapshotRemotely(VSS_ID snapshotID, wstring shareName, wst
 
     // Expose locally the shadow copy set
     LPWSTR pwszExposed = NULL;
-    CHECK_COM(m_pVssObject->ExposeSnapshot(snapshotID, 
+    CHECK_COM(GetVssObject()->ExposeSnapshot(snapshotID, 
         pwszPathFromRoot, 
         VSS_VOLSNAP_ATTR_EXPOSED_REMOTELY, 
         (VSS_PWSZ)shareName.c_str(), 
@@ -181,6 +184,9 @@ void VssClient::ExposeSnapshotRemotely(VSS_ID snapshotID, wstring shareName, wst
     // Automatically call CoTaskMemFree on this pointer at the end of scope
     CAutoComPointer ptrAutoCleanup(pwszExposed);
 
+    // The exposed name is not in the snapshot index
+    m_snapshotIndex.Invalidate();
+
     ft.WriteLine(L"- Shadow copy exposed as '%s'", pwszExposed);
 }
 
@@ -27,42 +27,26 @@ void VssClient::QuerySnapshotSet(VSS_ID snapshotSetID)
         ft.WriteLine(L"\nQuerying all shadow copies with the SnapshotSetID " WSTR_GUID_FMT L" ...\n", GUID_PRINTF_ARG(snapshotSetID));
     
     // Get list all shadow copies. 
-    CComPtr<IVssEnumObject> pIEnumSnapshots;
-    HRESULT hr = m_pVssObject->Query( GUID_NULL, 
-            VSS_OBJECT_NONE, 
-            VSS_OBJECT_SNAPSHOT, 
-            &pIEnumSnapshots );
-
-    CHECK_COM_ERROR(hr, L"m_pVssObject->Query(GUID_NULL, VSS_OBJECT_NONE, VSS_OBJECT_SNAPSHOT, &pIEnumSnapshots )")
+    SnapshotIndex & index = GetSnapshotIndex();
 
     // If there are no shadow copies, just return
-    if (hr == S_FALSE) {
+    if (index.GetCount() == 0) {
         if (snapshotSetID == GUID_NULL)
             ft.WriteLine(L"\nThere are no shadow copies in the system\n");
         return;
     } 
 
-    // Enumerate all shadow copies. 
-    VSS_OBJECT_PROP Prop;
-    VSS_SNAPSHOT_PROP& Snap = Prop.Obj.Snap;
-    
-    while(true)
+    // Print all shadow copies, or the ones in the given set
+    if (snapshotSetID == GUID_NULL)
     {
-        // Get the next element
-        ULONG ulFetched;
-        hr = pIEnumSnapshots->Next( 1, &Prop, &ulFetched );
-        CHECK_COM_ERROR(hr, L"pIEnumSnapshots->Next( 1, &Prop, &ulFetched )")
-
-        // We reached the end of list
-        if (ulFetched == 0)
-            break;
-
-        // Automatically call VssFreeSnapshotProperties on this structure at the end of scope
-        CAutoSnapPointer snapAutoCleanup(&Snap);
-
-        // Print the shadow copy (if not filtered out)
-        if ((snapshotSetID == GUID_NULL) || (Snap.m_SnapshotSetId == snapshotSetID))
-            PrintSnapshotProperties(Snap);
+        for (size_t i = 0; i < index.GetCount(); i++)
+            PrintSnapshotProperties(index.GetSnapshot(i));
+    }
+    else
+    {
+        vector<VSS_SNAPSHOT_PROP *> snapshots = index.GetSnapshotSet(snapshotSetID);
+        for (size_t i = 0; i < snapshots.size(); i++)
+            PrintSnapshotProperties(*snapshots[i]);
     }
 }
 
@@ -74,7 +58,7 @@ void VssClient::GetSnapshotProperties(VSS_ID snapshotID)
 
     // Get the shadow copy properties
     VSS_SNAPSHOT_PROP Snap;
-    CHECK_COM(m_pVssObject->GetSnapshotProperties(snapshotID, &Snap));
+    CHECK_COM(m_pBackend->GetSnapshotProperties(snapshotID, &Snap));
 
     // Automatically call VssFreeSnapshotProperties on this structure at the end of scope
     CAutoSnapPointer snapAutoCleanup(&Snap);
@@ -94,10 +78,14 @@ void VssClient::PrintSnapshotProperties(VSS_SNAPSHOT_PROP & prop)
     ft.WriteLine(L"* SNAPSHOT ID = " WSTR_GUID_FMT L" ...", GUID_PRINTF_ARG(prop.m_SnapshotId));
     ft.WriteLine(L"   - Shadow copy Set: " WSTR_GUID_FMT, GUID_PRINTF_ARG(prop.m_SnapshotSetId));
     ft.WriteLine(L"   - Original count of shadow copies = %d", prop.m_lSnapshotsCount);
-    ft.WriteLine(L"   - Original Volume name: %s [%s]", 
-        prop.m_pwszOriginalVolumeName, 
-        GetDisplayNameForVolume(prop.m_pwszOriginalVolumeName).c_str()
-        );
+    wstring wsLocalVolume;
+    if (GetDisplayNameForVolumeNoThrow(prop.m_pwszOriginalVolumeName, wsLocalVolume))
+        ft.WriteLine(L"   - Original Volume name: %s [%s]", 
+            prop.m_pwszOriginalVolumeName, 
+            wsLocalVolume.c_str()
+            );
+    else
+        ft.WriteLine(L"   - Original Volume name: %s [Not valid for local machine]", prop.m_pwszOriginalVolumeName);
     ft.WriteLine(L"   - Creation Time: %s", VssTimeToString(prop.m_tsCreationTimestamp).c_str());
     ft.WriteLine(L"   - Shadow copy device name: %s", prop.m_pwszSnapshotDeviceObject);
     ft.WriteLine(L"   - Originating machine: %s", prop.m_pwszOriginatingMachine);
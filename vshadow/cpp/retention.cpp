@@ -0,0 +1,142 @@
+// Main header
+#include "stdafx.h"
+
+
+// Length of the retention buckets, in the 100 nanosecond units of VSS_TIMESTAMP
+const VSS_TIMESTAMP RETENTION_HOUR = 36000000000ll;
+const VSS_TIMESTAMP RETENTION_DAY = 24 * RETENTION_HOUR;
+const VSS_TIMESTAMP RETENTION_WEEK = 7 * RETENTION_DAY;
+
+
+
+// Parse a comma separated list of name:value pairs
+void RetentionPolicy::Parse(wstring policy)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    vector<wstring> pairs = SplitWString(policy, L',');
+    for (unsigned i = 0; i < pairs.size(); i++)
+    {
+        size_t separatorPos = pairs[i].find(L':');
+        wstring name = pairs[i].substr(0, separatorPos);
+        wstring value = (separatorPos == wstring::npos) ? wstring() : pairs[i].substr(separatorPos + 1);
+        LPWSTR pwszEnd = NULL;
+        DWORD dwValue = wcstoul(value.c_str(), &pwszEnd, 10);
+        if (value.empty() || *pwszEnd != L'\0')
+        {
+            ft.WriteLine(L"ERROR: Invalid retention rule '%s', expected name:number!", pairs[i].c_str());
+            throw(E_INVALIDARG);
+        }
+
+        if (IsEqual(name, L"keep"))
+            keepNewest = dwValue;
+        else if (IsEqual(name, L"hourly"))
+            hourly = dwValue;
+        else if (IsEqual(name, L"daily"))
+            daily = dwValue;
+        else if (IsEqual(name, L"weekly"))
+            weekly = dwValue;
+        else if (IsEqual(name, L"maxage"))
+            maxAgeHours = dwValue;
+        else
+        {
+            ft.WriteLine(L"ERROR: Unknown retention rule '%s'!", pairs[i].c_str());
+            throw(E_INVALIDARG);
+        }
+    }
+
+    // Refuse to delete everything because of a missing policy
+    if (!HasKeepRules() && maxAgeHours == 0)
+    {
+        ft.WriteLine(L"ERROR: The retention policy must keep some shadow copies, use keep, hourly, daily, weekly or maxage!");
+        throw(E_INVALIDARG);
+    }
+}
+
+
+// Short description of the decision
+wstring RetentionEntry::Describe() const
+{
+    if (bExpired)
+        return L"expired";
+
+    if (dwReasons == 0)
+        return L"not kept by any rule";
+
+    wstring description;
+    if (dwReasons & RETAIN_NEWEST)
+        description += L", newest";
+    if (dwReasons & RETAIN_HOURLY)
+        description += L", hourly";
+    if (dwReasons & RETAIN_DAILY)
+        description += L", daily";
+    if (dwReasons & RETAIN_WEEKLY)
+        description += L", weekly";
+    if (dwReasons & RETAIN_AGE)
+        description += L", younger than maximum age";
+    return description.substr(2);
+}
+
+
+// Keep the shadow copy if it is the first one seen in a new bucket, and the number of buckets is not reached
+static void KeepFirstInBucket(VSS_TIMESTAMP bucket, VSS_TIMESTAMP & lastBucket, DWORD & cBuckets, DWORD maxBuckets, DWORD dwReason, DWORD & dwReasons)
+{
+    if (bucket == lastBucket)
+        return;
+
+    lastBucket = bucket;
+    if (cBuckets < maxBuckets)
+    {
+        cBuckets++;
+        dwReasons |= dwReason;
+    }
+}
+
+
+// Plan which shadow copies of a volume to keep and which to delete
+vector<RetentionEntry> PlanRetention(const RetentionPolicy & policy, const vector<VSS_SNAPSHOT_PROP *> & snapshots, VSS_TIMESTAMP now)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    vector<RetentionEntry> plan(snapshots.size());
+
+    DWORD cNewest = 0, cHours = 0, cDays = 0, cWeeks = 0;
+    VSS_TIMESTAMP lastHour = -1, lastDay = -1, lastWeek = -1;
+
+    // Walk from the newest to the oldest, so the first shadow copy seen in a bucket is the newest in it
+    for (size_t i = snapshots.size(); i-- > 0; )
+    {
+        RetentionEntry & entry = plan[i];
+        entry.pSnapshot = snapshots[i];
+        entry.dwReasons = 0;
+
+        VSS_TIMESTAMP created = snapshots[i]->m_tsCreationTimestamp;
+        entry.bExpired = (policy.maxAgeHours > 0) && (now - created > (VSS_TIMESTAMP)policy.maxAgeHours * RETENTION_HOUR);
+        if (entry.bExpired)
+            continue;
+
+        if (!policy.HasKeepRules())
+        {
+            entry.dwReasons = RETAIN_AGE;
+            continue;
+        }
+
+        if (cNewest < policy.keepNewest)
+        {
+            cNewest++;
+            entry.dwReasons |= RETAIN_NEWEST;
+        }
+
+        // Hours, days and weeks are counted in local time
+        FILETIME ftLocal = {0};
+        ::FileTimeToLocalFileTime((FILETIME *)&created, &ftLocal);
+        VSS_TIMESTAMP local = ((VSS_TIMESTAMP)ftLocal.dwHighDateTime << 32) | ftLocal.dwLowDateTime;
+
+        // (January 1st 1601 was a monday, so the weeks start on mondays)
+        KeepFirstInBucket(local / RETENTION_HOUR, lastHour, cHours, policy.hourly, RETAIN_HOURLY, entry.dwReasons);
+        KeepFirstInBucket(local / RETENTION_DAY, lastDay, cDays, policy.daily, RETAIN_DAILY, entry.dwReasons);
+        KeepFirstInBucket(local / RETENTION_WEEK, lastWeek, cWeeks, policy.weekly, RETAIN_WEEKLY, entry.dwReasons);
+    }
+
+    return plan;
+}
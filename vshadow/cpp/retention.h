@@ -0,0 +1,85 @@
+#pragma once
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Retention policy
+//
+//  Decides which shadow copies of a volume to keep when pruning. A shadow
+//  copy is kept if any of the rules keeps it:
+//
+//  - keep:n     The n newest shadow copies
+//  - hourly:n   The newest shadow copy in each of the n latest hours having shadow copies
+//  - daily:n    The newest shadow copy in each of the n latest days having shadow copies
+//  - weekly:n   The newest shadow copy in each of the n latest weeks (starting monday) having shadow copies
+//
+//  With maxage:hours, shadow copies older than the given number of hours are
+//  deleted even if kept by a rule. If there is no other rule, all shadow
+//  copies younger than that are kept. Hours, days and weeks are in local time.
+//
+//  The plan for a volume is made from its shadow copies sorted by creation
+//  time, as given by the snapshot index, in a single pass from the newest
+//  to the oldest.
+//
+
+// Reasons for keeping a shadow copy, combined as flags
+enum RetentionReason
+{
+    RETAIN_NEWEST   = 0x1,
+    RETAIN_HOURLY   = 0x2,
+    RETAIN_DAILY    = 0x4,
+    RETAIN_WEEKLY   = 0x8,
+    RETAIN_AGE      = 0x10,     // Younger than maxage, when there is no other rule
+};
+
+
+struct RetentionPolicy
+{
+    RetentionPolicy():
+        keepNewest(0),
+        hourly(0),
+        daily(0),
+        weekly(0),
+        maxAgeHours(0)
+        {};
+
+    // Parse a comma separated list of name:value pairs, as given to the -prune command.
+    // Throws E_INVALIDARG on unknown names, invalid values or if there is no rule.
+    void Parse(wstring policy);
+
+    // True if there is a keep, hourly, daily or weekly rule
+    bool HasKeepRules() const { return keepNewest > 0 || hourly > 0 || daily > 0 || weekly > 0; }
+
+    // Number of newest shadow copies to keep
+    DWORD   keepNewest;
+
+    // Number of hours, days and weeks to keep the newest shadow copy of
+    DWORD   hourly;
+    DWORD   daily;
+    DWORD   weekly;
+
+    // Shadow copies older than this are deleted, 0 for no limit
+    DWORD   maxAgeHours;
+};
+
+
+// Decision for a single shadow copy
+struct RetentionEntry
+{
+    VSS_SNAPSHOT_PROP * pSnapshot;
+
+    // Combination of RetentionReason flags, 0 if the shadow copy is deleted
+    DWORD               dwReasons;
+
+    // True if older than the maximum age
+    bool                bExpired;
+
+    bool IsKept() const { return dwReasons != 0; }
+
+    // Short description of the decision, e.g. "newest, daily" or "expired"
+    wstring Describe() const;
+};
+
+
+// Plan which shadow copies of a volume to keep and which to delete
+// The shadow copies must be sorted oldest first, the entries are returned in the same order
+vector<RetentionEntry> PlanRetention(const RetentionPolicy & policy, const vector<VSS_SNAPSHOT_PROP *> & snapshots, VSS_TIMESTAMP now);
@@ -22,7 +22,7 @@ void VssClient::RevertToSnapshot(VSS_ID snapshotID)
 
     // Get the shadow copy properties
     VSS_SNAPSHOT_PROP Snap;
-    CHECK_COM(m_pVssObject->GetSnapshotProperties(snapshotID, &Snap));
+    CHECK_COM(m_pBackend->GetSnapshotProperties(snapshotID, &Snap));
     
     // Automatically call VssFreeSnapshotProperties on this structure at the end of scope
     CAutoSnapPointer snapAutoCleanup(&Snap);
@@ -42,7 +42,8 @@ void VssClient::RevertToSnapshot(VSS_ID snapshotID)
         return;
     }
 
-    HRESULT hr = m_pVssObject->RevertToSnapshot(snapshotID, true);
+    HRESULT hr = GetVssObject()->RevertToSnapshot(snapshotID, true);
+    m_snapshotIndex.Invalidate();
     if (FAILED(hr))
     {
         switch (hr)
@@ -72,7 +73,7 @@ void VssClient::RevertToSnapshot(VSS_ID snapshotID)
     }
 
     CComPtr<IVssAsync> pAsync;
-    hr = m_pVssObject->QueryRevertStatus(Snap.m_pwszOriginalVolumeName, &pAsync);
+    hr = GetVssObject()->QueryRevertStatus(Snap.m_pwszOriginalVolumeName, &pAsync);
     if (hr != VSS_E_OBJECT_NOT_FOUND)
     {
         if (FAILED(hr))
@@ -30,6 +30,7 @@ void VssClient::SelectComponentsForBackup(
         )
 {
     FunctionTracer ft(DBG_INFO);
+    ScopedPhase phase(m_phaseTimer, L"SelectComponentsForBackup");
 
     // First, exclude all components that have data outside of the shadow set
     DiscoverDirectlyExcludedComponents(excludedWriterAndComponentList, m_writerList);
@@ -63,6 +64,8 @@ void VssClient::SelectComponentsForBackup(
 
     // Finally, select the explicitly included components
     SelectExplicitelyIncludedComponents();
+
+    phase.Complete();
 }
 
 
@@ -197,13 +200,16 @@ void VssClient::ExcludeWritersWithNoRestoreEvents()
 
 // Discover excluded components that have file groups outside the shadow set
 void VssClient::DiscoverNonShadowedExcludedComponents(
-    vector<wstring> shadowSourceVolumes
+    const vector<wstring> & shadowSourceVolumes
 )
 {
     FunctionTracer ft(DBG_INFO);
 
     ft.WriteLine(L"Discover components that reside outside the shadow set ...");
 
+    // Volumes in the shadow set, looked up once for each affected volume of each component
+    CaseInsensitiveStringSet shadowSourceVolumeSet(shadowSourceVolumes);
+
     // Discover components that should be excluded from the shadow set 
     // This means components that have at least one File Descriptor requiring 
     // volumes not in the shadow set. 
@@ -238,7 +244,7 @@ void VssClient::DiscoverNonShadowedExcludedComponents(
                     component.affectedVolumes[iVol] = wsUniquePath;
                 }
 
-                if (!FindStringInList(component.affectedVolumes[iVol], shadowSourceVolumes))
+                if (!shadowSourceVolumeSet.Contains(component.affectedVolumes[iVol]))
                 {
                     wstring wsLocalVolume;
 
@@ -275,6 +281,20 @@ void VssClient::DiscoverAllExcludedComponents()
         if (writer.isExcluded)
             continue;
 
+        // Find the first excluded descendent of each component
+        vector<bool> excluded(writer.components.size());
+        for (unsigned i = 0; i < writer.components.size(); i++)
+            excluded[i] = writer.components[i].isExcluded;
+        vector<int> firstExcludedDescendent = writer.componentTree.FindFirstMarkedDescendents(excluded);
+
+        // Components with excluded descendents are excluded as well. Report the same 
+        // descendent as a sequential scan that excludes the components one by one:
+        // an earlier component excluded in this pass is reported if it comes first.
+        vector<bool> withExcludedDescendent(writer.components.size());
+        for (unsigned i = 0; i < writer.components.size(); i++)
+            withExcludedDescendent[i] = (firstExcludedDescendent[i] != -1);
+        vector<int> firstDescendentWithExcluded = writer.componentTree.FindFirstMarkedDescendents(withExcludedDescendent);
+
         // Enumerate all components
         for (unsigned i = 0; i < writer.components.size(); i++)
         {
@@ -282,19 +302,18 @@ void VssClient::DiscoverAllExcludedComponents()
 
             // Check if this component has any excluded children
             // If yes, deselect it
-            for (unsigned j = 0; j < writer.components.size(); j++)
-            {
-                VssComponent & descendent = writer.components[j];
-                if (component.IsAncestorOf(descendent) && descendent.isExcluded)
-                {
-                    ft.WriteLine(L"- Component '%s' from writer '%s' is excluded from backup "
-                        L"(it has an excluded descendent: '%s')",
-                        component.fullPath.c_str(), writer.name.c_str(), descendent.name.c_str());
+            int j = firstExcludedDescendent[i];
+            if (j == -1)
+                continue;
+            if (firstDescendentWithExcluded[i] != -1 && firstDescendentWithExcluded[i] < (int)i)
+                j = min(j, firstDescendentWithExcluded[i]);
 
-                    component.isExcluded = true; 
-                    break; 
-                }
-            }
+            VssComponent & descendent = writer.components[j];
+            ft.WriteLine(L"- Component '%s' from writer '%s' is excluded from backup "
+                L"(it has an excluded descendent: '%s')",
+                component.fullPath.c_str(), writer.name.c_str(), descendent.name.c_str());
+
+            component.isExcluded = true; 
         }
     }
 }
@@ -375,27 +394,23 @@ void VssClient::DiscoverExplicitelyIncludedComponents()
         if (writer.isExcluded)
             continue;
 
+        vector<bool> includable(writer.components.size());
+        for (unsigned i = 0; i < writer.components.size(); i++)
+            includable[i] = writer.components[i].CanBeExplicitlyIncluded();
+        vector<bool> hasIncludableAncestor = writer.componentTree.FindMarkedAncestors(includable);
+
         // Compute the roots of included components
         for (unsigned i = 0; i < writer.components.size(); i++)
         {
             VssComponent & component = writer.components[i]; 
 
-            if (!component.CanBeExplicitlyIncluded())
+            if (!includable[i])
                 continue;
 
             // Test if our component has a parent that is also included
-            component.isExplicitlyIncluded = true;
-            for (unsigned j = 0; j < writer.components.size(); j++)
-            {
-                VssComponent & ancestor = writer.components[j];
-                if (ancestor.IsAncestorOf(component) && ancestor.CanBeExplicitlyIncluded())
-                {
-                    // This cannot be explicitely included since we have another 
-                    // ancestor that that must be (implictely or explicitely) included
-                    component.isExplicitlyIncluded = false; 
-                    break; 
-                }
-            }
+            // If yes, this cannot be explicitely included since we have another 
+            // ancestor that that must be (implictely or explicitely) included
+            component.isExplicitlyIncluded = !hasIncludableAncestor[i];
         }
     }
 }
@@ -454,15 +469,10 @@ void VssClient::VerifyExplicitelyIncludedComponent(
                 bool isIncluded = component.isExplicitlyIncluded;
                 if (!isIncluded)
                 {
+                    vector<bool> explicitlyIncluded(writer.components.size());
                     for (unsigned k = 0; k < writer.components.size(); k++)
-                    {
-                        VssComponent & ancestor = writer.components[k];
-                        if (ancestor.IsAncestorOf(component) && ancestor.isExplicitlyIncluded)
-                        {
-                            isIncluded = true;
-                            break;
-                        }
-                    }
+                        explicitlyIncluded[k] = writer.components[k].isExplicitlyIncluded;
+                    isIncluded = writer.componentTree.FindMarkedAncestors(explicitlyIncluded)[j];
                 }
 
                 if (isIncluded)
@@ -578,7 +588,7 @@ void VssClient::SelectExplicitelyIncludedComponents()
             ft.WriteLine(L"   - Add component %s", component.fullPath.c_str());
 
             // Add the component
-            CHECK_COM(m_pVssObject->AddComponent(
+            CHECK_COM(m_pBackend->AddComponent(
                 WString2Guid(writer.instanceId),
                 WString2Guid(writer.id),
                 component.type,
@@ -619,7 +629,7 @@ void VssClient::SelectNonexcludedComponentsForRestore()
             ft.WriteLine(L"   - Select component %s", component.fullPath.c_str());
 
             // Select the component for restore
-            CHECK_COM(m_pVssObject->SetSelectedForRestore(
+            CHECK_COM(GetVssObject()->SetSelectedForRestore(
                 WString2Guid(writer.id),
                 component.type,
                 component.logicalPath.c_str(),
@@ -667,7 +677,7 @@ void VssClient::SetFileRestoreStatus(bool bSuccesfullyRestored)
             ft.WriteLine(L"   - Select component %s", component.fullPath.c_str());
 
             // Select the component for restore
-            CHECK_COM(m_pVssObject->SetFileRestoreStatus(
+            CHECK_COM(GetVssObject()->SetFileRestoreStatus(
                 WString2Guid(writer.id),
                 component.type,
                 component.logicalPath.c_str(),
@@ -708,7 +718,7 @@ void VssClient::CheckSelectedWriterStatus()
     // Gets the number of writers in the gathered status info
     // (WARNING: GatherWriterStatus must be called before)
     unsigned cWriters = 0;
-    CHECK_COM(m_pVssObject->GetWriterStatusCount(&cWriters));
+    CHECK_COM(m_pBackend->GetWriterStatusCount(&cWriters));
 
     // Enumerate each writer
     for(unsigned iWriter = 0; iWriter < cWriters; iWriter++)
@@ -720,7 +730,7 @@ void VssClient::CheckSelectedWriterStatus()
         HRESULT hrWriterFailure = S_OK;
 
         // Get writer status
-        CHECK_COM(m_pVssObject->GetWriterStatus(iWriter,
+        CHECK_COM(m_pBackend->GetWriterStatus(iWriter,
                              &idInstance,
                              &idWriter,
                              &bstrWriterName,
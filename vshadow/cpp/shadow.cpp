@@ -128,6 +128,13 @@ int CommandLineParser::MainRoutine(vector<wstring> arguments)
 
     DWORD dwResyncFlags = 0;
 
+    // Timing report and Chrome trace event file for the shadow copy creation
+    wstring timingReportFile;
+    wstring chromeTraceFile;
+
+    // Only print what -prune would delete
+    bool bDryRun = false;
+
     // Enumerate each argument
     for(unsigned argIndex = 0; argIndex < arguments.size(); argIndex++)
     {
@@ -285,6 +292,87 @@ int CommandLineParser::MainRoutine(vector<wstring> arguments)
             continue;
         }
 
+        // Check for the simulation option, with or without settings
+        wstring simulationSettings;
+        if (MatchArgument(arguments[argIndex], L"simulate") || MatchArgument(arguments[argIndex], L"simulate", simulationSettings))
+        {
+            ft.WriteLine(L"(Option: Use simulated VSS provider)");
+            SimulationSettings settings;
+            settings.Parse(simulationSettings);
+            m_vssClient.UseSimulatedBackend(settings);
+            continue;
+        }
+
+        // Check for the timing report option
+        if (MatchArgument(arguments[argIndex], L"timing", timingReportFile))
+        {
+            ft.WriteLine(L"(Option: Write timing report of the shadow copy creation to '%s')", timingReportFile.c_str());
+            m_vssClient.EnableTiming();
+            continue;
+        }
+
+        // Check for the Chrome trace option
+        if (MatchArgument(arguments[argIndex], L"chrometrace", chromeTraceFile))
+        {
+            ft.WriteLine(L"(Option: Write Chrome trace of the shadow copy creation to '%s')", chromeTraceFile.c_str());
+            m_vssClient.EnableTiming();
+            continue;
+        }
+
+        // Check for the enumeration batch size option
+        wstring batchSize;
+        if (MatchArgument(arguments[argIndex], L"batch", batchSize))
+        {
+            LPWSTR pwszEnd = NULL;
+            ULONG ulBatchSize = wcstoul(batchSize.c_str(), &pwszEnd, 10);
+            if (batchSize.empty() || *pwszEnd != L'\0' || ulBatchSize == 0)
+            {
+                ft.WriteLine(L"ERROR: Invalid batch size '%s', expected a positive number!", batchSize.c_str());
+                throw(E_INVALIDARG);
+            }
+
+            ft.WriteLine(L"(Option: Enumerate %lu shadow copies at a time)", ulBatchSize);
+            m_vssClient.SetEnumerationBatchSize(ulBatchSize);
+            continue;
+        }
+
+        // Check for the deletion concurrency option
+        wstring deleteConcurrency;
+        if (MatchArgument(arguments[argIndex], L"parallel", deleteConcurrency))
+        {
+            LPWSTR pwszEnd = NULL;
+            DWORD dwDeleteConcurrency = wcstoul(deleteConcurrency.c_str(), &pwszEnd, 10);
+            if (deleteConcurrency.empty() || *pwszEnd != L'\0' || dwDeleteConcurrency == 0)
+            {
+                ft.WriteLine(L"ERROR: Invalid number of parallel deletions '%s', expected a positive number!", deleteConcurrency.c_str());
+                throw(E_INVALIDARG);
+            }
+
+            ft.WriteLine(L"(Option: Delete shadow copies on up to %lu volumes at a time)", dwDeleteConcurrency);
+            m_vssClient.SetDeleteConcurrency(dwDeleteConcurrency);
+            continue;
+        }
+
+        // Check for the asynchronous operation timeout option
+        wstring timeouts;
+        if (MatchArgument(arguments[argIndex], L"timeout", timeouts))
+        {
+            AsyncWaitSettings asyncWaitSettings;
+            asyncWaitSettings.Parse(timeouts);
+
+            ft.WriteLine(L"(Option: Asynchronous operation timeouts '%s')", timeouts.c_str());
+            m_vssClient.SetAsyncWaitSettings(asyncWaitSettings);
+            continue;
+        }
+
+        // Check for the dry run option
+        if (MatchArgument(arguments[argIndex], L"dryrun"))
+        {
+            ft.WriteLine(L"(Option: Dry run, do not delete any shadow copies)");
+            bDryRun = true;
+            continue;
+        }
+
 
         // Checks for BreakEx flags
 
@@ -426,6 +514,23 @@ int CommandLineParser::MainRoutine(vector<wstring> arguments)
             return 0;
         }
 
+        // Delete the shadow copies not kept by a retention policy
+        wstring retentionPolicy;
+        if (MatchArgument(arguments[argIndex], L"prune", retentionPolicy))
+        {
+            ft.WriteLine(L"(Option: Delete shadow copies not kept by the retention policy '%s')", retentionPolicy.c_str());
+
+            RetentionPolicy policy;
+            policy.Parse(retentionPolicy);
+
+            // Initialize the VSS client
+            m_vssClient.Initialize(VSS_CTX_ALL);
+
+            m_vssClient.PruneSnapshots(policy, bDryRun);
+
+            return 0;
+        }
+
         // List the summary writer metadata
         if (MatchArgument(arguments[argIndex], L"wm"))
         {
@@ -869,43 +974,55 @@ int CommandLineParser::MainRoutine(vector<wstring> arguments)
             dwContext = UpdateFinalContext(dwContext);
             m_vssClient.Initialize(dwContext);
 
-            // Create the shadow copy set
-            m_vssClient.CreateSnapshotSet(
-                volumeList, 
-                xmlBackupComponentsDoc, 
-                excludedWriterList,
-                includedWriterList
-                );
-
-            // Execute BackupComplete, except in fast snapshot creation
-            if ((dwContext & VSS_VOLSNAP_ATTR_DELAYED_POSTSNAPSHOT) == 0)
+            try
             {
-                try
-                {
-                    // Generate management scripts if needed
-                    if (stringFileName.length() > 0)
-                        m_vssClient.GenerateSetvarScript(stringFileName);
-
-                    // Executing the custom command if needed
-                    if (execCommand.length() > 0)
-                        ExecCommand(execCommand);
-
-                }
-                catch(HRESULT)
+                // Create the shadow copy set
+                m_vssClient.CreateSnapshotSet(
+                    volumeList, 
+                    xmlBackupComponentsDoc, 
+                    excludedWriterList,
+                    includedWriterList
+                    );
+
+                // Execute BackupComplete, except in fast snapshot creation
+                if ((dwContext & VSS_VOLSNAP_ATTR_DELAYED_POSTSNAPSHOT) == 0)
                 {
-                    // Mark backup failure and exit
+                    try
+                    {
+                        // Generate management scripts if needed
+                        if (stringFileName.length() > 0)
+                            m_vssClient.GenerateSetvarScript(stringFileName);
+
+                        // Executing the custom command if needed
+                        if (execCommand.length() > 0)
+                            ExecCommand(execCommand);
+
+                    }
+                    catch(HRESULT)
+                    {
+                        // Mark backup failure and exit
+                        if ((dwContext & VSS_VOLSNAP_ATTR_NO_WRITERS) == 0)
+                            m_vssClient.BackupComplete(false);
+
+                        throw;
+                    }
+
+                    // Complete the backup
+                    // Note that this will notify writers that the backup is succesful! 
+                    // (which means eventually log truncation)
                     if ((dwContext & VSS_VOLSNAP_ATTR_NO_WRITERS) == 0)
-                        m_vssClient.BackupComplete(false);
-
-                    throw;
+                        m_vssClient.BackupComplete(true);
                 }
-
-                // Complete the backup
-                // Note that this will notify writers that the backup is succesful! 
-                // (which means eventually log truncation)
-                if ((dwContext & VSS_VOLSNAP_ATTR_NO_WRITERS) == 0)
-                    m_vssClient.BackupComplete(true);
             }
+            catch(HRESULT)
+            {
+                // Write the timing reports also for a failed creation, the failing step is marked as not completed
+                m_vssClient.WriteTimingReports(timingReportFile, chromeTraceFile);
+                throw;
+            }
+
+            // Write the timing reports if needed
+            m_vssClient.WriteTimingReports(timingReportFile, chromeTraceFile);
 
             ft.WriteLine(L"\nSnapshot creation done.");
             
@@ -1022,6 +1139,14 @@ void CommandLineParser::PrintUsage()
         L"  -exec={command}    - Custom command executed after shadow creation, import or between break and make-it-write\n"
         L"  -wait              - Wait before program termination or between shadow set break and make-it-write\n"
         L"  -tracing           - Runs VSHADOW.EXE with enhanced diagnostics\n"
+        L"  -simulate[={list}] - Use a simulated in-memory VSS provider, optionally with settings name:value,...\n"
+        L"  -timing={file.json} - Write the durations of the shadow copy creation steps as JSON\n"
+        L"  -chrometrace={file.json} - Write the shadow copy creation steps as Chrome trace events\n"
+        L"  -batch={number}    - Number of shadow copies fetched at a time when enumerating (default 64)\n"
+        L"  -dryrun            - Only list which shadow copies -prune would keep and delete\n"
+        L"  -parallel={number} - Delete shadow copies on up to this many volumes at a time (default 4)\n"
+        L"  -timeout={list}    - Cancel asynchronous operations still pending after name:seconds,... (default, or\n"
+        L"                       an operation like DoSnapshotSet), and set poll:milliseconds and progress:seconds\n"
         L"\n" );
     ft.WriteLine(
         L"List of commands:\n"
@@ -1037,6 +1162,7 @@ void CommandLineParser::PrintUsage()
         L"  -do={volume}                    - Deletes the oldest shadow of the specified volume\n"
         L"  -dx={SnapSetID}                 - Deletes all shadow copies in this set\n"
         L"  -ds={SnapID}                    - Deletes this shadow copy\n"
+        L"  -prune={policy}                 - Deletes shadow copies not kept by the policy keep:n,hourly:n,daily:n,weekly:n,maxage:hours\n"
         L"  -i={file.xml}                   - Transportable shadow copy import\n"
         L"  -b={SnapSetID}                  - Break the given shadow set into read-only volumes\n"
         L"  -bw={SnapSetID}                 - Break the shadow set into writable volumes\n"
@@ -1091,6 +1217,14 @@ void CommandLineParser::PrintUsage()
         L"  -exec={command}    - Custom command executed after shadow creation\n"
         L"  -wait              - Wait before program termination \n"
         L"  -tracing           - Runs VSHADOW.EXE with enhanced diagnostics\n"
+        L"  -simulate[={list}] - Use a simulated in-memory VSS provider, optionally with settings name:value,...\n"
+        L"  -timing={file.json} - Write the durations of the shadow copy creation steps as JSON\n"
+        L"  -chrometrace={file.json} - Write the shadow copy creation steps as Chrome trace events\n"
+        L"  -batch={number}    - Number of shadow copies fetched at a time when enumerating (default 64)\n"
+        L"  -dryrun            - Only list which shadow copies -prune would keep and delete\n"
+        L"  -parallel={number} - Delete shadow copies on up to this many volumes at a time (default 4)\n"
+        L"  -timeout={list}    - Cancel asynchronous operations still pending after name:seconds,... (default, or\n"
+        L"                       an operation like DoSnapshotSet), and set poll:milliseconds and progress:seconds\n"
         L"\n"
         L"List of commands:\n"
         L"  {volume list}      - Creates a shadow set on these volumes\n"
@@ -1104,6 +1238,7 @@ void CommandLineParser::PrintUsage()
         L"  -da                - Deletes all shadow copies in the system\n"
         L"  -dx={SnapSetID}    - Deletes all shadow copies in this set\n"
         L"  -ds={SnapID}       - Deletes this shadow copy\n"
+        L"  -prune={policy}    - Deletes shadow copies not kept by the policy keep:n,hourly:n,daily:n,weekly:n,maxage:hours\n"
         L"  -r={file.xml}      - Restore based on a previously-generated Backup Components doc\n"
         L"  -rs={file.xml}     - Simulated restore based on a previously-generated Backup Components doc\n"
         L"\n");
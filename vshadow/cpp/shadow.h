@@ -27,6 +27,13 @@
 #include "tracing.h"
 #include "util.h"
 #include "writer.h"
+#include "writerxml.h"
+#include "backend.h"
+#include "timing.h"
+#include "asyncwaiter.h"
+#include "snapshotindex.h"
+#include "retention.h"
+#include "deleter.h"
 #include "vssclient.h"
 
 
@@ -0,0 +1,159 @@
+// Main header
+#include "stdafx.h"
+
+
+
+SnapshotIndex::SnapshotIndex():
+    m_bUpToDate(false)
+{
+}
+
+
+SnapshotIndex::~SnapshotIndex()
+{
+    Clear();
+}
+
+
+// Enumerate all the shadow copies, fetching batchSize shadow copies at a time
+void SnapshotIndex::Build(VssBackend * pBackend, ULONG batchSize)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    Clear();
+
+    if (batchSize == 0)
+        batchSize = DEFAULT_ENUMERATION_BATCH_SIZE;
+
+    // Get list all shadow copies.
+    CComPtr<IVssEnumObject> pIEnumSnapshots;
+    HRESULT hr = pBackend->Query( GUID_NULL,
+            VSS_OBJECT_NONE,
+            VSS_OBJECT_SNAPSHOT,
+            &pIEnumSnapshots );
+
+    CHECK_COM_ERROR(hr, L"pBackend->Query(GUID_NULL, VSS_OBJECT_NONE, VSS_OBJECT_SNAPSHOT, &pIEnumSnapshots )")
+
+    // If there are no shadow copies the index is empty
+    if (hr != S_FALSE)
+    {
+        // Enumerate all shadow copies, one batch at a time
+        vector<VSS_OBJECT_PROP> batch(batchSize);
+        while(true)
+        {
+            ULONG ulFetched = 0;
+            hr = pIEnumSnapshots->Next( batchSize, &batch[0], &ulFetched );
+            CHECK_COM_ERROR(hr, L"pIEnumSnapshots->Next( batchSize, &batch[0], &ulFetched )")
+
+            // Take over the fetched properties, they are freed by Clear
+            // (reserve first, so that none of them is lost if there is no memory)
+            m_snapshots.reserve(m_snapshots.size() + ulFetched);
+            for (ULONG i = 0; i < ulFetched; i++)
+                m_snapshots.push_back(batch[i].Obj.Snap);
+
+            // We reached the end of list
+            if (ulFetched == 0 || hr == S_FALSE)
+                break;
+        }
+    }
+
+    ft.Trace(DBG_INFO, L"Enumerated %d shadow copies", (int)m_snapshots.size());
+
+    // Build the lookups
+    for (size_t i = 0; i < m_snapshots.size(); i++)
+    {
+        VSS_SNAPSHOT_PROP & snap = m_snapshots[i];
+        m_byId[snap.m_SnapshotId] = i;
+        m_bySet[snap.m_SnapshotSetId].push_back(i);
+        m_byVolume[ToLowerCase(snap.m_pwszOriginalVolumeName ? snap.m_pwszOriginalVolumeName : L"")].push_back(i);
+        m_byCreationTime.push_back(i);
+    }
+
+    // Sort by creation time, keeping the enumeration order for equal timestamps
+    auto isOlder = [this](size_t first, size_t second)
+    {
+        return m_snapshots[first].m_tsCreationTimestamp < m_snapshots[second].m_tsCreationTimestamp;
+    };
+    stable_sort(m_byCreationTime.begin(), m_byCreationTime.end(), isOlder);
+    for (auto it = m_byVolume.begin(); it != m_byVolume.end(); ++it)
+        stable_sort(it->second.begin(), it->second.end(), isOlder);
+
+    m_bUpToDate = true;
+}
+
+
+// Free all the shadow copy properties
+void SnapshotIndex::Clear()
+{
+    for (size_t i = 0; i < m_snapshots.size(); i++)
+        ::VssFreeSnapshotProperties(&m_snapshots[i]);
+
+    m_snapshots.clear();
+    m_byId.clear();
+    m_bySet.clear();
+    m_byVolume.clear();
+    m_byCreationTime.clear();
+    m_bUpToDate = false;
+}
+
+
+// Shadow copy with the given ID, or NULL if there is none
+VSS_SNAPSHOT_PROP * SnapshotIndex::FindSnapshot(VSS_ID snapshotID)
+{
+    auto it = m_byId.find(snapshotID);
+    return (it == m_byId.end()) ? NULL : &m_snapshots[it->second];
+}
+
+
+// Shadow copies in the given set, in enumeration order
+vector<VSS_SNAPSHOT_PROP *> SnapshotIndex::GetSnapshotSet(VSS_ID snapshotSetID)
+{
+    auto it = m_bySet.find(snapshotSetID);
+    return (it == m_bySet.end()) ? vector<VSS_SNAPSHOT_PROP *>() : GetSnapshots(it->second);
+}
+
+
+// Shadow copies of the given original volume, oldest first
+vector<VSS_SNAPSHOT_PROP *> SnapshotIndex::GetSnapshotsForVolume(const wstring & volumeName)
+{
+    auto it = m_byVolume.find(ToLowerCase(volumeName));
+    return (it == m_byVolume.end()) ? vector<VSS_SNAPSHOT_PROP *>() : GetSnapshots(it->second);
+}
+
+
+// Shadow copies created in the given interval (both inclusive), oldest first
+vector<VSS_SNAPSHOT_PROP *> SnapshotIndex::GetSnapshotsByCreationTime(VSS_TIMESTAMP from, VSS_TIMESTAMP to)
+{
+    // Binary search for the first shadow copy created at or after the start of the interval
+    auto it = lower_bound(m_byCreationTime.begin(), m_byCreationTime.end(), from,
+        [this](size_t position, VSS_TIMESTAMP timestamp) { return m_snapshots[position].m_tsCreationTimestamp < timestamp; });
+
+    vector<VSS_SNAPSHOT_PROP *> snapshots;
+    for (; it != m_byCreationTime.end() && m_snapshots[*it].m_tsCreationTimestamp <= to; ++it)
+        snapshots.push_back(&m_snapshots[*it]);
+    return snapshots;
+}
+
+
+// Original volumes having shadow copies, as returned by VSS
+vector<wstring> SnapshotIndex::GetVolumes()
+{
+    vector<wstring> volumes;
+    for (auto it = m_byVolume.begin(); it != m_byVolume.end(); ++it)
+    {
+        LPCWSTR pwszVolumeName = m_snapshots[it->second.front()].m_pwszOriginalVolumeName;
+        volumes.push_back(pwszVolumeName ? pwszVolumeName : L"");
+    }
+    return volumes;
+}
+
+
+// Shadow copies for the given positions in m_snapshots
+vector<VSS_SNAPSHOT_PROP *> SnapshotIndex::GetSnapshots(const vector<size_t> & positions)
+{
+    vector<VSS_SNAPSHOT_PROP *> snapshots;
+    snapshots.reserve(positions.size());
+    for (size_t i = 0; i < positions.size(); i++)
+        snapshots.push_back(&m_snapshots[positions[i]]);
+    return snapshots;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Snapshot index
+//
+//  In-memory index of the shadow copies in the system, built by a single
+//  enumeration fetching the shadow copy properties in batches. The query
+//  and delete commands look up shadow copies by set ID, shadow copy ID,
+//  original volume or creation time in the index, instead of each of them
+//  enumerating all the shadow copies again.
+//
+//  The index owns the enumerated VSS_SNAPSHOT_PROP structures, and frees
+//  them when cleared.
+//
+
+// Default number of shadow copies fetched by each call to IVssEnumObject::Next
+const ULONG DEFAULT_ENUMERATION_BATCH_SIZE = 64;
+
+
+class SnapshotIndex
+{
+public:
+
+    SnapshotIndex();
+
+    ~SnapshotIndex();
+
+    // Enumerate all the shadow copies, fetching batchSize shadow copies at a time
+    void Build(VssBackend * pBackend, ULONG batchSize);
+
+    // Mark the index as out of date, after shadow copies have been created, deleted or changed
+    // The contents stay valid until the index is built again or cleared
+    void Invalidate() { m_bUpToDate = false; }
+
+    bool IsUpToDate() { return m_bUpToDate; }
+
+    // Free all the shadow copy properties
+    void Clear();
+
+    // Number of shadow copies
+    size_t GetCount() { return m_snapshots.size(); }
+
+    // Shadow copy number index, in enumeration order
+    VSS_SNAPSHOT_PROP & GetSnapshot(size_t index) { return m_snapshots[index]; }
+
+    // Shadow copy with the given ID, or NULL if there is none
+    VSS_SNAPSHOT_PROP * FindSnapshot(VSS_ID snapshotID);
+
+    // Shadow copies in the given set, in enumeration order
+    vector<VSS_SNAPSHOT_PROP *> GetSnapshotSet(VSS_ID snapshotSetID);
+
+    // Shadow copies of the given original volume, oldest first
+    // The volume is given by its unique volume name, compared case insensitive
+    vector<VSS_SNAPSHOT_PROP *> GetSnapshotsForVolume(const wstring & volumeName);
+
+    // Shadow copies created in the given interval (both inclusive), oldest first
+    vector<VSS_SNAPSHOT_PROP *> GetSnapshotsByCreationTime(VSS_TIMESTAMP from, VSS_TIMESTAMP to);
+
+    // Original volumes having shadow copies, as returned by VSS
+    vector<wstring> GetVolumes();
+
+private:
+
+    // Not copyable, the shadow copy properties are owned by the index
+    SnapshotIndex(const SnapshotIndex &);
+    SnapshotIndex & operator=(const SnapshotIndex &);
+
+    // Shadow copies for the given positions in m_snapshots
+    vector<VSS_SNAPSHOT_PROP *> GetSnapshots(const vector<size_t> & positions);
+
+    //
+    //  Data members
+    //
+
+    bool                                    m_bUpToDate;
+
+    // All shadow copies, in enumeration order
+    vector<VSS_SNAPSHOT_PROP>               m_snapshots;
+
+    // Positions in m_snapshots by shadow copy ID
+    map<VSS_ID, size_t, ltguid>             m_byId;
+
+    // Positions in m_snapshots by shadow copy set ID, in enumeration order
+    map<VSS_ID, vector<size_t>, ltguid>     m_bySet;
+
+    // Positions in m_snapshots by lowercase original volume name, oldest first
+    map<wstring, vector<size_t>>            m_byVolume;
+
+    // Positions in m_snapshots, oldest first
+    vector<size_t>                          m_byCreationTime;
+};
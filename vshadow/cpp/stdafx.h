@@ -26,9 +26,12 @@
 // STL includes
 #include <vector>
 #include <map>
+#include <unordered_set>
+#include <memory>
 #include <algorithm>
 #include <string>
 #include <fstream>
+#include <atomic>
 using namespace std;   
 
 // Used for safe string manipulation
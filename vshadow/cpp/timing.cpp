@@ -0,0 +1,183 @@
+// Main header
+#include "stdafx.h"
+
+
+
+// Convert to UTF-8 and quote as a JSON string
+static string JsonString(wstring value)
+{
+    string utf8;
+    if (value.length() > 0)
+    {
+        int cbUtf8 = WideCharToMultiByte(CP_UTF8, 0, value.c_str(), (int)value.length(), NULL, 0, NULL, NULL);
+        utf8.resize(cbUtf8);
+        WideCharToMultiByte(CP_UTF8, 0, value.c_str(), (int)value.length(), &utf8[0], cbUtf8, NULL, NULL);
+    }
+
+    string quoted = "\"";
+    for (unsigned i = 0; i < utf8.length(); i++)
+    {
+        if (utf8[i] == '"' || utf8[i] == '\\')
+            quoted += '\\';
+        if ((unsigned char)utf8[i] < 0x20)
+            continue;
+        quoted += utf8[i];
+    }
+    return quoted + "\"";
+}
+
+
+// Format a number of milliseconds or microseconds with three decimals
+static string FormatDecimal(double value)
+{
+    char buffer[64];
+    StringCchPrintfA(buffer, ARRAYSIZE(buffer), "%.3f", value);
+    return buffer;
+}
+
+
+// Write the given UTF-8 contents to a file
+static void WriteUtf8File(wstring fileName, const string & contents)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    ft.WriteLine(L"Writing the file '%s' ...", fileName.c_str());
+
+    HANDLE hFile = CreateFile((LPWSTR)fileName.c_str(),
+                          GENERIC_WRITE,
+                          FILE_SHARE_READ,
+                          NULL,
+                          CREATE_ALWAYS,
+                          0,
+                          NULL);
+
+    if (hFile == INVALID_HANDLE_VALUE)
+        CHECK_WIN32_ERROR(GetLastError(), L"CreateFile");
+
+    // Will automatically call CloseHandle at the end of scope
+    // (even if an exception is thrown)
+    CAutoHandle autoCleanupHandle(hFile);
+
+    DWORD dwWritten;
+    CHECK_WIN32(WriteFile(hFile, contents.c_str(), (DWORD)contents.length(), &dwWritten, NULL));
+}
+
+
+
+PhaseTimer::PhaseTimer():
+    m_bEnabled(false), m_frequency(1), m_origin(0)
+{
+}
+
+
+// Start recording phases
+void PhaseTimer::Enable()
+{
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    m_frequency = frequency.QuadPart;
+    m_bEnabled = true;
+}
+
+
+// Begin a phase nested in the currently running phase, if any
+size_t PhaseTimer::BeginPhase(LPCWSTR name)
+{
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+
+    Phase phase;
+    phase.name = m_running.empty() ? wstring(name) : m_phases[m_running.back()].name + L"/" + name;
+    phase.depth = (int)m_running.size();
+    phase.start = counter.QuadPart;
+    phase.end = counter.QuadPart;
+    phase.completed = false;
+
+    if (m_phases.empty())
+        m_origin = phase.start;
+
+    m_phases.push_back(phase);
+    m_running.push_back(m_phases.size() - 1);
+    return m_phases.size() - 1;
+}
+
+
+// End a phase
+void PhaseTimer::EndPhase(size_t index, bool completed)
+{
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+
+    _ASSERTE(!m_running.empty() && m_running.back() == index);
+
+    m_phases[index].end = counter.QuadPart;
+    m_phases[index].completed = completed;
+    m_running.pop_back();
+}
+
+
+// Milliseconds since the start of the first phase
+double PhaseTimer::ToMilliseconds(LONGLONG counter)
+{
+    return (double)(counter - m_origin) * 1000.0 / (double)m_frequency;
+}
+
+
+// Write the JSON timing report
+//
+// {
+//   "phases": [
+//     { "name": "CreateSnapshotSet/DoSnapshotSet", "depth": 1, "startMs": 12.345, "durationMs": 678.901, "completed": true },
+//     ...
+//   ]
+// }
+//
+void PhaseTimer::WriteTimingReport(wstring fileName)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    string report = "{\n  \"phases\": [";
+    for (unsigned i = 0; i < m_phases.size(); i++)
+    {
+        Phase & phase = m_phases[i];
+        report += (i > 0) ? ",\n" : "\n";
+        report += "    { \"name\": " + JsonString(phase.name);
+        report += ", \"depth\": " + to_string(phase.depth);
+        report += ", \"startMs\": " + FormatDecimal(ToMilliseconds(phase.start));
+        report += ", \"durationMs\": " + FormatDecimal(ToMilliseconds(phase.end) - ToMilliseconds(phase.start));
+        report += string(", \"completed\": ") + (phase.completed ? "true" : "false") + " }";
+    }
+    report += "\n  ]\n}\n";
+
+    WriteUtf8File(fileName, report);
+}
+
+
+// Write the phases as complete ("X") events in the Chrome trace event format
+void PhaseTimer::WriteChromeTrace(wstring fileName)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    string pid = to_string(GetCurrentProcessId());
+    string tid = to_string(GetCurrentThreadId());
+
+    string trace = "{\n  \"displayTimeUnit\": \"ms\",\n  \"traceEvents\": [";
+    for (unsigned i = 0; i < m_phases.size(); i++)
+    {
+        Phase & phase = m_phases[i];
+
+        // Only the last part of the name, the nesting is shown by the viewer
+        size_t pos = phase.name.find_last_of(L'/');
+        wstring name = (pos == wstring::npos) ? phase.name : phase.name.substr(pos + 1);
+
+        trace += (i > 0) ? ",\n" : "\n";
+        trace += "    { \"name\": " + JsonString(name) + ", \"cat\": \"vss\", \"ph\": \"X\"";
+        trace += ", \"ts\": " + FormatDecimal(ToMilliseconds(phase.start) * 1000.0);
+        trace += ", \"dur\": " + FormatDecimal((ToMilliseconds(phase.end) - ToMilliseconds(phase.start)) * 1000.0);
+        trace += ", \"pid\": " + pid + ", \"tid\": " + tid;
+        trace += string(", \"args\": { \"completed\": ") + (phase.completed ? "true" : "false") + " } }";
+    }
+    trace += "\n  ]\n}\n";
+
+    WriteUtf8File(fileName, trace);
+}
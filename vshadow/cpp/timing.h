@@ -0,0 +1,100 @@
+#pragma once
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Phase timing
+//
+//  Records the start and duration of the named phases of an operation,
+//  like the steps of the shadow copy creation, using the high resolution
+//  performance counter. Phases can be nested, and are then named by their
+//  path, e.g. "DoSnapshotSet/Wait". Nothing is recorded until the timer
+//  is enabled.
+//
+//  The recorded phases are written as a JSON timing report, and optionally
+//  as a Chrome trace event file that can be loaded in chrome://tracing or
+//  other trace viewers.
+//
+
+class PhaseTimer
+{
+public:
+
+    PhaseTimer();
+
+    // Start recording phases, the start of the first phase is time zero in the reports
+    void Enable();
+
+    bool IsEnabled() { return m_bEnabled; }
+
+    // Begin a phase nested in the currently running phase, if any
+    // Returns an index to be given to EndPhase
+    size_t BeginPhase(LPCWSTR name);
+
+    // End a phase, the completed flag is false if the phase ended with an error
+    void EndPhase(size_t index, bool completed);
+
+    // Write the JSON timing report
+    void WriteTimingReport(wstring fileName);
+
+    // Write the phases as complete events in the Chrome trace event format
+    void WriteChromeTrace(wstring fileName);
+
+private:
+
+    struct Phase
+    {
+        wstring     name;
+        int         depth;
+        LONGLONG    start;
+        LONGLONG    end;
+        bool        completed;
+    };
+
+    // Milliseconds since the start of the first phase
+    double ToMilliseconds(LONGLONG counter);
+
+    //
+    //  Data members
+    //
+
+    bool            m_bEnabled;
+
+    LONGLONG        m_frequency;
+
+    LONGLONG        m_origin;
+
+    // Recorded phases, in the order they were started
+    vector<Phase>   m_phases;
+
+    // Indexes of the currently running phases, innermost last
+    vector<size_t>  m_running;
+};
+
+
+// Records a phase for the lifetime of the object
+// The phase is recorded as not completed if the object is destroyed without a call to Complete,
+// as when the scope is left because of an exception
+class ScopedPhase
+{
+public:
+    ScopedPhase(PhaseTimer & timer, LPCWSTR name):
+        m_timer(timer), m_index(0), m_bCompleted(false)
+    {
+        if (m_timer.IsEnabled())
+            m_index = m_timer.BeginPhase(name);
+    }
+
+    ~ScopedPhase()
+    {
+        if (m_timer.IsEnabled())
+            m_timer.EndPhase(m_index, m_bCompleted);
+    }
+
+    // Called at each successful end of the scope
+    void Complete() { m_bCompleted = true; }
+
+private:
+    PhaseTimer &    m_timer;
+    size_t          m_index;
+    bool            m_bCompleted;
+};
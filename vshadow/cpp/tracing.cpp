@@ -28,48 +28,42 @@ bool    FunctionTracer::m_traceEnabled = false;
 
 // Console logging routine
 // Can throw HRESULT on invalid formats
-void FunctionTracer::WriteLine(wstring format, ...)
+void FunctionTracer::WriteLine(LPCWSTR format, ...)
 {
     wstring buffer;
     VPRINTF_VAR_PARAMS(buffer, format);
 
     wprintf(L"%s\n", buffer.c_str());
-    Trace(m_fileName, m_lineNumber, m_functionName, L"OUTPUT: %s", buffer.c_str());
+    if (IsTracingEnabled())
+        WriteTrace(m_fileName, m_lineNumber, m_functionName, L"OUTPUT: %s", buffer.c_str());
 }
 
 
 // Tracing routine
 // Can throw HRESULT on invalid formats
-void FunctionTracer::Trace(wstring file, int line, wstring functionName, wstring format, ...)
+void FunctionTracer::WriteTrace(LPCWSTR file, int line, LPCWSTR functionName, LPCWSTR format, ...)
 {
-    if (m_traceEnabled)
-    {
-        wstring buffer;
-        VPRINTF_VAR_PARAMS(buffer, format);
-    
-        size_t pos = file.find_last_of(L"\\");
-        wstring fileName = (pos == wstring::npos)? file: file.substr(pos+1);
-
-        // TODO - put here your own implementation of a tracing routine, if needed
-        wprintf(L"[[%40s @ %10s:%4d]] %s\n", functionName.c_str(), fileName.c_str(), line, buffer.c_str());
-    }
+    va_list args;
+    va_start(args, format);
+    WriteTraceV(file, line, functionName, format, args);
+    va_end(args);
 }
 
 
-// Constructor
-FunctionTracer::FunctionTracer(wstring fileName, INT lineNumber, wstring functionName):
-    m_fileName(fileName), m_lineNumber(lineNumber), m_functionName(functionName)
+// Tracing routine for the arguments of a variadic caller
+// Can throw HRESULT on invalid formats
+void FunctionTracer::WriteTraceV(LPCWSTR file, int line, LPCWSTR functionName, LPCWSTR format, va_list args)
 {
-    if (m_traceEnabled)
-        Trace(m_fileName, m_lineNumber, m_functionName, L"ENTER %s", m_functionName.c_str());
-}
+    wstring buffer(MAX_VPRINTF_BUFFER_SIZE, L'\0');
+    HRESULT hr = StringCchVPrintfW(WString2Buffer(buffer), buffer.length(), format, args);
+    if (FAILED(hr) && (hr != STRSAFE_E_INSUFFICIENT_BUFFER))
+        throw(hr);
 
+    LPCWSTR fileName = wcsrchr(file, L'\\');
+    fileName = (fileName == NULL)? file: fileName+1;
 
-// Destructor
-FunctionTracer::~FunctionTracer()
-{
-    if (m_traceEnabled)
-        Trace(m_fileName, m_lineNumber, m_functionName, L"EXIT %s", m_functionName.c_str());;
+    // TODO - put here your own implementation of a tracing routine, if needed
+    wprintf(L"[[%40s @ %10s:%4d]] %s\n", functionName, fileName, line, buffer.c_str());
 }
 
 
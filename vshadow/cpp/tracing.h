@@ -19,18 +19,55 @@
 //
 
 
+// Set to 0 to build without the tracing enabled by the /tracing option.
+// Trace points then return right away.
+#ifndef FUNCTIONTRACER_TRACING
+#define FUNCTIONTRACER_TRACING 1
+#endif
+
+
 // Very simple tracing/logging class 
+// The file and function names given to the constructor (see DBG_INFO) must be
+// string literals, they are referenced and not copied. The tracing check comes
+// before the arguments are formatted, so a disabled trace point costs a call and
+// a comparison. Trace takes C variable arguments rather than a variadic template,
+// which the Visual Studio 2012 (v110) toolset does not support.
 class FunctionTracer
 {
 public:
-    FunctionTracer(wstring fileName, INT lineNumber, wstring functionName);
-    ~FunctionTracer();
+    FunctionTracer(LPCWSTR fileName, INT lineNumber, LPCWSTR functionName):
+        m_fileName(fileName), m_lineNumber(lineNumber), m_functionName(functionName)
+    {
+        if (IsTracingEnabled())
+            WriteTrace(m_fileName, m_lineNumber, m_functionName, L"ENTER %s", m_functionName);
+    }
+
+    ~FunctionTracer()
+    {
+        if (IsTracingEnabled())
+            WriteTrace(m_fileName, m_lineNumber, m_functionName, L"EXIT %s", m_functionName);
+    }
     
+    // Returns true if tracing is enabled
+    static bool IsTracingEnabled()
+    {
+        return FUNCTIONTRACER_TRACING && m_traceEnabled;
+    }
+
     // tracing routine
-    void Trace(wstring file, int line, wstring functionName, wstring format, ...);
+    void Trace(LPCWSTR file, int line, LPCWSTR functionName, LPCWSTR format, ...)
+    {
+        if (!IsTracingEnabled())
+            return;
+
+        va_list args;
+        va_start(args, format);
+        WriteTraceV(file, line, functionName, format, args);
+        va_end(args);
+    }
     
     // console logging routine
-    void WriteLine(wstring format, ...);
+    void WriteLine(LPCWSTR format, ...);
     
     // Converts a HRESULT into a printable message
     static wstring  HResult2String(HRESULT hrError);
@@ -40,15 +77,19 @@ public:
 
 private:
 
+    // Format and print a trace message, called when tracing is enabled
+    static void WriteTrace(LPCWSTR file, int line, LPCWSTR functionName, LPCWSTR format, ...);
+    static void WriteTraceV(LPCWSTR file, int line, LPCWSTR functionName, LPCWSTR format, va_list args);
+
     //
     //  Data members
     //
 
     static bool m_traceEnabled;
 
-    wstring     m_fileName;
+    LPCWSTR     m_fileName;
     int         m_lineNumber;
-    wstring     m_functionName;
+    LPCWSTR     m_functionName;
 
 };
 
@@ -210,7 +210,7 @@ inline wstring BSTR2WString(BSTR bstr)
 
 
 // Case insensitive comparison
-inline bool IsEqual(wstring str1, wstring str2)
+inline bool IsEqual(const wstring & str1, const wstring & str2)
 {
     return (_wcsicmp(str1.c_str(), str2.c_str()) == 0);
 }
@@ -218,7 +218,7 @@ inline bool IsEqual(wstring str1, wstring str2)
 
 // Returns TRUE if the string is already present in the string list  
 // (performs case insensitive comparison)
-inline bool FindStringInList(wstring str, vector<wstring> stringList)
+inline bool FindStringInList(const wstring & str, const vector<wstring> & stringList)
 {
     // Check to see if the volume is already added 
     for (unsigned i = 0; i < stringList.size( ); i++)
@@ -229,6 +229,37 @@ inline bool FindStringInList(wstring str, vector<wstring> stringList)
 }
 
 
+// Converts the string to lowercase, for case insensitive lookups
+inline wstring ToLowerCase(wstring str)
+{
+    for (size_t i = 0; i < str.length(); i++)
+        str[i] = towlower(str[i]);
+    return str;
+}
+
+
+// Set of strings with case insensitive lookup. Use instead of FindStringInList 
+// when the same list is searched many times.
+class CaseInsensitiveStringSet
+{
+public:
+    CaseInsensitiveStringSet(const vector<wstring> & stringList)
+    {
+        for (size_t i = 0; i < stringList.size(); ++i)
+            m_strings.insert(ToLowerCase(stringList[i]));
+    }
+
+    // Returns TRUE if the string is present in the set
+    bool Contains(const wstring & str) const
+    {
+        return m_strings.find(ToLowerCase(str)) != m_strings.end();
+    }
+
+private:
+    unordered_set<wstring> m_strings;
+};
+
+
 // Append a backslash to the current string 
 inline wstring AppendBackslash(wstring str)
 {
@@ -739,8 +770,6 @@ struct ltguid
 {
     bool operator()(GUID guid1, GUID guid2) const
     {
-        return (guid1.Data1 < guid2.Data1) ||
-               (guid1.Data1 == guid2.Data1 && guid1.Data2 < guid1.Data2) ||
-               (guid1.Data1 == guid2.Data1 && guid1.Data2 == guid2.Data2 && guid1.Data3 < guid2.Data3);
+        return memcmp(&guid1, &guid2, sizeof(GUID)) < 0;
     }
 };
@@ -23,15 +23,21 @@ VssClient::VssClient()
     m_dwContext = VSS_CTX_BACKUP;
     m_latestSnapshotSetID = GUID_NULL;
     m_bDuringRestore = false;
+    m_enumerationBatchSize = DEFAULT_ENUMERATION_BATCH_SIZE;
+    m_deleteConcurrency = DEFAULT_DELETE_CONCURRENCY;
+    m_pBackend.reset(new ComVssBackend());
 }
 
 
 // Destructor
 VssClient::~VssClient()
 {
+    // Free the enumerated shadow copy properties
+    m_snapshotIndex.Clear();
+
     // Release the IVssBackupComponents interface 
     // WARNING: this must be done BEFORE calling CoUninitialize()
-    m_pVssObject = NULL;
+    m_pBackend.reset();
     
     // Call CoUninitialize if the CoInitialize was performed sucesfully
     if (m_bCoInitializeCalled)
@@ -39,6 +45,67 @@ VssClient::~VssClient()
 }
 
 
+// Use the simulated VSS provider instead of the VSS infrastructure
+void VssClient::UseSimulatedBackend(const SimulationSettings & settings)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    m_pBackend.reset(new SimulatedVssBackend(settings));
+}
+
+
+// Record the duration of the shadow copy creation steps
+void VssClient::EnableTiming()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    m_phaseTimer.Enable();
+}
+
+
+// Polling interval and deadlines for the asynchronous operations
+void VssClient::SetAsyncWaitSettings(const AsyncWaitSettings & settings)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    m_asyncWaitSettings = settings;
+}
+
+
+// Number of shadow copies fetched at a time when enumerating the shadow copies
+void VssClient::SetEnumerationBatchSize(ULONG batchSize)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    m_enumerationBatchSize = (batchSize > 0) ? batchSize : DEFAULT_ENUMERATION_BATCH_SIZE;
+}
+
+
+// Maximum number of volumes to delete shadow copies from at the same time
+void VssClient::SetDeleteConcurrency(DWORD maxConcurrency)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    m_deleteConcurrency = (maxConcurrency > 0) ? maxConcurrency : 1;
+}
+
+
+// Write the recorded durations of the shadow copy creation steps
+void VssClient::WriteTimingReports(wstring timingReportFile, wstring chromeTraceFile)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    if (!m_phaseTimer.IsEnabled())
+        return;
+
+    if (timingReportFile.length() > 0)
+        m_phaseTimer.WriteTimingReport(timingReportFile);
+
+    if (chromeTraceFile.length() > 0)
+        m_phaseTimer.WriteChromeTrace(chromeTraceFile);
+}
+
+
 // Initialize the COM infrastructure and the internal pointers
 void VssClient::Initialize(DWORD dwContext, wstring xmlDoc, bool bDuringRestore)
 {
@@ -62,60 +129,61 @@ void VssClient::Initialize(DWORD dwContext, wstring xmlDoc, bool bDuringRestore)
             NULL                            //  Reserved parameter
             ) );
 
-    // Create the internal backup components object
-    CHECK_COM( CreateVssBackupComponents(&m_pVssObject) );
-    
     // We are during restore now?
     m_bDuringRestore = bDuringRestore;
 
-    // Call either Initialize for backup or for restore
-    if (m_bDuringRestore)
-    {
-        CHECK_COM(m_pVssObject->InitializeForRestore(CComBSTR(xmlDoc.c_str())))
-    }
-    else
-    {
-        // Initialize for backup
-        if (xmlDoc.length() == 0)
-            CHECK_COM(m_pVssObject->InitializeForBackup())
-        else
-            CHECK_COM(m_pVssObject->InitializeForBackup(CComBSTR(xmlDoc.c_str())))
+    // Create and initialize the internal backup components object
+    ft.Trace(DBG_INFO, L"- Using the %s backend", m_pBackend->GetName());
+    m_pBackend->Initialize(dwContext, xmlDoc, bDuringRestore);
 
-#ifdef VSS_SERVER
+    // Keep the context
+    m_dwContext = dwContext;
+}
 
-        // Set the context, if different than the default context
-        if (dwContext != VSS_CTX_BACKUP)
-        {
-            ft.WriteLine(L"- Setting the VSS context to: 0x%08lx", dwContext);
-            CHECK_COM(m_pVssObject->SetContext(dwContext) );
-        }
 
-#endif
+// Returns the IVssBackupComponents object, for the operations not supported by all backends
+IVssBackupComponents* VssClient::GetVssObject()
+{
+    FunctionTracer ft(DBG_INFO);
 
+    IVssBackupComponents* pVssObject = m_pBackend->GetBackupComponents();
+    if (pVssObject == NULL)
+    {
+        ft.WriteLine(L"ERROR: This operation is not supported by the %s backend!", m_pBackend->GetName());
+        throw(E_NOTIMPL);
     }
 
-    // Keep the context
-    m_dwContext = dwContext;
-
-    // Set various properties per backup components instance
-    CHECK_COM(m_pVssObject->SetBackupState(true, true, VSS_BT_FULL, false));
+    return pVssObject;
 }
 
 
+// Returns the index of all shadow copies, enumerating them if the index is out of date
+SnapshotIndex & VssClient::GetSnapshotIndex()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    if (!m_snapshotIndex.IsUpToDate())
+        m_snapshotIndex.Build(m_pBackend.get(), m_enumerationBatchSize);
+
+    return m_snapshotIndex;
+}
+
 
 // Waits for the completion of the asynchronous operation
-void VssClient::WaitAndCheckForAsyncOperation(IVssAsync* pAsync)
+void VssClient::WaitAndCheckForAsyncOperation(IVssAsync* pAsync, LPCWSTR operationName)
 {
     FunctionTracer ft(DBG_INFO);
+    ScopedPhase phase(m_phaseTimer, L"Wait");
 
     ft.WriteLine(L"(Waiting for the asynchronous operation to finish...)");
 
-    // Wait until the async operation finishes
-    CHECK_COM(pAsync->Wait());
+    // Wait until the async operation finishes, or is cancelled because of its deadline
+    AsyncWaiter waiter(m_asyncWaitSettings);
+    waiter.Add(pAsync, operationName);
+    waiter.WaitAll();
 
     // Check the result of the asynchronous operation
-    HRESULT hrReturned = S_OK;
-    CHECK_COM(pAsync->QueryStatus(&hrReturned, NULL));
+    HRESULT hrReturned = waiter.GetResult(0);
 
     // Check if the async operation succeeded...
     if(FAILED(hrReturned))
@@ -126,6 +194,8 @@ void VssClient::WaitAndCheckForAsyncOperation(IVssAsync* pAsync)
         ft.WriteLine(L"- Please re-run VSHADOW.EXE with the /tracing option to get more details");
         throw(hrReturned);
     }
+
+    phase.Complete();
 }
 
 
@@ -31,6 +31,26 @@ public:
     // Destructor
     ~VssClient();
 
+    // Use the simulated VSS provider instead of the VSS infrastructure
+    // Must be called before Initialize
+    void UseSimulatedBackend(const SimulationSettings & settings);
+
+    // Record the duration of the shadow copy creation steps
+    void EnableTiming();
+
+    // Write the recorded durations as a JSON timing report and/or a Chrome trace event file
+    // Empty file names are skipped
+    void WriteTimingReports(wstring timingReportFile, wstring chromeTraceFile);
+
+    // Polling interval and deadlines for the asynchronous operations
+    void SetAsyncWaitSettings(const AsyncWaitSettings & settings);
+
+    // Number of shadow copies fetched at a time when enumerating the shadow copies
+    void SetEnumerationBatchSize(ULONG batchSize);
+
+    // Maximum number of volumes to delete shadow copies from at the same time
+    void SetDeleteConcurrency(DWORD maxConcurrency);
+
     // Initialize the internal pointers
     void Initialize(DWORD dwContext = VSS_CTX_BACKUP, wstring xmlDoc = L"", bool bDuringRestore = false);
 
@@ -100,6 +120,10 @@ public:
     // Delete the oldest shadow copy on a volume
     void DeleteOldestSnapshot(const wstring& stringVolumeName);
 
+    // Delete the shadow copies not kept by the retention policy, on all volumes
+    // With bDryRun, only print which shadow copies would be kept and deleted
+    void PruneSnapshots(const RetentionPolicy & policy, bool bDryRun);
+
     //
     //  Shadow copy break related methods
     //
@@ -195,7 +219,7 @@ public:
 
     // Discover excluded components that have file groups outside the shadow set
     void DiscoverNonShadowedExcludedComponents(
-        vector<wstring> shadowSourceVolumes
+        const vector<wstring> & shadowSourceVolumes
     );
 
     // Discover the components that should not be included (explicitly or implicitly)
@@ -245,8 +269,15 @@ public:
 
 private:
 
-    // Waits for the async operation to finish
-    void WaitAndCheckForAsyncOperation(IVssAsync*  pAsync);
+    // Waits for the async operation to finish, cancelling it if its deadline passes
+    // The operation name selects the deadline, see AsyncWaitSettings
+    void WaitAndCheckForAsyncOperation(IVssAsync*  pAsync, LPCWSTR operationName);
+
+    // Returns the IVssBackupComponents object, for the operations not supported by all backends
+    IVssBackupComponents* GetVssObject();
+
+    // Returns the index of all shadow copies, enumerating them if the index is out of date
+    SnapshotIndex & GetSnapshotIndex();
 
 
 
@@ -263,9 +294,23 @@ private:
     // VSS context
     DWORD                           m_dwContext;
 
-    // The IVssBackupComponents interface is automatically released when this object is destructed.
-    // Needed to issue VSS calls 
-    CComPtr<IVssBackupComponents>   m_pVssObject;
+    // The backend issuing the VSS calls, by default using the IVssBackupComponents interface
+    unique_ptr<VssBackend>          m_pBackend;
+
+    // Durations of the shadow copy creation steps, when enabled
+    PhaseTimer                      m_phaseTimer;
+
+    // Index of the shadow copies in the system, enumerated on first use
+    SnapshotIndex                   m_snapshotIndex;
+
+    // Polling interval and deadlines for the asynchronous operations
+    AsyncWaitSettings               m_asyncWaitSettings;
+
+    // Number of shadow copies fetched at a time when enumerating
+    ULONG                           m_enumerationBatchSize;
+
+    // Maximum number of volumes to delete shadow copies from at the same time
+    DWORD                           m_deleteConcurrency;
 
     // List of selected writers during the shadow copy creation process
     vector<wstring>                 m_latestVolumeList;
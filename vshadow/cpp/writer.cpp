@@ -25,21 +25,24 @@
 void VssClient::GatherWriterMetadata()
 {
     FunctionTracer ft(DBG_INFO);
+    ScopedPhase phase(m_phaseTimer, L"GatherWriterMetadata");
 
     ft.WriteLine(L"(Gathering writer metadata...)");
 
     // Gathers writer metadata
     // WARNING: this call can be performed only once per IVssBackupComponents instance!
     CComPtr<IVssAsync>  pAsync;
-    CHECK_COM(m_pVssObject->GatherWriterMetadata(&pAsync));
+    CHECK_COM(m_pBackend->GatherWriterMetadata(&pAsync));
 
     // Waits for the async operation to finish and checks the result
-    WaitAndCheckForAsyncOperation(pAsync);
+    WaitAndCheckForAsyncOperation(pAsync, L"GatherWriterMetadata");
 
     ft.WriteLine(L"Initialize writer metadata ...");
 
     // Initialize the internal metadata data structures
     InitializeWriterMetadata();
+
+    phase.Complete();
 }
 
 
@@ -52,26 +55,23 @@ void VssClient::GatherWriterMetadataToScreen()
     // Gathers writer metadata
     // WARNING: this call can be performed only once per IVssBackupComponents instance!
     CComPtr<IVssAsync>  pAsync;
-    CHECK_COM(m_pVssObject->GatherWriterMetadata(&pAsync));
+    CHECK_COM(m_pBackend->GatherWriterMetadata(&pAsync));
 
     // Waits for the async operation to finish and checks the result
-    WaitAndCheckForAsyncOperation(pAsync);
+    WaitAndCheckForAsyncOperation(pAsync, L"GatherWriterMetadata");
 
     // Get the list of writers in the metadata  
     unsigned cWriters = 0;
-    CHECK_COM(m_pVssObject->GetWriterMetadataCount(&cWriters));
+    CHECK_COM(m_pBackend->GetWriterMetadataCount(&cWriters));
 
     // Enumerate writers
     for (unsigned iWriter = 0; iWriter < cWriters; iWriter++)
     {
-        CComBSTR bstrXML;
-        // Get the metadata for this particular writer
-        VSS_ID idInstance = GUID_NULL;
-        CComPtr<IVssExamineWriterMetadata> pMetadata;
-        CHECK_COM(m_pVssObject->GetWriterMetadata(iWriter, &idInstance, &pMetadata));
+        // Get the metadata for this particular writer, as XML
+        wstring xml;
+        CHECK_COM(m_pBackend->GetWriterMetadataXml(iWriter, xml));
 
-        CHECK_COM(pMetadata->SaveAsXML(&bstrXML));
-        wprintf(L"\n--[Writer %u]--\n%s\n", iWriter, (LPCWSTR)(bstrXML));
+        wprintf(L"\n--[Writer %u]--\n%s\n", iWriter, xml.c_str());
     }
 
     wprintf(L"--[end of data]--\n");
@@ -81,14 +81,17 @@ void VssClient::GatherWriterMetadataToScreen()
 void VssClient::GatherWriterStatus()
 {
     FunctionTracer ft(DBG_INFO);
+    ScopedPhase phase(m_phaseTimer, L"GatherWriterStatus");
 
     // Gathers writer status
     // WARNING: GatherWriterMetadata must be called before
     CComPtr<IVssAsync>  pAsync;
-    CHECK_COM(m_pVssObject->GatherWriterStatus(&pAsync));
+    CHECK_COM(m_pBackend->GatherWriterStatus(&pAsync));
 
     // Waits for the async operation to finish and checks the result
-    WaitAndCheckForAsyncOperation(pAsync);
+    WaitAndCheckForAsyncOperation(pAsync, L"GatherWriterStatus");
+
+    phase.Complete();
 }
 
 
@@ -98,18 +101,14 @@ void VssClient::InitializeWriterMetadata()
 
     // Get the list of writers in the metadata  
     unsigned cWriters = 0;
-    CHECK_COM(m_pVssObject->GetWriterMetadataCount (&cWriters));
+    CHECK_COM(m_pBackend->GetWriterMetadataCount (&cWriters));
 
     // Enumerate writers
     for (unsigned iWriter = 0; iWriter < cWriters; iWriter++)
     {
         // Get the metadata for this particular writer
-        VSS_ID idInstance = GUID_NULL;
-        CComPtr<IVssExamineWriterMetadata> pMetadata;
-        CHECK_COM(m_pVssObject->GetWriterMetadata(iWriter, &idInstance, &pMetadata));
-
         VssWriter   writer;
-        writer.Initialize(pMetadata);
+        CHECK_COM(m_pBackend->GetWriterMetadata(iWriter, writer));
 
         // Add this writer to the list 
         m_writerList.push_back(writer);
@@ -126,14 +125,14 @@ void VssClient::InitializeWriterComponentsForRestore()
 
     // Get the list of writers in the metadata  
     unsigned cWriters = 0;
-    CHECK_COM(m_pVssObject->GetWriterComponentsCount(&cWriters));
+    CHECK_COM(m_pBackend->GetWriterComponentsCount(&cWriters));
 
     // Enumerate writers
     for (unsigned iWriter = 0; iWriter < cWriters; iWriter++)
     {
         // Get the selected components for this particular writer
         CComPtr<IVssWriterComponentsExt> pWriterComponents;
-        CHECK_COM(m_pVssObject->GetWriterComponents(iWriter, &pWriterComponents));
+        CHECK_COM(GetVssObject()->GetWriterComponents(iWriter, &pWriterComponents));
         
         // Get writer identity. 
         // Ignore this writer if the real writer is not present in the system
@@ -204,7 +203,7 @@ void VssClient::ListWriterStatus()
     // Gets the number of writers in the gathered status info
     // (WARNING: GatherWriterStatus must be called before)
     unsigned cWriters = 0;
-    CHECK_COM(m_pVssObject->GetWriterStatusCount(&cWriters));
+    CHECK_COM(m_pBackend->GetWriterStatusCount(&cWriters));
     ft.WriteLine(L"- Number of writers that responded: %u", cWriters);  
 
     // Enumerate each writer
@@ -217,7 +216,7 @@ void VssClient::ListWriterStatus()
         HRESULT hrWriterFailure = S_OK;
 
         // Get writer status
-        CHECK_COM(m_pVssObject->GetWriterStatus(iWriter,
+        CHECK_COM(m_pBackend->GetWriterStatus(iWriter,
                              &idInstance,
                              &idWriter,
                              &bstrWriterName,
@@ -251,10 +250,10 @@ void VssClient::PreRestore()
     // Gathers writer status
     // WARNING: GatherWriterMetadata must be called before
     CComPtr<IVssAsync>  pAsync;
-    CHECK_COM(m_pVssObject->PreRestore(&pAsync));
+    CHECK_COM(GetVssObject()->PreRestore(&pAsync));
 
     // Waits for the async operation to finish and checks the result
-    WaitAndCheckForAsyncOperation(pAsync);
+    WaitAndCheckForAsyncOperation(pAsync, L"PreRestore");
 }
 
 
@@ -269,10 +268,10 @@ void VssClient::PostRestore()
     // Gathers writer status
     // WARNING: GatherWriterMetadata must be called before
     CComPtr<IVssAsync>  pAsync;
-    CHECK_COM(m_pVssObject->PostRestore(&pAsync));
+    CHECK_COM(GetVssObject()->PostRestore(&pAsync));
 
     // Waits for the async operation to finish and checks the result
-    WaitAndCheckForAsyncOperation(pAsync);
+    WaitAndCheckForAsyncOperation(pAsync, L"PostRestore");
 }
 
 
@@ -393,13 +392,22 @@ void VssWriter::Initialize(IVssExamineWriterMetadata * pMetadata)
     }
 
     // Discover toplevel components
-    for(unsigned i = 0; i < cComponents; i++)
-    {
-        components[i].isTopLevel = true;
-        for(unsigned j = 0; j < cComponents; j++)
-            if (components[j].IsAncestorOf(components[i]))
-                components[i].isTopLevel = false;
-    }
+    DiscoverTopLevelComponents();
+}
+
+
+// Build the component tree and discover the top-level components
+void VssWriter::DiscoverTopLevelComponents()
+{
+    FunctionTracer ft(DBG_INFO);
+
+    componentTree.Build(components);
+
+    // Top-level components are the ones without any ancestor component
+    vector<bool> allComponents(components.size(), true);
+    vector<bool> hasAncestor = componentTree.FindMarkedAncestors(allComponents);
+    for(unsigned i = 0; i < components.size(); i++)
+        components[i].isTopLevel = !hasAncestor[i];
 }
 
 
@@ -430,6 +438,9 @@ void VssWriter::InitializeComponentsForRestore(IVssWriterComponentsExt * pWriter
 
         components.push_back(component);
     }
+
+    // Index the components
+    componentTree.Build(components);
 }
 
 
@@ -541,9 +552,7 @@ void VssComponent::Initialize(wstring writerNameParam, IVssWMComponent * pCompon
     notifyOnBackupComplete = pInfo->bNotifyOnBackupComplete;
 
     // Compute the full path
-    fullPath = AppendBackslash(logicalPath) + name;
-    if (fullPath[0] != L'\\')
-        fullPath = wstring(L"\\") + fullPath;
+    ComputeFullPath();
 
     // Get file list descriptors
     for(unsigned i = 0; i < pInfo->cFileCount; i++)
@@ -596,17 +605,7 @@ void VssComponent::Initialize(wstring writerNameParam, IVssWMComponent * pCompon
     pComponent->FreeComponentInfo (pInfo);
 
     // Compute the affected paths and volumes
-    for(unsigned i = 0; i < descriptors.size(); i++)
-    {
-        if (!FindStringInList(descriptors[i].expandedPath, affectedPaths))
-            affectedPaths.push_back(descriptors[i].expandedPath);
-
-        if (!FindStringInList(descriptors[i].affectedVolume, affectedVolumes))
-            affectedVolumes.push_back(descriptors[i].affectedVolume);
-    }
-
-
-    sort( affectedPaths.begin( ), affectedPaths.end( ) );
+    ComputeAffectedPathsAndVolumes();
 }
 
 
@@ -631,12 +630,36 @@ void VssComponent::Initialize(wstring writerNameParam, IVssComponent * pComponen
     logicalPath = BSTR2WString(bstrLogicalPath);
 
     // Compute the full path
+    ComputeFullPath();
+}
+
+
+// Compute the full path from the logical path and the name
+void VssComponent::ComputeFullPath()
+{
     fullPath = AppendBackslash(logicalPath) + name;
     if (fullPath[0] != L'\\')
         fullPath = wstring(L"\\") + fullPath;
 }
 
 
+// Compute the paths and volumes affected by the file descriptors
+void VssComponent::ComputeAffectedPathsAndVolumes()
+{
+    for(unsigned i = 0; i < descriptors.size(); i++)
+    {
+        if (!FindStringInList(descriptors[i].expandedPath, affectedPaths))
+            affectedPaths.push_back(descriptors[i].expandedPath);
+
+        if (!FindStringInList(descriptors[i].affectedVolume, affectedVolumes))
+            affectedVolumes.push_back(descriptors[i].affectedVolume);
+    }
+
+
+    sort( affectedPaths.begin( ), affectedPaths.end( ) );
+}
+
+
 // Print summary/detalied information about this component
 void VssComponent::Print(bool bListDetailedInfo)
 {
@@ -759,6 +782,176 @@ bool VssComponent::CanBeExplicitlyIncluded()
 
 
 
+////////////////////////////////////////////////////////////////////////////////////
+//  ComponentTree
+//
+
+
+// Return the lowest of two component indexes, where -1 means none
+static int FirstComponentIndex(int index1, int index2)
+{
+    if (index1 == -1)
+        return index2;
+    if (index2 == -1)
+        return index1;
+    return min(index1, index2);
+}
+
+
+// Build the index for the given list of components
+void ComponentTree::Build(vector<VssComponent> & components)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    m_nodes.clear();
+    m_componentNodes.clear();
+    m_pathLengths.clear();
+
+    // The root node
+    m_nodes.push_back(Node(-1));
+
+    // Child node for each pair of parent node and lowercase path segment
+    map<pair<int, wstring>, int> children;
+
+    for (unsigned i = 0; i < components.size(); i++)
+    {
+        // Walk down the segments of the full path, creating nodes as needed.
+        // The path is terminated with a backslash, so that "\a\b" and "\a\b\"
+        // end up in the same node, like the prefix match in IsAncestorOf.
+        wstring path = AppendBackslash(components[i].fullPath);
+        int node = 0;
+        size_t start = 0;
+        for (size_t end = path.find(L'\\'); end != wstring::npos; end = path.find(L'\\', start))
+        {
+            wstring segment = ToLowerCase(path.substr(start, end - start));
+            start = end + 1;
+
+            pair<int, wstring> key(node, segment);
+            map<pair<int, wstring>, int>::iterator it = children.find(key);
+            if (it == children.end())
+            {
+                m_nodes.push_back(Node(node));
+                it = children.insert(make_pair(key, (int)m_nodes.size() - 1)).first;
+            }
+            node = it->second;
+        }
+
+        m_nodes[node].components.push_back(i);
+        m_componentNodes.push_back(node);
+        m_pathLengths.push_back(components[i].fullPath.length());
+    }
+
+#ifdef _DEBUG
+
+    // Verify the index against the pairwise comparison it replaces
+    for (unsigned i = 0; i < components.size(); i++)
+        for (unsigned j = 0; j < components.size(); j++)
+            _ASSERTE(IsAncestorOf(i, j) == components[i].IsAncestorOf(components[j]));
+
+#endif
+}
+
+
+// Return TRUE if the first component is an ancestor of the second one
+bool ComponentTree::IsAncestorOf(unsigned ancestor, unsigned descendent)
+{
+    int ancestorNode = m_componentNodes[ancestor];
+    int node = m_componentNodes[descendent];
+
+    if (node == ancestorNode)
+        return m_pathLengths[descendent] > m_pathLengths[ancestor];
+
+    for (node = m_nodes[node].parent; node != -1; node = m_nodes[node].parent)
+        if (node == ancestorNode)
+            return true;
+
+    return false;
+}
+
+
+// Return, for each component, the lowest index of a marked descendent, or -1 if none
+vector<int> ComponentTree::FindFirstMarkedDescendents(const vector<bool> & marked)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    // Lowest marked component in the nodes below each node, computed bottom-up
+    vector<int> firstBelow(m_nodes.size(), -1);
+    for (size_t n = m_nodes.size() - 1; n > 0; n--)
+    {
+        int first = firstBelow[n];
+        for (unsigned c = 0; c < m_nodes[n].components.size(); c++)
+            if (marked[m_nodes[n].components[c]])
+                first = FirstComponentIndex(first, (int)m_nodes[n].components[c]);
+
+        int parent = m_nodes[n].parent;
+        firstBelow[parent] = FirstComponentIndex(firstBelow[parent], first);
+    }
+
+    vector<int> result(m_componentNodes.size(), -1);
+    for (unsigned i = 0; i < m_componentNodes.size(); i++)
+    {
+        const Node & node = m_nodes[m_componentNodes[i]];
+        int first = firstBelow[m_componentNodes[i]];
+
+        // Components in the same node with a longer path are also descendents
+        for (unsigned c = 0; c < node.components.size(); c++)
+        {
+            unsigned other = node.components[c];
+            if (marked[other] && m_pathLengths[other] > m_pathLengths[i])
+                first = FirstComponentIndex(first, (int)other);
+        }
+
+        result[i] = first;
+    }
+
+    return result;
+}
+
+
+// Return, for each component, TRUE if it has a marked ancestor
+vector<bool> ComponentTree::FindMarkedAncestors(const vector<bool> & marked)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    vector<bool> hasMarked(m_nodes.size(), false);
+    for (unsigned i = 0; i < m_componentNodes.size(); i++)
+        if (marked[i])
+            hasMarked[m_componentNodes[i]] = true;
+
+    // Whether any node above each node has marked components, computed top-down
+    vector<bool> markedAbove(m_nodes.size(), false);
+    for (size_t n = 1; n < m_nodes.size(); n++)
+    {
+        int parent = m_nodes[n].parent;
+        markedAbove[n] = markedAbove[parent] || hasMarked[parent];
+    }
+
+    vector<bool> result(m_componentNodes.size(), false);
+    for (unsigned i = 0; i < m_componentNodes.size(); i++)
+    {
+        const Node & node = m_nodes[m_componentNodes[i]];
+        bool found = markedAbove[m_componentNodes[i]];
+
+        // Components in the same node with a shorter path are also ancestors
+        for (unsigned c = 0; !found && c < node.components.size(); c++)
+        {
+            unsigned other = node.components[c];
+            if (marked[other] && m_pathLengths[other] < m_pathLengths[i])
+                found = true;
+        }
+
+        result[i] = found;
+    }
+
+    return result;
+}
+
+
+
+
+
+
+
 ////////////////////////////////////////////////////////////////////////////////////
 //  VssFileDescriptor
 //
@@ -794,10 +987,19 @@ void VssFileDescriptor::Initialize(
     expandedPath = bRecursive;
     path = BSTR2WString(bstrPath);
 
+    _ASSERTE(bstrPath && bstrPath[0]);
+    ExpandPath();
+}
+
+
+// Compute the expanded path and the affected volume from the path
+void VssFileDescriptor::ExpandPath()
+{
+    FunctionTracer ft(DBG_INFO);
+
     // Get the expanded path
     expandedPath.resize(MAX_PATH, L'\0');
-    _ASSERTE(bstrPath && bstrPath[0]);
-    CHECK_WIN32(ExpandEnvironmentStringsW(bstrPath, (PWCHAR)expandedPath.c_str(), (DWORD)expandedPath.length()));
+    CHECK_WIN32(ExpandEnvironmentStringsW(path.c_str(), (PWCHAR)expandedPath.c_str(), (DWORD)expandedPath.length()));
     expandedPath = AppendBackslash(expandedPath);
 
     // Get the affected volume 
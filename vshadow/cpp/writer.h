@@ -42,6 +42,9 @@ struct VssFileDescriptor
         VSS_DESCRIPTOR_TYPE typeParam
         );
 
+    // Compute the expanded path and the affected volume from the path
+    void ExpandPath();
+
     // Print this file descriptor 
     void Print();
 
@@ -116,6 +119,12 @@ struct VssComponent
     // Initialize from a IVssComponent
     void Initialize(wstring writerNameParam, IVssComponent * pComponent);
 
+    // Compute the full path from the logical path and the name
+    void ComputeFullPath();
+
+    // Compute the paths and volumes affected by the file descriptors
+    void ComputeAffectedPathsAndVolumes();
+
     // Print summary/detalied information about this component
     void Print(bool bListDetailedInfo);
 
@@ -154,6 +163,58 @@ struct VssComponent
 };
 
 
+//////////////////////////////////////////////////////////////////////////////////////
+// Index over the logical path hierarchy of the components of one writer
+//
+//  Components are placed in a trie keyed by the (case-insensitive) segments of
+//  their full path, so that ancestor/descendent relations between all components
+//  are resolved in linear time instead of comparing every pair of components.
+//  Components are referred to by their index in the component list.
+//
+
+class ComponentTree
+{
+public:
+
+    ComponentTree() {};
+
+    // Build the index for the given list of components
+    void Build(vector<VssComponent> & components);
+
+    // Return TRUE if the first component is an ancestor of the second one
+    // (same result as VssComponent::IsAncestorOf)
+    bool IsAncestorOf(unsigned ancestor, unsigned descendent);
+
+    // Return, for each component, the lowest index of a marked descendent, or -1 if none
+    vector<int> FindFirstMarkedDescendents(const vector<bool> & marked);
+
+    // Return, for each component, TRUE if it has a marked ancestor
+    vector<bool> FindMarkedAncestors(const vector<bool> & marked);
+
+private:
+
+    struct Node
+    {
+        Node(int parentParam): parent(parentParam) {};
+
+        // Parent node, or -1 for the root
+        int                 parent;
+
+        // Components with this full path
+        vector<unsigned>    components;
+    };
+
+    // Nodes in creation order, so a parent always comes before its children
+    vector<Node>            m_nodes;
+
+    // Node and full path length of each component. Components in the same node
+    // only differ by a trailing backslash, the shorter path is the ancestor.
+    vector<int>             m_componentNodes;
+    vector<size_t>          m_pathLengths;
+};
+
+
+
 //////////////////////////////////////////////////////////////////////////////////////
 // In-memory representation of a writer metadata
 //
@@ -174,6 +235,9 @@ struct VssWriter
     // Initialize from a IVssWriterComponentsExt
     void InitializeComponentsForRestore(IVssWriterComponentsExt * pWriterComponents);
 
+    // Build the component tree and discover the top-level components
+    void DiscoverTopLevelComponents();
+
     // Print summary/detalied information about this writer
     void Print(bool bListDetailedInfo);
 
@@ -196,5 +260,8 @@ struct VssWriter
     bool                        rebootRequiredAfterRestore;
 
     bool                        isExcluded;
+
+    // Index over the components
+    ComponentTree               componentTree;
 };
 
@@ -0,0 +1,557 @@
+// Main header
+#include "stdafx.h"
+
+
+// Elements of the writer metadata
+const WCHAR XML_WRITER_METADATA[] = L"WRITER_METADATA";
+const WCHAR XML_IDENTIFICATION[] = L"IDENTIFICATION";
+const WCHAR XML_RESTORE_METHOD[] = L"RESTORE_METHOD";
+const WCHAR XML_EXCLUDE_FILES[] = L"EXCLUDE_FILES";
+const WCHAR XML_BACKUP_LOCATIONS[] = L"BACKUP_LOCATIONS";
+const WCHAR XML_FILE_GROUP[] = L"FILE_GROUP";
+const WCHAR XML_DATABASE[] = L"DATABASE";
+const WCHAR XML_FILE_LIST[] = L"FILE_LIST";
+const WCHAR XML_DATABASE_FILES[] = L"DATABASE_FILES";
+const WCHAR XML_DATABASE_LOGFILES[] = L"DATABASE_LOGFILES";
+const WCHAR XML_DEPENDENCY[] = L"DEPENDENCY";
+
+
+// Whitespace as defined by XML
+static inline bool IsXmlWhitespace(WCHAR ch)
+{
+    return ch == L' ' || ch == L'\t' || ch == L'\r' || ch == L'\n';
+}
+
+
+// Characters that end a name in a tag
+static inline bool IsXmlNameEnd(WCHAR ch)
+{
+    switch (ch)
+    {
+    case L'/': case L'>': case L'=': case L'<': case L'"': case L'\'':
+        return true;
+    default:
+        return IsXmlWhitespace(ch);
+    }
+}
+
+
+
+WriterMetadataReader::WriterMetadataReader():
+    m_pwszText(NULL),
+    m_pwszEnd(NULL),
+    m_pwszPosition(NULL),
+    m_pwszDocument(NULL),
+    m_pWriters(NULL),
+    m_pDocuments(NULL),
+    m_bInWriter(false),
+    m_bInComponent(false),
+    m_bDocumentHasWriter(false)
+{
+}
+
+
+// Read the writers from a file in UTF-16 with a byte order mark, UTF-8 or the ANSI code page
+void WriterMetadataReader::ReadFromFile(wstring fileName, vector<VssWriter> & writers, vector<wstring> & documents)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    ft.WriteLine(L"Reading writer metadata from '%s' ...", fileName.c_str());
+
+    HANDLE hFile = CreateFile(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        CHECK_WIN32_ERROR(GetLastError(), L"CreateFile");
+
+    // Will automatically call CloseHandle at the end of scope
+    CAutoHandle autoCleanupHandle(hFile);
+
+    LARGE_INTEGER fileSize;
+    CHECK_WIN32(GetFileSizeEx(hFile, &fileSize));
+    if (fileSize.QuadPart > MAXLONG / sizeof(WCHAR))
+    {
+        ft.WriteLine(L"ERROR: The writer metadata file '%s' is too large!", fileName.c_str());
+        throw(E_INVALIDARG);
+    }
+
+    vector<BYTE> bytes((size_t)fileSize.QuadPart + sizeof(WCHAR));
+    DWORD cbRead = 0;
+    CHECK_WIN32(::ReadFile(hFile, &bytes[0], (DWORD)fileSize.QuadPart, &cbRead, NULL));
+
+    ULONGLONG ullStart = GetTickCount64();
+    size_t cWriters = writers.size();
+
+    if (cbRead >= 2 && bytes[0] == 0xFF && bytes[1] == 0xFE)
+    {
+        // UTF-16 is parsed where it was read
+        Parse((const WCHAR *)&bytes[2], (cbRead - 2) / sizeof(WCHAR), writers, documents);
+    }
+    else
+    {
+        // Otherwise UTF-8, unless it is not valid as such, like the -wm3 output redirected to a file
+        const BYTE utf8Bom[] = { 0xEF, 0xBB, 0xBF };
+        DWORD cbStart = (cbRead >= sizeof(utf8Bom) && memcmp(&bytes[0], utf8Bom, sizeof(utf8Bom)) == 0) ? sizeof(utf8Bom) : 0;
+        LPCSTR pszText = (LPCSTR)&bytes[cbStart];
+        int cbText = (int)(cbRead - cbStart);
+
+        UINT codePage = CP_UTF8;
+        int cchText = (cbText == 0) ? 0 : MultiByteToWideChar(codePage, MB_ERR_INVALID_CHARS, pszText, cbText, NULL, 0);
+        if (cchText == 0 && cbText > 0)
+        {
+            codePage = CP_ACP;
+            cchText = MultiByteToWideChar(codePage, 0, pszText, cbText, NULL, 0);
+        }
+
+        vector<WCHAR> text(cchText + 1);
+        if (cchText > 0)
+            CHECK_WIN32(MultiByteToWideChar(codePage, 0, pszText, cbText, &text[0], cchText));
+        Parse(&text[0], cchText, writers, documents);
+    }
+
+    ULONGLONG ullDuration = GetTickCount64() - ullStart;
+    ft.WriteLine(L"- Read %u writers (%u KB in %I64u ms, %.1f MB/s)",
+        (unsigned)(writers.size() - cWriters),
+        (unsigned)(cbRead / 1024),
+        ullDuration,
+        (ullDuration == 0) ? 0.0 : (double)cbRead / 1000.0 / (double)ullDuration);
+}
+
+
+// Read the writers from the text
+void WriterMetadataReader::Parse(const WCHAR * pwszText, size_t cchText, vector<VssWriter> & writers, vector<wstring> & documents)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    m_pwszText = pwszText;
+    m_pwszEnd = pwszText + cchText;
+    m_pwszPosition = pwszText;
+    m_pWriters = &writers;
+    m_pDocuments = &documents;
+    m_openElements.clear();
+    m_bInWriter = false;
+    m_bInComponent = false;
+    m_bDocumentHasWriter = false;
+
+    // The character data is not used, only the tags are
+    while (m_pwszPosition < m_pwszEnd)
+    {
+        const WCHAR * pwszTag = wmemchr(m_pwszPosition, L'<', m_pwszEnd - m_pwszPosition);
+        if (pwszTag == NULL)
+            break;
+
+        m_pwszPosition = pwszTag + 1;
+        if (m_pwszPosition == m_pwszEnd)
+            ThrowFormatError(pwszTag, L"Incomplete tag");
+
+        if (*m_pwszPosition == L'/')
+            ParseEndTag();
+        else if (*m_pwszPosition == L'?' || *m_pwszPosition == L'!')
+            SkipMarkup();
+        else
+        {
+            if (m_openElements.empty())
+                m_pwszDocument = pwszTag;
+            ParseStartTag();
+        }
+    }
+
+    if (!m_openElements.empty())
+        ThrowFormatError(m_pwszEnd, L"Unexpected end of the text, with elements not ended");
+
+    m_pWriters = NULL;
+    m_pDocuments = NULL;
+}
+
+
+// Parse the tag starting after '<' at the current position
+void WriterMetadataReader::ParseStartTag()
+{
+    XmlString name = ParseName();
+
+    // The attributes are kept as they are, until their values are used
+    m_attributes.clear();
+    bool bEmpty = false;
+    while (true)
+    {
+        SkipWhitespace();
+        if (m_pwszPosition == m_pwszEnd)
+            ThrowFormatError(m_pwszPosition, L"Incomplete tag");
+        if (*m_pwszPosition == L'>')
+        {
+            m_pwszPosition++;
+            break;
+        }
+        if (*m_pwszPosition == L'/')
+        {
+            if (m_pwszPosition + 1 == m_pwszEnd || m_pwszPosition[1] != L'>')
+                ThrowFormatError(m_pwszPosition, L"Expected '>' after '/'");
+            m_pwszPosition += 2;
+            bEmpty = true;
+            break;
+        }
+
+        XmlAttribute attribute;
+        attribute.name = ParseName();
+        SkipWhitespace();
+        if (m_pwszPosition == m_pwszEnd || *m_pwszPosition != L'=')
+            ThrowFormatError(m_pwszPosition, L"Expected '=' after the attribute name");
+        m_pwszPosition++;
+        SkipWhitespace();
+        if (m_pwszPosition == m_pwszEnd || (*m_pwszPosition != L'"' && *m_pwszPosition != L'\''))
+            ThrowFormatError(m_pwszPosition, L"Expected a quoted attribute value");
+
+        const WCHAR * pwszQuote = wmemchr(m_pwszPosition + 1, *m_pwszPosition, m_pwszEnd - m_pwszPosition - 1);
+        if (pwszQuote == NULL)
+            ThrowFormatError(m_pwszPosition, L"Attribute value not ended");
+        attribute.value.pwsz = m_pwszPosition + 1;
+        attribute.value.cch = pwszQuote - attribute.value.pwsz;
+        m_pwszPosition = pwszQuote + 1;
+        m_attributes.push_back(attribute);
+    }
+
+    m_openElements.push_back(name);
+    OnStartElement(name);
+    if (bEmpty)
+    {
+        m_openElements.pop_back();
+        OnEndElement(name);
+    }
+}
+
+
+void WriterMetadataReader::ParseEndTag()
+{
+    const WCHAR * pwszTag = m_pwszPosition - 1;
+    m_pwszPosition++;
+    XmlString name = ParseName();
+    SkipWhitespace();
+    if (m_pwszPosition == m_pwszEnd || *m_pwszPosition != L'>')
+        ThrowFormatError(m_pwszPosition, L"Expected '>' after the name of the end tag");
+    m_pwszPosition++;
+
+    if (m_openElements.empty() || m_openElements.back().cch != name.cch
+        || wmemcmp(m_openElements.back().pwsz, name.pwsz, name.cch) != 0)
+        ThrowFormatError(pwszTag, L"End tag does not match the start tag");
+    m_openElements.pop_back();
+    OnEndElement(name);
+}
+
+
+// Skip a processing instruction, comment, CDATA section or declaration
+void WriterMetadataReader::SkipMarkup()
+{
+    const WCHAR * pwszTag = m_pwszPosition - 1;
+    size_t cchLeft = m_pwszEnd - m_pwszPosition;
+    LPCWSTR pwszTerminator = L">";
+    if (*m_pwszPosition == L'?')
+        pwszTerminator = L"?>";
+    else if (cchLeft >= 3 && wmemcmp(m_pwszPosition, L"!--", 3) == 0)
+        pwszTerminator = L"-->";
+    else if (cchLeft >= 8 && wmemcmp(m_pwszPosition, L"![CDATA[", 8) == 0)
+        pwszTerminator = L"]]>";
+
+    // A declaration with an internal subset, like a DOCTYPE, is not expected here
+    size_t cchTerminator = wcslen(pwszTerminator);
+    while (true)
+    {
+        const WCHAR * pwszFound = wmemchr(m_pwszPosition, pwszTerminator[cchTerminator - 1], m_pwszEnd - m_pwszPosition);
+        if (pwszFound == NULL)
+            ThrowFormatError(pwszTag, L"Markup not ended");
+        m_pwszPosition = pwszFound + 1;
+        if (pwszFound - pwszTag >= (ptrdiff_t)cchTerminator
+            && wmemcmp(pwszFound + 1 - cchTerminator, pwszTerminator, cchTerminator) == 0)
+            break;
+    }
+}
+
+
+WriterMetadataReader::XmlString WriterMetadataReader::ParseName()
+{
+    XmlString name;
+    name.pwsz = m_pwszPosition;
+    while (m_pwszPosition < m_pwszEnd && !IsXmlNameEnd(*m_pwszPosition))
+        m_pwszPosition++;
+    name.cch = m_pwszPosition - name.pwsz;
+    if (name.cch == 0)
+        ThrowFormatError(m_pwszPosition, L"Expected a name");
+    return name;
+}
+
+
+void WriterMetadataReader::SkipWhitespace()
+{
+    while (m_pwszPosition < m_pwszEnd && IsXmlWhitespace(*m_pwszPosition))
+        m_pwszPosition++;
+}
+
+
+// Compare the characters of the text with a name
+bool WriterMetadataReader::IsName(const XmlString & str, LPCWSTR pwszName)
+{
+    return wcslen(pwszName) == str.cch && wmemcmp(str.pwsz, pwszName, str.cch) == 0;
+}
+
+
+// Handle the start of the elements of the writer metadata
+void WriterMetadataReader::OnStartElement(const XmlString & name)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    if (IsName(name, XML_WRITER_METADATA))
+    {
+        if (m_bInWriter)
+            ThrowFormatError(name.pwsz, L"Writer metadata inside writer metadata");
+        m_bInWriter = true;
+        m_bDocumentHasWriter = true;
+        m_pWriters->push_back(VssWriter());
+        return;
+    }
+    if (!m_bInWriter)
+        return;
+
+    // The element the current one is in
+    const XmlString & parent = m_openElements[m_openElements.size() - 2];
+    VssWriter & writer = m_pWriters->back();
+
+    if (IsName(parent, XML_WRITER_METADATA))
+    {
+        if (IsName(name, XML_IDENTIFICATION))
+        {
+            writer.name = GetAttribute(L"friendlyName");
+            writer.id = GetGuidAttribute(L"writerId");
+            writer.instanceId = GetGuidAttribute(L"instanceId");
+        }
+        else if (IsName(name, XML_RESTORE_METHOD))
+        {
+            wstring method = GetAttribute(L"method");
+            if (method == L"RESTORE_IF_NONE_THERE")
+                writer.restoreMethod = VSS_RME_RESTORE_IF_NOT_THERE;
+            else if (method == L"RESTORE_IF_CAN_BE_REPLACED")
+                writer.restoreMethod = VSS_RME_RESTORE_IF_CAN_REPLACE;
+            else if (method == L"STOP_RESTART_SERVICE")
+                writer.restoreMethod = VSS_RME_STOP_RESTORE_START;
+            else if (method == L"REPLACE_AT_REBOOT")
+                writer.restoreMethod = VSS_RME_RESTORE_AT_REBOOT;
+#ifdef VSS_SERVER
+            else if (method == L"REPLACE_AT_REBOOT_IF_CANNOT_REPLACE")
+                writer.restoreMethod = VSS_RME_RESTORE_AT_REBOOT_IF_CANNOT_REPLACE;
+#endif
+            else if (method == L"RESTORE_TO_ALTERNATE_LOCATION")
+                writer.restoreMethod = VSS_RME_RESTORE_TO_ALTERNATE_LOCATION;
+            else if (method == L"CUSTOM")
+                writer.restoreMethod = VSS_RME_CUSTOM;
+            else if (method == L"RESTORE_STOP_START")
+                writer.restoreMethod = VSS_RME_RESTORE_STOP_START;
+            else
+                ft.WriteLine(L"- Unknown restore method '%s' of writer \"%s\"", method.c_str(), writer.name.c_str());
+
+            wstring writerRestore = GetAttribute(L"writerRestore");
+            if (writerRestore == L"never")
+                writer.writerRestoreConditions = VSS_WRE_NEVER;
+            else if (writerRestore == L"ifReplaceFails")
+                writer.writerRestoreConditions = VSS_WRE_IF_REPLACE_FAILS;
+            else if (writerRestore == L"always")
+                writer.writerRestoreConditions = VSS_WRE_ALWAYS;
+
+            writer.rebootRequiredAfterRestore = GetBooleanAttribute(L"rebootRequired");
+        }
+        else if (IsName(name, XML_EXCLUDE_FILES))
+        {
+            VssFileDescriptor excludedFile;
+            ReadFileDescriptor(VSS_FDT_EXCLUDE_FILES, excludedFile);
+            writer.excludedFiles.push_back(excludedFile);
+        }
+    }
+    else if (IsName(parent, XML_BACKUP_LOCATIONS))
+    {
+        if (IsName(name, XML_FILE_GROUP) || IsName(name, XML_DATABASE))
+        {
+            VssComponent component;
+            component.writerName = writer.name;
+            component.name = GetAttribute(L"componentName");
+            component.logicalPath = GetAttribute(L"logicalPath");
+            component.caption = GetAttribute(L"caption");
+            component.type = IsName(name, XML_DATABASE) ? VSS_CT_DATABASE : VSS_CT_FILEGROUP;
+            component.isSelectable = GetBooleanAttribute(L"selectable");
+            component.notifyOnBackupComplete = GetBooleanAttribute(L"notifyOnBackupComplete");
+            component.ComputeFullPath();
+            writer.components.push_back(component);
+            m_bInComponent = true;
+        }
+    }
+    else if (m_bInComponent && (IsName(parent, XML_FILE_GROUP) || IsName(parent, XML_DATABASE)))
+    {
+        VssComponent & component = writer.components.back();
+        VSS_DESCRIPTOR_TYPE type = VSS_FDT_UNDEFINED;
+        if (IsName(name, XML_FILE_LIST))
+            type = VSS_FDT_FILELIST;
+        else if (IsName(name, XML_DATABASE_FILES))
+            type = VSS_FDT_DATABASE;
+        else if (IsName(name, XML_DATABASE_LOGFILES))
+            type = VSS_FDT_DATABASE_LOG;
+
+        if (type != VSS_FDT_UNDEFINED)
+        {
+            VssFileDescriptor descriptor;
+            ReadFileDescriptor(type, descriptor);
+            component.descriptors.push_back(descriptor);
+        }
+
+#ifdef VSS_SERVER
+        if (IsName(name, XML_DEPENDENCY))
+        {
+            VssDependency dependency;
+            dependency.writerId = GetGuidAttribute(L"writerId");
+            dependency.logicalPath = GetAttribute(L"logicalPath");
+            dependency.componentName = GetAttribute(L"componentName");
+
+            // Compute the full path
+            dependency.fullPath = AppendBackslash(dependency.logicalPath) + dependency.componentName;
+            if (dependency.fullPath[0] != L'\\')
+                dependency.fullPath = wstring(L"\\") + dependency.fullPath;
+
+            component.dependencies.push_back(dependency);
+        }
+#endif
+    }
+}
+
+
+// Handle the end of the elements of the writer metadata
+void WriterMetadataReader::OnEndElement(const XmlString & name)
+{
+    // The document ends with its outermost element, which is just before the current position
+    if (m_openElements.empty() && m_bDocumentHasWriter)
+    {
+        m_pDocuments->push_back(wstring(m_pwszDocument, m_pwszPosition));
+        m_bDocumentHasWriter = false;
+    }
+
+    if (!m_bInWriter)
+        return;
+
+    VssWriter & writer = m_pWriters->back();
+    if (m_bInComponent && (IsName(name, XML_FILE_GROUP) || IsName(name, XML_DATABASE))
+        && IsName(m_openElements.back(), XML_BACKUP_LOCATIONS))
+    {
+        writer.components.back().ComputeAffectedPathsAndVolumes();
+        m_bInComponent = false;
+    }
+    else if (IsName(name, XML_WRITER_METADATA))
+    {
+        // Same as for the metadata gathered from the writer
+        writer.supportsRestore = (writer.writerRestoreConditions != VSS_WRE_NEVER);
+        writer.DiscoverTopLevelComponents();
+        m_bInWriter = false;
+    }
+}
+
+
+// Read the attributes of a file descriptor element
+void WriterMetadataReader::ReadFileDescriptor(VSS_DESCRIPTOR_TYPE type, VssFileDescriptor & descriptor)
+{
+    descriptor.type = type;
+    descriptor.path = GetAttribute(L"path");
+    descriptor.filespec = GetAttribute(L"filespec");
+    descriptor.alternatePath = GetAttribute(L"alternatePath");
+    descriptor.isRecursive = GetBooleanAttribute(L"recursive");
+    descriptor.ExpandPath();
+}
+
+
+// The value of an attribute of the current element, with the references replaced, empty if not there
+wstring WriterMetadataReader::GetAttribute(LPCWSTR pwszName)
+{
+    const XmlString * pValue = NULL;
+    for (size_t i = 0; i < m_attributes.size() && pValue == NULL; i++)
+        if (IsName(m_attributes[i].name, pwszName))
+            pValue = &m_attributes[i].value;
+    if (pValue == NULL)
+        return wstring();
+
+    const WCHAR * pwsz = pValue->pwsz;
+    const WCHAR * pwszEnd = pwsz + pValue->cch;
+    const WCHAR * pwszReference = wmemchr(pwsz, L'&', pwszEnd - pwsz);
+    if (pwszReference == NULL)
+        return wstring(pwsz, pwszEnd);
+
+    wstring value;
+    value.reserve(pValue->cch);
+    while (pwszReference != NULL)
+    {
+        value.append(pwsz, pwszReference);
+        const WCHAR * pwszSemicolon = wmemchr(pwszReference, L';', pwszEnd - pwszReference);
+        if (pwszSemicolon == NULL)
+            ThrowFormatError(pwszReference, L"Reference not ended with ';'");
+
+        XmlString reference = { pwszReference + 1, (size_t)(pwszSemicolon - pwszReference - 1) };
+        if (IsName(reference, L"amp"))
+            value += L'&';
+        else if (IsName(reference, L"lt"))
+            value += L'<';
+        else if (IsName(reference, L"gt"))
+            value += L'>';
+        else if (IsName(reference, L"quot"))
+            value += L'"';
+        else if (IsName(reference, L"apos"))
+            value += L'\'';
+        else if (reference.cch >= 2 && reference.pwsz[0] == L'#')
+        {
+            // Character reference, decimal or hexadecimal
+            bool bHex = (reference.pwsz[1] == L'x');
+            LPWSTR pwszNumberEnd = NULL;
+            unsigned long ulChar = wcstoul(reference.pwsz + (bHex ? 2 : 1), &pwszNumberEnd, bHex ? 16 : 10);
+            if (pwszNumberEnd != pwszSemicolon || ulChar == 0 || ulChar > 0x10FFFF)
+                ThrowFormatError(pwszReference, L"Invalid character reference");
+            if (ulChar >= 0x10000)
+            {
+                value += (WCHAR)(0xD800 + ((ulChar - 0x10000) >> 10));
+                value += (WCHAR)(0xDC00 + ((ulChar - 0x10000) & 0x3FF));
+            }
+            else
+                value += (WCHAR)ulChar;
+        }
+        else
+            ThrowFormatError(pwszReference, L"Unknown entity reference");
+
+        pwsz = pwszSemicolon + 1;
+        pwszReference = wmemchr(pwsz, L'&', pwszEnd - pwsz);
+    }
+    value.append(pwsz, pwszEnd);
+    return value;
+}
+
+
+bool WriterMetadataReader::GetBooleanAttribute(LPCWSTR pwszName)
+{
+    wstring value = GetAttribute(pwszName);
+    return IsEqual(value, L"yes") || IsEqual(value, L"true") || value == L"1";
+}
+
+
+// The attribute value as a GUID in the format of Guid2WString, which is not the one of the XML
+wstring WriterMetadataReader::GetGuidAttribute(LPCWSTR pwszName)
+{
+    wstring value = GetAttribute(pwszName);
+    if (value.empty())
+        return value;
+    if (value[0] != L'{')
+        value = L"{" + value + L"}";
+    return Guid2WString(WString2Guid(value));
+}
+
+
+// Report an error at the given position of the text
+void WriterMetadataReader::ThrowFormatError(const WCHAR * pwszPosition, LPCWSTR pwszMessage)
+{
+    FunctionTracer ft(DBG_INFO);
+
+    // Lines are only counted here, not while parsing
+    size_t line = 1 + count(m_pwszText, pwszPosition, L'\n');
+    const WCHAR * pwszLine = pwszPosition;
+    while (pwszLine > m_pwszText && pwszLine[-1] != L'\n')
+        pwszLine--;
+
+    ft.WriteLine(L"ERROR: Invalid writer metadata XML at line %u, column %u: %s!",
+        (unsigned)line, (unsigned)(pwszPosition - pwszLine + 1), pwszMessage);
+    throw(E_INVALIDARG);
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+
+/////////////////////////////////////////////////////////////////////////
+//  Writer metadata XML reader
+//
+//  Reads writer metadata saved as XML, as listed by -wm3 or returned by
+//  IVssExamineWriterMetadata::SaveAsXML, into the same in-memory structures
+//  as the metadata gathered from the writers: VssWriter, VssComponent and
+//  VssFileDescriptor. The simulated backend uses it to serve the writers of
+//  another machine, so that their components can be listed and selected
+//  without VSS.
+//
+//  The text is parsed in a single pass, without building a document tree:
+//  each element is handled when it starts or ends, with its attributes kept
+//  as pointers into the text, and only the values used are copied. Text
+//  outside the WRITER_METADATA elements, like the separator lines of -wm3,
+//  and elements not used, like the inline schema, are skipped. A file can
+//  hold any number of writer metadata documents.
+//
+
+class WriterMetadataReader
+{
+public:
+
+    WriterMetadataReader();
+
+    // Read the writers from a file in UTF-16 with a byte order mark, UTF-8 or the ANSI code page.
+    // The XML document of each writer is added to the documents.
+    void ReadFromFile(wstring fileName, vector<VssWriter> & writers, vector<wstring> & documents);
+
+    // Read the writers from the text
+    void Parse(const WCHAR * pwszText, size_t cchText, vector<VssWriter> & writers, vector<wstring> & documents);
+
+private:
+
+    // Characters in the text being parsed
+    struct XmlString
+    {
+        const WCHAR *   pwsz;
+        size_t          cch;
+    };
+
+    struct XmlAttribute
+    {
+        XmlString       name;
+        XmlString       value;
+    };
+
+    // Parse the tag starting after '<' at the current position
+    void ParseStartTag();
+    void ParseEndTag();
+
+    // Skip a processing instruction, comment, CDATA section or declaration
+    void SkipMarkup();
+
+    XmlString ParseName();
+
+    void SkipWhitespace();
+
+    // Compare the characters of the text with a name
+    static bool IsName(const XmlString & str, LPCWSTR pwszName);
+
+    // Handle the start and end of the elements of the writer metadata, with the element
+    // removed from the open elements at its end
+    void OnStartElement(const XmlString & name);
+    void OnEndElement(const XmlString & name);
+
+    // Read the attributes of a file descriptor element
+    void ReadFileDescriptor(VSS_DESCRIPTOR_TYPE type, VssFileDescriptor & descriptor);
+
+    // The value of an attribute of the current element, with the references replaced, empty if not there
+    wstring GetAttribute(LPCWSTR pwszName);
+
+    bool GetBooleanAttribute(LPCWSTR pwszName);
+
+    // The attribute value as a GUID in the format of Guid2WString, which is not the one of the XML
+    wstring GetGuidAttribute(LPCWSTR pwszName);
+
+    // Report an error at the given position of the text
+    void ThrowFormatError(const WCHAR * pwszPosition, LPCWSTR pwszMessage);
+
+    //
+    //  Data members
+    //
+
+    // Text being parsed, and the current position in it
+    const WCHAR *               m_pwszText;
+    const WCHAR *               m_pwszEnd;
+    const WCHAR *               m_pwszPosition;
+
+    // Attributes of the current element, and the elements open around it.
+    // Kept between the elements so that their memory is reused.
+    vector<XmlAttribute>        m_attributes;
+    vector<XmlString>           m_openElements;
+
+    // Start of the outermost element, as the start of the document
+    const WCHAR *               m_pwszDocument;
+
+    // Results, with the writer and the component being read
+    vector<VssWriter> *         m_pWriters;
+    vector<wstring> *           m_pDocuments;
+    bool                        m_bInWriter;
+    bool                        m_bInComponent;
+    bool                        m_bDocumentHasWriter;
+};